@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <deque>
 #include <map>
 #include <asio/io_context.hpp>
@@ -10,6 +11,7 @@
 #include "terminalRaw.hpp"
 #include "protocol/message.hpp"
 #include "filesystem/utils.hpp"
+#include "filesystem/transfer_file.hpp"
 #include "filesystem/partmeta.hpp"
 #include "sync_manifest.hpp"
 #include "sync_diff.hpp"
@@ -18,9 +20,30 @@
 struct ActiveTransfer{
     uint32_t transfer_id; // ID used in partmeta_ database
     fsutils::FileMetadata fmeta; // File metadata
-    std::filesystem::path partial_path; // Path of .part file (user/.partial/id.part)
+    std::filesystem::path partial_path; // Path of .part file (user/.partial/id.part, downloads beside their destination)
     std::vector<protocol::ChunkInfo> chunks; // Sizes, indexes and hashes of chunks
     std::vector<bool> chunk_state; // Represents received/sent chunks
+    uint32_t chunk_size = fsutils::CHUNK_SIZE; // Negotiated for this transfer, each chunk carries its own offset
+    uint32_t window = 1; // Negotiated number of chunks that may be unacknowledged at once
+    uint32_t in_flight = 0; // Sent but not yet acknowledged (sending side)
+    uint32_t next_chunk = 0; // Cursor: every chunk below it is sent or acknowledged (sending side)
+    uint32_t acked_prefix = 0; // Every chunk below it is transferred, the cumulative ack
+    fsutils::TransferFile file{}; // Source or partial file, held open for the whole transfer
+    std::chrono::steady_clock::time_point started{}; // When the server accepted this run of the transfer
+    uint64_t transferred = 0; // Chunk bytes sent or received since started
+    bool compressed = false; // Server granted compressing chunk bodies (protocol/compression.hpp)
+};
+
+// Extra connection of a striped upload (--streams), carries SEND chunks and their acks only
+struct DataStream {
+    explicit DataStream(asio::io_context& io_context) : socket(io_context) {}
+    asio::ip::tcp::socket socket;
+    std::deque<protocol::OutboundFrame> write_queue; // Same discipline as Client::write_queue_
+    std::deque<uint32_t> in_flight; // Chunks sent on this connection and not yet acknowledged
+    bool attached = false; // Server accepted ATTACH, chunks may be sent
+    uint32_t msg_len = 0; // Message length of the ATTACH answer
+    std::vector<char> buffer; // Buffer of the ATTACH answer
+    protocol::ChunkHeader ch; // Chunk header for this connection's read loop, read in place
 };
 
 enum class ClientState {
@@ -36,7 +59,8 @@ enum class ClientState {
     DOWNLOADING, // Downloading chunks of data
     NEED_INPUT_RESUME_TRANSFER, // Resuming transfer
     SYNC_LISTING, // SYNC listing request sent, waiting for the server's recursive file listing
-    TIERS_LISTING // TIERS request sent, waiting for the server's list of storage media
+    TIERS_LISTING, // TIERS request sent, waiting for the server's list of storage media
+    SIGNATURES_LISTING // SIGNATURES request sent, waiting for the block signatures a delta upload is computed against
 };
 
 // Which command filled batch_queue_ - decides how the SYNC listing response is turned into ops and
@@ -50,7 +74,7 @@ enum class BatchMode {
 
 class Client {
 public:
-    Client(const std::string& username, asio::io_context& io_context, std::shared_ptr<asio::executor_work_guard<asio::io_context::executor_type>> guard);
+    Client(const std::string& username, uint32_t streams, bool content_defined, asio::io_context& io_context, std::shared_ptr<asio::executor_work_guard<asio::io_context::executor_type>> guard);
     ~Client();
 
     // Connect and start listening loop
@@ -60,8 +84,11 @@ public:
     void exit(); // Triggered by user, signals, async read/write error, session exit, sends notification to server, shutdown and close socket
 private:
     std::string username_;
+    uint32_t streams_; // Extra connections asked for per upload (--streams), 0 keeps uploads on socket_
+    bool content_defined_; // Cut uploads with fsutils::compute_cdc_chunks() (--cdc), fixed-size chunks otherwise
     asio::io_context& io_context_;
     asio::ip::tcp::socket socket_;
+    asio::ip::tcp::endpoint server_endpoint_; // Where socket_ connected, extra connections dial the same address
     asio::posix::stream_descriptor input_;
     std::shared_ptr<asio::executor_work_guard<asio::io_context::executor_type>> guard_;
     std::unordered_map<std::string, std::function<void(std::istringstream&)>> commands_; // Map of commands and their functions
@@ -69,7 +96,10 @@ private:
     uint32_t msg_len_; // Message lenght for json read loop
     std::string input_buffer_;
     std::vector<char> buffer_; // Buffer for json read loop
-    protocol::ChunkHeader ch_; // Chunk header for binary read loop
+    protocol::ChunkHeader ch_; // Chunk header for binary read loop, read in place
+    std::shared_ptr<protocol::BufferPool> buffers_ = std::make_shared<protocol::BufferPool>(); // Chunk bodies of socket_ and the data streams
+    std::deque<protocol::OutboundFrame> write_queue_; // Frames waiting for the socket, front() is being written
+    bool draining_ = false; // Aborted a windowed transfer, discarding the server's in-flight chunks until its marker arrives
     std::atomic<ClientState> state_ = ClientState::LOGIN; // State of client
     std::unique_ptr<TerminalNoEcho> password_guard_; // Turns off echo in cmd (non-tty / piped input path)
     std::atomic<bool> exiting_{false}; // Indicates exit has been called
@@ -93,8 +123,13 @@ private:
     EscState esc_state_{EscState::NONE}; // Parser state for ANSI escape sequences (arrow/home/end/delete keys)
     std::string csi_params_; // Accumulated parameter bytes of the CSI sequence currently being parsed
     ActiveTransfer transfer_{UINT32_MAX, fsutils::FileMetadata{}, std::filesystem::path(""), {}, {}}; // Current active transfer info
+    std::string delta_remote_; // Remote file of the delta upload waiting for its signatures
     std::filesystem::path root_; // Client root
     std::optional<PartialMetadata> partmeta_; // Database for partial file metadata
+    std::vector<std::shared_ptr<DataStream>> data_streams_; // Extra connections of the upload in progress
+    std::deque<uint32_t> retry_chunks_; // Unacknowledged chunks of lost extra connections, sent before the cursor moves on
+    bool striped_ = false; // Upload in progress uses extra connections, LAST waits until every other chunk is acknowledged
+    uint64_t throughput_ = 0; // Bytes/s of recent transfers, picks the chunk size of the next one, 0 until one finished
 
     // Batch engine. One queue-draining mechanism shared by SYNC, UPLOAD_DIR/DOWNLOAD_DIR and the
     // multi-argument DELETE/MOVE/COPY forms: each op is driven through the ordinary single-item
@@ -153,6 +188,9 @@ private:
     // Special write which calls finish_exit();
     void send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data);
 
+    // Write queue, keeps at most one async_write on the socket so pipelined frames never interleave
+    void queue_frame(protocol::OutboundFrame frame); // Append frame, start writing if the socket is idle
+    void write_next(); // Write front() of write_queue_, continue with the rest on completion
 
     // Protocol switch between binary data and json message based on state_
     void read_next();
@@ -161,7 +199,7 @@ private:
     void handle_error(const std::error_code& ec); // Handles error codes of async operations
     void handle_response(const nlohmann::json& j); // Handles json response message from server
     void handle_request(const std::string& line); // Handles string request command from user
-    void handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data); // Handles recieved binary data from server, calls transfer functions
+    void handle_chunk(const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // Handles recieved binary data from server, calls transfer functions
 
     // Closes socket and on exit removes itself from sessions_ list in server
     void finish_exit();
@@ -192,6 +230,7 @@ private:
     // single-item request/response cycle the interactive commands use
     void do_list(const std::string& remote);
     void do_upload(const std::filesystem::path& local, const std::string& remote);
+    void do_delta_upload(const std::filesystem::path& local, const std::string& remote); // Ask for the remote file's signatures, handle_signatures() sends the DELTA
     void do_download(const std::string& remote, const std::filesystem::path& local, bool allow_overwrite);
     void do_delete(const std::string& remote);
     void do_mkdir(const std::string& remote);
@@ -211,21 +250,42 @@ private:
     void record_op_result(); // Count the finished op and update the baseline
     void handle_sync_listing(const protocol::Response& res); // Turn a recursive listing into a queue of ops
     void handle_tiers_listing(const protocol::Response& res); // Print the storage media the server offers
+    void handle_signatures(const protocol::Response& res); // Compute the delta of transfer_.fmeta against them and send DELTA
     bool scan_local_tree(const std::filesystem::path& dir, std::map<std::string, SyncEntry>& out); // Recursive local scan, relative-path keyed
 
+    // Sliding window shared by both directions
+    void open_window(uint32_t window); // Reset window bookkeeping of transfer_ for a new or resumed transfer
+    void measure_throughput(); // Fold the finished run of transfer_ into throughput_
+    void acknowledge_chunks(uint32_t index, uint32_t cumulative); // Apply the server's selective and cumulative ack
+    void inflate(protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // Decompress a COMPRESSED download chunk in place, a failure leaves a body valid_chunk() rejects
+
+    // Striped upload: extra connections that ATTACH to the session's upload and pull chunks from the same cursor
+    void open_streams(uint32_t count, const std::string& token); // Connect count extra connections, each sends ATTACH token
+    void stream_read_header_json(std::shared_ptr<DataStream> stream); // ATTACH answer, then chunk acks only
+    void stream_read_body_json(std::shared_ptr<DataStream> stream);
+    void stream_read_header_chunk(std::shared_ptr<DataStream> stream);
+    void stream_read_body_chunk(std::shared_ptr<DataStream> stream);
+    void stream_send(const std::shared_ptr<DataStream>& stream, protocol::OutboundFrame frame);
+    void stream_write_next(std::shared_ptr<DataStream> stream);
+    void handle_stream_chunk(const std::shared_ptr<DataStream>& stream, const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // Ack of a chunk sent on stream
+    void stream_failed(const std::shared_ptr<DataStream>& stream, const std::error_code& ec); // Drop the connection, requeue its unacknowledged chunks
+    void close_streams(); // Close every extra connection, upload is over
+
     // Upload
-    void upload_init(); // Create partial metadata  entry in partmeta_, call uploading()
-    void uploading(); // Pick chunk to send, read chunk of file and send it, call send_chunk()
+    void upload_init(const std::vector<uint32_t>& have); // Create partial metadata  entry in partmeta_, mark the chunks the server already has, call uploading()
+    void uploading(); // Fill the windows of socket_ and of every attached extra connection
+    bool next_upload_chunk(bool on_main, uint32_t& index, uint8_t& flag); // Next chunk to send and its SEND/LAST flag, false when nothing may be sent now
+    bool send_upload_chunk(const std::shared_ptr<DataStream>& stream, uint32_t index, uint8_t flag); // Read and send on stream or socket_ (nullptr), false when the upload was aborted
     void upload_done(); // Delete partial file metadata, nullify transfer_, state_ = READY
     void upload_abort(bool save, bool notify, uint8_t flag); // Delete or save partial file metadta, notify server with protocol::flag
     void upload_abort_exit(bool save, bool notify, uint8_t flag); // calls finish_exit()
 
     // Download
-    bool valid_file(const std::filesystem::path& partial_file, const std::array<uint8_t, crypto_generichash_BYTES>& expected); // Compute hash of full file after download and compare with expected
+    bool valid_file(const std::filesystem::path& partial_file, const fsutils::FileMetadata& expected); // Tree hash over the verified chunks, hash of full file only for servers without one
     bool valid_chunk(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data); // Compute hash of chunk data and compare with expected
-    void download_init(const std::vector<protocol::ChunkInfo>& chunks, const std::string& file_hash); // Prepare transfer_ data, call downloading()
-    void download_prepare_partmeta(); // Create partial metadata entry in database partmeta_ (client_root/.partial/partmeta.json) and create .part file
-    void downloading(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data, uint8_t flag); // Systemtically sends one chunk, is called by handle_chunk()
+    void download_init(const std::vector<protocol::ChunkInfo>& chunks, const std::string& file_hash, const std::string& tree_hash); // Prepare transfer_ data, call downloading()
+    bool download_prepare_partmeta(); // Create partial metadata entry in database partmeta_ (client_root/.partial/partmeta.json) and the .part file at its final size, false when it aborted
+    void downloading(const uint32_t& index, const uint32_t& size, protocol::ChunkBuffer& data, uint8_t flag); // Systemtically sends one chunk, is called by handle_chunk()
     void download_done(); // Delete partial metadata from database partmeta_ (client_root/.partial/partmeta.json)
     void download_abort(bool save, bool notify, uint8_t flag); // Delete or save partial file metadata, delete .part file, notify server with protocol::flag
     void download_abort_exit(bool save, bool notify, uint8_t flag); // calls finish_exit()
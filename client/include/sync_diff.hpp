@@ -17,6 +17,7 @@ enum class SyncOpType {
     MOVE_REMOTE,
     COPY_REMOTE,
     UPLOAD,
+    DELTA_UPLOAD, // Replace a modified remote file, sending only the blocks it does not have (SIGNATURES + DELTA)
     DOWNLOAD,
     CONFLICT_DOWNLOAD // Download the server's version of a conflicted file under a new local name
 };
@@ -25,7 +26,7 @@ enum class SyncOpType {
 struct SyncEntry {
     std::string hash; // hash_to_hex, empty for directories
     uint64_t mtime = 0;
-    uint32_t size = 0;
+    uint64_t size = 0;
     bool is_directory = false;
 };
 
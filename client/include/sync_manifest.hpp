@@ -9,7 +9,7 @@
 struct SyncManifestEntry {
     std::string hash; // hash_to_hex of the file as it was after the last sync, empty for directories
     uint64_t mtime = 0; // Last modified at that time, seconds since epoch
-    uint32_t size = 0; // Size at that time
+    uint64_t size = 0; // Size at that time
     bool is_directory = false;
 };
 
@@ -1,4 +1,6 @@
 #include <asio.hpp>
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <vector>
 #include <spdlog/spdlog.h>
@@ -9,16 +11,22 @@
 #include "protocol/codes.hpp"
 #include "protocol/statuses.hpp"
 #include "protocol/flags.hpp"
+#include "protocol/compression.hpp"
 #include <nlohmann/json.hpp>
 #include "filesystem/utils.hpp"
+#include "filesystem/chunker.hpp"
+#include "filesystem/delta.hpp"
+#include "filesystem/scanner.hpp"
 #include <functional>
 #include <sstream>
 
 using asio::ip::tcp;
 using nlohmann::json;
 
-Client::Client(const std::string& username, asio::io_context& io_context, std::shared_ptr<asio::executor_work_guard<asio::io_context::executor_type>> guard)
+Client::Client(const std::string& username, uint32_t streams, bool content_defined, asio::io_context& io_context, std::shared_ptr<asio::executor_work_guard<asio::io_context::executor_type>> guard)
     : username_(username), 
+      streams_(streams),
+      content_defined_(content_defined),
       io_context_(io_context),
       socket_(io_context_),
       input_(io_context_, ::dup(STDIN_FILENO)),
@@ -57,6 +65,7 @@ void Client::connect(const std::string& host, uint16_t port) {
     asio::async_connect(socket_, resolver.resolve(host, std::to_string(port)),
         [this](std::error_code ec, tcp::endpoint endpoint) {
             if(!ec) {
+                server_endpoint_ = endpoint;
                 handle_request(username_);
                 read_header_json();
             } else {
@@ -298,48 +307,29 @@ json redact_for_log(const json& request_json) {
 void Client::send_json(const json& j) {
     spdlog::info("-> {}", redact_for_log(j).dump());
 
-    auto write_buffer = std::make_shared<std::string>(j.dump());
+    std::string body = j.dump();
 
-    if(write_buffer->size() > std::numeric_limits<uint32_t>::max()) {
+    if(body.size() > std::numeric_limits<uint32_t>::max()) {
         print(protocol::codes::INTERNAL_SERVER_ERROR, "File data was too large.");
         return;
     }
 
-    auto len = std::make_shared<uint32_t>(htonl(write_buffer->size())); // Host to network layer
-
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(len.get(), sizeof(uint32_t)));
-    buffers.push_back(asio::buffer(*write_buffer));
-
-    asio::async_write(socket_, buffers, [this, len, write_buffer](std::error_code ec, std::size_t) {
-        if(exiting_ || ec) {
-            if(ec && ec != asio::error::operation_aborted) {
-                handle_error(ec);
-            }
-            return;
-        }
-    });
+    queue_frame(protocol::make_json_frame(body));
 }
 
 void Client::send_json_exit(const json& j) {
     spdlog::info("-> {} (exit)", redact_for_log(j).dump());
 
-    auto write_buffer = std::make_shared<std::string>(j.dump());
+    std::string body = j.dump();
 
-    if(write_buffer->size() > std::numeric_limits<uint32_t>::max()) {
+    if(body.size() > std::numeric_limits<uint32_t>::max()) {
         print(protocol::codes::INTERNAL_SERVER_ERROR, "File data was too large.");
         return;
     }
 
-    auto len = std::make_shared<uint32_t>(htonl(write_buffer->size())); // Host to network layer
-
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(len.get(), sizeof(uint32_t)));
-    buffers.push_back(asio::buffer(*write_buffer));
-
-    asio::async_write(socket_, buffers, [this, len, write_buffer](std::error_code ec, std::size_t) {
-        finish_exit();
-    });
+    protocol::OutboundFrame frame = protocol::make_json_frame(body);
+    frame.exit_after = true;
+    queue_frame(std::move(frame));
 }
 
 void Client::read_header_json() {
@@ -381,82 +371,255 @@ void Client::read_body_json() {
 }
 
 void Client::read_header_chunk() {
-    auto header = std::make_shared<protocol::ChunkHeader>();
-
-    asio::async_read(socket_, asio::buffer(header.get(), sizeof(protocol::ChunkHeader)), [this, header](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, asio::buffer(&ch_, sizeof(protocol::ChunkHeader)), [this](std::error_code ec, std::size_t) {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
             }
             return;
         }
-        ch_.transfer_id = ntohl(header->transfer_id); // Network to host layer
-        ch_.index = ntohl(header->index);
-        ch_.size = ntohl(header->size);
-        ch_.flags = header->flags;
+        ch_.transfer_id = ntohl(ch_.transfer_id); // Network to host layer
+        ch_.index = ntohl(ch_.index);
+        ch_.size = ntohl(ch_.size);
         read_body_chunk();
     });
 }
 
 void Client::read_body_chunk() {
-    auto data = std::make_shared<std::vector<uint8_t>>(ch_.size);
+    protocol::ChunkBuffer data = buffers_->acquire(ch_.size);
+    asio::mutable_buffer target = asio::buffer(data.bytes());
 
-    asio::async_read(socket_, asio::buffer(*data), [this, data](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, target, [this, data = std::move(data)](std::error_code ec, std::size_t) mutable {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
             }
             return;
         }
-        handle_chunk(ch_, *data);
+        inflate(ch_, data);
+        handle_chunk(ch_, data);
         read_next();
     });
 }
 
 void Client::send_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
-    auto header = std::make_shared<protocol::ChunkHeader>();
-    header->transfer_id = htonl(ch.transfer_id); // Host to network layer
-    header->index = htonl(ch.index);
-    header->size = htonl(ch.size);
-    header->flags = ch.flags;
+    queue_frame(protocol::make_chunk_frame(ch, data));
+}
 
-    auto data_to_write = std::make_shared<std::vector<uint8_t>>(data);
+void Client::send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+    protocol::OutboundFrame frame = protocol::make_chunk_frame(ch, data);
+    frame.exit_after = true;
+    queue_frame(std::move(frame));
+}
+
+void Client::queue_frame(protocol::OutboundFrame frame) {
+    write_queue_.push_back(std::move(frame));
+    if(write_queue_.size() == 1) { // Socket idle, otherwise the running write picks it up
+        write_next();
+    }
+}
+
+void Client::write_next() {
+    const protocol::OutboundFrame& frame = write_queue_.front(); // deque keeps it in place while more frames are queued
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(frame.header.data(), frame.header_size),
+        asio::buffer(frame.body.bytes())
+    };
 
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(header.get(), sizeof(protocol::ChunkHeader)));
-    buffers.push_back(asio::buffer(*data_to_write));
+    asio::async_write(socket_, buffers, [this](std::error_code ec, std::size_t) {
+        bool exit_after = write_queue_.front().exit_after;
+        write_queue_.pop_front();
 
-    asio::async_write(socket_, buffers, [this, header, data_to_write](std::error_code ec, std::size_t) {
+        if(exit_after) {
+            write_queue_.clear();
+            finish_exit();
+            return;
+        }
         if(exiting_ || ec) {
+            write_queue_.clear();
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
             }
             return;
         }
+        if(!write_queue_.empty()) {
+            write_next();
+        }
     });
 }
 
-void Client::send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
-     auto header = std::make_shared<protocol::ChunkHeader>();
-    header->transfer_id = htonl(ch.transfer_id); // Host to network layer
-    header->index = htonl(ch.index);
-    header->size = htonl(ch.size);
-    header->flags = ch.flags;
+void Client::open_streams(uint32_t count, const std::string& token) {
+    striped_ = true;
+    for(uint32_t i = 0; i < count; ++i) {
+        auto stream = std::make_shared<DataStream>(io_context_);
+        data_streams_.push_back(stream);
+
+        stream->socket.async_connect(server_endpoint_, [this, stream, token](std::error_code ec) {
+            if(exiting_ || ec) {
+                if(ec && ec != asio::error::operation_aborted) {
+                    stream_failed(stream, ec);
+                }
+                return;
+            }
+            protocol::Request req{
+                protocol::commands::ATTACH,
+                token,
+                "",
+                0,
+                ""
+            };
+            json j;
+            protocol::to_json(j, req);
+            stream_send(stream, protocol::make_json_frame(j.dump()));
+            stream_read_header_json(stream);
+        });
+    }
+}
+
+void Client::stream_read_header_json(std::shared_ptr<DataStream> stream) {
+    auto msg_len_local = std::make_shared<uint32_t>();
+
+    asio::async_read(stream->socket, asio::buffer(msg_len_local.get(), sizeof(uint32_t)), [this, stream, msg_len_local](std::error_code ec, std::size_t) {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_failed(stream, ec);
+            }
+            return;
+        }
+        stream->msg_len = ntohl(*msg_len_local);
+        stream->buffer.resize(stream->msg_len);
+        stream_read_body_json(stream);
+    });
+}
+
+void Client::stream_read_body_json(std::shared_ptr<DataStream> stream) {
+    asio::async_read(stream->socket, asio::buffer(stream->buffer), [this, stream](std::error_code ec, std::size_t) {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_failed(stream, ec);
+            }
+            return;
+        }
+        protocol::Response res;
+        try {
+            protocol::from_json(json::parse(stream->buffer.begin(), stream->buffer.end()), res);
+        } catch (json::exception& e) {
+            stream_failed(stream, asio::error::invalid_argument);
+            return;
+        }
+        if(std::find(data_streams_.begin(), data_streams_.end(), stream) == data_streams_.end()) return; // Upload ended meanwhile
+        if(res.status != protocol::statuses::OK) {
+            spdlog::warn("Data stream rejected: {}", res.message);
+            stream_failed(stream, asio::error::connection_refused);
+            return;
+        }
+        spdlog::debug("Data stream attached");
+        stream->attached = true;
+        stream_read_header_chunk(stream);
+        if(state_ == ClientState::UPLOADING && !draining_) {
+            uploading();
+        }
+    });
+}
+
+void Client::stream_read_header_chunk(std::shared_ptr<DataStream> stream) {
+    asio::async_read(stream->socket, asio::buffer(&stream->ch, sizeof(protocol::ChunkHeader)), [this, stream](std::error_code ec, std::size_t) {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_failed(stream, ec);
+            }
+            return;
+        }
+        stream->ch.transfer_id = ntohl(stream->ch.transfer_id);
+        stream->ch.index = ntohl(stream->ch.index);
+        stream->ch.size = ntohl(stream->ch.size);
+        stream_read_body_chunk(stream);
+    });
+}
+
+void Client::stream_read_body_chunk(std::shared_ptr<DataStream> stream) {
+    protocol::ChunkBuffer data = buffers_->acquire(stream->ch.size);
+    asio::mutable_buffer target = asio::buffer(data.bytes());
+
+    asio::async_read(stream->socket, target, [this, stream, data = std::move(data)](std::error_code ec, std::size_t) mutable {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_failed(stream, ec);
+            }
+            return;
+        }
+        handle_stream_chunk(stream, stream->ch, data);
+        if(std::find(data_streams_.begin(), data_streams_.end(), stream) != data_streams_.end()) { // Not closed with its upload
+            stream_read_header_chunk(stream);
+        }
+    });
+}
+
+void Client::stream_send(const std::shared_ptr<DataStream>& stream, protocol::OutboundFrame frame) {
+    stream->write_queue.push_back(std::move(frame));
+    if(stream->write_queue.size() == 1) {
+        stream_write_next(stream);
+    }
+}
 
-    auto data_to_write = std::make_shared<std::vector<uint8_t>>(data);
+void Client::stream_write_next(std::shared_ptr<DataStream> stream) {
+    const protocol::OutboundFrame& frame = stream->write_queue.front();
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(frame.header.data(), frame.header_size),
+        asio::buffer(frame.body.bytes())
+    };
 
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(header.get(), sizeof(protocol::ChunkHeader)));
-    buffers.push_back(asio::buffer(*data_to_write));
+    asio::async_write(stream->socket, buffers, [this, stream](std::error_code ec, std::size_t) {
+        stream->write_queue.pop_front();
 
-    asio::async_write(socket_, buffers, [this, header, data_to_write](std::error_code ec, std::size_t) {
-        finish_exit();
+        if(exiting_ || ec) {
+            stream->write_queue.clear();
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_failed(stream, ec);
+            }
+            return;
+        }
+        if(!stream->write_queue.empty()) {
+            stream_write_next(stream);
+        }
     });
 }
 
+void Client::stream_failed(const std::shared_ptr<DataStream>& stream, const std::error_code& ec) {
+    auto it = std::find(data_streams_.begin(), data_streams_.end(), stream);
+    if(it == data_streams_.end()) return; // Already closed with its upload
+
+    if(stream->in_flight.empty()) {
+        spdlog::debug("Data stream closed: {}", ec.message());
+    } else {
+        spdlog::warn("Data stream lost: {}, sending its {} chunk(s) again", ec.message(), stream->in_flight.size());
+    }
+    retry_chunks_.insert(retry_chunks_.end(), stream->in_flight.begin(), stream->in_flight.end());
+
+    std::error_code close_ec;
+    stream->socket.shutdown(tcp::socket::shutdown_both, close_ec);
+    stream->socket.close(close_ec);
+    data_streams_.erase(it);
+
+    if(state_ == ClientState::UPLOADING && !draining_) { // The remaining connections take over its chunks
+        uploading();
+    }
+}
+
+void Client::close_streams() {
+    for(auto& stream : data_streams_) {
+        std::error_code ec;
+        stream->socket.shutdown(tcp::socket::shutdown_both, ec);
+        stream->socket.close(ec);
+    }
+    data_streams_.clear();
+    retry_chunks_.clear();
+    striped_ = false;
+}
+
 void Client::read_next() {
     if(exiting_) return;
-    if(state_ == ClientState::DOWNLOADING || state_ == ClientState::UPLOADING) {
+    if(draining_ || state_ == ClientState::DOWNLOADING || state_ == ClientState::UPLOADING) {
         read_header_chunk();
     } else {
         read_header_json();
@@ -530,17 +693,34 @@ void Client::handle_response(const json& j) {
             state_ = ClientState::READY;
             handle_tiers_listing(res);
             return;
+        } else if(state_ == ClientState::SIGNATURES_LISTING) {
+            handle_signatures(res);
+            return;
         } else if(state_ == ClientState::UPLOAD_INIT) {
             state_ = ClientState::UPLOADING;
-            upload_init();
+            open_window(protocol::negotiate_window(res.window)); // Old servers leave it out and get stop-and-wait
+            transfer_.compressed = res.compression == protocol::CODEC_ZSTD;
+            if(res.streams > 0 && !res.stream_token.empty()) {
+                open_streams(std::min(res.streams, streams_), res.stream_token); // They join uploading() once attached
+            }
+            upload_init(res.have);
             return;
         } else if(state_ == ClientState::DOWNLOAD_INIT) {
-            download_init(res.chunks, res.file_hash);
+            open_window(protocol::negotiate_window(res.window));
+            transfer_.compressed = res.compression == protocol::CODEC_ZSTD;
+            transfer_.chunk_size = res.chunk_size == 0 ? fsutils::CHUNK_SIZE : res.chunk_size; // Old servers always cut with the default
+            download_init(res.chunks, res.file_hash, res.tree_hash);
             return;
         } else {
             state_ = ClientState::READY;
             command_finished(true);
         }
+    } else if(res.status == protocol::statuses::DONE) { // UPLOAD the server finished from a file it already stores
+        transfer_.fmeta = fsutils::FileMetadata{};
+        transfer_.chunk_state.clear();
+        transfer_.chunks.clear();
+        state_ = ClientState::READY;
+        command_finished(true);
     } else if (res.status == protocol::statuses::RESUME) {
         if (res.file_hash.empty()) { // question: "Do you want to resume X of Y? (y/n)"
             state_ = ClientState::NEED_INPUT_RESUME_TRANSFER;
@@ -550,6 +730,8 @@ void Client::handle_response(const json& j) {
             std::istringstream iss(res.message);
             std::string cmd;
             iss >> cmd;
+            open_window(protocol::negotiate_window(res.window)); // Chunks left unacknowledged last time are simply sent again
+            transfer_.compressed = res.compression == protocol::CODEC_ZSTD;
 
             auto entry = partmeta_->get_entry(id);
             if (!entry) {
@@ -566,7 +748,9 @@ void Client::handle_response(const json& j) {
             transfer_.fmeta.absolute_path = entry->absolute_path;
             transfer_.fmeta.size = entry->size;
             transfer_.fmeta.hash = entry->file_hash;
+            transfer_.fmeta.tree_hash = entry->tree_hash;
             transfer_.chunks = entry->chunks;
+            transfer_.chunk_size = entry->chunk_size;
             transfer_.chunk_state = entry->chunk_state;
 
             if (cmd == protocol::commands::UPLOAD) {
@@ -631,25 +815,51 @@ void Client::handle_request(const std::string& line) {
     }
 }
 
-void Client::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+void Client::handle_stream_chunk(const std::shared_ptr<DataStream>& stream, const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if(state_ != ClientState::UPLOADING || draining_) return; // Upload is over, close_streams() takes the connection down
+
+    if(ch.flags != protocol::flags::OK || ch.transfer_id != transfer_.transfer_id || ch.index >= transfer_.chunk_state.size()) {
+        stream_failed(stream, asio::error::invalid_argument); // Failures are reported on socket_, here only acks are expected
+        return;
+    }
+    auto it = std::find(stream->in_flight.begin(), stream->in_flight.end(), ch.index);
+    if(it != stream->in_flight.end()) {
+        stream->in_flight.erase(it);
+    }
+    acknowledge_chunks(ch.index, protocol::decode_ack(data.bytes()));
+    uploading();
+}
+
+void Client::handle_chunk(const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if(draining_) { // Leftovers of an aborted windowed transfer, wait for the server's marker
+        if(ch.flags == protocol::flags::ABORTED || ch.flags == protocol::flags::ERROR || ch.flags == protocol::flags::CHUNK_MISMATCH) {
+            draining_ = false;
+        } else if(ch.flags == protocol::flags::EXIT) {
+            draining_ = false;
+            print(protocol::codes::INTERNAL_SERVER_ERROR, "Server unavailable.", false);
+            exit();
+        }
+        return;
+    }
     if(state_ == ClientState::UPLOADING) {
         if(ch.flags == protocol::flags::OK) {
-            if(ch.transfer_id != transfer_.transfer_id) {
+            if(ch.transfer_id != transfer_.transfer_id || ch.index >= transfer_.chunk_state.size()) {
                 print(protocol::codes::INTERNAL_SERVER_ERROR, "Transfer ID mismatch.", !batch_active_);
                 upload_abort(false, true, protocol::flags::ERROR); // Last: may dispatch the next batch item
                 return;
             }
-            transfer_.chunk_state[ch.index] = true; // Set chunk at index to sent
-            partmeta_->mark_chunk_received(transfer_.transfer_id, ch.index); // Set chunk at index to sent in partial metadata database
+            acknowledge_chunks(ch.index, protocol::decode_ack(data.bytes())); // Set chunks to sent, also in partial metadata database
+            if(transfer_.in_flight > 0) {
+                transfer_.in_flight--;
+            }
             uploading();
         } else if (ch.flags == protocol::flags::DONE) {
-            transfer_.chunk_state[ch.index] = true;
             print(protocol::codes::OK, "Upload successful", !batch_active_);
             upload_done();
             return;
-        } else if(ch.flags == protocol::flags::ERROR) {
+        } else if(ch.flags == protocol::flags::ERROR || ch.flags == protocol::flags::CHUNK_MISMATCH) {
             print(protocol::codes::INTERNAL_SERVER_ERROR, "Upload failed.", !batch_active_);
-            upload_abort(false, false, protocol::flags::ERROR); // Last: may dispatch the next batch item
+            upload_abort(false, transfer_.window > 1, protocol::flags::ABORTED); // Windowed server drains until our marker. Last: may dispatch the next batch item
             return;
         } else if(ch.flags == protocol::flags::EXIT) {
             upload_abort(true, false, protocol::flags::EXIT);
@@ -658,10 +868,10 @@ void Client::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uin
         }
     } else if (state_ == ClientState::DOWNLOADING) {
         if(ch.flags == protocol::flags::SEND) {
-            if(valid_chunk(ch.index, ch.size, data)) {
+            if(valid_chunk(ch.index, ch.size, data.bytes())) {
                 if(transfer_.transfer_id == UINT32_MAX) { // transfer_id not initilized - upload not initialized
                     transfer_.transfer_id = ch.transfer_id;
-                    download_prepare_partmeta();
+                    if(!download_prepare_partmeta()) return;
                 }
                 downloading(ch.index, ch.size, data, protocol::flags::OK);
                 return;
@@ -670,10 +880,10 @@ void Client::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uin
             download_abort(false, true, protocol::flags::CHUNK_MISMATCH);
             return;
         } else if(ch.flags == protocol::flags::LAST) {
-            if(valid_chunk(ch.index, ch.size, data)) {
+            if(valid_chunk(ch.index, ch.size, data.bytes())) {
                 if(transfer_.transfer_id == UINT32_MAX) { // transfer_id not initilized - upload not initialized
                     transfer_.transfer_id = ch.transfer_id;
-                    download_prepare_partmeta();
+                    if(!download_prepare_partmeta()) return;
                 }
                 downloading(ch.index, ch.size, data, protocol::flags::DONE);
                 return;
@@ -683,7 +893,7 @@ void Client::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uin
             return;
         } else if(ch.flags == protocol::flags::ERROR) {
             print(protocol::codes::INTERNAL_SERVER_ERROR, "Download failed");
-            download_abort(false, false, protocol::flags::ERROR);
+            download_abort(false, transfer_.window > 1, protocol::flags::ABORTED); // Windowed server drains until our marker
             return;
         } else if(ch.flags == protocol::flags::EXIT) {
             download_abort(true, false, protocol::flags::EXIT);
@@ -738,6 +948,10 @@ void Client::need_input(const std::string input) {
             ""
         };
     req.chunks.clear();
+    if(state_ == ClientState::NEED_INPUT_RESUME_TRANSFER) { // A "y" starts the transfer right away
+        req.window = protocol::DEFAULT_WINDOW;
+        req.compression = protocol::CODEC_ZSTD;
+    }
     json j;
     protocol::to_json(j, req);
     send_json(j);
@@ -775,6 +989,7 @@ void Client::exit() {
 
 void Client::finish_exit() {
     state_ = ClientState::EXIT;
+    close_streams();
     std::error_code ec;
     socket_.cancel(ec);
 
@@ -844,30 +1059,32 @@ void Client::do_upload(const std::filesystem::path& local, const std::string& re
         return;
     }
 
-    fsutils::FileMetadata fmeta = fsutils::scan_file(local);
-
-    if(fsutils::is_scan_file_error(fmeta)) {
+    uint64_t size = fsutils::get_file_size(local); // The chunk size depends on it, so it is known before the file is read
+    if(size == fsutils::SIZE_ERROR) {
         print(protocol::codes::INTERNAL_SERVER_ERROR, "Gathering file metadata failed: " + local.string(), !batch_active_);
         command_finished(false);
         return;
     }
 
-    if(fmeta.size == 0) {
+    if(size == 0) {
         print(protocol::codes::BAD_REQUEST, "Local file is empty: " + local.string(), !batch_active_);
         command_finished(false);
         return;
     }
 
-    std::vector<protocol::ChunkInfo> chunks = fsutils::compute_chunks(fmeta);
-
-    if(fsutils::is_compute_chunks_error(chunks)) {
+    uint32_t chunk_size = protocol::choose_chunk_size(size, protocol::preferred_chunk_size(throughput_));
+    fsutils::FileMetadata fmeta;
+    std::vector<protocol::ChunkInfo> chunks;
+    if(!fsutils::scan_file_chunks(local, chunk_size, content_defined_, fmeta, chunks) || chunks.empty()) { // Emptied since the stat
         print(protocol::codes::INTERNAL_SERVER_ERROR, "Generating file chunks failed: " + local.string(), !batch_active_);
         command_finished(false);
         return;
     }
 
+    fmeta.tree_hash = fsutils::tree_hash(chunks);
     transfer_.fmeta = fmeta;
     transfer_.chunks = chunks;
+    transfer_.chunk_size = chunk_size;
     transfer_.chunk_state = std::vector<bool>(chunks.size(), false);
 
     protocol::Request req{
@@ -876,8 +1093,78 @@ void Client::do_upload(const std::filesystem::path& local, const std::string& re
         "",
         fmeta.size,
         fsutils::hash_to_hex(fmeta.hash),
-        chunks
+        chunks,
+        protocol::DEFAULT_WINDOW,
+        streams_,
+        chunk_size,
+        fsutils::hash_to_hex(fmeta.tree_hash),
+        protocol::CODEC_ZSTD,
+        content_defined_ ? protocol::CHUNKING_CDC : ""
+    };
+    req.instant = true; // A DONE answer means the server had it already, see handle_response()
+
+    json j;
+    protocol::to_json(j, req);
+    send_json(j);
+    state_ = ClientState::UPLOAD_INIT;
+}
+
+void Client::do_delta_upload(const std::filesystem::path& local, const std::string& remote) {
+    if(!fsutils::exists(local)) {
+        print(protocol::codes::BAD_REQUEST, "Local file does not exist: " + local.string(), !batch_active_);
+        command_finished(false);
+        return;
+    }
+
+    fsutils::FileMetadata fmeta = fsutils::scan_file(local);
+
+    if(fsutils::is_scan_file_error(fmeta)) {
+        print(protocol::codes::INTERNAL_SERVER_ERROR, "Gathering file metadata failed: " + local.string(), !batch_active_);
+        command_finished(false);
+        return;
+    }
+
+    if(fmeta.size == 0) {
+        print(protocol::codes::BAD_REQUEST, "Local file is empty: " + local.string(), !batch_active_);
+        command_finished(false);
+        return;
+    }
+
+    transfer_.fmeta = fmeta;
+    delta_remote_ = remote;
+    send_command(protocol::commands::SIGNATURES, remote, "");
+    state_ = ClientState::SIGNATURES_LISTING;
+}
+
+void Client::handle_signatures(const protocol::Response& res) {
+    uint32_t chunk_size = protocol::choose_chunk_size(transfer_.fmeta.size, protocol::preferred_chunk_size(throughput_));
+    fsutils::Delta delta;
+    if(res.chunk_size == 0 || !fsutils::compute_delta(transfer_.fmeta, res.signatures, res.chunk_size, chunk_size, delta)) {
+        print(protocol::codes::INTERNAL_SERVER_ERROR, "Computing delta failed: " + transfer_.fmeta.absolute_path.string(), !batch_active_);
+        command_finished(false);
+        return;
+    }
+    spdlog::info("Delta upload of {}: {} of {} bytes to send, {} ranges reused.", transfer_.fmeta.absolute_path.string(), delta.literal_bytes, transfer_.fmeta.size, delta.copies.size());
+
+    transfer_.fmeta.tree_hash = fsutils::HASH_ERROR; // Chunks cover only the new bytes, the server rehashes the rebuilt file
+    transfer_.chunks = delta.literals;
+    transfer_.chunk_size = chunk_size;
+    transfer_.chunk_state = std::vector<bool>(delta.literals.size(), false);
+
+    protocol::Request req{
+        protocol::commands::DELTA,
+        delta_remote_,
+        "",
+        transfer_.fmeta.size,
+        fsutils::hash_to_hex(transfer_.fmeta.hash),
+        delta.literals,
+        protocol::DEFAULT_WINDOW,
+        streams_,
+        chunk_size,
+        "",
+        protocol::CODEC_ZSTD
     };
+    req.copies = std::move(delta.copies);
 
     json j;
     protocol::to_json(j, req);
@@ -892,7 +1179,7 @@ void Client::do_download(const std::string& remote, const std::filesystem::path&
         return;
     }
 
-    // download_done() renames the .part file onto this path, so its parent has to be there already
+    // The .part file is written beside this path and renamed onto it, so its parent has to be there already
     if(local.has_parent_path() && !local.parent_path().empty()) {
         std::error_code ec;
         std::filesystem::create_directories(local.parent_path(), ec);
@@ -913,6 +1200,9 @@ void Client::do_download(const std::string& remote, const std::filesystem::path&
         ""
     };
     req.chunks.clear();
+    req.window = protocol::DEFAULT_WINDOW;
+    req.chunk_size = protocol::preferred_chunk_size(throughput_); // Server grows it for large files
+    req.compression = protocol::CODEC_ZSTD;
     json j;
     protocol::to_json(j, req);
     send_json(j);
@@ -1224,11 +1514,12 @@ bool Client::scan_local_tree(const std::filesystem::path& dir, std::map<std::str
         if(relative_path.empty() || relative_path == ".") continue;
         // The baseline lives inside the synced folder, it is bookkeeping and never content
         if(relative_path == ".minidrive-sync" || relative_path.rfind(".minidrive-sync/", 0) == 0) continue;
+        if(PartialMetadata::is_partial_beside(file.absolute_path)) continue; // A download in progress, or one left to resume
 
         SyncEntry entry;
         entry.is_directory = fsutils::is_directory(file.absolute_path);
         entry.mtime = file.last_modified;
-        entry.size = entry.is_directory ? 0u : file.size;
+        entry.size = entry.is_directory ? uint64_t{0} : file.size;
         entry.hash = entry.is_directory ? std::string() : fsutils::hash_to_hex(file.hash);
         out[relative_path] = entry;
     }
@@ -1380,6 +1671,7 @@ void Client::advance_batch_queue() {
             case SyncOpType::MOVE_REMOTE:       do_move(op.remote_path_from, op.remote_path); break;
             case SyncOpType::COPY_REMOTE:       do_copy(op.remote_path_from, op.remote_path); break;
             case SyncOpType::UPLOAD:            do_upload(op.local_path, op.remote_path); break;
+            case SyncOpType::DELTA_UPLOAD:      do_delta_upload(op.local_path, op.remote_path); break;
             case SyncOpType::DOWNLOAD:          do_download(op.remote_path, op.local_path, true); break;
             case SyncOpType::CONFLICT_DOWNLOAD: do_download(op.remote_path, op.local_path, false); break;
         }
@@ -1398,6 +1690,7 @@ void Client::record_op_result() {
         case SyncOpType::MOVE_REMOTE:       batch_moved_++; break;
         case SyncOpType::COPY_REMOTE:       batch_copied_++; break;
         case SyncOpType::UPLOAD:            batch_uploaded_++; break;
+        case SyncOpType::DELTA_UPLOAD:      batch_uploaded_++; break;
         case SyncOpType::DOWNLOAD:          batch_downloaded_++; break;
         case SyncOpType::CONFLICT_DOWNLOAD: batch_downloaded_++; break;
     }
@@ -1464,32 +1757,122 @@ void Client::finish_batch() {
     read_line();
 }
 
-void Client::upload_init() {
-    transfer_.transfer_id = partmeta_->add_partial_metadata(TransferType::UPLOAD, transfer_.fmeta, transfer_.chunks, UINT32_MAX);
+void Client::upload_init(const std::vector<uint32_t>& have) {
+    transfer_.transfer_id = partmeta_->add_partial_metadata(TransferType::UPLOAD, transfer_.fmeta, transfer_.chunks, transfer_.chunk_size, UINT32_MAX);
+    uint64_t skipped = 0;
+    for(uint32_t index : have) { // Already in the server's .part, taken from chunks it stores
+        if(index >= transfer_.chunk_state.size() || transfer_.chunk_state[index]) continue;
+        transfer_.chunk_state[index] = true;
+        partmeta_->mark_chunk_received(transfer_.transfer_id, index);
+        skipped += transfer_.chunks[index].size;
+    }
+    if(skipped > 0) {
+        transfer_.acked_prefix = fsutils::next_pending_chunk(transfer_.chunk_state, 0);
+        spdlog::info("Server already stores {} of {} chunks ({} bytes) of {}.", have.size(), transfer_.chunks.size(), skipped, transfer_.fmeta.absolute_path.string());
+    }
     //read_line();
     uploading();
 }
 
-void Client::uploading() {
-    uint32_t index = UINT32_MAX;
+void Client::open_window(uint32_t window) {
+    transfer_.window = window;
+    transfer_.in_flight = 0;
+    transfer_.next_chunk = 0;
+    transfer_.acked_prefix = 0;
+    transfer_.started = std::chrono::steady_clock::now();
+    transfer_.transferred = 0;
+}
 
-    for(uint32_t i = 0; i < transfer_.chunk_state.size(); ++i) { // Finf first chunk that has not been sent yet
+void Client::measure_throughput() {
+    if(transfer_.transferred < protocol::MIN_CHUNK_SIZE * 16) return; // Round trips dominate small transfers, they would only drag it down
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - transfer_.started).count();
+    if(elapsed <= 0) return;
+    uint64_t sample = transfer_.transferred * 1000000 / static_cast<uint64_t>(elapsed);
+    throughput_ = throughput_ == 0 ? sample : (throughput_ + sample) / 2;
+    spdlog::debug("Transfer ran at {} B/s, next chunk size {} B.", sample, protocol::preferred_chunk_size(throughput_));
+}
+
+void Client::inflate(protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if((ch.flags & protocol::flags::COMPRESSED) == 0) return;
+    if(state_ != ClientState::DOWNLOADING || ch.index >= transfer_.chunks.size()) { // Nothing to take the raw size from
+        ch.flags &= static_cast<uint8_t>(~protocol::flags::COMPRESSED);
+        return;
+    }
+    if(!protocol::decompress_chunk(ch, data, transfer_.chunks[ch.index].size, *buffers_)) {
+        spdlog::warn("Chunk {} of transfer {} does not decompress.", ch.index, transfer_.transfer_id);
+    }
+}
+
+void Client::acknowledge_chunks(uint32_t index, uint32_t cumulative) {
+    cumulative = std::min(cumulative, static_cast<uint32_t>(transfer_.chunk_state.size()));
+    for(uint32_t i = transfer_.acked_prefix; i < cumulative; ++i) { // Everything below cumulative is on the server's disk
         if(!transfer_.chunk_state[i]) {
-            index = i;
-            break;
+            transfer_.chunk_state[i] = true;
+            partmeta_->mark_chunk_received(transfer_.transfer_id, i);
         }
     }
-    if(index == UINT32_MAX) { // Every chunk already acknowledged - nothing left to send
-        spdlog::warn("uploading() called with no pending chunks (transfer {})", transfer_.transfer_id);
-        return;
+    if(!transfer_.chunk_state[index]) {
+        transfer_.chunk_state[index] = true;
+        partmeta_->mark_chunk_received(transfer_.transfer_id, index);
+    }
+    transfer_.acked_prefix = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.acked_prefix);
+}
+
+void Client::uploading() {
+    uint32_t index;
+    uint8_t flag;
+
+    while(transfer_.in_flight < transfer_.window && next_upload_chunk(true, index, flag)) {
+        if(!send_upload_chunk(nullptr, index, flag)) return;
+        transfer_.in_flight++;
     }
-    protocol::ChunkInfo chunk = transfer_.chunks[index];
-    uint8_t flag = protocol::flags::SEND;
 
-    if(chunk.index == (transfer_.chunks.size() - 1)) { // If it is last chunk
-        flag = protocol::flags::LAST;
+    std::vector<std::shared_ptr<DataStream>> streams = data_streams_; // An abort clears data_streams_ under our feet
+    for(const auto& stream : streams) {
+        if(!stream->attached) continue;
+        while(stream->in_flight.size() < transfer_.window && next_upload_chunk(false, index, flag)) {
+            if(!send_upload_chunk(stream, index, flag)) return;
+            stream->in_flight.push_back(index);
+        }
+    }
+}
+
+bool Client::next_upload_chunk(bool on_main, uint32_t& index, uint8_t& flag) {
+    // Chunks of a lost connection may have been covered by a cumulative ack since
+    retry_chunks_.erase(std::remove_if(retry_chunks_.begin(), retry_chunks_.end(), [this](uint32_t i) { return transfer_.chunk_state[i]; }), retry_chunks_.end());
+
+    uint32_t cursor = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.next_chunk); // Cursor only moves forward, no rescan from 0
+    bool retry = !retry_chunks_.empty();
+    if(!retry && cursor >= transfer_.chunks.size()) { // Everything is sent or acknowledged, only acks are left
+        return false;
+    }
+    index = retry ? retry_chunks_.front() : cursor;
+
+    bool more = retry ? (retry_chunks_.size() > 1 || cursor < transfer_.chunks.size())
+                      : fsutils::next_pending_chunk(transfer_.chunk_state, cursor + 1) < transfer_.chunks.size();
+    flag = more ? protocol::flags::SEND : protocol::flags::LAST; // Nothing left to send after it, server verifies the file
+
+    if(flag == protocol::flags::LAST && striped_) {
+        // Connections do not keep order between each other: the server may only verify the file once
+        // every other chunk is written, and only the session's own connection may finish the upload
+        size_t in_flight = transfer_.in_flight;
+        for(const auto& stream : data_streams_) {
+            in_flight += stream->in_flight.size();
+        }
+        if(!on_main || in_flight > 0) return false;
     }
 
+    if(retry) {
+        retry_chunks_.pop_front();
+    } else {
+        transfer_.next_chunk = cursor + 1;
+    }
+    return true;
+}
+
+bool Client::send_upload_chunk(const std::shared_ptr<DataStream>& stream, uint32_t index, uint8_t flag) {
+    protocol::ChunkInfo chunk = transfer_.chunks[index];
+
     protocol::ChunkHeader chunk_header{
         transfer_.transfer_id,
         chunk.index,
@@ -1497,30 +1880,47 @@ void Client::uploading() {
         flag
     };
 
-    uint32_t offset = fsutils::CHUNK_SIZE * chunk.index;
+    uint64_t offset = chunk.offset;
 
-    std::vector<uint8_t> data = fsutils::read_chunk(transfer_.fmeta.absolute_path, offset, chunk.size);
-    if(data.empty()) {
-        return;
+    protocol::ChunkBuffer data = buffers_->acquire(chunk.size);
+    if(!transfer_.file.open(transfer_.fmeta.absolute_path, fsutils::TransferFile::Mode::READ) || !transfer_.file.read_at(offset, chunk.size, data.bytes())) {
+        spdlog::error("Failed to read chunk {} of {}: {}", chunk.index, transfer_.fmeta.absolute_path.string(), transfer_.file.error().message());
+        print(protocol::codes::INTERNAL_SERVER_ERROR, "Cannot read from file", !batch_active_);
+        upload_abort(false, true, protocol::flags::ERROR);
+        return false;
+    }
+    if(transfer_.compressed) {
+        protocol::compress_chunk(chunk_header, data, *buffers_);
+    }
+    if(stream) {
+        stream_send(stream, protocol::make_chunk_frame(chunk_header, std::move(data)));
+    } else {
+        queue_frame(protocol::make_chunk_frame(chunk_header, std::move(data)));
     }
-    send_chunk(chunk_header, data);
+    transfer_.transferred += chunk.size;
+    return true;
 }
 
 void Client::upload_done() {
+    measure_throughput();
+    close_streams();
     partmeta_->delete_partial_metadata(transfer_.transfer_id);
 
     transfer_.transfer_id = UINT32_MAX;
     transfer_.fmeta = fsutils::FileMetadata{};
     transfer_.chunk_state.clear();
     transfer_.chunks.clear();
+    transfer_.file.close();
 
     state_ = ClientState::READY;
     command_finished(true);
 }
 
 void Client::upload_abort(bool save, bool notify, uint8_t flag) {
+    close_streams();
     if(save) {
         partmeta_->save();
+        transfer_.file.close();
     } else {
         partmeta_->delete_partial_metadata(transfer_.transfer_id);
 
@@ -1528,6 +1928,7 @@ void Client::upload_abort(bool save, bool notify, uint8_t flag) {
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.file.close();
     }
 
     if(notify) {
@@ -1541,6 +1942,9 @@ void Client::upload_abort(bool save, bool notify, uint8_t flag) {
         std::vector<uint8_t> data;
 
         send_chunk(chunk_header, data);
+        if(transfer_.window > 1 && flag != protocol::flags::ABORTED) { // Server may still have acks on the way
+            draining_ = true;
+        }
     }
 
     if(flag != protocol::flags::EXIT) {
@@ -1550,8 +1954,10 @@ void Client::upload_abort(bool save, bool notify, uint8_t flag) {
 }
 
 void Client::upload_abort_exit(bool save, bool notify, uint8_t flag) {
+    close_streams();
     if(save) {
         partmeta_->save();
+        transfer_.file.close();
     } else {
         partmeta_->delete_partial_metadata(transfer_.transfer_id);
 
@@ -1559,6 +1965,7 @@ void Client::upload_abort_exit(bool save, bool notify, uint8_t flag) {
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.file.close();
     }
 
     if(notify) {
@@ -1575,13 +1982,17 @@ void Client::upload_abort_exit(bool save, bool notify, uint8_t flag) {
     }
 }
 
-bool Client::valid_file(const std::filesystem::path& partial_file, const std::array<uint8_t, crypto_generichash_BYTES>& expected) {
+bool Client::valid_file(const std::filesystem::path& partial_file, const fsutils::FileMetadata& expected) {
+    if(!fsutils::is_hash_error(expected.tree_hash)) { // valid_chunk() checked every chunk as it came in
+        return fsutils::complete_tree(transfer_.chunks, transfer_.chunk_state, expected.tree_hash);
+    }
     std::array<uint8_t, crypto_generichash_BYTES> hash = fsutils::hash_file(partial_file);
 
-    return hash == expected && !fsutils::is_hash_error(hash);
+    return hash == expected.hash && !fsutils::is_hash_error(hash);
 }
 
 bool Client::valid_chunk(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data) {
+    if(index >= transfer_.chunks.size()) return false;
     protocol::ChunkInfo chunk = transfer_.chunks[index];
     if(chunk.size != size) return false;
     if(chunk.index != index) return false;
@@ -1589,71 +2000,99 @@ bool Client::valid_chunk(const uint32_t& index, const uint32_t& size, const std:
     return hash == fsutils::hex_to_hash(chunk.chunk_hash) && !fsutils::is_hash_error(hash);
 }
 
-void Client::download_init(const std::vector<protocol::ChunkInfo>& chunks, const std::string& file_hash) {
+void Client::download_init(const std::vector<protocol::ChunkInfo>& chunks, const std::string& file_hash, const std::string& tree_hash) {
     uint64_t file_size = 0;
     for(const protocol::ChunkInfo& chunk : chunks) {
         file_size += chunk.size;
     }
 
-    if(file_size > UINT32_MAX) {
+    if(file_size > protocol::MAX_FILE_SIZE) {
         print(protocol::codes::INTERNAL_SERVER_ERROR, "Requested file is too large.");
         download_abort(false, true, protocol::flags::ERROR);
         return;
     }
+    uint64_t available = fsutils::available_space(transfer_.fmeta.absolute_path.parent_path());
+    if(available != fsutils::SIZE_ERROR && available < file_size) {
+        print(protocol::codes::INSUFFICIENT_STORAGE, "Not enough free space for the download.");
+        download_abort(false, true, protocol::flags::ERROR);
+        return;
+    }
+
+    std::array<uint8_t, crypto_generichash_BYTES> tree = fsutils::HASH_ERROR; // Old servers: the finished file is rehashed instead
+    if(!tree_hash.empty()) {
+        tree = fsutils::tree_hash(chunks);
+    }
+    if(!protocol::valid_chunk_size(transfer_.chunk_size) || !fsutils::valid_chunk_plan(chunks, file_size, transfer_.chunk_size) ||
+       (!tree_hash.empty() && fsutils::hex_to_hash(tree_hash) != tree)) {
+        print(protocol::codes::INTERNAL_SERVER_ERROR, "Server sent an invalid chunk plan.");
+        download_abort(false, true, protocol::flags::ERROR);
+        return;
+    }
 
     transfer_.transfer_id = UINT32_MAX; // unitialized
-    transfer_.fmeta.size = static_cast<uint32_t>(file_size);
+    transfer_.fmeta.size = file_size;
     transfer_.fmeta.hash = fsutils::hex_to_hash(file_hash);
+    transfer_.fmeta.tree_hash = tree;
     transfer_.chunks = chunks;
+    fsutils::assign_offsets(transfer_.chunks); // Old servers send none
     transfer_.chunk_state = std::vector<bool>(chunks.size(), false);
     state_ = ClientState::DOWNLOADING;
     //read_line();
 }
 
-void Client::download_prepare_partmeta() {
-    partmeta_->add_partial_metadata(TransferType::DOWNLOAD, transfer_.fmeta, transfer_.chunks, transfer_.transfer_id);
+bool Client::download_prepare_partmeta() {
+    // Beside the destination, not under root_/.partial: a sync folder on another filesystem would turn download_done()'s rename into a copy
+    partmeta_->add_partial_metadata(TransferType::DOWNLOAD, transfer_.fmeta, transfer_.chunks, transfer_.chunk_size, transfer_.transfer_id,
+                                    PartialMetadata::partial_path_beside(transfer_.fmeta.absolute_path, transfer_.transfer_id));
 
     transfer_.partial_path = partmeta_->get_partial_path(transfer_.transfer_id);
 
     if(transfer_.partial_path.empty()) {
         print(protocol::codes::INTERNAL_SERVER_ERROR, "Cannot get partial file");
-        upload_abort(false, true, protocol::flags::ERROR);
-        return;
+        download_abort(false, true, protocol::flags::ERROR);
+        return false;
     } 
-    if(!fsutils::is_file(transfer_.partial_path)) {
-        fsutils::create_empty_file(transfer_.partial_path);
+    if(!transfer_.file.open(transfer_.partial_path, fsutils::TransferFile::Mode::WRITE) || !transfer_.file.preallocate(transfer_.fmeta.size)) {
+        spdlog::error("Failed to allocate {}: {}", transfer_.partial_path.string(), transfer_.file.error().message());
+        bool full = transfer_.file.error() == std::errc::no_space_on_device;
+        print(full ? protocol::codes::INSUFFICIENT_STORAGE : protocol::codes::INTERNAL_SERVER_ERROR, full ? "Not enough free space for the download." : "Cannot write to file");
+        download_abort(false, true, protocol::flags::ERROR);
+        return false;
     }
-    return;
+    return true;
 }
 
-void Client::downloading(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data, uint8_t flag) {
+void Client::downloading(const uint32_t& index, const uint32_t& size, protocol::ChunkBuffer& data, uint8_t flag) {
     transfer_.chunk_state[index] = true;
     partmeta_->mark_chunk_received(transfer_.transfer_id, index); // Set received chunks to true
 
-    uint32_t offset = fsutils::CHUNK_SIZE * index;
-    if(!fsutils::write_chunk(transfer_.partial_path, offset, data)) {
+    uint64_t offset = transfer_.chunks[index].offset;
+    if(!transfer_.file.open(transfer_.partial_path, fsutils::TransferFile::Mode::WRITE) || !transfer_.file.write_at(offset, data.bytes())) {
+        spdlog::error("Failed to write chunk {} of {}: {}", index, transfer_.partial_path.string(), transfer_.file.error().message());
         print(protocol::codes::INTERNAL_SERVER_ERROR, "Cannot write to file");
         flag = protocol::flags::ERROR;
         download_abort(false, true, flag);
         return;
     }
+    transfer_.transferred += size;
     if(flag == protocol::flags::DONE) {
-        if(!valid_file(transfer_.partial_path, transfer_.fmeta.hash)) {
+        if(!valid_file(transfer_.partial_path, transfer_.fmeta)) {
             print(protocol::codes::INTERNAL_SERVER_ERROR, "Downloaded file is corrupted");
             flag = protocol::flags::ERROR;
             download_abort(false, true, flag);
             return;
         }
     }
+    transfer_.acked_prefix = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.acked_prefix);
+    std::vector<uint8_t> response_data = protocol::encode_ack(transfer_.acked_prefix);
+
     protocol::ChunkHeader ch{
         transfer_.transfer_id,
         index,
-        0,
+        static_cast<uint32_t>(response_data.size()),
         flag
     };
 
-    std::vector<uint8_t> response_data;
-
     send_chunk(ch, response_data);
 
     if(flag == protocol::flags::DONE) {
@@ -1662,6 +2101,8 @@ void Client::downloading(const uint32_t& index, const uint32_t& size, const std:
 }
 
 void Client::download_done() {
+    measure_throughput();
+    transfer_.file.close();
     fsutils::move_path(transfer_.partial_path, transfer_.fmeta.absolute_path, true); // Move downloaded file to destination
     partmeta_->delete_partial_metadata(transfer_.transfer_id);
 
@@ -1678,6 +2119,7 @@ void Client::download_done() {
 void Client::download_abort(bool save, bool notify, uint8_t flag) {
     if(save) {
         partmeta_->save();
+        transfer_.file.close();
     } else {
         fsutils::remove_file(transfer_.partial_path); // Delete partial file
         partmeta_->delete_partial_metadata(transfer_.transfer_id);
@@ -1686,6 +2128,7 @@ void Client::download_abort(bool save, bool notify, uint8_t flag) {
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.file.close();
     }
 
     if(notify) {
@@ -1699,6 +2142,9 @@ void Client::download_abort(bool save, bool notify, uint8_t flag) {
         std::vector<uint8_t> data;
 
         send_chunk(ch, data);
+        if(transfer_.window > 1 && flag != protocol::flags::ABORTED) { // Server may still have chunks on the way
+            draining_ = true;
+        }
     }
 
     if(flag != protocol::flags::EXIT) {
@@ -1710,6 +2156,7 @@ void Client::download_abort(bool save, bool notify, uint8_t flag) {
 void Client::download_abort_exit(bool save, bool notify, uint8_t flag)  {
     if(save) {
         partmeta_->save();
+        transfer_.file.close();
     } else {
         fsutils::remove_file(transfer_.partial_path); // Delete partial file
         partmeta_->delete_partial_metadata(transfer_.transfer_id);
@@ -1718,6 +2165,7 @@ void Client::download_abort_exit(bool save, bool notify, uint8_t flag)  {
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.file.close();
     }
 
     if(notify) {
@@ -49,7 +49,7 @@ static bool parse_host_port(const std::string& input, UserHostPort& out) {
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " [username@]<host>:<port> [--log <log_file>] [--log-level <level>]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [username@]<host>:<port> [--log <log_file>] [--log-level <level>] [--streams <count>] [--cdc]" << std::endl;
         return 1;
     }
 
@@ -61,6 +61,8 @@ int main(int argc, char* argv[]) {
 
     std::string log_file;
     std::string log_level_str = "info";
+    uint32_t streams = 0;
+    bool content_defined = false;
     for (int i = 2; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--log") {
@@ -75,6 +77,20 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             log_level_str = argv[++i];
+        } else if (arg == "--streams") {
+            if (i + 1 >= argc) {
+                std::cerr << "--streams requires a count (0-" << protocol::MAX_STREAMS << ")\n";
+                return 1;
+            }
+            char* end = nullptr;
+            long count = std::strtol(argv[++i], &end, 10);
+            if (*end != '\0' || count < 0 || count > static_cast<long>(protocol::MAX_STREAMS)) {
+                std::cerr << "--streams requires a count (0-" << protocol::MAX_STREAMS << ")\n";
+                return 1;
+            }
+            streams = static_cast<uint32_t>(count);
+        } else if (arg == "--cdc") {
+            content_defined = true;
         } else {
             std::cerr << "Unknown argument: " << arg << std::endl;
             return 1;
@@ -96,7 +112,7 @@ int main(int argc, char* argv[]) {
     asio::io_context io_context;
     auto work_guard = std::make_shared<asio::executor_work_guard<asio::io_context::executor_type>>(asio::make_work_guard(io_context));
     
-    Client client(hp.username, io_context, work_guard);
+    Client client(hp.username, streams, content_defined, io_context, work_guard);
     client.connect(hp.host, hp.port);
 
     // handle SIGINT, SIGTERM
@@ -85,16 +85,10 @@ SyncPlan compute_sync_plan(const std::map<std::string, SyncEntry>& local,
         return join_remote(remote_dir, relative_path);
     };
 
-    // Queues an upload, preceded by a delete when the remote path is already taken.
+    // Queues an upload, a delta against the remote file when the remote path is already taken.
     auto emit_upload = [&](const std::string& relative_path, const SyncEntry& entry, bool remote_exists) {
-        if(remote_exists) {
-            SyncOp del{};
-            del.type = SyncOpType::DELETE_REMOTE;
-            del.remote_path = remote_of(relative_path);
-            deletes.push_back(del);
-        }
         SyncOp op{};
-        op.type = SyncOpType::UPLOAD;
+        op.type = remote_exists ? SyncOpType::DELTA_UPLOAD : SyncOpType::UPLOAD;
         op.local_path = local_dir / std::filesystem::path(relative_path);
         op.remote_path = remote_of(relative_path);
         op.relative_path = relative_path;
@@ -342,7 +336,7 @@ SyncPlan compute_sync_plan(const std::map<std::string, SyncEntry>& local,
     }
     for(const SyncOp& op : moves) source_by_hash[op.entry.hash] = op.remote_path;
     for(const SyncOp& op : transfers) {
-        if(op.type == SyncOpType::UPLOAD) source_by_hash.emplace(op.entry.hash, op.remote_path);
+        if(op.type == SyncOpType::UPLOAD || op.type == SyncOpType::DELTA_UPLOAD) source_by_hash.emplace(op.entry.hash, op.remote_path);
     }
 
     for(size_t i = 0; i < new_local_files.size(); ++i) {
@@ -56,7 +56,7 @@ void SyncManifest::load() {
             SyncManifestEntry entry;
             entry.hash = item.value("hash", std::string());
             entry.mtime = item.value("mtime", uint64_t{0});
-            entry.size = item.value("size", uint32_t{0});
+            entry.size = item.value("size", uint64_t{0});
             entry.is_directory = item.value("is_directory", false);
             entries_[item.at("relative_path").get<std::string>()] = entry;
         }
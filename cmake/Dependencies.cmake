@@ -47,6 +47,26 @@ if(NOT TARGET libsodium::libsodium)
     endif()
 endif()
 
+# zstd (chunk body compression)
+FetchContent_Declare(
+    zstd
+    GIT_REPOSITORY https://github.com/facebook/zstd.git
+    GIT_TAG v1.5.7
+    SOURCE_SUBDIR build/cmake
+)
+set(ZSTD_BUILD_PROGRAMS OFF CACHE INTERNAL "")
+set(ZSTD_BUILD_SHARED OFF CACHE INTERNAL "")
+set(ZSTD_BUILD_STATIC ON CACHE INTERNAL "")
+set(ZSTD_BUILD_TESTS OFF CACHE INTERNAL "")
+set(ZSTD_LEGACY_SUPPORT OFF CACHE INTERNAL "")
+FetchContent_MakeAvailable(zstd)
+if(NOT TARGET zstd::zstd)
+    add_library(zstd::zstd ALIAS libzstd_static)
+    # Mark zstd includes as system to suppress warnings
+    set_target_properties(libzstd_static PROPERTIES INTERFACE_SYSTEM_INCLUDE_DIRECTORIES "${zstd_SOURCE_DIR}/lib")
+    target_include_directories(libzstd_static INTERFACE $<BUILD_INTERFACE:${zstd_SOURCE_DIR}/lib>)
+endif()
+
 # Helper interface library for shared warning flags
 add_library(minidrive_warnings INTERFACE)
 if(MSVC)
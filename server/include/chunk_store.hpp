@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "protocol/message.hpp"
+#include "manifest_cache.hpp"
+
+// Where a stored chunk can be read back from
+struct ChunkLocation {
+    std::filesystem::path file; // Stored file holding the chunk
+    uint64_t offset;
+    uint32_t size;
+};
+
+// Content-addressed index of the chunks stored on one tier, --chunk-store turns it on.
+// Stored files are immutable: an upload renames its verified .part into place and nothing writes
+// the file afterwards, so its chunk plan stays true until it is replaced or removed - which changes
+// its stamp. Each chunk hash maps to the files holding it, which are its reference count. A file
+// whose stamp changed drops its references, and a chunk left without any is gone from the store.
+//
+// The index persists as an append-only log of (file, stamp, chunks) records in <tier>/chunks.
+// collect() rewrites it with only the live records into a temporary file, fsyncs it, renames that
+// over the log and fsyncs the directory, so a crash leaves either log complete. load() skips torn
+// records and keeps the ones after them.
+// Chunks are read back and hashed before they are used, a stale record costs a resend, never data.
+// The store spans every user of the tier, so a lookup names the directories the caller may read:
+// a chunk hash is no secret, and matching one must never hand out another user's bytes.
+// Shared by all sessions of the tier's users, every access goes through mutex_.
+class ChunkStore {
+public:
+    static constexpr size_t MIN_COLLECT_RECORDS = 1024; // Dead records in the log before add() compacts it
+
+    explicit ChunkStore(std::filesystem::path dir); // Log is dir/index.log, dir is created by load()
+
+    void load(); // Replay the log, then collect()
+    void add(const std::filesystem::path& file, const std::vector<protocol::ChunkInfo>& chunks); // file was just verified against chunks, offsets set
+    std::vector<ChunkLocation> find(const std::string& hash, const std::vector<std::filesystem::path>& within); // Files under one of within still holding the chunk, stale ones are dropped on the way
+    size_t collect(); // Drop changed files and unreferenced chunks, rewrite the log, returns the number of chunks dropped
+
+private:
+    struct ChunkRef {
+        std::string file; // Key of files_
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    struct FileRecord {
+        FileStamp stamp; // Taken right after the upload renamed the file into place
+        std::vector<protocol::ChunkInfo> chunks; // Hashes and offsets, what the log record repeats
+    };
+
+    static bool unchanged(const FileStamp& recorded, const std::filesystem::path& file); // Same inode, size and mtime. Not ctime: COPY links files, which touches it
+    void insert(const std::string& file, FileRecord record); // Caller holds mutex_
+    size_t drop(const std::string& file); // Remove a file and its references, returns chunks left unreferenced, caller holds mutex_
+    void append(const std::string& file, const FileRecord& record); // One log line, caller holds mutex_
+    static void write_record(std::ostream& out, const std::string& file, const FileRecord& record); // One JSON line
+    size_t compact(); // collect() with mutex_ held
+
+    std::filesystem::path dir_; // <tier>/chunks
+    std::filesystem::path log_path_; // dir_/index.log
+    std::ofstream log_; // Open for appending between compactions
+    std::unordered_map<std::string, FileRecord> files_; // Keyed by absolute path
+    std::unordered_map<std::string, std::vector<ChunkRef>> chunks_; // hash_to_hex value -> files holding it
+    size_t dead_records_ = 0; // Records in the log whose file was dropped or recorded again since
+    std::mutex mutex_;
+};
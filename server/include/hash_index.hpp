@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "manifest_cache.hpp"
+
+// Which hash of a file a key is. Kept apart: file contents can be crafted to equal a tree node,
+// so a tree hash must only ever match tree hashes.
+enum class ContentHash {
+    FILE, // fsutils::hash_file() of the whole file
+    TREE  // fsutils::tree_hash() of a chunk plan the file was verified against
+};
+
+// Stored files by content hash, so an UPLOAD of content the tier already holds is finished from
+// the stored file instead of the network. One per tier, a link or reflink never crosses media.
+// Only hashes the server computed or verified go in: a client's claim about its own file is not
+// checked until its chunks arrive, and an entry built from it would hand its bytes to the next
+// upload claiming that hash. Entries are stamped like ManifestCache's and dropped when the file
+// changes. Kept in memory, SYNC listings, downloads and uploads fill it again after a restart.
+// Shared by all sessions of the tier's users, every access goes through mutex_.
+class HashIndex {
+public:
+    static constexpr size_t MAX_FILES = 64 * 1024; // Indexed files, the oldest are forgotten first
+
+    void put(ContentHash kind, const std::string& hash, const std::filesystem::path& file, const FileStamp& stamp); // hash_to_hex value, stamp taken before the file was hashed
+    std::optional<std::filesystem::path> find(ContentHash kind, const std::string& hash, uint64_t size, const std::filesystem::path& within); // Unchanged file of that size under within, stale ones are dropped
+
+private:
+    struct Entry {
+        FileStamp stamp;
+        std::vector<std::string> keys; // Keys of files_by_key_ naming this file
+    };
+
+    static std::string key(ContentHash kind, const std::string& hash);
+    void erase(const std::string& file); // Caller holds mutex_
+
+    std::unordered_map<std::string, Entry> entries_; // Keyed by absolute path
+    std::unordered_map<std::string, std::vector<std::string>> files_by_key_; // key() -> paths in entries_
+    std::deque<std::string> order_; // Keys of entries_ in insertion order, oldest first
+    std::mutex mutex_;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <asio/any_io_executor.hpp>
+#include <asio/io_context.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+#include <asio/strand.hpp>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// io_uring for the chunk reads and writes of transfers (--io-engine uring), so a slow disk
+// stalls only the session waiting for it instead of a whole io_context thread.
+// Talks to the kernel directly (linux/io_uring.h, no liburing). Completions raise an eventfd
+// that is watched like any socket, handlers are posted to the executor passed with the request.
+// Shared by all sessions, submission and reaping go through mutex_.
+class IoRing : public std::enable_shared_from_this<IoRing> {
+public:
+    using Handler = std::function<void(std::error_code)>; // Empty error_code when every byte was transferred
+
+    static constexpr unsigned ENTRIES = 256; // Requests in the kernel at once, later ones wait in backlog_
+
+    static std::shared_ptr<IoRing> create(asio::io_context& io_context, std::error_code& error); // nullptr and error when the kernel has no usable io_uring
+    ~IoRing();
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // data must stay valid until handler runs, keep its owner in the handler
+    void read(int fd, uint64_t offset, uint8_t* data, uint32_t size, asio::any_io_executor executor, Handler handler); // Exactly size bytes, EOF is io_error
+    void write(int fd, uint64_t offset, const uint8_t* data, uint32_t size, asio::any_io_executor executor, Handler handler);
+    void close(); // Stop watching completions, lets io_context run out of work on shutdown
+
+private:
+    struct Operation {
+        bool write; // IORING_OP_WRITE, IORING_OP_READ otherwise
+        int fd;
+        uint64_t offset; // Of the first byte not transferred yet
+        uint8_t* data; // First byte not transferred yet
+        uint32_t remaining; // Bytes left, short reads and writes are submitted again
+        asio::any_io_executor executor; // Where handler runs
+        Handler handler;
+    };
+
+    explicit IoRing(asio::io_context& io_context);
+
+    bool setup(std::error_code& error);
+    void submit(uint64_t id, Operation& op); // Caller holds mutex_
+    void enter(); // io_uring_enter() for queued SQEs, caller holds mutex_
+    void fail_queued(std::error_code error); // Take back the SQEs the kernel did not consume and fail their operations, caller holds mutex_
+    void arm(); // Wait for the eventfd, reap() on wake-up
+    void reap(); // Finish or resubmit every completed request
+
+    asio::strand<asio::io_context::executor_type> strand_; // Serializes arm(), reap() and close() on event_
+    asio::posix::stream_descriptor event_; // eventfd registered with the ring
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr; // mmap of the submission ring, also the completion ring with IORING_FEAT_SINGLE_MMAP
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+
+    std::unordered_map<uint64_t, Operation> pending_; // In the kernel, keyed by user_data
+    std::deque<std::pair<uint64_t, Operation>> backlog_; // Waiting for one of the ENTRIES slots
+    uint64_t next_id_ = 0;
+    std::mutex mutex_;
+};
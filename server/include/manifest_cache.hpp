@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <sodium.h>
+#include "protocol/message.hpp"
+
+// Identity of a stored file as stat() sees it. Any write, truncate or replace changes it.
+struct FileStamp {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+
+    bool operator==(const FileStamp& other) const = default;
+    bool same_content(const FileStamp& other) const { // Equal but for ctime, which linking the file touches
+        return device == other.device && inode == other.inode && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+
+// Whole-file hash and chunk plan of a stored file, what DOWNLOAD sends ahead of the chunks
+struct FileManifest {
+    uint64_t size;
+    std::array<uint8_t, crypto_generichash_BYTES> hash;
+    std::vector<protocol::ChunkInfo> chunks;
+    uint32_t chunk_size; // Size chunks were cut with, a DOWNLOAD negotiating another one cuts the file again
+};
+
+// Manifests of stored files, so a DOWNLOAD of an unchanged file does not read and hash it again.
+// Filled by downloads that had to hash and by finished uploads (their plan was verified chunk by chunk).
+// Shared by all sessions, every access goes through mutex_.
+class ManifestCache {
+public:
+    static constexpr size_t MAX_CHUNKS = 256 * 1024; // Cached ChunkInfo entries in total (64 GiB of files)
+
+    static std::optional<FileStamp> stamp(const std::filesystem::path& path); // nullopt when stat() fails
+
+    std::optional<FileManifest> find(const std::filesystem::path& path); // nullopt when missing or the file changed since put()
+    void put(const std::filesystem::path& path, const FileStamp& stamp, FileManifest manifest); // stamp taken before the file was read
+
+private:
+    struct Entry {
+        FileStamp stamp;
+        FileManifest manifest;
+    };
+
+    void erase(const std::string& key); // Caller holds mutex_
+    void evict(); // Drops the oldest entries until the chunk budget holds, caller holds mutex_
+
+    std::unordered_map<std::string, Entry> entries_; // Keyed by absolute path
+    std::deque<std::string> order_; // Keys of entries_ in insertion order, oldest first
+    size_t chunk_count_ = 0; // Sum of chunks over entries_
+    std::mutex mutex_;
+};
@@ -2,27 +2,49 @@
 
 #include <asio/io_context.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/strand.hpp>
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <unordered_set>
 #include <mutex>
+#include <vector>
 #include "storage.hpp"
 #include "session.hpp"
+#include "stream_registry.hpp"
+#include "io_ring.hpp"
+#include "work_pool.hpp"
 
 // Manages sockets, aceppts new connecions
+// One acceptor per io_context. With several (--io-model per-core) they all bind the port with
+// SO_REUSEPORT, the kernel spreads connections over them, and a session lives on the io_context
+// that accepted it. Storage, the stream registry and the work pool are shared by all of them.
 class Server {
 public:
-    Server(asio::io_context& io_context, std::uint16_t port, StorageConfig config);
+    Server(const std::vector<asio::io_context*>& io_contexts, std::uint16_t port, StorageConfig config);
     void start(); // Start accepting
-    void exit_all_sessions(); // Exit all sessions, triggered by signal
+    void exit_all_sessions(); // Exit all sessions, triggered by signal, from any thread
 
 private:
-    asio::ip::tcp::acceptor acceptor_;
+    // Accept loop of one io_context
+    struct Listener {
+        Listener(asio::io_context& io_context, const asio::ip::tcp::endpoint& endpoint, bool reuse_port); // Throws like asio's acceptor constructor
+
+        asio::io_context& io_context; // Executor of accepted sockets, each session puts its own strand on top
+        asio::strand<asio::io_context::executor_type> strand; // Serializes the accept loop with exit_all_sessions()
+        asio::ip::tcp::acceptor acceptor; // Runs its handlers on strand
+        std::shared_ptr<IoRing> io_ring; // Chunk I/O of its sessions with --io-engine uring, nullptr for blocking pread/pwrite
+    };
+
+    std::vector<std::unique_ptr<Listener>> listeners_;
     std::shared_ptr<Storage> storage_; // Manages server storage, locks per user
+    std::shared_ptr<StreamRegistry> stream_registry_; // Tokens of striped uploads, shared by all sessions
+    std::shared_ptr<WorkPool> work_pool_; // Scans, hashing and migrations of all sessions, off the io_context threads
     std::unordered_set<std::shared_ptr<Session>> sessions_; // Set of active sessions
     std::mutex sessions_mutex_; // Mutex for sessions_
-    bool exit = false;
-    void accept();
+    std::atomic<bool> exit{false}; // Set under sessions_mutex_, so no session is added after exit_all_sessions() took its copy
+    void accept(Listener& listener);
 
     void remove_session(std::shared_ptr<Session> session);
-    void add_session(std::shared_ptr<Session> session);
-};
\ No newline at end of file
+    bool add_session(std::shared_ptr<Session> session); // false once exiting, the session is not started
+};
@@ -1,12 +1,18 @@
 #pragma once
 
 #include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
 #include <atomic>
+#include <deque>
 #include <nlohmann/json.hpp>
 #include "protocol/message.hpp"
 #include "filesystem/partmeta.hpp"
 #include "storage.hpp"
 #include "database.hpp"
+#include "stream_registry.hpp"
+#include "io_ring.hpp"
+#include "work_pool.hpp"
 
 enum class SessionState {
     AUTH, // Authentification of user - password
@@ -25,15 +31,35 @@ enum class SessionState {
     UPLOADING, // Recieving uploaded data
     DOWNLOAD_INIT, // Download command registered, preparing for download
     DOWNLOADING, // Sending data
+    WORKING, // A job of the command runs on the WorkPool, no requests are read until it is back
+    WAITING, // The command waits for the user lock, another session of the user holds it, no requests are read meanwhile
+};
+
+// Extra data connection of a striped upload, taken over from the session that received its ATTACH
+struct DataStream {
+    explicit DataStream(asio::ip::tcp::socket s) : socket(std::move(s)) {}
+    asio::ip::tcp::socket socket;
+    std::deque<protocol::OutboundFrame> write_queue; // Same discipline as Session::write_queue_
+    protocol::ChunkHeader ch; // Chunk header for this connection's read loop, read in place
+};
+
+// DOWNLOAD chunk read through the IoRing, sent once it and every chunk queued before it are read
+struct PendingRead {
+    protocol::ChunkHeader header; // Header of the frame, host byte order
+    protocol::ChunkBuffer data; // Filled by the kernel
+    bool done = false; // Completion arrived
+    std::error_code error; // Of the completion
 };
 
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    Session(asio::ip::tcp::socket socket, std::shared_ptr<Storage> storage, std::function<void(std::shared_ptr<Session>)> on_exit);
-    void start(); // Start listening loop
-    void exit(); // Triggered by signals, server, client, sends notification to client or calls finish_exit()
+    Session(asio::ip::tcp::socket socket, std::shared_ptr<Storage> storage, std::shared_ptr<StreamRegistry> stream_registry, std::shared_ptr<IoRing> io_ring, std::shared_ptr<WorkPool> work_pool, std::function<void(std::shared_ptr<Session>)> on_exit);
+    void start(); // Start listening loop, on strand_
+    void shutdown(); // Server is going down, posts exit() to strand_ so it can be called from any thread
+    void adopt_stream(asio::ip::tcp::socket socket, const std::string& token); // Called by the session that received ATTACH, from its own thread
 private:
     asio::ip::tcp::socket socket_;
+    asio::strand<asio::any_io_executor> strand_; // Serializes handlers of socket_ and of the adopted data streams
     std::filesystem::path root_; // Root of filesystem
     std::shared_ptr<Storage> storage_; // Handles operations on filesystem using one mutex per user
     std::function<void(std::shared_ptr<Session>)> on_exit_; // Removes this session from server list of sessions on exit
@@ -42,7 +68,10 @@ private:
     std::unordered_map<std::string, std::function<void(protocol::Request&)>> requests_; // Map of commands and their executors
     std::vector<char> buffer_; // Buffer for json read loop
     uint32_t msg_len_; // Message length for json read loop
-    protocol::ChunkHeader ch_; // Chunk header for binary read loop
+    protocol::ChunkHeader ch_; // Chunk header for binary read loop, read in place
+    std::shared_ptr<protocol::BufferPool> buffers_ = std::make_shared<protocol::BufferPool>(); // Chunk bodies of socket_ and the data streams
+    std::deque<protocol::OutboundFrame> write_queue_; // Frames waiting for the socket, front() is being written
+    bool draining_ = false; // Aborted a windowed transfer, discarding the client's in-flight chunks until its marker arrives
     SessionState state_ = SessionState::LOGIN; // State of session
     std::filesystem::path current_dir_; // Current directory of session
     std::filesystem::path user_dir_; // Users root directory
@@ -52,6 +81,22 @@ private:
     std::queue<PartialMetadataEntry> files_to_be_resumed; // Files to be resumed
     bool resuming_ = false; // True while working through files_to_be_resumed (gates handle_resumes() re-population)
     std::string pending_tier_; // Tier the user asked to move to, held while waiting for their (Y/n)
+    std::shared_ptr<StreamRegistry> stream_registry_; // Tokens of striped uploads, shared with all sessions
+    std::vector<std::shared_ptr<DataStream>> streams_; // Extra connections of the striped upload in progress
+    std::string stream_token_; // Token of the striped upload in progress, empty when not striped
+    uint32_t streams_granted_ = 0; // Extra connections the client may attach
+    std::shared_ptr<IoRing> io_ring_; // Chunk reads and writes go through it when set, blocking TransferFile calls otherwise
+    std::deque<std::shared_ptr<PendingRead>> pending_reads_; // DOWNLOAD chunks submitted to io_ring_, in sending order
+    std::unordered_map<uint32_t, std::shared_ptr<PendingRead>> prefetch_; // DOWNLOAD chunks read ahead through io_ring_, by index
+    uint32_t pending_writes_ = 0; // UPLOAD chunks submitted to io_ring_ and not on disk yet
+    std::function<void()> after_writes_; // Hash check of the LAST chunk, waits until pending_writes_ drops to 0
+    std::shared_ptr<WorkPool> work_pool_; // Runs the blocking part of LIST, SYNC, DOWNLOAD and SET_TIER
+    asio::steady_timer lock_timer_; // Gives up waiting for the user lock after Storage::user_lock_wait(), on strand_
+    protocol::Request parked_; // Request waiting for the user lock, run again once it is handed over
+    std::chrono::steady_clock::time_point parked_since_;
+    uint64_t lock_waits_ = 0; // Tells a stale lock_timer_ completion from the current wait
+    bool lock_handed_ = false; // The paths of parked_ were handed over, its handler takes them instead of trying
+    std::string next_partial_; // File name of next_partial_path(), kept until an upload takes it so a parked UPLOAD run again locks the same one
 
     // Read loop and write using json protocol for communication
     void read_header_json(); // read header of json message using async_read, call read_body_json()
@@ -69,54 +114,106 @@ private:
     // Special write which calls finish_exit();
     void send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data);
 
+    // Write queue, keeps at most one async_write on the socket so pipelined frames never interleave
+    void queue_frame(protocol::OutboundFrame frame); // Append frame, start writing if the socket is idle
+    void write_next(); // Write front() of write_queue_, continue with the rest on completion
+    void write_file_body(); // sendfile(2) the body of a file backed front() frame, after its header
+    void frame_written(std::error_code ec); // Pop front(), then continue, exit or report ec
+
+    // Read loop and write queue of the extra connections of a striped upload, chunks only
+    void stream_read_header(std::shared_ptr<DataStream> stream);
+    void stream_read_body(std::shared_ptr<DataStream> stream);
+    void stream_send(const std::shared_ptr<DataStream>& stream, protocol::OutboundFrame frame);
+    void stream_write_next(std::shared_ptr<DataStream> stream);
+    void stream_error(const std::shared_ptr<DataStream>& stream, const std::error_code& ec); // Drop one connection, the client resends its chunks elsewhere
+    void close_streams(); // Close every extra connection and revoke the token
+
     // Sending helper
     void send_res(protocol::Response& res);
 
     // Protocol switch between binary data and json message based on state_
     void read_next();
 
+    // Run work on work_pool_ in WORKING state, then done on strand_ and read on. Caller holds its path locks,
+    // a full queue releases it and answers "Server is busy", or calls busy instead when given.
+    // work must not touch the session, give it copies
+    void offload(std::string name, std::function<void()> work, std::function<void()> done, std::function<void()> busy = nullptr);
+
+    // Lock paths for req, shared to read and exclusive to write (Storage::try_acquire_user_lock()). When an
+    // operation of another session of the user overlaps them, park req in WAITING state and run it again once
+    // they are handed over; answers "Server is busy" when the wait is not allowed or times out. false means
+    // the handler returns without answering
+    bool acquire_user_lock(const protocol::Request& req, std::vector<PathLock> paths);
+    void lock_granted(); // The parked request got the lock, on strand_
+
+    // Triggered by the client, errors and shutdown(), sends notification to client or calls finish_exit(). On strand_ only
+    void exit();
+
     // Closes socket and on exit removes itself from sessions_ list in server
     void finish_exit();
 
     // Handlers
     void handle_error(const std::error_code& ec); // Handles error codes of async operations
     void handle_request(const nlohmann::json& j);   // Handles json request message from client
-    void handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data); // Handles received binary data from server
+    void handle_chunk(const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // Handles received binary data from server, may take data over
+    void handle_stream_chunk(const std::shared_ptr<DataStream>& stream, const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // SEND chunks of extra connections
     void handle_resumes(); // Handles resumable transfers
     // Automatic operations
     void login(protocol::Request& req); // Handle users existance in db_ (root/users.json), send NEED_INPUT or AUTH response to client, decide public/private mode
     bool setup_dir(); // Set up user directory on their storage tier after succesful login, false means it already sent an error response
     void auth(protocol::Request& req); // Handle password in private mode, store in db_ (root/users.json), send BAD_REQUEST reponse when needed
     void need_input(protocol::Request& req); // Handle registration and resume transfer questions (Y/n)
+    void attach(protocol::Request& req); // Hand this connection to the session owning the token, then leave quietly
 
     // Executes commands
-    void list(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
-    void delete_file(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
-    void upload(protocol::Request& req); // Check arguments, prepare for upload, gather data from client, acquire  per user lock
-    void download(protocol::Request& req); // Check arguments, prepare for download, send data to client, acquire per user lock
+    void list(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
+    void delete_file(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
+    void upload(protocol::Request& req); // Check arguments, prepare for upload, gather data from client, acquire path locks. Also DELTA, which replaces an existing file
+    void signatures(protocol::Request& req); // Block signatures of a stored file for a DELTA, holds a shared path lock while reading
+    void download(protocol::Request& req); // Check arguments, prepare for download, send data to client, acquire path locks
     void cd(protocol::Request& req); // Check arguments, set current_dir_
-    void mkdir(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
-    void rmdir(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
-    void move(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
-    void copy(protocol::Request& req); // Check arguments, acquire per user lock, execute using fsutils, release per user lock
+    void mkdir(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
+    void rmdir(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
+    void move(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
+    void copy(protocol::Request& req); // Check arguments, acquire path locks, execute using fsutils, release path locks
     void sync(protocol::Request& req);
     void tiers(protocol::Request& req); // List storage media configured on the server, no lock needed
-    void set_tier(protocol::Request& req); // Check arguments, acquire per user lock, ask for confirmation
-    void finish_set_tier(); // Runs the migration after the user confirmed, releases per user lock
+    void set_tier(protocol::Request& req); // Check arguments, acquire path locks, ask for confirmation
+    void finish_set_tier(); // Runs the migration after the user confirmed, releases path locks
 
     // Upload - simular to clients download
-    bool valid_file(const std::filesystem::path& partial_file, const std::array<uint8_t, crypto_generichash_BYTES>& expected);
     bool valid_chunk(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data);
-    void upload_init();
-    void uploading(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data, uint8_t flag);
-    void upload_done(); // release per user lock
-    void upload_abort(bool save, bool notify, uint8_t flag); // release per user lock
+    std::filesystem::path next_partial_path(); // .part of the next upload, a name only it uses
+    static std::vector<uint32_t> stage_stored_chunks(const std::string& username, ChunkStore& store, const std::vector<std::filesystem::path>& within, const std::vector<protocol::ChunkInfo>& chunks, uint64_t size, const std::filesystem::path& partial); // Copy the chunks store has under within into partial, returns their indexes for the client to skip. On the WorkPool
+    void start_upload(const protocol::Request& req, std::vector<uint32_t> have); // Answer the UPLOAD with the chunks the client skips and take chunks
+    bool instant_upload(const protocol::Request& req, const std::filesystem::path& requested_file, const std::filesystem::path& tmp); // Finish the upload from an identical stored file and answer DONE, false when there is none
+    void index_file(const std::filesystem::path& file, const std::optional<FileStamp>& stamp, const std::string& file_hash, const std::string& tree_hash); // Into the HashIndex of the user's tier, hashes the server computed or verified, empty skips one
+    bool upload_init(); // false when it had to abort the upload
+    void uploading(const uint32_t& index, const uint32_t& size, protocol::ChunkBuffer& data, uint8_t flag, const std::shared_ptr<DataStream>& stream); // Ack goes back on stream, or socket_ when nullptr
+    void chunk_written(const uint32_t& index, uint8_t flag, const std::shared_ptr<DataStream>& stream); // Chunk is on disk, mark it received, verify the file on DONE and ack
+    void verify_upload(const uint32_t& index, const std::shared_ptr<DataStream>& stream); // Tree hash over the verified chunks, rereads the .part on work_pool_ only for peers without one
+    void upload_verified(const uint32_t& index, bool valid, const std::shared_ptr<DataStream>& stream); // Ack DONE and finish, or abort on a mismatch
+    void ack_chunk(const uint32_t& index, uint8_t flag, const std::shared_ptr<DataStream>& stream);
+    void upload_done(); // release path locks
+    void upload_abort(bool save, bool notify, uint8_t flag); // release path locks
     void upload_abort_exit(bool save, bool notify, uint8_t flag); // calls finish_exit()
 
+    bool open_transfer_file(const std::filesystem::path& path, fsutils::TransferFile::Mode mode); // Opens transfer_.file, kept until the transfer ends
+    void close_transfer_file(); // Drops transfer_.file, completions still in io_ring_ see another file and do nothing
+
+    // Sliding window shared by both directions
+    void open_window(uint32_t window); // Reset window bookkeeping of transfer_ for a new or resumed transfer
+    void acknowledge_chunks(uint32_t index, uint32_t cumulative); // Apply the client's selective and cumulative ack
+    void negotiate_compression(const protocol::Request& req, protocol::Response& res, TransferType type); // Grant the client's codec when enabled and the transfer can use it, sets transfer_.compressed
+    void inflate(protocol::ChunkHeader& ch, protocol::ChunkBuffer& data); // Decompress a COMPRESSED upload chunk in place, a failure leaves a body valid_chunk() rejects
+
     // Download - simular to clients upload
     void download_init();
-    void downloading();
-    void download_done(); // release per user lock
-    void download_abort(bool save, bool notify, uint8_t flag); // release per user lock
+    void downloading(); // Fill the window with unsent chunks
+    void send_reads(); // Send the read prefix of pending_reads_
+    std::shared_ptr<PendingRead> submit_read(const protocol::ChunkInfo& chunk); // Read chunk through io_ring_, header is filled in when it is queued
+    void prefetch(); // Read ahead the next prefetch_depth() unsent chunks past the window
+    void download_done(); // release path locks
+    void download_abort(bool save, bool notify, uint8_t flag); // release path locks
     void download_abort_exit(bool save, bool notify, uint8_t flag); // calls finish_exit()
 };
\ No newline at end of file
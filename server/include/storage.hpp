@@ -1,19 +1,39 @@
 #pragma once
 
+#include<chrono>
+#include<deque>
+#include<functional>
 #include<mutex>
 #include<unordered_map>
 #include "filesystem/utils.hpp"
+#include "filesystem/transfer_file.hpp"
 #include "database.hpp"
 #include "filesystem/partmeta.hpp"
 #include "tier_config.hpp"
+#include "manifest_cache.hpp"
+#include "chunk_store.hpp"
+#include "hash_index.hpp"
 
 // Stores data of currently active file transfer
 struct ActiveTransfer{
-    uint32_t transfer_id; // ID used in partmeta_ database
+    uint32_t transfer_id; // ID in the chunk headers, the client's own for uploads
     fsutils::FileMetadata fmeta; // File metadata
-    std::filesystem::path partial_path; // Path of .part file (user/.partial/id.part)
+    std::filesystem::path partial_path; // Path of .part file (user/.partial/upload-<random>.part for uploads)
     std::vector<protocol::ChunkInfo> chunks; // Sizes, indexes and hashes of chunks
     std::vector<bool> chunk_state; // Represents received/sent chunks
+    uint32_t chunk_size = fsutils::CHUNK_SIZE; // Negotiated for this transfer, each chunk carries its own offset
+    uint32_t window = 1; // Negotiated number of chunks that may be unacknowledged at once
+    uint32_t in_flight = 0; // Sent but not yet acknowledged (sending side)
+    uint32_t next_chunk = 0; // Cursor: every chunk below it is sent or acknowledged (sending side)
+    uint32_t acked_prefix = 0; // Every chunk below it is transferred, the cumulative ack
+    uint32_t prefetched = 0; // Cursor: every chunk below it was read ahead or sent (sending side)
+    uint64_t prefetch_hits = 0; // io_uring: chunks that were read ahead by the time the window reached them
+    uint64_t prefetch_misses = 0; // io_uring: chunks read only when the window reached them
+    uint64_t prefetch_advised = 0; // Blocking engine: chunks sent after a will_need() hint, which does not say they were cached
+    bool compressed = false; // Client and server agreed on compressing chunk bodies (protocol/compression.hpp)
+    std::vector<protocol::DeltaCopy> copies; // DELTA: ranges of the stored file copied into the .part before the first chunk
+    std::shared_ptr<fsutils::TransferFile> file{}; // Source or partial file, held open for the whole transfer, shared with queued sendfile frames
+    uint32_t entry_id = UINT32_MAX; // Key in partmeta_, picked by the server so uploads of clients picking the same transfer_id never share one
 };
 
 // Outcome of physically relocating one user's tree between two storage tiers
@@ -24,6 +44,44 @@ struct MigrationResult {
     uint64_t bytes; // Total size moved
 };
 
+// A path an operation works on, and everything below it. Reads share it, writes take it alone
+struct PathLock {
+    std::filesystem::path path; // Absolute and normalized, compared lexically
+    bool exclusive;
+};
+
+// Paths one session holds for its operation
+struct UserLockHolder {
+    const void* owner; // Session
+    std::vector<PathLock> paths;
+};
+
+// Session waiting for paths of a user
+struct UserLockWaiter {
+    const void* owner; // Session that will hold them
+    std::vector<PathLock> paths;
+    std::function<void()> granted; // Called once the paths are owner's, on the thread that released them
+    std::chrono::steady_clock::time_point since;
+};
+
+// Operation locks of one user. Operations on paths where neither is inside the other, or that
+// only read, hold theirs at once; the others wait in arrival order, and nobody overtakes an
+// earlier waiter it overlaps with
+struct UserLock {
+    std::vector<UserLockHolder> holders;
+    std::deque<UserLockWaiter> waiting;
+};
+
+// How sessions got the user lock, for the logs
+struct UserLockStats {
+    uint64_t acquired = 0; // Free on the first try
+    uint64_t waited = 0; // Handed over after waiting
+    uint64_t timed_out = 0; // Gave up after --lock-wait
+    uint64_t refused = 0; // --lock-queue sessions of the user waited already
+    std::chrono::microseconds total_wait{0}; // Over waited
+    std::chrono::microseconds max_wait{0};
+};
+
 class Storage {
 public:
     Storage(StorageConfig config);
@@ -32,8 +90,18 @@ public:
     std::shared_ptr<Database> get_database(); // Gets database of user data
     std::shared_ptr<PartialMetadata> get_partmeta(const std::string& user); // Gets database of partial file metadata for user, lazy initialization
     std::filesystem::path get_root(); // Gets server control root (users.json, public/)
-    bool try_acquire_user_lock(const std::string& user); // Returns if user can use lock, lazy initialization
-    void release_user_lock(const std::string& user); // Set the value of user lock"
+    bool try_acquire_user_lock(const std::string& user, const void* owner, std::vector<PathLock> paths); // false when paths overlap a holder or waiter, owner holds some already or the user is unknown, lazy initialization
+    bool wait_for_user_lock(const std::string& user, const void* owner, std::vector<PathLock> paths, std::function<void()> granted); // Queue for paths, false when lock_queue sessions wait already
+    bool cancel_user_lock_wait(const std::string& user, const void* owner, bool timed_out); // Leave the queue, false when the paths were handed to owner meanwhile
+    void release_user_lock(const std::string& user, const void* owner); // Release what owner holds, no-op when nothing, hands paths on to waiters
+    std::chrono::milliseconds user_lock_wait() const; // Longest a request waits for the lock, 0 answers "Server is busy" right away
+    UserLockStats user_lock_stats();
+    std::shared_ptr<ManifestCache> get_manifest_cache(); // Chunk plans of stored files, shared by all sessions
+    bool use_sendfile() const; // DOWNLOAD sends chunk bodies with sendfile(2)
+    uint32_t prefetch_depth() const; // DOWNLOAD chunks read ahead past the window
+    bool use_compression() const; // Transfers may compress chunk bodies
+    std::shared_ptr<ChunkStore> get_chunk_store(const std::string& user); // Store of the user's tier, nullptr without --chunk-store or when the tier is gone
+    std::shared_ptr<HashIndex> get_hash_index(const std::string& user); // Stored files by content hash on the user's tier, nullptr when the tier is gone
 
     // Storage tiering
     const std::vector<StorageTier>& get_tiers() const; // All media configured with --tier
@@ -48,9 +116,20 @@ private:
     std::filesystem::path root_; // Server control root directory (users.json, public/)
     std::vector<StorageTier> tiers_; // Configured storage media, immutable after construction
     std::string default_tier_; // Name of the tier new users are placed on
+    bool sendfile_; // Copy of StorageConfig::sendfile
+    uint32_t prefetch_; // Copy of StorageConfig::prefetch
+    bool compression_; // Copy of StorageConfig::compression
+    bool chunk_store_; // Copy of StorageConfig::chunk_store
+    std::chrono::milliseconds lock_wait_; // Copy of StorageConfig::lock_wait
+    size_t lock_queue_; // Copy of StorageConfig::lock_queue
     std::mutex user_partmeta_guard_; // Mutex for user_partmeta_ map
     std::mutex user_lock_guard_; // Mutex for user_transfer_map
     std::unordered_map<std::string, std::shared_ptr<PartialMetadata>> user_partmeta_; // Map of users and their partial file metadata database
-    std::unordered_map<std::string, bool> user_lock_; // Map of users and their operation lock value
+    std::unordered_map<std::string, UserLock> user_lock_; // Map of users and their operation lock
+    UserLockStats lock_stats_; // Guarded by user_lock_guard_
+    std::vector<std::function<void()>> hand_over(UserLock& lock); // Moves waiters that no longer overlap anything to holders, caller holds user_lock_guard_ and calls the result after unlocking
     std::shared_ptr<Database> db_; // Database of user data
+    std::shared_ptr<ManifestCache> manifest_cache_ = std::make_shared<ManifestCache>(); // Manifests of stored files for DOWNLOAD
+    std::unordered_map<std::string, std::shared_ptr<ChunkStore>> chunk_stores_; // Keyed by media root (tiers and the control root for public), filled by setup(), immutable after
+    std::unordered_map<std::string, std::shared_ptr<HashIndex>> hash_indexes_; // Keyed like chunk_stores_, always filled by setup()
 };
\ No newline at end of file
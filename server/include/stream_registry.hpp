@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class Session;
+
+// Tokens of striped uploads in progress, looked up by the sessions that receive ATTACH.
+// Sessions run on any thread of the io_context, so every access goes through mutex_.
+class StreamRegistry {
+public:
+    std::string issue(std::weak_ptr<Session> session); // Random token bound to session until revoked
+    std::shared_ptr<Session> find(const std::string& token); // nullptr for unknown tokens or sessions that are gone
+    void revoke(const std::string& token); // Upload finished, extra connections are no longer accepted
+
+private:
+    std::unordered_map<std::string, std::weak_ptr<Session>> tokens_;
+    std::mutex mutex_;
+};
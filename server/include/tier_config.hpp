@@ -1,5 +1,8 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <filesystem>
 #include <vector>
@@ -18,4 +21,13 @@ struct StorageConfig {
     std::filesystem::path root; // Control root: users.json and public/
     std::vector<StorageTier> tiers; // Declared media, always at least one
     std::string default_tier; // Tier assigned to newly registered users
+    bool sendfile = true; // DOWNLOAD chunk bodies go from the file to the socket with sendfile(2), --no-sendfile turns it off
+    bool io_uring = false; // Chunk reads and writes of transfers go through an IoRing, --io-engine uring turns it on
+    uint32_t prefetch = 4; // DOWNLOAD chunks read ahead past the window, --prefetch <chunks>, 0 turns it off
+    bool compression = true; // Grant chunk body compression to clients that ask for it, --no-compression turns it off
+    bool chunk_store = false; // Index stored chunks per tier so uploads skip the ones the tier has and COPY links, --chunk-store turns it on
+    unsigned work_threads = 0; // Threads of the WorkPool for scans, hashing and migrations, --work-threads <n>, 0 is one per core
+    size_t work_queue = 64; // Jobs waiting for those threads before sessions get "Server is busy", --work-queue <jobs>
+    std::chrono::milliseconds lock_wait{10000}; // A request waits this long for another operation of its user, --lock-wait <ms>, 0 answers "Server is busy" right away
+    size_t lock_queue = 8; // Requests of one user waiting at once, more get "Server is busy", --lock-queue <requests>
 };
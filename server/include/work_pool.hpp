@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Threads for blocking storage work - directory scans, whole-file hashing, tier migrations - so it
+// never runs on an io_context thread and stalls every session sharing it. Sessions hand a job in
+// and get the result posted back to their strand.
+// The queue is bounded: once MAX jobs wait, submit() refuses and the session answers "Server is
+// busy" instead of piling up. A job runs under its session's path locks, so a user only has
+// several jobs in here for disjoint paths.
+// Shared by all sessions, every access goes through mutex_.
+class WorkPool {
+public:
+    using Job = std::function<void()>;
+
+    static constexpr size_t DEFAULT_QUEUE_DEPTH = 64; // Jobs waiting at once, --work-queue <jobs>
+    static constexpr std::chrono::milliseconds SLOW_WAIT{1000}; // Jobs that waited longer are logged as a warning
+
+    // What a job went through, for the logs
+    struct Stats {
+        uint64_t completed = 0;
+        uint64_t rejected = 0; // Refused by submit(), queue was full
+        size_t queued = 0; // Waiting right now
+        size_t running = 0;
+        std::chrono::microseconds total_wait{0}; // From submit() until a thread picked it up, over completed jobs
+        std::chrono::microseconds max_wait{0};
+    };
+
+    WorkPool(unsigned threads, size_t max_queued); // threads 0: one per core
+    ~WorkPool(); // Runs what is queued, then joins
+
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    bool submit(std::string name, Job job); // false when max_queued jobs wait already, name only goes to the logs
+    Stats stats();
+    unsigned threads() const { return static_cast<unsigned>(threads_.size()); }
+
+private:
+    struct Queued {
+        std::string name;
+        Job job;
+        std::chrono::steady_clock::time_point since; // submit()
+    };
+
+    void run(); // Thread body, takes jobs until stopping_ and the queue is empty
+
+    size_t max_queued_;
+    std::deque<Queued> queue_;
+    Stats stats_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+};
@@ -0,0 +1,177 @@
+#include "chunk_store.hpp"
+#include <algorithm>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "filesystem/utils.hpp"
+
+using nlohmann::json;
+
+ChunkStore::ChunkStore(std::filesystem::path dir)
+    : dir_(std::move(dir)),
+      log_path_(dir_ / "index.log") {}
+
+void ChunkStore::load() {
+    std::lock_guard lock(mutex_);
+    if(!fsutils::is_directory(dir_)) {
+        fsutils::mkdir(dir_);
+    }
+
+    std::ifstream f(log_path_);
+    std::string line;
+    size_t records = 0;
+    size_t damaged = 0;
+    while(std::getline(f, line)) {
+        try {
+            json j = json::parse(line);
+            const json& stamp = j.at("stamp");
+            FileRecord record{
+                FileStamp{stamp.at(0).get<uint64_t>(), stamp.at(1).get<uint64_t>(), stamp.at(2).get<uint64_t>(), stamp.at(3).get<int64_t>(), stamp.at(4).get<int64_t>()},
+                j.at("chunks").get<std::vector<protocol::ChunkInfo>>()
+            };
+            insert(j.at("file").get<std::string>(), std::move(record));
+            records++;
+        } catch(const json::exception& e) { // Torn by a crash while appending, the records after it are still good
+            spdlog::warn("Chunk store {}: skipping a damaged record after {} records: {}", dir_.string(), records, e.what());
+            damaged++;
+        }
+    }
+    f.close();
+
+    compact();
+    spdlog::info("Chunk store {} holds {} chunks of {} files, skipped {} damaged records.", dir_.string(), chunks_.size(), files_.size(), damaged);
+}
+
+void ChunkStore::add(const std::filesystem::path& file, const std::vector<protocol::ChunkInfo>& chunks) {
+    std::optional<FileStamp> stamp = ManifestCache::stamp(file);
+    if(!stamp || chunks.empty()) return;
+
+    std::string key = file.string();
+    std::lock_guard lock(mutex_);
+    insert(key, FileRecord{*stamp, chunks});
+    append(key, files_.at(key));
+    if(dead_records_ > std::max(MIN_COLLECT_RECORDS, files_.size())) { // The log is mostly garbage by now
+        compact();
+    }
+}
+
+std::vector<ChunkLocation> ChunkStore::find(const std::string& hash, const std::vector<std::filesystem::path>& within) {
+    std::vector<ChunkLocation> found;
+    std::lock_guard lock(mutex_);
+    auto it = chunks_.find(hash);
+    if(it == chunks_.end()) return found;
+
+    std::vector<std::string> stale;
+    for(const ChunkRef& ref : it->second) {
+        if(std::find(stale.begin(), stale.end(), ref.file) != stale.end()) continue;
+        if(std::none_of(within.begin(), within.end(), [&ref](const std::filesystem::path& dir) { return fsutils::is_subpath(dir, ref.file); })) continue;
+        if(!unchanged(files_.at(ref.file).stamp, ref.file)) {
+            stale.push_back(ref.file);
+            continue;
+        }
+        found.push_back(ChunkLocation{ref.file, ref.offset, ref.size});
+    }
+    for(const std::string& file : stale) { // Invalidates it
+        drop(file);
+        dead_records_++;
+    }
+    return found;
+}
+
+size_t ChunkStore::collect() {
+    std::lock_guard lock(mutex_);
+    return compact();
+}
+
+bool ChunkStore::unchanged(const FileStamp& recorded, const std::filesystem::path& file) {
+    std::optional<FileStamp> current = ManifestCache::stamp(file);
+    return current && current->same_content(recorded);
+}
+
+void ChunkStore::insert(const std::string& file, FileRecord record) {
+    if(files_.count(file) != 0) { // Replaced since, its old record is garbage now
+        drop(file);
+        dead_records_++;
+    }
+    for(const protocol::ChunkInfo& chunk : record.chunks) {
+        chunks_[chunk.chunk_hash].push_back(ChunkRef{file, chunk.offset, chunk.size});
+    }
+    files_.emplace(file, std::move(record));
+}
+
+size_t ChunkStore::drop(const std::string& file) {
+    auto record = files_.find(file);
+    if(record == files_.end()) return 0;
+
+    size_t unreferenced = 0;
+    for(const protocol::ChunkInfo& chunk : record->second.chunks) {
+        auto it = chunks_.find(chunk.chunk_hash);
+        if(it == chunks_.end()) continue; // Repeated chunk of this file, already gone
+        std::erase_if(it->second, [&file](const ChunkRef& ref) { return ref.file == file; });
+        if(it->second.empty()) {
+            chunks_.erase(it);
+            unreferenced++;
+        }
+    }
+    files_.erase(record);
+    return unreferenced;
+}
+
+void ChunkStore::append(const std::string& file, const FileRecord& record) {
+    if(!log_.is_open()) {
+        log_.open(log_path_, std::ios::app);
+    }
+    write_record(log_, file, record);
+    log_.flush(); // A record lost with the process only costs a resend, no fsync
+    if(!log_) {
+        spdlog::warn("Chunk store {}: failed to append to {}.", dir_.string(), log_path_.string());
+        log_.close();
+    }
+}
+
+void ChunkStore::write_record(std::ostream& out, const std::string& file, const FileRecord& record) {
+    const FileStamp& s = record.stamp;
+    json j = {
+        {"file", file},
+        {"stamp", {s.device, s.inode, s.size, s.mtime_ns, s.ctime_ns}},
+        {"chunks", record.chunks}
+    };
+    out << j.dump() << '\n';
+}
+
+size_t ChunkStore::compact() {
+    std::vector<std::string> stale;
+    for(const auto& [file, record] : files_) {
+        if(!unchanged(record.stamp, file)) stale.push_back(file);
+    }
+    size_t unreferenced = 0;
+    for(const std::string& file : stale) {
+        unreferenced += drop(file);
+    }
+
+    // The old log stays in place until the new one is on disk, appends reopen whichever is there.
+    // Without the fsyncs a crash could leave the rename done but the new log empty or cut short
+    log_.close();
+    std::filesystem::path tmp = log_path_;
+    tmp += ".tmp";
+    std::ofstream out(tmp, std::ios::trunc);
+    for(const auto& [file, record] : files_) {
+        write_record(out, file, record);
+    }
+    out.close();
+    std::error_code ec;
+    bool written = out && fsutils::sync_path(tmp);
+    if(written) std::filesystem::rename(tmp, log_path_, ec);
+    if(!written || ec) {
+        spdlog::warn("Chunk store {}: failed to rewrite {}, keeping the old log.", dir_.string(), log_path_.string());
+        fsutils::remove_file(tmp);
+        return unreferenced;
+    }
+    if(!fsutils::sync_path(dir_)) { // The new log is complete either way, only the rename may not be durable yet
+        spdlog::warn("Chunk store {}: failed to sync the directory after rewriting {}.", dir_.string(), log_path_.string());
+    }
+    dead_records_ = 0;
+    if(!stale.empty() || unreferenced > 0) {
+        spdlog::info("Chunk store {}: dropped {} changed files, {} chunks no longer referenced.", dir_.string(), stale.size(), unreferenced);
+    }
+    return unreferenced;
+}
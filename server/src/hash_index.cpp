@@ -0,0 +1,66 @@
+#include "hash_index.hpp"
+#include <algorithm>
+#include "filesystem/utils.hpp"
+
+void HashIndex::put(ContentHash kind, const std::string& hash, const std::filesystem::path& file, const FileStamp& stamp) {
+    if(hash.empty() || stamp.size == 0) return;
+    std::string path = file.string();
+    std::string k = key(kind, hash);
+
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(path);
+    if(it != entries_.end() && !(it->second.stamp == stamp)) { // Replaced since, whatever it was indexed under is wrong now
+        erase(path);
+        it = entries_.end();
+    }
+    if(it == entries_.end()) {
+        it = entries_.emplace(path, Entry{stamp, {}}).first;
+        order_.push_back(path);
+    }
+    if(std::find(it->second.keys.begin(), it->second.keys.end(), k) != it->second.keys.end()) return;
+    it->second.keys.push_back(k);
+    files_by_key_[k].push_back(path);
+
+    while(entries_.size() > MAX_FILES) {
+        std::string oldest = order_.front();
+        erase(oldest);
+    }
+}
+
+std::optional<std::filesystem::path> HashIndex::find(ContentHash kind, const std::string& hash, uint64_t size, const std::filesystem::path& within) {
+    std::lock_guard lock(mutex_);
+    auto it = files_by_key_.find(key(kind, hash));
+    if(it == files_by_key_.end()) return std::nullopt;
+
+    std::vector<std::string> candidates = it->second; // erase() below edits the list
+    for(const std::string& path : candidates) {
+        const FileStamp& recorded = entries_.at(path).stamp;
+        std::optional<FileStamp> current = ManifestCache::stamp(path);
+        if(!current || !current->same_content(recorded)) { // Written, replaced or removed since it was hashed
+            erase(path);
+            continue;
+        }
+        if(recorded.size == size && fsutils::is_subpath(within, path)) {
+            return std::filesystem::path(path);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string HashIndex::key(ContentHash kind, const std::string& hash) {
+    return (kind == ContentHash::TREE ? "tree:" : "file:") + hash;
+}
+
+void HashIndex::erase(const std::string& file) {
+    auto it = entries_.find(file);
+    if(it == entries_.end()) return;
+    for(const std::string& k : it->second.keys) {
+        auto paths = files_by_key_.find(k);
+        std::erase(paths->second, file);
+        if(paths->second.empty()) {
+            files_by_key_.erase(paths);
+        }
+    }
+    entries_.erase(it);
+    order_.erase(std::find(order_.begin(), order_.end(), file));
+}
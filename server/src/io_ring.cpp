@@ -0,0 +1,265 @@
+#include "io_ring.hpp"
+
+#include <asio/bind_executor.hpp>
+#include <asio/post.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template<typename T>
+T* at(void* base, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+}
+
+IoRing::IoRing(asio::io_context& io_context)
+    : strand_(asio::make_strand(io_context)),
+      event_(io_context) {
+}
+
+std::shared_ptr<IoRing> IoRing::create(asio::io_context& io_context, std::error_code& error) {
+    std::shared_ptr<IoRing> ring(new IoRing(io_context));
+    if(!ring->setup(error)) return nullptr;
+    ring->arm();
+    return ring;
+}
+
+bool IoRing::setup(std::error_code& error) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = io_uring_setup(ENTRIES, &params);
+    if(ring_fd_ < 0) { // ENOSYS on old kernels, EPERM where io_uring is disabled
+        error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    if(!(params.features & IORING_FEAT_RW_CUR_POS)) { // Kernels before 5.6, no IORING_OP_READ/WRITE
+        error = std::make_error_code(std::errc::function_not_supported);
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    if(single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if(cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            error = std::error_code(errno, std::generic_category());
+            return false;
+        }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = at<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+    int event_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(event_fd < 0) {
+        error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    if(io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+        error = std::error_code(errno, std::generic_category());
+        ::close(event_fd);
+        return false;
+    }
+    event_.assign(event_fd);
+    return true;
+}
+
+IoRing::~IoRing() {
+    // Buffers of requests still in the kernel die with their handlers, wait until it is done with them
+    while(ring_fd_ >= 0 && !pending_.empty()) {
+        if(io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) break;
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head) {
+            pending_.erase(cqes_[head & *cq_mask_].user_data);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    std::error_code ec;
+    event_.close(ec);
+    if(sqes_) ::munmap(sqes_, sqes_size_);
+    if(cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+    if(sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+    if(ring_fd_ >= 0) ::close(ring_fd_);
+}
+
+void IoRing::read(int fd, uint64_t offset, uint8_t* data, uint32_t size, asio::any_io_executor executor, Handler handler) {
+    if(size == 0) { // Chunk of an empty file, a 0 byte completion would look like EOF
+        asio::post(executor, [handler = std::move(handler)]() { handler({}); });
+        return;
+    }
+    std::lock_guard lock(mutex_);
+    uint64_t id = next_id_++;
+    Operation op{false, fd, offset, data, size, std::move(executor), std::move(handler)};
+    if(pending_.size() >= ENTRIES) {
+        backlog_.emplace_back(id, std::move(op));
+        return;
+    }
+    submit(id, pending_.emplace(id, std::move(op)).first->second);
+    enter();
+}
+
+void IoRing::write(int fd, uint64_t offset, const uint8_t* data, uint32_t size, asio::any_io_executor executor, Handler handler) {
+    if(size == 0) {
+        asio::post(executor, [handler = std::move(handler)]() { handler({}); });
+        return;
+    }
+    std::lock_guard lock(mutex_);
+    uint64_t id = next_id_++;
+    Operation op{true, fd, offset, const_cast<uint8_t*>(data), size, std::move(executor), std::move(handler)}; // Only read by the kernel for writes
+    if(pending_.size() >= ENTRIES) {
+        backlog_.emplace_back(id, std::move(op));
+        return;
+    }
+    submit(id, pending_.emplace(id, std::move(op)).first->second);
+    enter();
+}
+
+void IoRing::close() {
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self]() {
+        std::error_code ec;
+        event_.cancel(ec);
+    });
+}
+
+void IoRing::submit(uint64_t id, Operation& op) {
+    unsigned tail = *sq_tail_;
+    unsigned slot = tail & *sq_mask_;
+    io_uring_sqe& sqe = sqes_[slot];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd = op.fd;
+    sqe.off = op.offset;
+    sqe.addr = reinterpret_cast<uint64_t>(op.data);
+    sqe.len = op.remaining;
+    sqe.user_data = id;
+    sq_array_[slot] = slot;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+void IoRing::enter() {
+    unsigned queued = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    while(queued > 0) {
+        int submitted = io_uring_enter(ring_fd_, queued, 0, 0);
+        if(submitted < 0 && errno == EINTR) continue;
+        if(submitted < 0 && (errno == EAGAIN || errno == EBUSY) && pending_.size() > queued) {
+            return; // Out of kernel resources for now, the next reap() submits them again
+        }
+        if(submitted <= 0) { // Nothing in the kernel would ever get them submitted
+            fail_queued(submitted < 0 ? std::error_code(errno, std::generic_category()) : std::make_error_code(std::errc::io_error));
+            return;
+        }
+        queued -= static_cast<unsigned>(submitted);
+    }
+}
+
+void IoRing::fail_queued(std::error_code error) {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    for(unsigned tail = *sq_tail_; head != tail; ++head) {
+        auto it = pending_.find(sqes_[sq_array_[head & *sq_mask_]].user_data);
+        if(it == pending_.end()) continue;
+        asio::post(it->second.executor, [handler = std::move(it->second.handler), error]() { handler(error); });
+        pending_.erase(it);
+    }
+    __atomic_store_n(sq_tail_, __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE); // The kernel only reads the tail inside io_uring_enter(), under mutex_
+}
+
+void IoRing::arm() {
+    auto self = shared_from_this();
+    event_.async_wait(asio::posix::stream_descriptor::wait_read, asio::bind_executor(strand_, [this, self](std::error_code ec) {
+        if(ec) return; // close()
+        reap();
+        arm();
+    }));
+}
+
+void IoRing::reap() {
+    uint64_t count;
+    while(::read(event_.native_handle(), &count, sizeof(count)) < 0 && errno == EINTR) {} // Reset before reading the ring, later completions wake us again
+
+    std::lock_guard lock(mutex_);
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        auto it = pending_.find(cqe.user_data);
+        if(it == pending_.end()) continue;
+        Operation& op = it->second;
+
+        std::error_code failure;
+        if(cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            submit(it->first, op);
+            continue;
+        }
+        if(cqe.res < 0) {
+            failure = std::error_code(-cqe.res, std::generic_category());
+        } else if(cqe.res == 0) { // Read past the end, file is shorter than its chunk plan
+            failure = std::make_error_code(std::errc::io_error);
+        } else if(static_cast<uint32_t>(cqe.res) < op.remaining) { // Short transfer, ask for the rest
+            op.offset += static_cast<uint64_t>(cqe.res);
+            op.data += cqe.res;
+            op.remaining -= static_cast<uint32_t>(cqe.res);
+            submit(it->first, op);
+            continue;
+        }
+        asio::post(op.executor, [handler = std::move(op.handler), failure]() { handler(failure); });
+        pending_.erase(it);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    while(!backlog_.empty() && pending_.size() < ENTRIES) {
+        auto& [id, op] = backlog_.front();
+        submit(id, pending_.emplace(id, std::move(op)).first->second);
+        backlog_.pop_front();
+    }
+    enter();
+}
@@ -1,6 +1,12 @@
 #include <iostream>
 #include <string>
 #include <cstdint>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <asio.hpp>
 #include <spdlog/spdlog.h>
 
@@ -8,10 +14,13 @@
 #include "minidrive/logging.hpp"
 #include "server.hpp"
 #include "tier_config.hpp"
+#include "work_pool.hpp"
 #include "filesystem/utils.hpp"
 #include <filesystem>
 #include <sodium.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
 
 namespace {
 
@@ -52,6 +61,26 @@ void warn_on_shared_devices(const std::vector<StorageTier>& tiers) {
     }
 }
 
+// Pins thread to the index-th CPU it may run on. Only logs when that fails, an unpinned thread still works.
+void pin_thread(std::thread& thread, unsigned index) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(::sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) return;
+    unsigned target = index % static_cast<unsigned>(CPU_COUNT(&allowed));
+    for(size_t cpu = 0; cpu < static_cast<size_t>(CPU_SETSIZE); ++cpu) {
+        if(!CPU_ISSET(cpu, &allowed)) continue;
+        if(target-- != 0) continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        int error = ::pthread_setaffinity_np(thread.native_handle(), sizeof(one), &one);
+        if(error != 0) {
+            spdlog::warn("Could not pin io thread {} to CPU {}: {}", index, cpu, std::strerror(error));
+        }
+        return;
+    }
+}
+
 } // namespace
 
 int main(int argc, char* argv[]) {
@@ -63,6 +92,18 @@ int main(int argc, char* argv[]) {
     std::string default_tier;
     std::string log_file;
     std::string log_level_str = "info";
+    bool sendfile = true;
+    bool io_uring = false;
+    uint32_t prefetch = 4;
+    bool compression = true;
+    bool chunk_store = false;
+    unsigned work_threads = 0;
+    size_t work_queue = WorkPool::DEFAULT_QUEUE_DEPTH;
+    unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+    bool per_core = false;
+    std::chrono::milliseconds lock_wait{10000};
+    size_t lock_queue = 8;
+    bool pin_cpus = false;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -149,6 +190,96 @@ int main(int argc, char* argv[]) {
             }
             log_level_str = argv[++i];
         }
+        else if (arg == "--no-sendfile") {
+            sendfile = false;
+        }
+        else if (arg == "--io-engine") {
+            if (i + 1 >= argc) {
+                std::cerr << "--io-engine requires a value (blocking|uring)\n";
+                return 1;
+            }
+            std::string engine = argv[++i];
+            if (engine != "blocking" && engine != "uring") {
+                std::cerr << "--io-engine expects blocking or uring, got: " << engine << std::endl;
+                return 1;
+            }
+            io_uring = engine == "uring";
+        }
+        else if (arg == "--prefetch") {
+            if (i + 1 >= argc) {
+                std::cerr << "--prefetch requires a number of chunks\n";
+                return 1;
+            }
+            prefetch = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--no-compression") {
+            compression = false;
+        }
+        else if (arg == "--chunk-store") {
+            chunk_store = true;
+        }
+        else if (arg == "--work-threads") {
+            if (i + 1 >= argc) {
+                std::cerr << "--work-threads requires a number of threads\n";
+                return 1;
+            }
+            work_threads = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--work-queue") {
+            if (i + 1 >= argc) {
+                std::cerr << "--work-queue requires a number of jobs\n";
+                return 1;
+            }
+            work_queue = static_cast<size_t>(std::stoul(argv[++i]));
+            if (work_queue == 0) {
+                std::cerr << "--work-queue must be at least 1\n";
+                return 1;
+            }
+        }
+        else if (arg == "--threads") {
+            if (i + 1 >= argc) {
+                std::cerr << "--threads requires a number of threads\n";
+                return 1;
+            }
+            thread_count = static_cast<unsigned>(std::stoul(argv[++i]));
+            if (thread_count == 0) {
+                std::cerr << "--threads must be at least 1\n";
+                return 1;
+            }
+        }
+        else if (arg == "--io-model") {
+            if (i + 1 >= argc) {
+                std::cerr << "--io-model requires a value (shared|per-core)\n";
+                return 1;
+            }
+            std::string model = argv[++i];
+            if (model != "shared" && model != "per-core") {
+                std::cerr << "--io-model expects shared or per-core, got: " << model << std::endl;
+                return 1;
+            }
+            per_core = model == "per-core";
+        }
+        else if (arg == "--lock-wait") {
+            if (i + 1 >= argc) {
+                std::cerr << "--lock-wait requires a number of milliseconds\n";
+                return 1;
+            }
+            lock_wait = std::chrono::milliseconds(std::stoul(argv[++i]));
+        }
+        else if (arg == "--lock-queue") {
+            if (i + 1 >= argc) {
+                std::cerr << "--lock-queue requires a number of requests\n";
+                return 1;
+            }
+            lock_queue = static_cast<size_t>(std::stoul(argv[++i]));
+            if (lock_queue == 0) {
+                std::cerr << "--lock-queue must be at least 1\n";
+                return 1;
+            }
+        }
+        else if (arg == "--pin-cpus") {
+            pin_cpus = true;
+        }
         else {
             std::cerr << "Unknown argument: " << arg << std::endl;
             return 1;
@@ -158,7 +289,7 @@ int main(int argc, char* argv[]) {
     if (!root_provided) {
         std::cerr << "Usage: " << argv[0] << " [--port <port>] --root <root_path>"
                   << " [--tier <name>=<path>]... [--tier-desc <name>=<text>]..."
-                  << " [--default-tier <name>] [--log-file <path>] [--log-level <level>]\n";
+                  << " [--default-tier <name>] [--log-file <path>] [--log-level <level>] [--no-sendfile] [--io-engine blocking|uring] [--prefetch <chunks>] [--no-compression] [--chunk-store] [--work-threads <n>] [--work-queue <jobs>] [--threads <n>] [--io-model shared|per-core] [--pin-cpus] [--lock-wait <ms>] [--lock-queue <requests>]\n";
         return 1;
     }
 
@@ -232,31 +363,42 @@ int main(int argc, char* argv[]) {
                      tier.name == default_tier ? " (default)" : "");
     }
 
-    asio::io_context io_context;
-    Server server(io_context, port, StorageConfig{root, tiers, default_tier});
+    // sendfile(2) has no MSG_NOSIGNAL: a client that hangs up mid-download must cost an EPIPE, not the process
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // shared: every thread runs the one io_context, a session's handlers hop between them.
+    // per-core: one io_context and one thread each, a session stays on the thread that accepted it.
+    std::vector<std::unique_ptr<asio::io_context>> io_contexts;
+    for(unsigned i = 0; i < (per_core ? thread_count : 1u); i++) {
+        io_contexts.push_back(std::make_unique<asio::io_context>(per_core ? 1 : static_cast<int>(thread_count)));
+    }
+    std::vector<asio::io_context*> contexts;
+    for(auto& io_context : io_contexts) {
+        contexts.push_back(io_context.get());
+    }
+    Server server(contexts, port, StorageConfig{root, tiers, default_tier, sendfile, io_uring, prefetch, compression, chunk_store, work_threads, work_queue, lock_wait, lock_queue});
 
-    asio::signal_set signals(io_context, SIGINT, SIGTERM);
+    asio::signal_set signals(*io_contexts.front(), SIGINT, SIGTERM);
     signals.async_wait([&](const std::error_code& ec, int) {
         spdlog::info("Signal received, shutting down...");
         server.exit_all_sessions();
     });
 
-    spdlog::info("Starting async server (version {}) on port {}", minidrive::resolved_version(), port);
+    spdlog::info("Starting async server (version {}) on port {}, {} thread(s), {} io model{}", minidrive::resolved_version(), port,
+                 thread_count, per_core ? "per-core" : "shared", pin_cpus ? ", pinned" : "");
     server.start();
 
-    const unsigned int thread_count =  std::max(1u, std::thread::hardware_concurrency());
-
     std::vector<std::thread> pool;
     pool.reserve(thread_count);
 
     for(unsigned int i = 0; i < thread_count; i++) {
+        asio::io_context& io_context = *io_contexts[per_core ? i : 0];
         pool.emplace_back([&io_context] {
             io_context.run();
         });
+        if(pin_cpus) pin_thread(pool.back(), i);
     }
 
-    //io_context.stop();
-    
     for (auto& t : pool) {
         t.join();
     }
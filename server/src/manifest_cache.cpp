@@ -0,0 +1,59 @@
+#include "manifest_cache.hpp"
+#include <algorithm>
+#include <sys/stat.h>
+
+std::optional<FileStamp> ManifestCache::stamp(const std::filesystem::path& path) {
+    struct stat st{};
+    if(::stat(path.c_str(), &st) != 0) return std::nullopt;
+    return FileStamp{
+        static_cast<uint64_t>(st.st_dev),
+        static_cast<uint64_t>(st.st_ino),
+        static_cast<uint64_t>(st.st_size),
+        static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+        static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec
+    };
+}
+
+std::optional<FileManifest> ManifestCache::find(const std::filesystem::path& path) {
+    std::optional<FileStamp> current = stamp(path);
+
+    std::string key = path.string();
+
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(key);
+    if(it == entries_.end()) return std::nullopt;
+    if(!current || !(*current == it->second.stamp)) { // Written, replaced or removed since it was hashed
+        erase(key);
+        return std::nullopt;
+    }
+    return it->second.manifest;
+}
+
+void ManifestCache::put(const std::filesystem::path& path, const FileStamp& stamp, FileManifest manifest) {
+    if(manifest.size == 0 || manifest.chunks.size() > MAX_CHUNKS) return;
+    std::string key = path.string();
+
+    std::lock_guard lock(mutex_);
+    erase(key);
+    chunk_count_ += manifest.chunks.size();
+    entries_.emplace(key, Entry{stamp, std::move(manifest)});
+    order_.push_back(std::move(key));
+    evict();
+}
+
+void ManifestCache::erase(const std::string& key) {
+    auto it = entries_.find(key);
+    if(it == entries_.end()) return;
+    chunk_count_ -= it->second.manifest.chunks.size();
+    entries_.erase(it);
+    order_.erase(std::find(order_.begin(), order_.end(), key));
+}
+
+void ManifestCache::evict() {
+    while(chunk_count_ > MAX_CHUNKS && !order_.empty()) {
+        auto it = entries_.find(order_.front());
+        chunk_count_ -= it->second.manifest.chunks.size();
+        entries_.erase(it);
+        order_.pop_front();
+    }
+}
@@ -11,54 +11,114 @@
 using asio::ip::tcp;
 
 
-Server::Server(asio::io_context& io_context, std::uint16_t port, StorageConfig config)
-    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)) {
+namespace {
+
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+}
+
+Server::Listener::Listener(asio::io_context& io_context, const tcp::endpoint& endpoint, bool reuse_port)
+    : io_context(io_context),
+      strand(asio::make_strand(io_context)),
+      acceptor(strand) {
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if(reuse_port) {
+        acceptor.set_option(::reuse_port(true));
+    }
+    acceptor.bind(endpoint);
+    acceptor.listen();
+}
+
+Server::Server(const std::vector<asio::io_context*>& io_contexts, std::uint16_t port, StorageConfig config) {
+    tcp::endpoint endpoint(tcp::v4(), port);
+    size_t rings = 0;
+    std::error_code ring_error;
+    for(asio::io_context* io_context : io_contexts) {
+        listeners_.push_back(std::make_unique<Listener>(*io_context, endpoint, io_contexts.size() > 1));
+        if(config.io_uring) { // Its completions are watched on the io_context of the sessions using it
+            listeners_.back()->io_ring = IoRing::create(*io_context, ring_error);
+            if(listeners_.back()->io_ring) rings++;
+        }
+    }
+    if(config.io_uring) {
+        if(rings == listeners_.size()) {
+            spdlog::info("Chunk I/O runs on io_uring.");
+        } else {
+            spdlog::warn("io_uring unavailable ({}), chunk I/O stays blocking on {} of {} io_context(s).", ring_error.message(), listeners_.size() - rings, listeners_.size());
+        }
+    }
+    if(listeners_.size() > 1) {
+        spdlog::info("{} io_contexts, each with its own SO_REUSEPORT acceptor.", listeners_.size());
+    }
+    work_pool_ = std::make_shared<WorkPool>(config.work_threads, config.work_queue);
+    spdlog::info("Blocking storage work runs on {} thread(s), up to {} job(s) queued.", work_pool_->threads(), config.work_queue);
     storage_ = std::make_shared<Storage>(std::move(config));
+    stream_registry_ = std::make_shared<StreamRegistry>();
 }
 void Server::start(){
     storage_->setup();
-    accept();
+    for(auto& listener : listeners_) {
+        accept(*listener);
+    }
 }
 
 void Server::exit_all_sessions() {
-    exit = true;
-    acceptor_.close();
     std::vector<std::shared_ptr<Session>> sessions_copy;
-    
     {
         std::lock_guard lock(sessions_mutex_);
+        exit = true;
         sessions_copy.assign(sessions_.begin(), sessions_.end());
     }
 
+    for(auto& listener : listeners_) {
+        asio::post(listener->strand, [l = listener.get()]() { // Signal handlers run on any io_context thread, the accept loop may be mid-handler
+            l->acceptor.close();
+            if(l->io_ring) l->io_ring->close(); // Its completion watch would keep io_context running
+        });
+    }
+    WorkPool::Stats work = work_pool_->stats();
+    spdlog::info("Work pool: {} job(s) done, {} refused, {} still queued, average wait {} ms, longest {} ms.",
+                 work.completed, work.rejected, work.queued,
+                 work.completed == 0 ? 0 : work.total_wait.count() / 1000 / static_cast<int64_t>(work.completed),
+                 work.max_wait.count() / 1000);
+    UserLockStats locks = storage_->user_lock_stats();
+    spdlog::info("User locks: {} taken free, {} after waiting, {} waits timed out, {} refused, average wait {} ms, longest {} ms.",
+                 locks.acquired, locks.waited, locks.timed_out, locks.refused,
+                 locks.waited == 0 ? 0 : locks.total_wait.count() / 1000 / static_cast<int64_t>(locks.waited),
+                 locks.max_wait.count() / 1000);
+
     for(std::shared_ptr session: sessions_copy) {
-        session->exit();
+        session->shutdown();
     }
 }
 
-void Server::accept() {
-    acceptor_.async_accept([this](std::error_code ec, tcp::socket socket) {
+void Server::accept(Listener& listener) {
+    listener.acceptor.async_accept(listener.io_context.get_executor(), [this, &listener](std::error_code ec, tcp::socket socket) { // Handler on the strand, socket on the plain io_context
         if (!ec) {
             std::error_code endpoint_ec;
             auto endpoint = socket.remote_endpoint(endpoint_ec);
             spdlog::info("Accepted connection from {}", endpoint_ec ? "unknown" : endpoint.address().to_string() + ":" + std::to_string(endpoint.port()));
-            auto session = std::make_shared<Session>(std::move(socket), storage_, [this](std::shared_ptr<Session> s) {
+            auto session = std::make_shared<Session>(std::move(socket), storage_, stream_registry_, listener.io_ring, work_pool_, [this](std::shared_ptr<Session> s) {
                 remove_session(s); // Session will remove itsefl from sessions_ on exit
             });
-            add_session(session);
-            session->start();
+            if(add_session(session)) {
+                session->start();
+            }
 
-        } else {
+        } else if(ec != asio::error::operation_aborted) {
             spdlog::warn("Accept failed: {}", ec.message());
         }
-        if(!exit) accept();
+        if(!exit) accept(listener);
     });
 }
 
-void Server::add_session(std::shared_ptr<Session> session) {
+bool Server::add_session(std::shared_ptr<Session> session) {
     std::lock_guard lock(sessions_mutex_);
+    if(exit) return false;
     sessions_.insert(session);
+    return true;
 }
-
 void Server::remove_session(std::shared_ptr<Session> session) {
     std::lock_guard lock(sessions_mutex_);
     sessions_.erase(session);
@@ -1,4 +1,7 @@
 #include <asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <memory>
 #include <vector>
 #include <nlohmann/json.hpp>
@@ -9,13 +12,20 @@
 #include "protocol/statuses.hpp"
 #include "protocol/codes.hpp"
 #include "protocol/flags.hpp"
+#include "protocol/compression.hpp"
 #include "filesystem/utils.hpp"
+#include "filesystem/chunker.hpp"
+#include "filesystem/delta.hpp"
+#include "filesystem/scanner.hpp"
+#include <sys/sendfile.h>
+#include <unistd.h>
 
 using asio::ip::tcp;
 using nlohmann::json;
 
-Session::Session(tcp::socket socket, std::shared_ptr<Storage> storage, std::function<void(std::shared_ptr<Session>)> on_exit) 
+Session::Session(tcp::socket socket, std::shared_ptr<Storage> storage, std::shared_ptr<StreamRegistry> stream_registry, std::shared_ptr<IoRing> io_ring, std::shared_ptr<WorkPool> work_pool, std::function<void(std::shared_ptr<Session>)> on_exit) 
     : socket_(std::move(socket)),
+      strand_(asio::make_strand(socket_.get_executor())),
       storage_(storage),
       on_exit_(on_exit),
       root_(storage->get_root()),
@@ -23,6 +33,8 @@ Session::Session(tcp::socket socket, std::shared_ptr<Storage> storage, std::func
       requests_{
           {protocol::commands::LIST,     [this](auto& req){ list(req); }},
           {protocol::commands::UPLOAD,   [this](auto& req){ upload(req); }},
+          {protocol::commands::DELTA,    [this](auto& req){ upload(req); }},
+          {protocol::commands::SIGNATURES, [this](auto& req){ signatures(req); }},
           {protocol::commands::DOWNLOAD, [this](auto& req){ download(req); }},
           {protocol::commands::DELETE,   [this](auto& req){ delete_file(req); }},
           {protocol::commands::CD,       [this](auto& req){ cd(req); }},
@@ -35,20 +47,36 @@ Session::Session(tcp::socket socket, std::shared_ptr<Storage> storage, std::func
           {protocol::commands::SET_TIER, [this](auto& req){ set_tier(req); }},
           {protocol::commands::LOGIN,     [this](auto& req){ login(req); }},
           {protocol::commands::NEED_INPUT, [this](auto& req){ need_input(req); }},
-          {protocol::commands::AUTH, [this](auto& req){ auth(req); }}
-      } {
+          {protocol::commands::AUTH, [this](auto& req){ auth(req); }},
+          {protocol::commands::ATTACH, [this](auto& req){ attach(req); }}
+      },
+      stream_registry_(stream_registry),
+      io_ring_(io_ring),
+      work_pool_(work_pool),
+      lock_timer_(strand_) {
         transfer_.transfer_id = UINT32_MAX;
+        transfer_.entry_id = UINT32_MAX;
 }
 
 void Session::start() {
-    read_header_json();
+    auto self = shared_from_this();
+    asio::dispatch(strand_, [this, self]() { // Called from the accept loop, the first read belongs on strand_ like every later one
+        read_header_json();
+    });
+}
+
+void Session::shutdown() {
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self]() {
+        exit();
+    });
 }
 
 void Session::read_header_json() {
     auto self = shared_from_this();
     auto msg_len_local = std::make_shared<uint32_t>();
 
-    asio::async_read(socket_, asio::buffer(msg_len_local.get(), sizeof(uint32_t)),[this, self, msg_len_local](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, asio::buffer(msg_len_local.get(), sizeof(uint32_t)), asio::bind_executor(strand_, [this, self, msg_len_local](std::error_code ec, std::size_t) {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
@@ -59,7 +87,7 @@ void Session::read_header_json() {
         buffer_.resize(msg_len_);
         read_body_json();
         
-    });
+    }));
 }
 
 void Session::read_body_json() {
@@ -68,7 +96,7 @@ void Session::read_body_json() {
         handle_error(asio::error::invalid_argument);
         return;
     }
-    asio::async_read(socket_, asio::buffer(buffer_),[this, self](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, asio::buffer(buffer_), asio::bind_executor(strand_, [this, self](std::error_code ec, std::size_t) {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
@@ -85,132 +113,320 @@ void Session::read_body_json() {
         }
         handle_request(j);
         read_next();
-    });
+    }));
 }
 
 void Session::write_response_json(const json& j) {
-    auto self = shared_from_this();
-
-    auto write_buffer = std::make_shared<std::string>(j.dump());
+    std::string body = j.dump();
 
-    if(write_buffer->size() > std::numeric_limits<uint32_t>::max()) {
-        spdlog::error("[{}] Response body too large to send ({} bytes)", username_, write_buffer->size());
+    if(body.size() > std::numeric_limits<uint32_t>::max()) {
+        spdlog::error("[{}] Response body too large to send ({} bytes)", username_, body.size());
         return;
     }
 
-    auto response_len = std::make_shared<uint32_t>(htonl(write_buffer->size()));
-
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(response_len.get(), sizeof(uint32_t)));
-    buffers.push_back(asio::buffer(*write_buffer));
-
-    asio::async_write(socket_, buffers, [this, self, write_buffer, response_len](std::error_code ec, std::size_t) {
-        if(ec) {
-            handle_error(ec);
-            return;
-        }
-    });
+    queue_frame(protocol::make_json_frame(body));
 }
 
 void Session::write_response_json_exit(const json& j) {
-    auto self = shared_from_this();
+    std::string body = j.dump();
 
-    auto write_buffer = std::make_shared<std::string>(j.dump());
-
-    if(write_buffer->size() > std::numeric_limits<uint32_t>::max()) {
-        spdlog::error("[{}] Response body too large to send ({} bytes)", username_, write_buffer->size());
+    if(body.size() > std::numeric_limits<uint32_t>::max()) {
+        spdlog::error("[{}] Response body too large to send ({} bytes)", username_, body.size());
         return;
     }
 
-    auto response_len = std::make_shared<uint32_t>(htonl(write_buffer->size()));
-
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(response_len.get(), sizeof(uint32_t)));
-    buffers.push_back(asio::buffer(*write_buffer));
-    
-    asio::async_write(socket_, buffers, [this, self, write_buffer, response_len](std::error_code ec, std::size_t) {
-        finish_exit();
-    });
+    protocol::OutboundFrame frame = protocol::make_json_frame(body);
+    frame.exit_after = true;
+    queue_frame(std::move(frame));
 }
 
 void Session::read_header_chunk() {
     auto self = shared_from_this();
 
-    auto header = std::make_shared<protocol::ChunkHeader>();
-
-    asio::async_read(socket_, asio::buffer(header.get(), sizeof(protocol::ChunkHeader)), [this, self, header](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, asio::buffer(&ch_, sizeof(protocol::ChunkHeader)), asio::bind_executor(strand_, [this, self](std::error_code ec, std::size_t) {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
             }
             return;
         }
-        ch_.transfer_id = ntohl(header->transfer_id);
-        ch_.index = ntohl(header->index);
-        ch_.size = ntohl(header->size);
-        ch_.flags = header->flags;
+        ch_.transfer_id = ntohl(ch_.transfer_id);
+        ch_.index = ntohl(ch_.index);
+        ch_.size = ntohl(ch_.size);
         read_body_chunk();
-    });
+    }));
 }
 
 void Session::read_body_chunk() {
     auto self = shared_from_this();
 
-    auto data = std::make_shared<std::vector<uint8_t>>(ch_.size);
+    protocol::ChunkBuffer data = buffers_->acquire(ch_.size);
+    asio::mutable_buffer target = asio::buffer(data.bytes());
 
-    asio::async_read(socket_, asio::buffer(*data), [this, self, data](std::error_code ec, std::size_t) {
+    asio::async_read(socket_, target, asio::bind_executor(strand_, [this, self, data = std::move(data)](std::error_code ec, std::size_t) mutable {
         if(exiting_ || ec) {
             if(ec && ec != asio::error::operation_aborted) {
                 handle_error(ec);
             }
             return;
         }
-        handle_chunk(ch_, *data);
+        inflate(ch_, data);
+        handle_chunk(ch_, data);
         read_next();
-    });
+    }));
 }
 
 void Session::send_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+    queue_frame(protocol::make_chunk_frame(ch, data));
+}
+
+void Session::send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+    protocol::OutboundFrame frame = protocol::make_chunk_frame(ch, data);
+    frame.exit_after = true;
+    queue_frame(std::move(frame));
+}
+
+void Session::queue_frame(protocol::OutboundFrame frame) {
+    write_queue_.push_back(std::move(frame));
+    if(write_queue_.size() == 1) { // Socket idle, otherwise the running write picks it up
+        write_next();
+    }
+}
+
+void Session::write_next() {
     auto self = shared_from_this();
 
-    auto header = std::make_shared<protocol::ChunkHeader>();
-    header->transfer_id = htonl(ch.transfer_id);
-    header->index = htonl(ch.index);
-    header->size = htonl(ch.size);
-    header->flags = ch.flags;
+    const protocol::OutboundFrame& frame = write_queue_.front(); // deque keeps it in place while more frames are queued
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(frame.header.data(), frame.header_size),
+        asio::buffer(frame.body.bytes())
+    };
 
-    auto data_to_write = std::make_shared<std::vector<uint8_t>>(data);
+    asio::async_write(socket_, buffers, asio::bind_executor(strand_, [this, self](std::error_code ec, std::size_t) {
+        if(!ec && write_queue_.front().file) {
+            write_file_body();
+            return;
+        }
+        frame_written(ec);
+    }));
+}
 
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(header.get(), sizeof(protocol::ChunkHeader)));
-    buffers.push_back(asio::buffer(*data_to_write));
+void Session::write_file_body() {
+    protocol::OutboundFrame& frame = write_queue_.front();
 
-    asio::async_write(socket_, buffers, [this, self, header, data_to_write](std::error_code ec, std::size_t) {
+    std::error_code ec;
+    if(!socket_.native_non_blocking()) { // sendfile() has to return EAGAIN instead of blocking the thread
+        socket_.native_non_blocking(true, ec);
         if(ec) {
+            frame_written(ec);
+            return;
+        }
+    }
+
+    while(frame.file_size > 0) {
+        off_t offset = static_cast<off_t>(frame.file_offset);
+        ssize_t n = ::sendfile(socket_.native_handle(), frame.file->native_handle(), &offset, frame.file_size);
+        if(n > 0) {
+            frame.file_offset += static_cast<uint64_t>(n);
+            frame.file_size -= static_cast<uint32_t>(n);
+            continue;
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // Socket buffer full, resume once it drains
+            auto self = shared_from_this();
+            socket_.async_wait(tcp::socket::wait_write, asio::bind_executor(strand_, [this, self](std::error_code ec) {
+                if(ec) {
+                    frame_written(ec);
+                    return;
+                }
+                write_file_body();
+            }));
+            return;
+        }
+        // Header is already out, the connection cannot carry on after a short body
+        std::error_code failure = n == 0 ? std::make_error_code(std::errc::io_error) : std::error_code(errno, std::generic_category());
+        spdlog::error("[{}] sendfile of chunk body failed: {}", username_, failure.message());
+        frame_written(failure);
+        return;
+    }
+    frame_written({});
+}
+
+void Session::frame_written(std::error_code ec) {
+    bool exit_after = write_queue_.front().exit_after;
+    write_queue_.pop_front();
+
+    if(exit_after) {
+        write_queue_.clear();
+        finish_exit();
+        return;
+    }
+    if(ec) {
+        bool exit_queued = std::any_of(write_queue_.begin(), write_queue_.end(), [](const auto& f) { return f.exit_after; });
+        write_queue_.clear();
+        if(exit_queued) { // exit() already ran and is waiting for its frame
+            finish_exit();
+        } else {
             handle_error(ec);
+        }
+        return;
+    }
+    if(!write_queue_.empty()) {
+        write_next();
+    }
+}
+
+void Session::adopt_stream(tcp::socket socket, const std::string& token) {
+    auto self = shared_from_this();
+    if(socket.get_executor() != socket_.get_executor()) { // Accepted on another io_context (--io-model per-core), moved onto this session's
+        std::error_code ec;
+        auto protocol = socket.local_endpoint(ec).protocol();
+        int fd = ec ? -1 : socket.release(ec);
+        tcp::socket moved(socket_.get_executor());
+        if(!ec) moved.assign(protocol, fd, ec);
+        if(ec) {
+            spdlog::warn("[{}] Could not move data connection to this session's io_context: {}", username_, ec.message());
+            if(fd >= 0) ::close(fd);
+            return;
+        }
+        socket = std::move(moved);
+    }
+    auto stream = std::make_shared<DataStream>(std::move(socket));
+
+    asio::post(strand_, [this, self, stream, token]() {
+        if(exiting_ || token != stream_token_ || state_ != SessionState::UPLOADING || streams_.size() >= streams_granted_) {
+            spdlog::warn("[{}] Rejected extra data connection.", username_);
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::SERVICE_UNAVAILABLE,
+                "Transfer does not accept more connections.",
+                ""
+            };
+            json j;
+            protocol::to_json(j, res);
+            protocol::OutboundFrame frame = protocol::make_json_frame(j.dump());
+            frame.exit_after = true;
+            stream_send(stream, std::move(frame));
             return;
         }
+        streams_.push_back(stream);
+        spdlog::info("[{}] Data stream {}/{} attached.", username_, streams_.size(), streams_granted_);
+
+        protocol::Response res {
+            protocol::statuses::OK,
+            protocol::codes::OK,
+            "Stream attached.",
+            ""
+        };
+        json j;
+        protocol::to_json(j, res);
+        stream_send(stream, protocol::make_json_frame(j.dump()));
+        stream_read_header(stream);
     });
 }
 
-void Session::send_chunk_exit(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+void Session::stream_read_header(std::shared_ptr<DataStream> stream) {
     auto self = shared_from_this();
 
-    auto header = std::make_shared<protocol::ChunkHeader>();
-    header->transfer_id = htonl(ch.transfer_id);
-    header->index = htonl(ch.index);
-    header->size = htonl(ch.size);
-    header->flags = ch.flags;
+    asio::async_read(stream->socket, asio::buffer(&stream->ch, sizeof(protocol::ChunkHeader)), asio::bind_executor(strand_, [this, self, stream](std::error_code ec, std::size_t) {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_error(stream, ec);
+            }
+            return;
+        }
+        stream->ch.transfer_id = ntohl(stream->ch.transfer_id);
+        stream->ch.index = ntohl(stream->ch.index);
+        stream->ch.size = ntohl(stream->ch.size);
+        stream_read_body(stream);
+    }));
+}
 
-    auto data_to_write = std::make_shared<std::vector<uint8_t>>(data);
+void Session::stream_read_body(std::shared_ptr<DataStream> stream) {
+    auto self = shared_from_this();
 
-    std::vector<asio::const_buffer> buffers;
-    buffers.push_back(asio::buffer(header.get(), sizeof(protocol::ChunkHeader)));
-    buffers.push_back(asio::buffer(*data_to_write));
+    protocol::ChunkBuffer data = buffers_->acquire(stream->ch.size);
+    asio::mutable_buffer target = asio::buffer(data.bytes());
 
-    asio::async_write(socket_, buffers, [this, self, header, data_to_write](std::error_code ec, std::size_t) {
-        finish_exit();
-    });
+    asio::async_read(stream->socket, target, asio::bind_executor(strand_, [this, self, stream, data = std::move(data)](std::error_code ec, std::size_t) mutable {
+        if(exiting_ || ec) {
+            if(ec && ec != asio::error::operation_aborted) {
+                stream_error(stream, ec);
+            }
+            return;
+        }
+        inflate(stream->ch, data);
+        handle_stream_chunk(stream, stream->ch, data);
+        if(std::find(streams_.begin(), streams_.end(), stream) != streams_.end()) { // Not closed with its transfer
+            stream_read_header(stream);
+        }
+    }));
+}
+
+void Session::stream_send(const std::shared_ptr<DataStream>& stream, protocol::OutboundFrame frame) {
+    stream->write_queue.push_back(std::move(frame));
+    if(stream->write_queue.size() == 1) {
+        stream_write_next(stream);
+    }
+}
+
+void Session::stream_write_next(std::shared_ptr<DataStream> stream) {
+    auto self = shared_from_this();
+
+    const protocol::OutboundFrame& frame = stream->write_queue.front();
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(frame.header.data(), frame.header_size),
+        asio::buffer(frame.body.bytes())
+    };
+
+    asio::async_write(stream->socket, buffers, asio::bind_executor(strand_, [this, self, stream](std::error_code ec, std::size_t) {
+        bool exit_after = stream->write_queue.front().exit_after;
+        stream->write_queue.pop_front();
+
+        if(exit_after) { // Rejected connection, it never joined streams_
+            stream->write_queue.clear();
+            std::error_code close_ec;
+            stream->socket.shutdown(tcp::socket::shutdown_both, close_ec);
+            stream->socket.close(close_ec);
+            return;
+        }
+        if(ec) {
+            stream->write_queue.clear();
+            if(ec != asio::error::operation_aborted) {
+                stream_error(stream, ec);
+            }
+            return;
+        }
+        if(!stream->write_queue.empty()) {
+            stream_write_next(stream);
+        }
+    }));
+}
+
+void Session::stream_error(const std::shared_ptr<DataStream>& stream, const std::error_code& ec) {
+    auto it = std::find(streams_.begin(), streams_.end(), stream);
+    if(it == streams_.end()) return; // Already closed with its transfer
+
+    spdlog::warn("[{}] Data stream of transfer {} lost: {}", username_, transfer_.transfer_id, ec.message());
+    std::error_code close_ec;
+    stream->socket.shutdown(tcp::socket::shutdown_both, close_ec);
+    stream->socket.close(close_ec);
+    streams_.erase(it);
+}
+
+void Session::close_streams() {
+    if(!stream_token_.empty()) {
+        stream_registry_->revoke(stream_token_);
+        stream_token_.clear();
+    }
+    streams_granted_ = 0;
+
+    for(auto& stream : streams_) {
+        std::error_code ec;
+        stream->socket.shutdown(tcp::socket::shutdown_both, ec);
+        stream->socket.close(ec);
+    }
+    streams_.clear();
 }
 
 void Session::send_res(protocol::Response& res) {
@@ -222,14 +438,120 @@ void Session::send_res(protocol::Response& res) {
 }
 
 void Session::read_next() {
-    if(exiting_) return;
-    if(state_ == SessionState::UPLOADING || state_ == SessionState::DOWNLOADING) {
+    if(exiting_ || state_ == SessionState::WORKING || state_ == SessionState::WAITING) return; // offload() and lock_granted() read on once they are done
+    if(draining_ || state_ == SessionState::UPLOADING || state_ == SessionState::DOWNLOADING) {
         read_header_chunk();
     } else {
         read_header_json();
     }
 }
 
+void Session::offload(std::string name, std::function<void()> work, std::function<void()> done, std::function<void()> busy) {
+    auto self = shared_from_this();
+    state_ = SessionState::WORKING;
+
+    // The guard keeps io_context running until done is posted, also when the server shuts down meanwhile
+    bool queued = work_pool_->submit("[" + username_ + "] " + name, [this, self, work, done, guard = asio::make_work_guard(strand_)]() mutable {
+        work();
+        asio::post(strand_, [this, self, done]() {
+            state_ = SessionState::READY;
+            done(); // Answers and releases the user lock, also when exiting
+            if(exiting_) {
+                exiting_ = false; // exit() returned early, run it for real now
+                exit();
+                return;
+            }
+            read_next();
+        });
+        guard.reset();
+    });
+    if(queued) return;
+
+    state_ = SessionState::READY;
+    if(busy) {
+        busy();
+        return;
+    }
+    storage_->release_user_lock(username_, this);
+    protocol::Response res {
+        protocol::statuses::ERROR,
+        protocol::codes::SERVICE_UNAVAILABLE,
+        "Server is busy",
+        ""
+    };
+    send_res(res);
+}
+
+bool Session::acquire_user_lock(const protocol::Request& req, std::vector<PathLock> paths) {
+    if(lock_handed_) { // Run again by lock_granted(), the lock is ours already
+        lock_handed_ = false;
+        return true;
+    }
+    if(storage_->try_acquire_user_lock(username_, this, paths)) return true;
+
+    auto self = shared_from_this();
+    state_ = SessionState::WAITING; // Parked before queueing, the handover may come before this returns
+    parked_ = req;
+    parked_since_ = std::chrono::steady_clock::now();
+    bool waiting = storage_->user_lock_wait().count() > 0 && storage_->wait_for_user_lock(username_, this, std::move(paths), [this, self]() {
+        asio::post(strand_, [this, self]() { lock_granted(); });
+    });
+    if(!waiting) {
+        state_ = SessionState::READY;
+        parked_ = protocol::Request{};
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::SERVICE_UNAVAILABLE,
+            "Server is busy",
+            ""
+        };
+        send_res(res);
+        return false;
+    }
+
+    uint64_t wait = ++lock_waits_;
+    lock_timer_.expires_after(storage_->user_lock_wait());
+    lock_timer_.async_wait([this, self, wait](std::error_code ec) {
+        if(ec || wait != lock_waits_ || state_ != SessionState::WAITING) return;
+        if(!storage_->cancel_user_lock_wait(username_, this, true)) return; // Handed over meanwhile, lock_granted() is on its way
+        state_ = SessionState::READY;
+        spdlog::warn("[{}] {} gave up after waiting {} ms for another operation of this user.", username_, parked_.cmd, storage_->user_lock_wait().count());
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::SERVICE_UNAVAILABLE,
+            "Server is busy",
+            ""
+        };
+        send_res(res);
+        read_next();
+    });
+    return false;
+}
+
+void Session::lock_granted() {
+    lock_waits_++;
+    lock_timer_.cancel();
+    state_ = SessionState::READY;
+    if(exiting_) {
+        exiting_ = false; // exit() returned early, run it for real now, finish_exit() releases the lock
+        exit();
+        return;
+    }
+
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - parked_since_);
+    spdlog::info("[{}] {} waited {} ms for another operation of this user.", username_, parked_.cmd, waited.count());
+    protocol::Request req = std::move(parked_);
+    parked_ = protocol::Request{};
+    lock_handed_ = true;
+    auto it = requests_.find(req.cmd);
+    if(it != requests_.end()) it->second(req);
+    if(lock_handed_) { // The handler answered before taking it, e.g. the file is gone by now
+        lock_handed_ = false;
+        storage_->release_user_lock(username_, this);
+    }
+    read_next();
+}
+
 void Session::handle_error(const std::error_code& ec) {
     spdlog::warn("[{}] Network error: {} ({})", username_, ec.message(), ec.value());
     exit();
@@ -257,15 +579,24 @@ void Session::handle_request(const json& j) {
     }
 }
 
-void Session::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<uint8_t>& data) {
+void Session::handle_chunk(const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if(draining_) { // Leftovers of an aborted windowed transfer, wait for the client's marker
+        if(ch.flags == protocol::flags::ABORTED || ch.flags == protocol::flags::ERROR || ch.flags == protocol::flags::CHUNK_MISMATCH) {
+            draining_ = false;
+        } else if(ch.flags == protocol::flags::EXIT) {
+            draining_ = false;
+            exit();
+        }
+        return;
+    }
     if(state_ == SessionState::UPLOADING) {
         if(ch.flags == protocol::flags::SEND) {
-            if(valid_chunk(ch.index, ch.size, data)) {
+            if(valid_chunk(ch.index, ch.size, data.bytes())) {
                 if(transfer_.transfer_id == UINT32_MAX) { // transfer_id not initilized -> upload not initialized
                     transfer_.transfer_id = ch.transfer_id;
-                    upload_init();
+                    if(!upload_init()) return;
                 }
-                uploading(ch.index, ch.size, data, protocol::flags::OK);
+                uploading(ch.index, ch.size, data, protocol::flags::OK, nullptr);
                 return;
             }
             spdlog::warn("[{}] Invalid chunk received (index {}).", username_, ch.index);
@@ -274,17 +605,17 @@ void Session::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<ui
         } else if(ch.flags == protocol::flags::LAST) {
             if(transfer_.transfer_id == UINT32_MAX) { // transfer_id not initilized -> upload not initialized
                 transfer_.transfer_id = ch.transfer_id;
-                upload_init();
+                if(!upload_init()) return;
             }
-            if(valid_chunk(ch.index, ch.size, data)) {
-                uploading(ch.index, ch.size, data, protocol::flags::DONE);
+            if(valid_chunk(ch.index, ch.size, data.bytes())) {
+                uploading(ch.index, ch.size, data, protocol::flags::DONE, nullptr);
                 return;
             }
             spdlog::warn("[{}] Invalid last chunk received (index {}).", username_, ch.index);
             upload_abort(false, true, protocol::flags::CHUNK_MISMATCH);
             return;
         } else if(ch.flags == protocol::flags::ERROR) {
-            upload_abort(false, false, protocol::flags::ERROR);
+            upload_abort(false, transfer_.window > 1, protocol::flags::ABORTED); // Windowed client drains until our marker
             return;
         } else if(ch.flags == protocol::flags::EXIT) {
             upload_abort(true, false, protocol::flags::EXIT);
@@ -293,27 +624,44 @@ void Session::handle_chunk(const protocol::ChunkHeader& ch, const std::vector<ui
         }
     } else if (state_ == SessionState::DOWNLOADING) {
         if(ch.flags == protocol::flags::OK) {
-            if(ch.transfer_id != transfer_.transfer_id) {
+            if(ch.transfer_id != transfer_.transfer_id || ch.index >= transfer_.chunk_state.size()) {
                 download_abort(false, true, protocol::flags::ERROR);
                 return;
             }
-            transfer_.chunk_state[ch.index] = true;
-            partmeta_->mark_chunk_received(transfer_.transfer_id, ch.index);
+            acknowledge_chunks(ch.index, protocol::decode_ack(data.bytes()));
             downloading();
         } else if (ch.flags == protocol::flags::DONE) {
-            transfer_.chunk_state[ch.index] = true;
             download_done();
             return;
-        } else if(ch.flags == protocol::flags::ERROR) {
-            download_abort(false, false, protocol::flags::ERROR);
+        } else if(ch.flags == protocol::flags::ERROR || ch.flags == protocol::flags::CHUNK_MISMATCH) {
+            download_abort(false, transfer_.window > 1, protocol::flags::ABORTED); // Windowed client drains until our marker
             return;
         } else if(ch.flags == protocol::flags::EXIT) {
-            upload_abort(true, false, protocol::flags::EXIT);
+            download_abort(true, false, protocol::flags::EXIT);
             exit();
         }
     }
 }
 
+void Session::handle_stream_chunk(const std::shared_ptr<DataStream>& stream, const protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if(state_ != SessionState::UPLOADING || draining_) return; // Transfer is over, close_streams() takes the connection down
+
+    if(ch.flags != protocol::flags::SEND) { // LAST, ERROR and EXIT only travel on socket_
+        stream_error(stream, asio::error::invalid_argument);
+        return;
+    }
+    if(!valid_chunk(ch.index, ch.size, data.bytes())) {
+        spdlog::warn("[{}] Invalid chunk received on data stream (index {}).", username_, ch.index);
+        upload_abort(false, true, protocol::flags::CHUNK_MISMATCH);
+        return;
+    }
+    if(transfer_.transfer_id == UINT32_MAX) { // First chunk of the upload came in on an extra connection
+        transfer_.transfer_id = ch.transfer_id;
+        if(!upload_init()) return;
+    }
+    uploading(ch.index, ch.size, data, protocol::flags::OK, stream);
+}
+
 void Session::handle_resumes() {
     if (!resuming_) {
         std::vector<PartialMetadataEntry> entries = partmeta_->get_entries();
@@ -587,7 +935,9 @@ void Session::need_input(protocol::Request& req) {
                 PartialMetadataEntry entry = files_to_be_resumed.front();
                 files_to_be_resumed.pop();
 
-                if(!storage_->try_acquire_user_lock(username_)) {
+                std::vector<PathLock> locks{PathLock{entry.absolute_path, entry.type == TransferType::UPLOAD}}; // Same as upload() and download()
+                if(entry.type == TransferType::UPLOAD) locks.push_back(PathLock{partmeta_->get_partial_path(entry.id), true}); // Also taken while another session still writes it
+                if(!storage_->try_acquire_user_lock(username_, this, std::move(locks))) { // The resume loop does not wait, it offers the next one
                     protocol::Response res {
                         protocol::statuses::ERROR,
                         protocol::codes::SERVICE_UNAVAILABLE,
@@ -599,34 +949,45 @@ void Session::need_input(protocol::Request& req) {
                     return;
                 }
 
-                transfer_.transfer_id = entry.id;
+                transfer_.transfer_id = entry.peer_id;
+                transfer_.entry_id = entry.id;
                 transfer_.fmeta.absolute_path = entry.absolute_path;
                 transfer_.fmeta.size = entry.size;
                 transfer_.fmeta.hash = entry.file_hash;
+                transfer_.fmeta.tree_hash = entry.tree_hash;
                 transfer_.chunks = entry.chunks;
+                transfer_.chunk_size = entry.chunk_size;
                 transfer_.chunk_state = entry.chunk_state;
                 transfer_.partial_path = partmeta_->get_partial_path(entry.id);
+                open_window(protocol::negotiate_window(req.window)); // Unacknowledged chunks of the last run are simply sent again
 
                 protocol::Response res {
                     protocol::statuses::RESUME,
                     protocol::codes::OK,
                     to_string(entry.type) + " " + fsutils::relative(user_dir_, entry.absolute_path).string(),
-                    std::to_string(entry.id) // reuse file_hash field to carry the transfer id being resumed
+                    std::to_string(entry.peer_id) // reuse file_hash field to carry the transfer id being resumed, the one the client knows
                 };
+                res.window = transfer_.window;
+                res.chunk_size = transfer_.chunk_size;
+                negotiate_compression(req, res, entry.type);
                 send_res(res);
 
                 if(entry.type == TransferType::UPLOAD) {
                     state_ = SessionState::UPLOADING; // client drives sending; handle_chunk() already skips upload_init() since transfer_id != UINT32_MAX
                 } else {
                     state_ = SessionState::DOWNLOADING;
-                    downloading(); // server drives sending, resumes at first chunk_state==false
+                    downloading(); // server drives sending, resumes at first chunk_state==false and fills the window
                 }
                 return;
             } else if(req.first_argument == "n") {
                 PartialMetadataEntry entry = files_to_be_resumed.front();
                 files_to_be_resumed.pop();
-                fsutils::remove_file(partmeta_->get_partial_path(entry.id));
-                partmeta_->delete_partial_metadata(entry.id);
+                std::filesystem::path partial = partmeta_->get_partial_path(entry.id);
+                if(storage_->try_acquire_user_lock(username_, this, {PathLock{partial, true}})) { // Left alone while another session writes it
+                    fsutils::remove_file(partial);
+                    partmeta_->delete_partial_metadata(entry.id);
+                    storage_->release_user_lock(username_, this);
+                }
             } else {
                 protocol::Response res {
                     protocol::statuses::ERROR,
@@ -646,7 +1007,7 @@ void Session::need_input(protocol::Request& req) {
             } else if(req.first_argument == "n") {
                 pending_tier_.clear();
                 state_ = SessionState::READY;
-                storage_->release_user_lock(username_);
+                storage_->release_user_lock(username_, this);
                 protocol::Response res {
                     protocol::statuses::OK,
                     protocol::codes::OK,
@@ -679,9 +1040,46 @@ void Session::need_input(protocol::Request& req) {
     // Implementation of need_input
 }
 
+void Session::attach(protocol::Request& req) {
+    if(state_ != SessionState::LOGIN) {
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::SERVICE_UNAVAILABLE,
+            "Already logged in",
+            ""
+        };
+        send_res(res);
+        return;
+    }
+
+    std::shared_ptr<Session> owner = stream_registry_->find(req.first_argument);
+    if(!owner) {
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::UNAUTHORIZED,
+            "Unknown stream token.",
+            ""
+        };
+        send_res(res);
+        return;
+    }
+
+    // The owner answers on the connection from now on, this session only has to disappear
+    exiting_ = true;
+    owner->adopt_stream(std::move(socket_), req.first_argument);
+    finish_exit();
+}
+
 void Session::exit() {
     bool expected = false;
     if(!exiting_.compare_exchange_strong(expected, true)) return;
+    if(state_ == SessionState::WORKING) return; // The job still uses the user's files and lock, offload() exits once it is back
+    if(state_ == SessionState::WAITING) {
+        if(!storage_->cancel_user_lock_wait(username_, this, false)) return; // Handed over meanwhile, lock_granted() exits
+        lock_waits_++;
+        lock_timer_.cancel();
+        state_ = SessionState::READY;
+    }
 
     bool socket_opened = socket_.is_open();
 
@@ -710,7 +1108,8 @@ void Session::exit() {
 void Session::finish_exit() {
     auto self = shared_from_this();
 
-    storage_->release_user_lock(username_);
+    storage_->release_user_lock(username_, this);
+    close_streams();
 
     std::error_code ec;
     socket_.shutdown(tcp::socket::shutdown_both, ec);
@@ -731,47 +1130,15 @@ void Session::list(protocol::Request& req) {
         send_res(res);
         return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_dir = req.first_argument.empty() ? current_dir_ : fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_dir, false}})) {
         return;
     }
 
+    std::string file_list;
     if(req.first_argument.empty()) {
-        std::vector<fsutils::FileMetadata> files = fsutils::scan_directory(current_dir_, false);
-        if(fsutils::is_scan_dir_error(files)) {
-            protocol::Response res {
-                protocol::statuses::ERROR,
-                protocol::codes::INTERNAL_SERVER_ERROR,
-                "Failed to list directory",
-                ""
-            };
-            send_res(res);
-            storage_->release_user_lock(username_);
-            return;
-        }
-        auto curr_rel = fsutils::relative(user_dir_, current_dir_);
-        std::string file_list("Current directory: " + curr_rel.string() + "\n");
-        for (const auto& file : files) {
-            std::filesystem::path relative = fsutils::relative(current_dir_, file.absolute_path);
-            file_list += relative.string() + "\n";
-        }
-        protocol::Response res {
-            protocol::statuses::OK,
-            protocol::codes::OK,
-            file_list,
-            ""
-        };
-        send_res(res);
-        storage_->release_user_lock(username_);
-        return;
-    }else {
-        std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+        file_list = "Current directory: " + fsutils::relative(user_dir_, current_dir_).string() + "\n";
+    } else {
         if(!fsutils::is_directory(requested_dir)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -780,7 +1147,7 @@ void Session::list(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
         if(!fsutils::is_subpath(user_dir_, requested_dir)) {
@@ -791,11 +1158,17 @@ void Session::list(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
-        std::vector<fsutils::FileMetadata> files = fsutils::scan_directory(requested_dir, false);
-        if(fsutils::is_scan_dir_error(files)) {
+    }
+
+    // scan_directory() hashes every file it lists
+    auto files = std::make_shared<std::vector<fsutils::FileMetadata>>();
+    offload("LIST", [requested_dir, files]() {
+        *files = fsutils::scan_directory(requested_dir, false);
+    }, [this, requested_dir, files, file_list]() mutable {
+        if(fsutils::is_scan_dir_error(*files)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
                 protocol::codes::INTERNAL_SERVER_ERROR,
@@ -803,11 +1176,10 @@ void Session::list(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
-        std::string file_list;
-        for (const auto& file : files) {
+        for (const auto& file : *files) {
             std::filesystem::path relative = fsutils::relative(requested_dir, file.absolute_path);
             file_list += relative.string() + "\n";
         }
@@ -818,9 +1190,8 @@ void Session::list(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
-        return;
-    }
+        storage_->release_user_lock(username_, this);
+    });
 }
 
 void Session::delete_file(protocol::Request& req) {
@@ -834,17 +1205,10 @@ void Session::delete_file(protocol::Request& req) {
         send_res(res);
         return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_file, true}})) {
         return;
     }
-    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     if(!fsutils::is_file(requested_file)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -853,7 +1217,7 @@ void Session::delete_file(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
         if(!fsutils::is_subpath(user_dir_, requested_file)) {
@@ -864,7 +1228,7 @@ void Session::delete_file(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
         if(!fsutils::remove_file(requested_file)) {
@@ -875,7 +1239,7 @@ void Session::delete_file(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
         protocol::Response res {
@@ -885,7 +1249,7 @@ void Session::delete_file(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
 }
 
 void Session::upload(protocol::Request& req) {
@@ -899,18 +1263,13 @@ void Session::upload(protocol::Request& req) {
         send_res(res);
         return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    std::filesystem::path partial = next_partial_path(); // Named by the server, clients may pick the same transfer id
+    if(!acquire_user_lock(req, {PathLock{requested_file, true}, PathLock{partial, true}})) {
         return;
     }
-    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
-    if(fsutils::is_file(requested_file)) {
+    bool delta = req.cmd == protocol::commands::DELTA; // Replaces the stored file, which the copies read from
+    if(!delta && fsutils::is_file(requested_file)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
                 protocol::codes::PRECONDITION_FAILED,
@@ -918,7 +1277,18 @@ void Session::upload(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
+            return;
+    }
+    if(delta && !fsutils::is_file(requested_file)) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::PRECONDITION_FAILED,
+                "File does not exist.",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(fsutils::is_directory(requested_file)) {
@@ -929,7 +1299,7 @@ void Session::upload(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(!fsutils::is_subpath(user_dir_, requested_file)) {
@@ -940,40 +1310,130 @@ void Session::upload(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
-    if(req.size > UINT32_MAX) {
+    if(req.size > protocol::MAX_FILE_SIZE) {
         protocol::Response res {
             protocol::statuses::ERROR,
             protocol::codes::PRECONDITION_FAILED,
-            "File too large. Max 4GB.",
+            "File too large. Max 256TB.",
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
+        return;
+    }
+    uint32_t chunk_size = req.chunk_size == 0 ? fsutils::CHUNK_SIZE : req.chunk_size; // Old clients cut with the default
+    std::array<uint8_t, crypto_generichash_BYTES> tree_hash = fsutils::HASH_ERROR; // Old clients: the finished file is rehashed instead
+    if(!req.tree_hash.empty() && !delta) { // A delta's chunks cover only the new bytes, its file is always rehashed
+        tree_hash = fsutils::tree_hash(req.chunks);
+    }
+    bool content_defined = req.chunking == protocol::CHUNKING_CDC;
+    bool valid_plan = false;
+    if(delta) {
+        valid_plan = req.chunking.empty() && fsutils::valid_delta_plan(req.chunks, req.copies, req.size, fsutils::get_file_size(requested_file), chunk_size);
+    } else {
+        valid_plan = content_defined ? fsutils::valid_cdc_plan(req.chunks, req.size, chunk_size) : req.chunking.empty() && fsutils::valid_chunk_plan(req.chunks, req.size, chunk_size);
+    }
+    if(!protocol::valid_chunk_size(chunk_size) || !valid_plan ||
+       (!delta && !req.tree_hash.empty() && fsutils::hex_to_hash(req.tree_hash) != tree_hash)) {
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::BAD_REQUEST,
+            "Invalid chunk plan.",
+            ""
+        };
+        send_res(res);
+        storage_->release_user_lock(username_, this);
+        return;
+    }
+    if(!delta && instant_upload(req, requested_file, partial)) { // Stays READY, no chunks follow
+        next_partial_.clear();
+        storage_->release_user_lock(username_, this);
+        return;
+    }
+    uint64_t available = fsutils::available_space(user_dir_); // .part and the final file share the user's tier
+    if(available != fsutils::SIZE_ERROR && available < req.size) {
+        spdlog::warn("[{}] Rejected upload of {} bytes, {} bytes free on the tier.", username_, req.size, available);
+        protocol::Response res {
+            protocol::statuses::ERROR,
+            protocol::codes::INSUFFICIENT_STORAGE,
+            "Not enough free space on the server.",
+            ""
+        };
+        send_res(res);
+        storage_->release_user_lock(username_, this);
         return;
     }
     fsutils::FileMetadata fmeta{
         requested_file,
         req.size,
         0,
-        fsutils::hex_to_hash(req.file_hash)
+        fsutils::hex_to_hash(req.file_hash),
+        tree_hash
     };
 
     transfer_.fmeta = fmeta;
     transfer_.chunks = req.chunks;
-    transfer_.chunk_state = transfer_.chunk_state = std::vector<bool>(req.chunks.size(), false);
+    if(!delta) {
+        fsutils::assign_offsets(transfer_.chunks); // Derived from the sizes, whatever the client sent
+    }
+    transfer_.copies = req.copies;
+    transfer_.chunk_size = chunk_size;
+    transfer_.chunk_state = std::vector<bool>(req.chunks.size(), false);
+    transfer_.partial_path = partial;
+    next_partial_.clear();
+    open_window(protocol::negotiate_window(req.window));
+
+    std::shared_ptr<ChunkStore> store = delta ? nullptr : storage_->get_chunk_store(username_); // A delta already leaves out what the stored file has
+    if(!store || transfer_.chunks.size() < 2) { // The last chunk always travels, its LAST finishes the upload
+        start_upload(req, {});
+        return;
+    }
+
+    // Reads and hashes every chunk the store has, on the pool. Like instant_upload(), only the user's
+    // own files and public ones may supply chunks: the client names them by hash alone
+    std::vector<std::filesystem::path> within{user_dir_};
+    if(username_ != "public") {
+        within.push_back(root_ / "public" / "files");
+    }
+    auto have = std::make_shared<std::vector<uint32_t>>();
+    offload("UPLOAD staging", [username = username_, store, within, chunks = transfer_.chunks, size = transfer_.fmeta.size, partial, have]() {
+        *have = stage_stored_chunks(username, *store, within, chunks, size, partial);
+    }, [this, req, have]() {
+        if(exiting_) { // No upload follows, nothing would remove the staged chunks
+            fsutils::remove_file(transfer_.partial_path);
+            return;
+        }
+        for(uint32_t i : *have) {
+            transfer_.chunk_state[i] = true;
+        }
+        start_upload(req, std::move(*have));
+    }, [this, req]() { // The client sends every chunk instead
+        start_upload(req, {});
+    });
+}
 
+void Session::start_upload(const protocol::Request& req, std::vector<uint32_t> have) {
     protocol::Response res {
         protocol::statuses::OK,
         protocol::codes::OK,
-        "Starting upload to file: " + fsutils::relative(user_dir_, requested_file).string(),
+        "Starting upload to file: " + fsutils::relative(user_dir_, transfer_.fmeta.absolute_path).string(),
         ""
     };
+    res.window = transfer_.window;
+    res.chunk_size = transfer_.chunk_size;
+    res.have = std::move(have);
+    negotiate_compression(req, res, TransferType::UPLOAD);
+    if(req.streams > 0) { // Chunks may also arrive on extra connections that ATTACH with this token
+        streams_granted_ = std::min(req.streams, protocol::MAX_STREAMS);
+        stream_token_ = stream_registry_->issue(weak_from_this());
+        res.streams = streams_granted_;
+        res.stream_token = stream_token_;
+    }
     send_res(res);
     state_ = SessionState::UPLOADING;
-    return;
 }
 
 void Session::download(protocol::Request& req) {
@@ -987,17 +1447,10 @@ void Session::download(protocol::Request& req) {
         send_res(res);
         return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_file, false}})) {
         return;
     }
-    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     if(!fsutils::is_file(requested_file)) {
         protocol::Response res {
             protocol::statuses::ERROR,
@@ -1006,7 +1459,7 @@ void Session::download(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
     if(fsutils::is_directory(requested_file)) {
@@ -1017,7 +1470,7 @@ void Session::download(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
     if(!fsutils::is_subpath(user_dir_, requested_file)) {
@@ -1028,78 +1481,176 @@ void Session::download(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
-    fsutils::FileMetadata fmeta = fsutils::scan_file(requested_file);
+    fsutils::FileMetadata fmeta{requested_file, 0, 0, {}};
+    std::vector<protocol::ChunkInfo> chunks;
+    uint32_t chunk_size = fsutils::CHUNK_SIZE; // Old clients send no hint and expect the default
+    if(req.chunk_size != 0) {
+        chunk_size = protocol::choose_chunk_size(fsutils::get_file_size(requested_file), req.chunk_size);
+    }
+    // Answers with the plan and starts sending, on strand_ either way
+    auto send_plan = [this, req](fsutils::FileMetadata fmeta, std::vector<protocol::ChunkInfo> chunks, uint32_t chunk_size) {
+        fmeta.tree_hash = fsutils::tree_hash(chunks);
+        transfer_.fmeta = fmeta;
+        transfer_.chunks = chunks;
+        transfer_.chunk_size = chunk_size;
+        transfer_.chunk_state = std::vector<bool>(chunks.size(), false);
+        open_window(protocol::negotiate_window(req.window));
+
+        if(fmeta.size > protocol::MAX_FILE_SIZE) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::PRECONDITION_FAILED,
+                "File too large. Max 256TB.",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
 
-    if(fsutils::is_scan_file_error(fmeta)) {
         protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::INTERNAL_SERVER_ERROR,
-            "Failed to scan file.",
-            ""
-        };
-        send_res(res);
-        storage_->release_user_lock(username_);
+            protocol::statuses::OK,
+            protocol::codes::OK,
+            "Starting download.",
+            fsutils::hash_to_hex(transfer_.fmeta.hash)
+        };
+        res.chunks = transfer_.chunks;
+        res.window = transfer_.window;
+        res.chunk_size = transfer_.chunk_size;
+        res.tree_hash = fsutils::hash_to_hex(transfer_.fmeta.tree_hash);
+        negotiate_compression(req, res, TransferType::DOWNLOAD);
+        json j;
+        protocol::to_json(j, res);
+        write_response_json(j);
+        state_ = SessionState::DOWNLOADING;
+        download_init();
+    };
+
+    std::shared_ptr<ManifestCache> manifests = storage_->get_manifest_cache();
+    std::optional<FileManifest> manifest = manifests->find(requested_file);
+    if(manifest && manifest->chunk_size == chunk_size) { // Unchanged since it was last hashed, nothing to read up front
+        fmeta.size = manifest->size;
+        fmeta.hash = manifest->hash;
+        chunks = std::move(manifest->chunks);
+        send_plan(fmeta, std::move(chunks), chunk_size);
         return;
     }
 
-    if(fmeta.size == 0) {
+    // Hash and plan from one read of the whole file, on the pool
+    struct Scan {
+        fsutils::FileMetadata fmeta;
+        std::vector<protocol::ChunkInfo> chunks;
+        std::optional<FileStamp> stamp;
+        bool ok = false;
+    };
+    auto scan = std::make_shared<Scan>();
+    scan->fmeta = fmeta;
+    offload("DOWNLOAD", [scan, requested_file, chunk_size, manifests]() {
+        scan->stamp = ManifestCache::stamp(requested_file); // Taken before reading, a write meanwhile leaves a stale entry that find() drops
+        scan->ok = fsutils::scan_file_chunks(requested_file, chunk_size, false, scan->fmeta, scan->chunks);
+        if(scan->ok && scan->fmeta.size != 0 && scan->stamp) {
+            manifests->put(requested_file, *scan->stamp, FileManifest{scan->fmeta.size, scan->fmeta.hash, scan->chunks, chunk_size});
+        }
+    }, [this, scan, requested_file, chunk_size, send_plan]() {
+        if(!scan->ok) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                "Failed to scan file.",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+
+        if(scan->fmeta.size == 0) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::PRECONDITION_FAILED,
+                "File is empty.",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+
+        index_file(requested_file, scan->stamp, fsutils::hash_to_hex(scan->fmeta.hash), fsutils::hash_to_hex(fsutils::tree_hash(scan->chunks))); // Hashed right here
+        send_plan(scan->fmeta, std::move(scan->chunks), chunk_size);
+    });
+}
+
+void Session::signatures(protocol::Request& req) {
+    if(state_ != SessionState::READY) {
         protocol::Response res {
             protocol::statuses::ERROR,
-            protocol::codes::PRECONDITION_FAILED,
-            "File is empty.",
+            protocol::codes::SERVICE_UNAVAILABLE,
+            "Session not ready.",
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
         return;
     }
-
-    std::vector<protocol::ChunkInfo> chunks = fsutils::compute_chunks(fmeta);
-
-    if(fsutils::is_compute_chunks_error(chunks)) {
+    std::filesystem::path requested_file = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_file, false}})) {
+        return;
+    }
+    if(!fsutils::is_subpath(user_dir_, requested_file)) {
         protocol::Response res {
             protocol::statuses::ERROR,
-            protocol::codes::INTERNAL_SERVER_ERROR,
-            "Gathering chunk data failed.",
+            protocol::codes::FORBIDDEN,
+            "Access denied.",
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
-
-    transfer_.fmeta = fmeta;
-    transfer_.chunks = chunks;
-    transfer_.chunk_state = std::vector<bool>(chunks.size(), false);
-
-    if(fmeta.size > UINT32_MAX) {
+    if(!fsutils::is_file(requested_file)) {
         protocol::Response res {
             protocol::statuses::ERROR,
             protocol::codes::PRECONDITION_FAILED,
-            "File too large. Max 4GB.",
+            "File does not exist.",
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
 
-    protocol::Response res {
-        protocol::statuses::OK,
-        protocol::codes::OK,
-        "Starting download.",
-        fsutils::hash_to_hex(transfer_.fmeta.hash)
-    };
-    res.chunks = transfer_.chunks;
-    json j;
-    protocol::to_json(j, res);
-    write_response_json(j);
-    state_ = SessionState::DOWNLOADING;
-    download_init();
-    return;
+    // Reads and hashes the whole stored file, on the pool
+    uint32_t block_size = fsutils::signature_block_size(fsutils::get_file_size(requested_file));
+    auto signatures = std::make_shared<std::vector<protocol::BlockSignature>>();
+    offload("SIGNATURES", [requested_file, block_size, signatures]() {
+        *signatures = fsutils::compute_signatures(requested_file, block_size);
+    }, [this, block_size, signatures]() {
+        storage_->release_user_lock(username_, this); // The DELTA takes it again and fails its final hash check if the file changed meanwhile
+
+        if(signatures->empty()) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                "Failed to read file signatures.",
+                ""
+            };
+            send_res(res);
+            return;
+        }
+
+        protocol::Response res {
+            protocol::statuses::OK,
+            protocol::codes::OK,
+            "Signatures of " + std::to_string(signatures->size()) + " blocks.",
+            ""
+        };
+        res.chunk_size = block_size;
+        res.signatures = std::move(*signatures);
+        send_res(res);
+    });
 }
 
 void Session::cd(protocol::Request& req) {
@@ -1164,17 +1715,10 @@ void Session::mkdir(protocol::Request& req) {
             send_res(res);
             return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_dir, true}})) {
         return;
     }
-    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     if(fsutils::is_directory(requested_dir)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -1183,7 +1727,7 @@ void Session::mkdir(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
     if(!fsutils::is_subpath(user_dir_, requested_dir)) {
@@ -1194,7 +1738,7 @@ void Session::mkdir(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
     if(!fsutils::mkdir(requested_dir)) {
@@ -1205,7 +1749,7 @@ void Session::mkdir(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     protocol::Response res {
@@ -1215,7 +1759,7 @@ void Session::mkdir(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
 }
 void Session::rmdir(protocol::Request& req) {
     if(state_ != SessionState::READY) {
@@ -1238,17 +1782,10 @@ void Session::rmdir(protocol::Request& req) {
             send_res(res);
             return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_dir, true}})) {
         return;
     }
-    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     if(!fsutils::is_directory(requested_dir)) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -1257,7 +1794,7 @@ void Session::rmdir(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
         }
     if(!fsutils::is_subpath(user_dir_, requested_dir) || user_dir_ == requested_dir) {
@@ -1268,7 +1805,7 @@ void Session::rmdir(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
     if(!fsutils::rmdir(requested_dir)) {
@@ -1279,7 +1816,7 @@ void Session::rmdir(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     protocol::Response res {
@@ -1289,7 +1826,7 @@ void Session::rmdir(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
 }
 void Session::move(protocol::Request& req) {
     if(state_ != SessionState::READY) {
@@ -1312,18 +1849,11 @@ void Session::move(protocol::Request& req) {
             send_res(res);
             return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
-        return;
-    }
     std::filesystem::path requested_src = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     std::filesystem::path requested_dst = fsutils::resolve_path(user_dir_, current_dir_, req.second_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_src, true}, PathLock{requested_dst, true}})) {
+        return;
+    }
     if(!(fsutils::is_directory(requested_src) || fsutils::is_file(requested_src))) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -1332,7 +1862,7 @@ void Session::move(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(fsutils::is_directory(requested_dst) || fsutils::is_file(requested_dst)) {
@@ -1343,7 +1873,7 @@ void Session::move(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(!fsutils::is_subpath(user_dir_, requested_src) || !fsutils::is_subpath(user_dir_, requested_dst)) {
@@ -1354,10 +1884,11 @@ void Session::move(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
-    if(!(fsutils::move_path(requested_src ,requested_dst, false))) {
+    fsutils::CopyStats stats;
+    if(!(fsutils::move_path(requested_src ,requested_dst, false, stats))) {
         protocol::Response res {
                 protocol::statuses::ERROR,
                 protocol::codes::INTERNAL_SERVER_ERROR,
@@ -1365,7 +1896,7 @@ void Session::move(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     protocol::Response res {
@@ -1374,8 +1905,11 @@ void Session::move(protocol::Request& req) {
             "Path moved.",
             ""
         };
+        if(stats.files > 0) { // Rename was not possible, the data was copied
+            spdlog::info("[{}] Moved {} by copying: {}", username_, fsutils::relative(user_dir_, requested_src).string(), stats.summary());
+        }
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
 }
 void Session::copy(protocol::Request& req) {
     if(state_ != SessionState::READY) {
@@ -1398,18 +1932,11 @@ void Session::copy(protocol::Request& req) {
             send_res(res);
             return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
-        return;
-    }
     std::filesystem::path requested_src = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     std::filesystem::path requested_dst = fsutils::resolve_path(user_dir_, current_dir_, req.second_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_src, false}, PathLock{requested_dst, true}})) {
+        return;
+    }
     if(!(fsutils::is_directory(requested_src) || fsutils::is_file(requested_src))) {
             protocol::Response res {
                 protocol::statuses::ERROR,
@@ -1418,7 +1945,7 @@ void Session::copy(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(fsutils::is_directory(requested_dst) || fsutils::is_file(requested_dst)) {
@@ -1429,7 +1956,7 @@ void Session::copy(protocol::Request& req) {
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
     }
     if(!fsutils::is_subpath(user_dir_, requested_src) || !fsutils::is_subpath(user_dir_, requested_dst)) {
@@ -1440,35 +1967,51 @@ void Session::copy(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
-        return;
-    }
-    if(!(fsutils::copy_path(requested_src, requested_dst, false))) {
-        protocol::Response res {
+        storage_->release_user_lock(username_, this);
+        return;
+    }
+    // Stored files are never written in place, with a chunk store they may share their data.
+    // A whole tree can take long to copy, on the pool
+    bool shared_data = storage_->get_chunk_store(username_) != nullptr;
+    auto linked = std::make_shared<bool>(false);
+    auto copied = std::make_shared<bool>(false);
+    auto stats = std::make_shared<fsutils::CopyStats>();
+    offload("COPY", [requested_src, requested_dst, shared_data, linked, copied, stats]() {
+        *linked = shared_data && fsutils::link_path(requested_src, requested_dst);
+        *copied = *linked || fsutils::copy_path(requested_src, requested_dst, false, *stats);
+    }, [this, requested_src, linked, copied, stats]() {
+        if(!*copied) {
+            protocol::Response res {
                 protocol::statuses::ERROR,
                 protocol::codes::INTERNAL_SERVER_ERROR,
                 "Cannot copy paths.",
                 ""
             };
             send_res(res);
-            storage_->release_user_lock(username_);
+            storage_->release_user_lock(username_, this);
             return;
-    }
-    protocol::Response res {
+        }
+        protocol::Response res {
             protocol::statuses::OK,
             protocol::codes::OK,
             "Path copied.",
             ""
         };
+        if(*linked) {
+            spdlog::info("[{}] Copied {} by hard links.", username_, fsutils::relative(user_dir_, requested_src).string());
+        } else {
+            spdlog::info("[{}] Copied {}: {}", username_, fsutils::relative(user_dir_, requested_src).string(), stats->summary());
+        }
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
+    });
 }
 
 // SYNC is a stateless listing request: it returns a recursive hash+mtime listing of the requested
 // directory and nothing else. Every mutation the client decides on afterwards is driven by the
 // ordinary single-item UPLOAD/DOWNLOAD/DELETE/MOVE/COPY/MKDIR/RMDIR handlers, one request at a time.
-// That is why the per-user lock must be released on *every* path out of this function before the
-// client can send the next request: Storage's lock is a non-reentrant busy-boolean, so a lock left
+// That is why the path lock must be released on *every* path out of this function before the
+// client can send the next request: a session holds one set of paths at a time, so a lock left
 // held here would make every follow-up command in the batch fail with "Server is busy" forever.
 void Session::sync(protocol::Request& req) {
     if(state_ != SessionState::READY) {
@@ -1491,17 +2034,10 @@ void Session::sync(protocol::Request& req) {
         send_res(res);
         return;
     }
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
+    if(!acquire_user_lock(req, {PathLock{requested_dir, false}})) {
         return;
     }
-    std::filesystem::path requested_dir = fsutils::resolve_path(user_dir_, current_dir_, req.first_argument);
     if(!fsutils::is_subpath(user_dir_, requested_dir)) {
         protocol::Response res {
             protocol::statuses::ERROR,
@@ -1510,7 +2046,7 @@ void Session::sync(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
     if(!fsutils::is_directory(requested_dir)) {
@@ -1521,43 +2057,63 @@ void Session::sync(protocol::Request& req) {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
 
-    std::vector<fsutils::FileMetadata> files = fsutils::scan_directory(requested_dir, true);
-    if(fsutils::is_scan_dir_error(files)) {
+    // Recursive and hashes every file, on the pool, which also files the hashes in the tier's HashIndex.
+    // Stamped after hashing, nothing writes below requested_dir while the lock is held
+    struct Listing {
+        std::vector<fsutils::FileMetadata> files;
+        std::vector<bool> dirs; // Per entry of files
+    };
+    auto listing = std::make_shared<Listing>();
+    offload("SYNC", [requested_dir, listing, index = storage_->get_hash_index(username_)]() {
+        listing->files = fsutils::scan_directory(requested_dir, true);
+        if(fsutils::is_scan_dir_error(listing->files)) return;
+        for(const auto& file : listing->files) {
+            bool is_dir = fsutils::is_directory(file.absolute_path);
+            listing->dirs.push_back(is_dir);
+            if(!index || is_dir || fsutils::is_hash_error(file.hash)) continue;
+            if(std::optional<FileStamp> stamp = ManifestCache::stamp(file.absolute_path)) {
+                index->put(ContentHash::FILE, fsutils::hash_to_hex(file.hash), file.absolute_path, *stamp);
+            }
+        }
+    }, [this, requested_dir, listing]() {
+        if(fsutils::is_scan_dir_error(listing->files)) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                "Failed to list directory",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+
         protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::INTERNAL_SERVER_ERROR,
-            "Failed to list directory",
+            protocol::statuses::OK,
+            protocol::codes::OK,
+            "Listing of " + fsutils::relative(user_dir_, requested_dir).string(),
             ""
         };
-        send_res(res);
-        storage_->release_user_lock(username_);
-        return;
-    }
-
-    protocol::Response res {
-        protocol::statuses::OK,
-        protocol::codes::OK,
-        "Listing of " + fsutils::relative(user_dir_, requested_dir).string(),
-        ""
-    };
 
-    for(const auto& file : files) {
-        bool is_dir = fsutils::is_directory(file.absolute_path);
-        res.files.push_back(protocol::FileEntry{
-            fsutils::relative(requested_dir, file.absolute_path).generic_string(),
-            is_dir ? 0u : file.size,
-            is_dir ? std::string() : fsutils::hash_to_hex(file.hash),
-            file.last_modified,
-            is_dir
-        });
-    }
+        for(size_t i = 0; i < listing->files.size(); ++i) {
+            const fsutils::FileMetadata& file = listing->files[i];
+            bool is_dir = listing->dirs[i];
+            res.files.push_back(protocol::FileEntry{
+                fsutils::relative(requested_dir, file.absolute_path).generic_string(),
+                is_dir ? uint64_t{0} : file.size,
+                is_dir ? std::string() : fsutils::hash_to_hex(file.hash),
+                file.last_modified,
+                is_dir
+            });
+        }
 
-    send_res(res);
-    storage_->release_user_lock(username_);
+        send_res(res);
+        storage_->release_user_lock(username_, this);
+    });
 }
 
 void Session::tiers(protocol::Request& req) {
@@ -1671,40 +2227,51 @@ void Session::set_tier(protocol::Request& req) {
         return;
     }
 
-    // Held across the confirmation so a concurrent upload cannot start under the migration.
-    // finish_exit() releases it unconditionally, so a client that never answers cannot brick the user.
-    if(!storage_->try_acquire_user_lock(username_)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::SERVICE_UNAVAILABLE,
-            "Server is busy",
-            ""
-        };
-        send_res(res);
+    // The whole tree, files and partials, held across the confirmation so no operation of another session
+    // runs under the migration. finish_exit() releases it, so a client that never answers cannot brick the user.
+    if(!acquire_user_lock(req, {PathLock{user_dir_.parent_path(), true}})) {
         return;
     }
 
-    uint64_t files = 0;
-    uint64_t bytes = 0;
-    std::vector<fsutils::FileMetadata> contents = fsutils::scan_directory(user_dir_, true);
-    if(!fsutils::is_scan_dir_error(contents)) {
+    // Counting walks (and hashes) the whole tree, on the pool
+    auto totals = std::make_shared<std::pair<uint64_t, uint64_t>>(0, 0); // Files, bytes
+    auto failed = std::make_shared<bool>(false);
+    std::string target = req.first_argument;
+    offload("SET_TIER", [user_dir = user_dir_, totals, failed]() {
+        std::vector<fsutils::FileMetadata> contents = fsutils::scan_directory(user_dir, true);
+        if(fsutils::is_scan_dir_error(contents)) {
+            *failed = true;
+            return;
+        }
         for(const auto& file : contents) {
             if(fsutils::is_directory(file.absolute_path)) continue;
-            files++;
-            bytes += file.size;
+            totals->first++;
+            totals->second += file.size;
         }
-    }
-
-    pending_tier_ = req.first_argument;
-    protocol::Response res {
-        protocol::statuses::NEED_INPUT,
-        protocol::codes::OK,
-        "Move " + std::to_string(files) + " file(s), " + std::to_string(bytes) + " bytes from tier '" +
-            current + "' to '" + pending_tier_ + "'? This may take a while. (Y/n)",
-        ""
-    };
-    send_res(res);
-    state_ = SessionState::NEED_INPUT_SET_TIER;
+    }, [this, totals, failed, current, target]() {
+        if(*failed) { // Asking to confirm 0 files would hide that the tree could not be read
+            spdlog::error("[{}] Failed to scan storage before moving it to tier '{}'.", username_, target);
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                "Failed to scan your storage",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+        pending_tier_ = target;
+        protocol::Response res {
+            protocol::statuses::NEED_INPUT,
+            protocol::codes::OK,
+            "Move " + std::to_string(totals->first) + " file(s), " + std::to_string(totals->second) + " bytes from tier '" +
+                current + "' to '" + pending_tier_ + "'? This may take a while. (Y/n)",
+            ""
+        };
+        send_res(res);
+        state_ = SessionState::NEED_INPUT_SET_TIER;
+    });
 }
 
 void Session::finish_set_tier() {
@@ -1725,113 +2292,334 @@ void Session::finish_set_tier() {
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
         return;
     }
 
-    // Synchronous on purpose: the per user lock already makes this user's other commands fail
-    // fast with "Server is busy", and the io_context runs a thread per core so the server keeps
-    // serving everyone else. A very large move still occupies one of those threads.
-    MigrationResult result = storage_->migrate_user(username_, *from, *to);
+    // On the pool: the lock on the whole tree makes this user's other commands wait meanwhile,
+    // and a very large move no longer occupies an io_context thread.
+    // The move is recorded there too, a session exiting meanwhile must not leave it unrecorded.
+    struct Migration {
+        MigrationResult result;
+        bool recorded = false;
+    };
+    auto migration = std::make_shared<Migration>();
+    offload("SET_TIER", [storage = storage_, db = db_, user = username_, from = *from, to = *to, migration]() {
+        migration->result = storage->migrate_user(user, from, to);
+        migration->recorded = migration->result.ok && db->set_storage_class(user, to.name);
+    }, [this, migration, target]() {
+        const MigrationResult& result = migration->result;
+        if(!result.ok) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                result.error,
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+
+        if(!migration->recorded) {
+            protocol::Response res {
+                protocol::statuses::ERROR,
+                protocol::codes::INTERNAL_SERVER_ERROR,
+                "Data was moved to tier '" + target + "' but the change could not be recorded.",
+                ""
+            };
+            send_res(res);
+            storage_->release_user_lock(username_, this);
+            return;
+        }
+
+        // Re-point user_dir_, current_dir_ and partmeta_ at the new medium
+        if(!setup_dir()) {
+            storage_->release_user_lock(username_, this);
+            return; // setup_dir() already answered with the error
+        }
 
-    if(!result.ok) {
         protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::INTERNAL_SERVER_ERROR,
-            result.error,
+            protocol::statuses::OK,
+            protocol::codes::OK,
+            "Moved to tier '" + target + "'. " + std::to_string(result.files) + " file(s), " +
+                std::to_string(result.bytes) + " bytes.",
             ""
         };
         send_res(res);
-        storage_->release_user_lock(username_);
+        storage_->release_user_lock(username_, this);
+    });
+}
+
+void Session::verify_upload(const uint32_t& index, const std::shared_ptr<DataStream>& stream) {
+    if(!fsutils::is_hash_error(transfer_.fmeta.tree_hash)) { // valid_chunk() checked every chunk as it came in
+        upload_verified(index, fsutils::complete_tree(transfer_.chunks, transfer_.chunk_state, transfer_.fmeta.tree_hash), stream);
         return;
     }
 
-    if(!db_->set_storage_class(username_, target)) {
-        protocol::Response res {
-            protocol::statuses::ERROR,
-            protocol::codes::INTERNAL_SERVER_ERROR,
-            "Data was moved to tier '" + target + "' but the change could not be recorded.",
-            ""
-        };
-        send_res(res);
-        storage_->release_user_lock(username_);
-        return;
+    // A peer without a tree hash only gave the whole-file hash, reading the .part again is on the pool
+    auto hash = std::make_shared<std::array<uint8_t, crypto_generichash_BYTES>>(fsutils::HASH_ERROR);
+    offload("UPLOAD hash", [partial_file = transfer_.partial_path, hash]() {
+        *hash = fsutils::hash_file(partial_file);
+    }, [this, index, stream, hash]() {
+        upload_verified(index, *hash == transfer_.fmeta.hash && !fsutils::is_hash_error(*hash), stream);
+    }, [this]() {
+        spdlog::error("[{}] No work pool thread to verify upload {}.", username_, transfer_.transfer_id);
+        upload_abort(false, true, protocol::flags::ERROR);
+    });
+}
+
+bool Session::valid_chunk(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data) {
+    if(index >= transfer_.chunks.size()) return false;
+    protocol::ChunkInfo chunk = transfer_.chunks[index];
+    if(chunk.size != size) return false;
+    if(chunk.index != index) return false;
+    std::array<uint8_t, crypto_generichash_BYTES> hash = fsutils::hash_chunk(data);
+    return hash == fsutils::hex_to_hash(chunk.chunk_hash) && !fsutils::is_hash_error(hash);
+}
+
+bool Session::open_transfer_file(const std::filesystem::path& path, fsutils::TransferFile::Mode mode) {
+    if(!transfer_.file) {
+        transfer_.file = std::make_shared<fsutils::TransferFile>();
+    }
+    return transfer_.file->open(path, mode);
+}
+
+void Session::close_transfer_file() {
+    transfer_.file.reset();
+    pending_reads_.clear();
+    prefetch_.clear();
+    pending_writes_ = 0;
+    after_writes_ = nullptr;
+    buffers_->trim(); // Up to a window of chunks, not worth keeping for a connection that may stay idle
+}
+
+std::filesystem::path Session::next_partial_path() {
+    if(next_partial_.empty()) {
+        std::array<unsigned char, 16> bytes;
+        randombytes_buf(bytes.data(), bytes.size());
+        std::array<char, bytes.size() * 2 + 1> hex;
+        sodium_bin2hex(hex.data(), hex.size(), bytes.data(), bytes.size());
+        next_partial_ = "upload-" + std::string(hex.data()) + ".part";
+    }
+    return user_dir_.parent_path() / ".partial" / next_partial_;
+}
+
+std::vector<uint32_t> Session::stage_stored_chunks(const std::string& username, ChunkStore& store, const std::vector<std::filesystem::path>& within, const std::vector<protocol::ChunkInfo>& chunks, uint64_t size, const std::filesystem::path& partial) {
+    std::vector<uint32_t> have;
+    fsutils::TransferFile file;
+    if(!file.open(partial, fsutils::TransferFile::Mode::WRITE) || !file.preallocate(size)) {
+        spdlog::warn("[{}] Failed to stage stored chunks: {}", username, file.error().message());
+        file.close();
+        fsutils::remove_file(partial);
+        return have;
     }
 
-    // Re-point user_dir_, current_dir_ and partmeta_ at the new medium
-    if(!setup_dir()) {
-        storage_->release_user_lock(username_);
-        return; // setup_dir() already answered with the error
+    fsutils::TransferFile source; // Chunks of one stored file tend to come in a row, open() keeps it
+    std::vector<uint8_t> data;
+    uint64_t bytes = 0;
+    for(uint32_t i = 0; i + 1 < chunks.size(); ++i) {
+        const protocol::ChunkInfo& chunk = chunks[i];
+        for(const ChunkLocation& location : store.find(chunk.chunk_hash, within)) {
+            if(location.size != chunk.size) continue;
+            if(!source.open(location.file, fsutils::TransferFile::Mode::READ) || !source.read_at(location.offset, chunk.size, data)) continue;
+            std::array<uint8_t, crypto_generichash_BYTES> hash = fsutils::hash_chunk(data);
+            if(fsutils::is_hash_error(hash) || hash != fsutils::hex_to_hash(chunk.chunk_hash)) continue; // Replaced since it was checked, the next location may still hold it
+            if(!file.write_at(chunk.offset, data)) {
+                spdlog::warn("[{}] Failed to stage stored chunks: {}", username, file.error().message());
+                file.close();
+                fsutils::remove_file(partial);
+                return {};
+            }
+            have.push_back(i);
+            bytes += chunk.size;
+            break;
+        }
+    }
+    file.close();
+
+    if(have.empty()) {
+        fsutils::remove_file(partial);
+        return have;
+    }
+    spdlog::info("[{}] {} of {} chunks ({} bytes) are already stored, the client skips them.", username, have.size(), chunks.size(), bytes);
+    return have;
+}
+
+bool Session::instant_upload(const protocol::Request& req, const std::filesystem::path& requested_file, const std::filesystem::path& tmp) {
+    if(!req.instant) return false; // Old clients wait for the window to open
+
+    // The user's own files, then public ones, which anybody may download anyway. Never another user's
+    std::vector<std::pair<std::shared_ptr<HashIndex>, std::filesystem::path>> scopes{{storage_->get_hash_index(username_), user_dir_}};
+    if(username_ != "public") {
+        scopes.emplace_back(storage_->get_hash_index("public"), root_ / "public" / "files");
+    }
+    std::optional<std::filesystem::path> source;
+    ContentHash matched = ContentHash::TREE;
+    for(const auto& [index, within] : scopes) {
+        if(!index) continue;
+        if(!req.tree_hash.empty()) { // upload() checked it against the plan, the plan is what the client hashed
+            source = index->find(ContentHash::TREE, req.tree_hash, req.size, within);
+        }
+        if(!source) {
+            source = index->find(ContentHash::FILE, req.file_hash, req.size, within);
+            matched = ContentHash::FILE;
+        }
+        if(source) break;
+    }
+    if(!source) return false;
+
+    // Stored files are never written in place, whatever is opened below holds the indexed content
+    std::string how = "reflinked";
+    if(!fsutils::reflink_file(*source, tmp)) {
+        std::error_code ec;
+        std::filesystem::create_hard_link(*source, tmp, ec);
+        how = "linked";
+        if(ec) { // Public files on another medium than the user's tier
+            fsutils::CopyStats stats;
+            if(!fsutils::copy_file_data(*source, tmp, false, stats)) {
+                spdlog::warn("[{}] Failed to copy {} for an instant upload, receiving it instead.", username_, source->string());
+                fsutils::remove_file(tmp);
+                return false;
+            }
+            how = "copied";
+        }
+    }
+    if(fsutils::get_file_size(tmp) != req.size || !fsutils::move_path(tmp, requested_file, false)) {
+        spdlog::warn("[{}] Failed to place {} for an instant upload, receiving it instead.", username_, requested_file.string());
+        fsutils::remove_file(tmp);
+        return false;
+    }
+    std::optional<FileStamp> stamp = ManifestCache::stamp(requested_file);
+    if(matched == ContentHash::TREE) {
+        index_file(requested_file, stamp, "", req.tree_hash);
+    } else {
+        index_file(requested_file, stamp, req.file_hash, "");
     }
+    spdlog::info("[{}] Upload of {} finished from {} ({}), no chunks sent.", username_, requested_file.string(), source->string(), how);
 
     protocol::Response res {
-        protocol::statuses::OK,
+        protocol::statuses::DONE,
         protocol::codes::OK,
-        "Moved to tier '" + target + "'. " + std::to_string(result.files) + " file(s), " +
-            std::to_string(result.bytes) + " bytes.",
+        "Identical file already stored, " + how + " to: " + fsutils::relative(user_dir_, requested_file).string(),
         ""
     };
     send_res(res);
-    storage_->release_user_lock(username_);
+    return true;
 }
 
-bool Session::valid_file(const std::filesystem::path& partial_file, const std::array<uint8_t, crypto_generichash_BYTES>& expected) {
-    std::array<uint8_t, crypto_generichash_BYTES> hash = fsutils::hash_file(partial_file);
-    return hash == expected && !fsutils::is_hash_error(hash);
+void Session::index_file(const std::filesystem::path& file, const std::optional<FileStamp>& stamp, const std::string& file_hash, const std::string& tree_hash) {
+    std::shared_ptr<HashIndex> index = storage_->get_hash_index(username_);
+    if(!index || !stamp) return;
+    if(!file_hash.empty()) {
+        index->put(ContentHash::FILE, file_hash, file, *stamp);
+    }
+    if(!tree_hash.empty()) {
+        index->put(ContentHash::TREE, tree_hash, file, *stamp);
+    }
 }
 
-bool Session::valid_chunk(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data) {
-    protocol::ChunkInfo chunk = transfer_.chunks[index];
-    if(chunk.size != size) return false;
-    if(chunk.index != index) return false;
-    std::array<uint8_t, crypto_generichash_BYTES> hash = fsutils::hash_chunk(data);
-    return hash == fsutils::hex_to_hash(chunk.chunk_hash) && !fsutils::is_hash_error(hash);
+bool Session::upload_init() {
+    // Keyed by an id of the server's, the entry remembers the client's for a resume
+    transfer_.entry_id = partmeta_->add_partial_metadata(TransferType::UPLOAD, transfer_.fmeta, transfer_.chunks, transfer_.chunk_size, UINT32_MAX, transfer_.partial_path, transfer_.transfer_id);
+    spdlog::debug("[{}] Upload {} -> partial file {}", username_, transfer_.transfer_id, transfer_.partial_path.string());
+    for(uint32_t i = 0; i < transfer_.chunk_state.size(); ++i) { // Nothing arrived yet, every marked chunk was staged
+        if(transfer_.chunk_state[i]) partmeta_->mark_chunk_received(transfer_.entry_id, i);
+    }
+    if(!open_transfer_file(transfer_.partial_path, fsutils::TransferFile::Mode::WRITE) || !transfer_.file->preallocate(transfer_.fmeta.size)) {
+        spdlog::error("[{}] Failed to allocate partial file of upload {}: {}", username_, transfer_.transfer_id, transfer_.file->error().message());
+        upload_abort(false, true, protocol::flags::ERROR);
+        return false;
+    }
+    if(!fsutils::apply_copies(transfer_.fmeta.absolute_path, *transfer_.file, transfer_.copies)) { // DELTA: the reused ranges go in before any chunk
+        spdlog::error("[{}] Failed to copy the stored file into delta upload {}: {}", username_, transfer_.transfer_id, transfer_.file->error().message());
+        upload_abort(false, true, protocol::flags::ERROR);
+        return false;
+    }
+    transfer_.copies.clear();
+    return true;
 }
 
-void Session::upload_init() {
-    partmeta_->add_partial_metadata(TransferType::UPLOAD, transfer_.fmeta, transfer_.chunks, transfer_.transfer_id);
-    transfer_.partial_path = partmeta_->get_partial_path(transfer_.transfer_id);
-    spdlog::debug("[{}] Upload {} -> partial file {}", username_, transfer_.transfer_id, transfer_.partial_path.string());
-    if(transfer_.partial_path.empty()) {
-        spdlog::error("[{}] Failed to get partial path for upload {}.", username_, transfer_.transfer_id);
+void Session::uploading(const uint32_t& index, const uint32_t& size, protocol::ChunkBuffer& data, uint8_t flag, const std::shared_ptr<DataStream>& stream) {
+    uint64_t offset = transfer_.chunks[index].offset;
+    if(!open_transfer_file(transfer_.partial_path, fsutils::TransferFile::Mode::WRITE)) {
+        spdlog::error("[{}] Failed to open partial file of transfer {}: {}", username_, transfer_.transfer_id, transfer_.file->error().message());
         upload_abort(false, true, protocol::flags::ERROR);
         return;
     }
-    if(!fsutils::is_file(transfer_.partial_path)) {
-        fsutils::create_empty_file(transfer_.partial_path);
+
+    if(io_ring_) { // Ack goes out from the completion, the read loop carries on meanwhile
+        auto self = shared_from_this();
+        auto file = transfer_.file;
+        auto body = std::make_shared<protocol::ChunkBuffer>(std::move(data)); // Kernel reads it until the completion, back to buffers_ after
+        pending_writes_++;
+        io_ring_->write(file->native_handle(), offset, body->data(), size, strand_, [this, self, file, body, index, flag, stream](std::error_code ec) {
+            if(exiting_ || transfer_.file != file) return; // Transfer ended while the kernel was writing
+            pending_writes_--;
+            if(ec) {
+                spdlog::error("[{}] Failed to write chunk {} of transfer {} to file: {}", username_, index, transfer_.transfer_id, ec.message());
+                upload_abort(false, true, protocol::flags::ERROR);
+                return;
+            }
+            if(flag == protocol::flags::DONE && pending_writes_ > 0) { // Earlier chunks are still on their way to disk
+                after_writes_ = [this, index, flag, stream]() { chunk_written(index, flag, stream); };
+                return;
+            }
+            chunk_written(index, flag, stream);
+            if(pending_writes_ == 0 && after_writes_) {
+                auto finish = std::move(after_writes_);
+                after_writes_ = nullptr;
+                finish();
+            }
+        });
+        return;
     }
+
+    if(!transfer_.file->write_at(offset, data.bytes())) {
+        spdlog::error("[{}] Failed to write chunk {} of transfer {} to file: {}", username_, index, transfer_.transfer_id, transfer_.file->error().message());
+        upload_abort(false, true, protocol::flags::ERROR);
+        return;
+    }
+    chunk_written(index, flag, stream);
 }
 
-void Session::uploading(const uint32_t& index, const uint32_t& size, const std::vector<uint8_t>& data, uint8_t flag) {
+void Session::chunk_written(const uint32_t& index, uint8_t flag, const std::shared_ptr<DataStream>& stream) {
+    // Only now that the bytes are in the .part, a resume would otherwise skip a chunk that never got there
     transfer_.chunk_state[index] = true;
-    partmeta_->mark_chunk_received(transfer_.transfer_id, index);
+    partmeta_->mark_chunk_received(transfer_.entry_id, index);
 
-    uint32_t offset = fsutils::CHUNK_SIZE * index;
-    if(!fsutils::write_chunk(transfer_.partial_path, offset, data)) {
-        flag = protocol::flags::ERROR;
-        spdlog::error("[{}] Failed to write chunk {} of transfer {} to file.", username_, index, transfer_.transfer_id);
-        upload_abort(false, true, flag);
+    if(flag == protocol::flags::DONE) {
+        verify_upload(index, stream);
         return;
     }
+    ack_chunk(index, flag, stream);
+}
 
-    if(flag == protocol::flags::DONE) {
-        if(!valid_file(transfer_.partial_path, transfer_.fmeta.hash)) {
-            flag = protocol::flags::ERROR;
-            spdlog::error("[{}] Uploaded file hash mismatch for transfer {}.", username_, transfer_.transfer_id);
-            upload_abort(false, true, flag);
-            return;
-        }
+void Session::upload_verified(const uint32_t& index, bool valid, const std::shared_ptr<DataStream>& stream) {
+    if(!valid) {
+        spdlog::error("[{}] Uploaded file hash mismatch for transfer {}.", username_, transfer_.transfer_id);
+        upload_abort(false, true, protocol::flags::ERROR);
+        return;
     }
+    ack_chunk(index, protocol::flags::DONE, stream);
+}
+
+void Session::ack_chunk(const uint32_t& index, uint8_t flag, const std::shared_ptr<DataStream>& stream) {
+    transfer_.acked_prefix = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.acked_prefix);
+    std::vector<uint8_t> response_data = protocol::encode_ack(transfer_.acked_prefix);
+
     protocol::ChunkHeader ch{
         transfer_.transfer_id,
         index,
-        0,
+        static_cast<uint32_t>(response_data.size()),
         flag
     };
 
-    std::vector<uint8_t> response_data;
-
-    send_chunk(ch, response_data);
+    if(stream) {
+        stream_send(stream, protocol::make_chunk_frame(ch, response_data));
+    } else {
+        send_chunk(ch, response_data);
+    }
 
     if(flag == protocol::flags::DONE) {
         upload_done();
@@ -1839,31 +2627,57 @@ void Session::uploading(const uint32_t& index, const uint32_t& size, const std::
 }
 
 void Session::upload_done() {
-    fsutils::move_path(transfer_.partial_path, transfer_.fmeta.absolute_path, true);
-    partmeta_->delete_partial_metadata(transfer_.transfer_id);
+    close_streams();
+    close_transfer_file();
+    if(fsutils::move_path(transfer_.partial_path, transfer_.fmeta.absolute_path, true)) {
+        std::optional<FileStamp> stamp = ManifestCache::stamp(transfer_.fmeta.absolute_path);
+        bool fixed = fsutils::valid_chunk_plan(transfer_.chunks, transfer_.fmeta.size, transfer_.chunk_size); // DOWNLOAD plans are never content-defined
+        if(stamp && fixed) { // Every chunk was verified against this plan, a later DOWNLOAD can reuse it
+            storage_->get_manifest_cache()->put(transfer_.fmeta.absolute_path, *stamp, FileManifest{transfer_.fmeta.size, transfer_.fmeta.hash, transfer_.chunks, transfer_.chunk_size});
+        }
+        if(std::shared_ptr<ChunkStore> store = storage_->get_chunk_store(username_)) { // Verified chunks at their offsets, for a DELTA only its literals
+            store->add(transfer_.fmeta.absolute_path, transfer_.chunks);
+        }
+        if(fsutils::is_hash_error(transfer_.fmeta.tree_hash)) { // verify_upload() rehashed it, the whole-file hash is the server's own
+            index_file(transfer_.fmeta.absolute_path, stamp, fsutils::hash_to_hex(transfer_.fmeta.hash), "");
+        } else { // Only the tree was verified, the client's whole-file hash never was
+            index_file(transfer_.fmeta.absolute_path, stamp, "", fsutils::hash_to_hex(transfer_.fmeta.tree_hash));
+        }
+    }
+    partmeta_->delete_partial_metadata(transfer_.entry_id);
 
     transfer_.partial_path = std::filesystem::path("");
     transfer_.transfer_id = UINT32_MAX;
+    transfer_.entry_id = UINT32_MAX;
     transfer_.fmeta = fsutils::FileMetadata{};
     transfer_.chunk_state.clear();
     transfer_.chunks.clear();
+    transfer_.copies.clear();
 
-    storage_->release_user_lock(username_);
+    storage_->release_user_lock(username_, this);
     if(resuming_) { handle_resumes(); } else { state_ = SessionState::READY; }
 }
 
 void Session::upload_abort(bool save, bool notify, uint8_t flag) {
+    close_streams();
     if(save) {
         partmeta_->save();
+        close_transfer_file();
+        if(transfer_.entry_id == UINT32_MAX) { // No chunk arrived, no entry leads a resume to the staged chunks
+            fsutils::remove_file(transfer_.partial_path);
+        }
     } else {
         fsutils::remove_file(transfer_.partial_path);
-        partmeta_->delete_partial_metadata(transfer_.transfer_id);
+        partmeta_->delete_partial_metadata(transfer_.entry_id);
 
         transfer_.partial_path = std::filesystem::path("");
         transfer_.transfer_id = UINT32_MAX;
+        transfer_.entry_id = UINT32_MAX;
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.copies.clear();
+        close_transfer_file();
     }
 
     if(notify) {
@@ -1877,24 +2691,35 @@ void Session::upload_abort(bool save, bool notify, uint8_t flag) {
         std::vector<uint8_t> data;
 
         send_chunk(ch, data);
+        if(transfer_.window > 1 && flag != protocol::flags::ABORTED) { // Client may still have chunks on the way
+            draining_ = true;
+        }
     }
 
-    storage_->release_user_lock(username_);
+    storage_->release_user_lock(username_, this);
     if(resuming_) { handle_resumes(); } else { state_ = SessionState::READY; }
 }
 
 void Session::upload_abort_exit(bool save, bool notify, uint8_t flag) {
+    close_streams();
     if(save) {
         partmeta_->save();
+        close_transfer_file();
+        if(transfer_.entry_id == UINT32_MAX) { // No chunk arrived, no entry leads a resume to the staged chunks
+            fsutils::remove_file(transfer_.partial_path);
+        }
     } else {
         fsutils::remove_file(transfer_.partial_path);
-        partmeta_->delete_partial_metadata(transfer_.transfer_id);
+        partmeta_->delete_partial_metadata(transfer_.entry_id);
 
         transfer_.partial_path = std::filesystem::path("");
         transfer_.transfer_id = UINT32_MAX;
+        transfer_.entry_id = UINT32_MAX;
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        transfer_.copies.clear();
+        close_transfer_file();
     }
 
     if(notify) {
@@ -1912,72 +2737,211 @@ void Session::upload_abort_exit(bool save, bool notify, uint8_t flag) {
 }
 
 void Session::download_init() {
-    transfer_.transfer_id = partmeta_->add_partial_metadata(TransferType::DOWNLOAD, transfer_.fmeta, transfer_.chunks, UINT32_MAX);
+    transfer_.transfer_id = partmeta_->add_partial_metadata(TransferType::DOWNLOAD, transfer_.fmeta, transfer_.chunks, transfer_.chunk_size, UINT32_MAX);
+    transfer_.entry_id = transfer_.transfer_id;
     downloading();
 }
 
-void Session::downloading() {
-    uint32_t index = UINT32_MAX;
+void Session::open_window(uint32_t window) {
+    transfer_.window = window;
+    transfer_.in_flight = 0;
+    transfer_.next_chunk = 0;
+    transfer_.acked_prefix = 0;
+    transfer_.prefetched = 0;
+    transfer_.prefetch_hits = 0;
+    transfer_.prefetch_misses = 0;
+    transfer_.prefetch_advised = 0;
+}
 
-    for(uint32_t i = 0; i < transfer_.chunk_state.size(); ++i) {
+void Session::negotiate_compression(const protocol::Request& req, protocol::Response& res, TransferType type) {
+    // A compressed body has to be read into memory first, so a DOWNLOAD that can go by sendfile(2) stays uncompressed
+    bool zero_copy = type == TransferType::DOWNLOAD && storage_->use_sendfile() && !io_ring_;
+    transfer_.compressed = storage_->use_compression() && !zero_copy && req.compression == protocol::CODEC_ZSTD;
+    res.compression = transfer_.compressed ? protocol::CODEC_ZSTD : "";
+}
+
+void Session::inflate(protocol::ChunkHeader& ch, protocol::ChunkBuffer& data) {
+    if((ch.flags & protocol::flags::COMPRESSED) == 0) return;
+    if(state_ != SessionState::UPLOADING || ch.index >= transfer_.chunks.size()) { // Nothing to take the raw size from
+        ch.flags &= static_cast<uint8_t>(~protocol::flags::COMPRESSED);
+        return;
+    }
+    if(!protocol::decompress_chunk(ch, data, transfer_.chunks[ch.index].size, *buffers_)) {
+        spdlog::warn("[{}] Chunk {} of transfer {} does not decompress.", username_, ch.index, transfer_.transfer_id);
+    }
+}
+
+void Session::acknowledge_chunks(uint32_t index, uint32_t cumulative) {
+    cumulative = std::min(cumulative, static_cast<uint32_t>(transfer_.chunk_state.size()));
+    for(uint32_t i = transfer_.acked_prefix; i < cumulative; ++i) { // Everything below cumulative is on the client's disk
         if(!transfer_.chunk_state[i]) {
-            index = i;
-            break;
+            transfer_.chunk_state[i] = true;
+            partmeta_->mark_chunk_received(transfer_.entry_id, i);
         }
     }
-    if(index == UINT32_MAX) { // Every chunk already acknowledged - nothing left to send
-        spdlog::warn("[{}] downloading() called with no pending chunks (transfer {})", username_, transfer_.transfer_id);
-        return;
+    if(!transfer_.chunk_state[index]) {
+        transfer_.chunk_state[index] = true;
+        partmeta_->mark_chunk_received(transfer_.entry_id, index);
     }
-    protocol::ChunkInfo chunk = transfer_.chunks[index];
-    uint8_t flag = protocol::flags::SEND;
-
-    if(chunk.index == (transfer_.chunks.size() - 1)) {
-        flag = protocol::flags::LAST;
+    transfer_.acked_prefix = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.acked_prefix);
+    if(transfer_.in_flight > 0) {
+        transfer_.in_flight--;
     }
+}
 
-    protocol::ChunkHeader chunk_header{
-        transfer_.transfer_id,
-        chunk.index,
-        chunk.size,
-        flag
-    };
+void Session::downloading() {
+    while(transfer_.in_flight < transfer_.window) {
+        uint32_t index = fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.next_chunk);
+        if(index >= transfer_.chunks.size()) { // Everything is sent or acknowledged, only acks are left
+            return;
+        }
+        transfer_.next_chunk = index + 1;
 
+        protocol::ChunkInfo chunk = transfer_.chunks[index];
+        uint8_t flag = protocol::flags::SEND;
 
-    uint32_t offset = fsutils::CHUNK_SIZE * chunk.index;
+        if(fsutils::next_pending_chunk(transfer_.chunk_state, transfer_.next_chunk) >= transfer_.chunks.size()) { // Nothing left to send after it, client verifies the file
+            flag = protocol::flags::LAST;
+        }
+
+        protocol::ChunkHeader chunk_header{
+            transfer_.transfer_id,
+            chunk.index,
+            chunk.size,
+            flag
+        };
 
-    std::vector<uint8_t> data = fsutils::read_chunk(transfer_.fmeta.absolute_path, offset, chunk.size);
-    if(data.empty()) {
+        uint64_t offset = chunk.offset;
 
-        return;
+        if(!open_transfer_file(transfer_.fmeta.absolute_path, fsutils::TransferFile::Mode::READ)) {
+            spdlog::error("[{}] Failed to open file of transfer {}: {}", username_, transfer_.transfer_id, transfer_.file->error().message());
+            download_abort(false, true, protocol::flags::ERROR);
+            return;
+        }
+        if(!io_ring_ && index < transfer_.prefetched) { // will_need() was called for it, whether the kernel read it in is not known
+            transfer_.prefetch_advised++;
+        }
+        if(io_ring_) { // Takes over from sendfile(2), which would block this thread on a cold disk read. send_reads() keeps the chunks in order
+            std::shared_ptr<PendingRead> read;
+            auto ahead = prefetch_.find(index);
+            if(ahead != prefetch_.end()) {
+                read = ahead->second;
+                prefetch_.erase(ahead);
+                transfer_.prefetch_hits++;
+            } else {
+                read = submit_read(chunk);
+                transfer_.prefetch_misses++;
+            }
+            read->header = chunk_header;
+            pending_reads_.push_back(read);
+        } else if(storage_->use_sendfile() && !transfer_.compressed) { // Body goes file -> socket in write_file_body(), never copied through here
+            queue_frame(protocol::make_file_chunk_frame(chunk_header, transfer_.file, offset));
+        } else {
+            protocol::ChunkBuffer data = buffers_->acquire(chunk.size);
+            if(!transfer_.file->read_at(offset, chunk.size, data.bytes())) {
+                spdlog::error("[{}] Failed to read chunk {} of transfer {}: {}", username_, chunk.index, transfer_.transfer_id, transfer_.file->error().message());
+                download_abort(false, true, protocol::flags::ERROR);
+                return;
+            }
+            if(transfer_.compressed) {
+                protocol::compress_chunk(chunk_header, data, *buffers_);
+            }
+            queue_frame(protocol::make_chunk_frame(chunk_header, std::move(data)));
+        }
+        transfer_.in_flight++;
+    }
+    prefetch();
+    if(io_ring_) { // Prefetched chunks may be read already
+        send_reads();
+    }
+}
+
+std::shared_ptr<PendingRead> Session::submit_read(const protocol::ChunkInfo& chunk) {
+    auto self = shared_from_this();
+    auto file = transfer_.file;
+    auto read = std::make_shared<PendingRead>();
+    read->data = buffers_->acquire(chunk.size);
+    uint64_t offset = chunk.offset;
+    io_ring_->read(file->native_handle(), offset, read->data.data(), chunk.size, strand_, [this, self, file, read](std::error_code ec) {
+        if(exiting_ || transfer_.file != file) return; // Transfer ended while the kernel was reading
+        read->done = true;
+        read->error = ec;
+        send_reads(); // No-op while the chunk only sits in prefetch_
+    });
+    return read;
+}
+
+void Session::prefetch() {
+    uint32_t depth = storage_->prefetch_depth();
+    uint32_t index = transfer_.next_chunk;
+    for(uint32_t ahead = 0; ahead < depth; ++ahead) {
+        index = fsutils::next_pending_chunk(transfer_.chunk_state, index);
+        if(index >= transfer_.chunks.size()) return;
+        if(index >= transfer_.prefetched) {
+            const protocol::ChunkInfo& chunk = transfer_.chunks[index];
+            if(io_ring_) {
+                prefetch_.emplace(index, submit_read(chunk));
+            } else { // sendfile(2) and pread() find the chunk in the page cache
+                transfer_.file->will_need(chunk.offset, chunk.size);
+            }
+            transfer_.prefetched = index + 1;
+        }
+        ++index;
+    }
+}
+
+void Session::send_reads() {
+    while(!pending_reads_.empty() && pending_reads_.front()->done) {
+        std::shared_ptr<PendingRead> read = pending_reads_.front();
+        pending_reads_.pop_front();
+        if(read->error) {
+            spdlog::error("[{}] Failed to read chunk {} of transfer {}: {}", username_, read->header.index, transfer_.transfer_id, read->error.message());
+            download_abort(false, true, protocol::flags::ERROR);
+            return;
+        }
+        if(transfer_.compressed) {
+            protocol::compress_chunk(read->header, read->data, *buffers_);
+        }
+        queue_frame(protocol::make_chunk_frame(read->header, std::move(read->data)));
     }
-    send_chunk(chunk_header, data);
 }
 
 void Session::download_done() {
-    partmeta_->delete_partial_metadata(transfer_.transfer_id);
+    if(storage_->prefetch_depth() > 0) {
+        if(io_ring_) {
+            spdlog::info("[{}] Download {} prefetch: {} hits, {} misses.", username_, transfer_.transfer_id, transfer_.prefetch_hits, transfer_.prefetch_misses);
+        } else {
+            spdlog::info("[{}] Download {} prefetch: {} chunks advised to the page cache.", username_, transfer_.transfer_id, transfer_.prefetch_advised);
+        }
+    }
+    partmeta_->delete_partial_metadata(transfer_.entry_id);
 
     transfer_.partial_path = std::filesystem::path("");
     transfer_.transfer_id = UINT32_MAX;
+    transfer_.entry_id = UINT32_MAX;
     transfer_.fmeta = fsutils::FileMetadata{};
     transfer_.chunk_state.clear();
     transfer_.chunks.clear();
+    close_transfer_file();
 
-    storage_->release_user_lock(username_);
+    storage_->release_user_lock(username_, this);
     if(resuming_) { handle_resumes(); } else { state_ = SessionState::READY; }
 }
 
 void Session::download_abort(bool save, bool notify, uint8_t flag) {
     if(save) {
         partmeta_->save();
+        close_transfer_file();
     } else {
-        partmeta_->delete_partial_metadata(transfer_.transfer_id);
+        partmeta_->delete_partial_metadata(transfer_.entry_id);
 
         transfer_.partial_path = std::filesystem::path("");
         transfer_.transfer_id = UINT32_MAX;
+        transfer_.entry_id = UINT32_MAX;
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        close_transfer_file();
     }
 
     if(notify) {
@@ -1991,22 +2955,28 @@ void Session::download_abort(bool save, bool notify, uint8_t flag) {
         std::vector<uint8_t> data;
 
         send_chunk(chunk_header, data);
+        if(transfer_.window > 1 && flag != protocol::flags::ABORTED) { // Client may still have acks on the way
+            draining_ = true;
+        }
     }
-    storage_->release_user_lock(username_);
+    storage_->release_user_lock(username_, this);
     if(resuming_) { handle_resumes(); } else { state_ = SessionState::READY; }
 }
 
 void Session::download_abort_exit(bool save, bool notify, uint8_t flag) {
     if(save) {
         partmeta_->save();
+        close_transfer_file();
     } else {
-        partmeta_->delete_partial_metadata(transfer_.transfer_id);
+        partmeta_->delete_partial_metadata(transfer_.entry_id);
 
         transfer_.partial_path = std::filesystem::path("");
         transfer_.transfer_id = UINT32_MAX;
+        transfer_.entry_id = UINT32_MAX;
         transfer_.fmeta = fsutils::FileMetadata{};
         transfer_.chunk_state.clear();
         transfer_.chunks.clear();
+        close_transfer_file();
     }
 
     if(notify) {
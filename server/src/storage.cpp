@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <map>
 #include <spdlog/spdlog.h>
 #include "filesystem/utils.hpp"
@@ -37,7 +38,13 @@ bool snapshot_files(const std::filesystem::path& files_dir,
 Storage::Storage(StorageConfig config)
     : root_(fsutils::absolute(config.root)),
       tiers_(std::move(config.tiers)),
-      default_tier_(std::move(config.default_tier)) {
+      default_tier_(std::move(config.default_tier)),
+      sendfile_(config.sendfile),
+      prefetch_(config.prefetch),
+      compression_(config.compression),
+      chunk_store_(config.chunk_store),
+      lock_wait_(config.lock_wait),
+      lock_queue_(config.lock_queue) {
     for(auto& tier : tiers_) {
         tier.path = fsutils::absolute(tier.path);
     }
@@ -64,6 +71,20 @@ void Storage::setup() {
             spdlog::info("Created private directory on tier '{}'.", tier.name);
         }
     }
+    // Each medium indexes only what is stored on it, public/ lives on the control root
+    std::vector<std::filesystem::path> media{root_};
+    for(const auto& tier : tiers_) {
+        media.push_back(tier.path);
+    }
+    for(const auto& medium : media) {
+        if(hash_indexes_.count(medium.string()) != 0) continue; // The implicit tier is the root itself
+        hash_indexes_.emplace(medium.string(), std::make_shared<HashIndex>());
+        if(chunk_store_) {
+            auto store = std::make_shared<ChunkStore>(medium / "chunks");
+            store->load();
+            chunk_stores_.emplace(medium.string(), store);
+        }
+    }
     db_ = std::make_shared<Database>(std::filesystem::path(root_ / "users.json"));
     spdlog::info("Root directory is set up ({}).", root_.string());
 }
@@ -100,33 +121,179 @@ std::filesystem::path Storage::get_root() {
     return root_;
 }
 
-bool Storage::try_acquire_user_lock(const std::string& user) {
+std::shared_ptr<ManifestCache> Storage::get_manifest_cache() {
+    return manifest_cache_;
+}
+
+bool Storage::use_sendfile() const {
+    return sendfile_;
+}
+
+uint32_t Storage::prefetch_depth() const {
+    return prefetch_;
+}
+
+bool Storage::use_compression() const {
+    return compression_;
+}
+
+std::shared_ptr<ChunkStore> Storage::get_chunk_store(const std::string& user) {
+    auto it = chunk_stores_.find(get_user_root(user).string());
+    return it == chunk_stores_.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<HashIndex> Storage::get_hash_index(const std::string& user) {
+    auto it = hash_indexes_.find(get_user_root(user).string());
+    return it == hash_indexes_.end() ? nullptr : it->second;
+}
+
+namespace {
+
+bool overlaps(const std::filesystem::path& a, const std::filesystem::path& b) { // One is the other or inside it
+    auto x = a.begin();
+    auto y = b.begin();
+    for(; x != a.end() && y != b.end(); ++x, ++y) {
+        if(*x != *y) return false;
+    }
+    return true;
+}
+
+bool conflict(const std::vector<PathLock>& a, const std::vector<PathLock>& b) {
+    for(const PathLock& x : a) {
+        for(const PathLock& y : b) {
+            if((x.exclusive || y.exclusive) && overlaps(x.path, y.path)) return true;
+        }
+    }
+    return false;
+}
+
+bool conflicts_with_holders(const UserLock& lock, const std::vector<PathLock>& paths) {
+    return std::any_of(lock.holders.begin(), lock.holders.end(), [&paths](const UserLockHolder& h) { return conflict(h.paths, paths); });
+}
+
+void normalize(std::vector<PathLock>& paths) { // "dir/" has an empty last element that would not match "dir/file"
+    for(PathLock& lock : paths) {
+        lock.path = lock.path.lexically_normal();
+        if(lock.path.has_parent_path() && lock.path.filename().empty()) lock.path = lock.path.parent_path();
+    }
+}
+
+bool holds(const UserLock& lock, const void* owner) {
+    return std::any_of(lock.holders.begin(), lock.holders.end(), [owner](const UserLockHolder& h) { return h.owner == owner; });
+}
+
+}
+
+bool Storage::try_acquire_user_lock(const std::string& user, const void* owner, std::vector<PathLock> paths) {
+    normalize(paths);
     std::lock_guard<std::mutex> lock(user_lock_guard_);
     auto it = user_lock_.find(user);
-    if(it != user_lock_.end()) {
-        if(it->second) {
+    if(it == user_lock_.end()) {
+        if(user != "public" && !db_->user_exists(user)) {
             return false;
         }
-        it->second = true;
-        return true;
+        it = user_lock_.emplace(user, UserLock{}).first;
     }
-    if(user == "public") {
-        user_lock_.emplace("public", true);
-        return true;
-    } else {
-        if(!db_->user_exists(user)) {
+    UserLock& user_lock = it->second;
+    if(holds(user_lock, owner) || conflicts_with_holders(user_lock, paths)) {
+        return false;
+    }
+    for(const UserLockWaiter& waiter : user_lock.waiting) { // Nobody jumps the queue
+        if(conflict(waiter.paths, paths)) return false;
+    }
+    user_lock.holders.push_back(UserLockHolder{owner, std::move(paths)});
+    lock_stats_.acquired++;
+    return true;
+}
+
+bool Storage::wait_for_user_lock(const std::string& user, const void* owner, std::vector<PathLock> paths, std::function<void()> granted) {
+    normalize(paths);
+    std::vector<std::function<void()>> handed;
+    {
+        std::lock_guard<std::mutex> lock(user_lock_guard_);
+        auto it = user_lock_.find(user);
+        if(it == user_lock_.end()) { // Unknown user, try_acquire_user_lock() never created it
+            return false;
+        }
+        UserLock& user_lock = it->second;
+        if(holds(user_lock, owner)) { // Would wait for itself
+            return false;
+        }
+        if(user_lock.waiting.size() >= lock_queue_) {
+            lock_stats_.refused++;
+            spdlog::warn("[{}] {} request(s) wait for the user lock already, refused another.", user, user_lock.waiting.size());
             return false;
         }
-        auto [inserted_it, inserted] = user_lock_.emplace(user, true);
-        return true;
+        user_lock.waiting.push_back(UserLockWaiter{owner, std::move(paths), std::move(granted), std::chrono::steady_clock::now()});
+        handed = hand_over(user_lock); // Released since the caller tried
+    }
+    for(auto& call : handed) call();
+    return true;
+}
+
+bool Storage::cancel_user_lock_wait(const std::string& user, const void* owner, bool timed_out) {
+    std::vector<std::function<void()>> handed;
+    {
+        std::lock_guard<std::mutex> lock(user_lock_guard_);
+        auto it = user_lock_.find(user);
+        if(it == user_lock_.end()) return false;
+        auto& waiting = it->second.waiting;
+        auto waiter = std::find_if(waiting.begin(), waiting.end(), [owner](const UserLockWaiter& w) { return w.owner == owner; });
+        if(waiter == waiting.end()) return false;
+        waiting.erase(waiter);
+        if(timed_out) lock_stats_.timed_out++;
+        handed = hand_over(it->second); // Later waiters may have queued only behind this one
+    }
+    for(auto& call : handed) call();
+    return true;
+}
+
+void Storage::release_user_lock(const std::string& user, const void* owner) {
+    std::vector<std::function<void()>> handed;
+    {
+        std::lock_guard<std::mutex> lock(user_lock_guard_);
+        auto it = user_lock_.find(user);
+        if(it == user_lock_.end()) return;
+        auto& holders = it->second.holders;
+        auto holder = std::find_if(holders.begin(), holders.end(), [owner](const UserLockHolder& h) { return h.owner == owner; });
+        if(holder == holders.end()) return;
+        holders.erase(holder);
+        handed = hand_over(it->second);
+    }
+    for(auto& call : handed) call();
+}
+
+std::vector<std::function<void()>> Storage::hand_over(UserLock& lock) {
+    std::vector<std::function<void()>> handed;
+    auto now = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < lock.waiting.size();) {
+        UserLockWaiter& waiter = lock.waiting[i];
+        bool blocked = conflicts_with_holders(lock, waiter.paths);
+        for(size_t k = 0; k < i && !blocked; ++k) { // Earlier waiters go first
+            blocked = conflict(lock.waiting[k].paths, waiter.paths);
+        }
+        if(blocked) {
+            ++i;
+            continue;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(now - waiter.since);
+        lock_stats_.waited++;
+        lock_stats_.total_wait += wait;
+        lock_stats_.max_wait = std::max(lock_stats_.max_wait, wait);
+        lock.holders.push_back(UserLockHolder{waiter.owner, std::move(waiter.paths)});
+        handed.push_back(std::move(waiter.granted));
+        lock.waiting.erase(lock.waiting.begin() + static_cast<std::ptrdiff_t>(i));
     }
+    return handed;
 }
 
-void Storage::release_user_lock(const std::string& user) {
+std::chrono::milliseconds Storage::user_lock_wait() const {
+    return lock_wait_;
+}
+
+UserLockStats Storage::user_lock_stats() {
     std::lock_guard<std::mutex> lock(user_lock_guard_);
-    auto it = user_lock_.find(user);
-    if(it == user_lock_.end()) return;
-    it->second = false;
+    return lock_stats_;
 }
 
 const std::vector<StorageTier>& Storage::get_tiers() const {
@@ -225,12 +392,15 @@ MigrationResult Storage::migrate_user(const std::string& user, const StorageTier
     }
 
     // Copy the whole user directory, files/ and .partial/ together, so the tree stays consistent
-    if(!fsutils::copy_path(src, dst, false)) {
+    fsutils::CopyStats stats;
+    if(!fsutils::copy_path(src, dst, false, stats)) {
         fsutils::rmdir(dst);
         return MigrationResult{false, "Failed to copy your data to tier '" + to.name +
             "'; nothing was removed.", 0, 0};
     }
 
+    spdlog::info("[{}] Copied to tier '{}': {}", user, to.name, stats.summary());
+
     // Verify before deleting anything - the source is still intact at this point
     std::map<std::string, std::string> after;
     uint64_t copied_bytes = 0;
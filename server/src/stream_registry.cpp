@@ -0,0 +1,27 @@
+#include "stream_registry.hpp"
+#include <array>
+#include <sodium.h>
+
+std::string StreamRegistry::issue(std::weak_ptr<Session> session) {
+    std::array<unsigned char, 16> bytes;
+    randombytes_buf(bytes.data(), bytes.size());
+    std::array<char, bytes.size() * 2 + 1> hex;
+    sodium_bin2hex(hex.data(), hex.size(), bytes.data(), bytes.size());
+    std::string token(hex.data());
+
+    std::lock_guard lock(mutex_);
+    tokens_[token] = std::move(session);
+    return token;
+}
+
+std::shared_ptr<Session> StreamRegistry::find(const std::string& token) {
+    std::lock_guard lock(mutex_);
+    auto it = tokens_.find(token);
+    if(it == tokens_.end()) return nullptr;
+    return it->second.lock();
+}
+
+void StreamRegistry::revoke(const std::string& token) {
+    std::lock_guard lock(mutex_);
+    tokens_.erase(token);
+}
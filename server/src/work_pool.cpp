@@ -0,0 +1,75 @@
+#include "work_pool.hpp"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+WorkPool::WorkPool(unsigned threads, size_t max_queued)
+    : max_queued_(std::max<size_t>(1, max_queued)) {
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads_.reserve(threads);
+    for(unsigned i = 0; i < threads; ++i) {
+        threads_.emplace_back([this]() { run(); });
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for(auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+bool WorkPool::submit(std::string name, Job job) {
+    {
+        std::lock_guard lock(mutex_);
+        if(stopping_ || queue_.size() >= max_queued_) {
+            stats_.rejected++;
+            spdlog::warn("Work pool full ({} queued, {} running), refused {}.", queue_.size(), stats_.running, name);
+            return false;
+        }
+        queue_.push_back(Queued{std::move(name), std::move(job), std::chrono::steady_clock::now()});
+        stats_.queued = queue_.size();
+    }
+    wake_.notify_one();
+    return true;
+}
+
+WorkPool::Stats WorkPool::stats() {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void WorkPool::run() {
+    while(true) {
+        Queued next;
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if(queue_.empty()) return; // Stopping and drained
+            next = std::move(queue_.front());
+            queue_.pop_front();
+            stats_.queued = queue_.size();
+            stats_.running++;
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(started - next.since);
+        if(wait >= SLOW_WAIT) {
+            spdlog::warn("{} waited {} ms for a work pool thread.", next.name, wait.count() / 1000);
+        }
+        next.job();
+        auto ran = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+        spdlog::debug("{} waited {} us, ran {} us in the work pool.", next.name, wait.count(), ran.count());
+
+        std::lock_guard lock(mutex_);
+        stats_.running--;
+        stats_.completed++;
+        stats_.total_wait += wait;
+        stats_.max_wait = std::max(stats_.max_wait, wait);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "filesystem/utils.hpp"
+#include "protocol/message.hpp"
+
+namespace fsutils {
+
+    // Content-defined chunking (FastCDC): a gear hash rolls over the bytes and a chunk ends where
+    // its top bits are zero, so boundaries follow the content instead of fixed offsets. Inserting
+    // a byte near the start of a file then changes the chunks around it, not every chunk after it.
+    // avg is a valid chunk size (power of two), cuts are harder to hit before avg than after it.
+    inline constexpr uint32_t cdc_min_size(uint32_t avg) { return avg / 4; }
+    inline constexpr uint32_t cdc_max_size(uint32_t avg) { return avg * 4; }
+
+    size_t cdc_cut(const uint8_t* data, size_t size, uint32_t avg); // Length of the chunk starting at data, size only if no cut is found before it, so pass at least cdc_max_size(avg) bytes unless at end of file
+    std::vector<protocol::ChunkInfo> compute_cdc_chunks(const FileMetadata& fmeta, uint32_t avg); // compute_chunks() with content-defined boundaries, same error value
+    bool valid_cdc_plan(const std::vector<protocol::ChunkInfo>& chunks, uint64_t file_size, uint32_t avg); // Indexes in order, sizes within [cdc_min_size, cdc_max_size] but the last, adding up to file_size
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace fsutils {
+    namespace fs = std::filesystem;
+
+    // How the data of one file was copied, fastest first. Each file tries them in this order:
+    // REFLINK shares the extents (FICLONE, btrfs/XFS/bcachefs, same filesystem) and copies nothing,
+    // COPY_FILE_RANGE copies inside the kernel (server side copy on NFS, no user space buffers),
+    // BUFFERED is read(2)/write(2) through a 1 MiB buffer, which works everywhere.
+    enum class CopyStrategy {
+        REFLINK,
+        COPY_FILE_RANGE,
+        BUFFERED
+    };
+
+    const char* to_string(CopyStrategy strategy);
+
+    // What a copy did, per strategy, for the caller's log line
+    struct CopyStats {
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        uint64_t reflinked = 0; // Files per strategy
+        uint64_t ranged = 0;
+        uint64_t buffered = 0;
+
+        void count(CopyStrategy strategy, uint64_t size);
+        std::string summary() const; // "12 files, 3.0 GiB: 12 reflinked, 0 copy_file_range, 0 buffered"
+    };
+
+    inline constexpr unsigned MAX_COPY_THREADS = 8; // Files of a tree copied at once
+
+    // Copy one regular file with the first strategy that works, starting at first (benchmarks force one).
+    // dest must not exist unless overwrite, a failed copy leaves no dest behind. Permissions are kept.
+    bool copy_file_data(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats, CopyStrategy first = CopyStrategy::REFLINK);
+
+    // Only the REFLINK step: dest shares src's extents or is not created. false where the filesystem cannot.
+    bool reflink_file(const fs::path& src, const fs::path& dest);
+
+    // Copy a directory tree: directories first, then the files on up to MAX_COPY_THREADS threads,
+    // each through copy_file_data(). dest must not exist, a failed copy removes what it created.
+    bool copy_tree(const fs::path& src, const fs::path& dest, CopyStats& stats, CopyStrategy first = CopyStrategy::REFLINK);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "filesystem/utils.hpp"
+#include "filesystem/transfer_file.hpp"
+#include "protocol/message.hpp"
+
+namespace fsutils {
+
+    // rsync-style delta upload: the server describes the file it has in blocks (weak rolling
+    // checksum + BLAKE2b), the client finds those blocks anywhere in its new version and sends
+    // only what is left over. Copies name a range of the old file, literals are ordinary chunks
+    // with explicit offsets that travel over the binary channel like any upload.
+    inline constexpr uint32_t MIN_BLOCK_SIZE = 2 * 1024;
+    inline constexpr uint32_t MAX_BLOCK_SIZE = 64 * 1024;
+
+    // Adler-32 style checksum of a block that slides by one byte in constant time
+    class RollingChecksum {
+    public:
+        void reset(const uint8_t* data, size_t size); // Checksum of data[0, size)
+        void roll(uint8_t out, uint8_t in); // Window moves one byte, out leaves, in enters
+        uint32_t value() const { return (b_ << 16) | a_; }
+
+    private:
+        uint32_t a_ = 0; // Sum of the bytes, low 16 bits
+        uint32_t b_ = 0; // Sum of the running sums, low 16 bits
+        uint32_t size_ = 0;
+    };
+
+    // What the client sends and the server applies
+    struct Delta {
+        std::vector<protocol::DeltaCopy> copies; // Ranges taken from the old file
+        std::vector<protocol::ChunkInfo> literals; // New bytes, chunk_size at most, hashed, explicit offsets
+        uint64_t literal_bytes = 0;
+    };
+
+    uint32_t signature_block_size(uint64_t file_size); // About sqrt(file_size), a power of two within [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE]
+    std::vector<protocol::BlockSignature> compute_signatures(const fs::path& path, uint32_t block_size); // Empty on error or for an empty file
+    bool compute_delta(const FileMetadata& fmeta, const std::vector<protocol::BlockSignature>& signatures, uint32_t block_size, uint32_t chunk_size, Delta& out); // fmeta.absolute_path against the old file's signatures, false on read error
+    bool valid_delta_plan(const std::vector<protocol::ChunkInfo>& chunks, const std::vector<protocol::DeltaCopy>& copies, uint64_t file_size, uint64_t base_size, uint32_t chunk_size); // Copies inside the old file, chunks in order and at most chunk_size, together covering [0, file_size) exactly once
+    bool apply_copies(const fs::path& base, TransferFile& dest, const std::vector<protocol::DeltaCopy>& copies); // Copy each range of base into dest at its new offset
+}
@@ -30,12 +30,16 @@ constexpr auto TRANSFER_TIMEOUT = std::chrono::hours(1); // Transfer is deleted
 struct PartialMetadataEntry {
     uint32_t id; // Id of transfer
     std::filesystem::path absolute_path; // Absolute destination path
-    uint32_t size; // Final size
+    uint64_t size; // Final size
     std::array<uint8_t, crypto_generichash_BYTES> file_hash; //Final file hash
+    std::array<uint8_t, crypto_generichash_BYTES> tree_hash; // fsutils::tree_hash() of chunks, HASH_ERROR when the file is checked against file_hash (older entries and peers)
     TransferType type; // Download/ Upload
-    std::vector<protocol::ChunkInfo> chunks; // Chunks, their indexes, sizes, hashes
+    std::vector<protocol::ChunkInfo> chunks; // Chunks, their indexes, offsets, sizes, hashes
+    uint32_t chunk_size; // Size the chunks were cut with, the average size for content-defined chunks
     std::vector<bool> chunk_state; // bitmap of transferred chunks
     std::chrono::system_clock::time_point last_activity; // last update of data
+    std::filesystem::path partial_path; // Where the data is written, empty for the default (user/.partial/id.part)
+    uint32_t peer_id; // Id the other side knows the transfer by, differs from id where it picked its own (server's uploads)
 };
 
 // File-based JSON database of partial file metadata for resuming unfinished transfers
@@ -43,11 +47,16 @@ class PartialMetadata {
 public:
     PartialMetadata(std::filesystem::path metadata_file);
 
-    std::filesystem::path get_partial_path(uint32_t id); // Returns partial path for entry (user/.partial/id.part)
+    std::filesystem::path get_partial_path(uint32_t id); // Returns partial path for entry (user/.partial/id.part unless the entry names its own)
     bool is_expired(uint32_t id);
 
-    // Add new partial metadata, lazy initialization, returns ID of entry
-    uint32_t add_partial_metadata(TransferType type, fsutils::FileMetadata fmeta, std::vector<protocol::ChunkInfo> chunks, uint32_t id);
+    // Hidden file in the destination's directory, so finishing the transfer is a rename on the same filesystem
+    static std::filesystem::path partial_path_beside(const std::filesystem::path& destination, uint32_t id); // dir/.minidrive-<id>.part
+    static bool is_partial_beside(const std::filesystem::path& path); // Name made by partial_path_beside()
+
+    // Add new partial metadata, lazy initialization, returns ID of entry. id UINT32_MAX picks a free one, partial_path empty
+    // keeps the data in the default place, peer_id UINT32_MAX is the same as the entry's id
+    uint32_t add_partial_metadata(TransferType type, fsutils::FileMetadata fmeta, std::vector<protocol::ChunkInfo> chunks, uint32_t chunk_size, uint32_t id, std::filesystem::path partial_path = {}, uint32_t peer_id = UINT32_MAX);
     void delete_partial_metadata(uint32_t id); // Delete entry
     void mark_chunk_received(uint32_t id, uint32_t chunk_index); // Mark chunk at index was sucesfully transfered
     void save(); // save entries_ to file, triggered manually, mostly during exit
@@ -63,5 +72,5 @@ private:// Check if scan_file returned error value
 
     void cleanup_expired(); // Deletes expired entries
     void load();// load from file to entries_, triggered by constructor
-    uint32_t generate_id(); // generate ID reusing free IDs or incrementing next_id_
+    uint32_t generate_id(); // generate ID reusing free IDs or incrementing next_id_, never one in entries_
 };
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+#include "filesystem/utils.hpp"
+#include "protocol/message.hpp"
+
+namespace fsutils {
+    namespace fs = std::filesystem;
+
+    inline constexpr size_t SCAN_BUFFER_SIZE = 8 * 1024 * 1024; // Bytes read at once, a multiple of every fixed chunk size
+    inline constexpr size_t MAX_SCAN_BUFFER_SIZE = 32 * 1024 * 1024; // Grown up to this so every hashing thread gets a chunk of large ones
+    inline constexpr unsigned MAX_HASH_THREADS = 8; // Threads hashing the chunks of one scan, the caller included
+
+    // scan_file() and compute_chunks() (compute_cdc_chunks() when content_defined) in one sequential
+    // read: each buffer feeds the whole-file hash and is cut into chunks hashed right there, so the
+    // file is read once instead of once for its hash and once more chunk by chunk.
+    // The chunks of a buffer are hashed on up to threads threads (0: one per core, at most
+    // MAX_HASH_THREADS) while the caller adds the buffer to the whole-file hash, which can only go
+    // in order. Cuts are made before any hashing and each hash has its slot, so the plan is the
+    // same for any number of threads.
+    // chunk_size is the fixed size, or the average for content-defined chunks. fmeta gets path,
+    // size, mtime and hash, chunks the plan with offsets (empty for an empty file).
+    // false when the file cannot be read or changed size while it was read.
+    bool scan_file_chunks(const fs::path& path, uint32_t chunk_size, bool content_defined, FileMetadata& fmeta, std::vector<protocol::ChunkInfo>& chunks, unsigned threads = 0);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <filesystem>
+#include <system_error>
+#include <cstdint>
+#include <vector>
+
+namespace fsutils {
+    namespace fs = std::filesystem;
+
+    // File of one transfer, opened once and read/written at chunk offsets with pread/pwrite.
+    // Replaces an open, seek and close per chunk (write_chunk/read_chunk), owned by ActiveTransfer.
+    class TransferFile {
+    public:
+        enum class Mode {
+            READ, // Source of the chunks we send
+            WRITE // Partial file we receive into, created if missing, never truncated
+        };
+
+        TransferFile() = default;
+        ~TransferFile();
+
+        TransferFile(const TransferFile&) = delete;
+        TransferFile& operator=(const TransferFile&) = delete;
+        TransferFile(TransferFile&& other) noexcept;
+        TransferFile& operator=(TransferFile&& other) noexcept;
+
+        bool open(const fs::path& path, Mode mode); // No-op if already open on the same path and mode, reopens otherwise
+        void close();
+        bool is_open() const;
+        const fs::path& path() const;
+        int native_handle() const; // Descriptor for sendfile(2), -1 when closed
+
+        bool write_at(uint64_t offset, const std::vector<uint8_t>& data); // Whole buffer or false
+        bool read_at(uint64_t offset, uint32_t size, std::vector<uint8_t>& out); // Exactly size bytes or false, out resized
+        bool preallocate(uint64_t size); // fallocate(2) the final size, false on ENOSPC and the like, true where the filesystem cannot
+        void will_need(uint64_t offset, uint64_t length); // posix_fadvise(WILLNEED), the kernel reads the range into the page cache in the background
+
+        const std::error_code& error() const; // Reason of the last failed call
+
+    private:
+        int fd_ = -1; // Descriptor, -1 when closed
+        Mode mode_ = Mode::READ; // Mode fd_ was opened with
+        fs::path path_; // Path fd_ was opened on
+        std::error_code error_; // Set by the last failed call
+    };
+}
@@ -5,25 +5,27 @@
 #include <vector>
 #include <sodium.h>
 #include "protocol/message.hpp"
+#include "filesystem/copy_engine.hpp"
 
 namespace fsutils {
     namespace fs = std::filesystem;
 
-    // Default size of chunk
+    // Default size of chunk, transfers may negotiate another one (protocol::choose_chunk_size)
     inline constexpr uint32_t CHUNK_SIZE = 256 * 1024; // 256 KB
 
     inline constexpr std::array<uint8_t, crypto_generichash_BYTES> HASH_ERROR = {}; // For error in hashing functions 
 
-    inline constexpr uint64_t SIZE_ERROR = UINT64_MAX; // For size > 4GB error
+    inline constexpr uint64_t SIZE_ERROR = UINT64_MAX; // For size errors
     
     inline constexpr uint64_t TIME_ERRROR = UINT64_MAX; // For last time error
 
     // Describes files
     struct FileMetadata {
         fs::path absolute_path; // Absolute path of file
-        uint32_t size; // size fo file
+        uint64_t size; // size fo file
         uint64_t last_modified; // last modified for SYNC
         std::array<uint8_t, crypto_generichash_BYTES> hash; // file hash - generic hash
+        std::array<uint8_t, crypto_generichash_BYTES> tree_hash{}; // tree_hash() of the chunk plan a transfer checks against, HASH_ERROR if only hash is known
 
         bool operator==(const FileMetadata& other) const; // for SYNC
         bool operator!=(const FileMetadata& other) const; // for SYNC
@@ -49,23 +51,35 @@ namespace fsutils {
     // File operations
     bool create_empty_file(const fs::path& path);
     bool remove_file(const fs::path& path);
+    bool sync_path(const fs::path& path); // fsync of a file or directory, for a rename that must survive a crash
 
     // Copy and move
     bool copy_path(const fs::path& src, const fs::path& dest, bool overwrite = false); // Create parent directories too
+    bool copy_path(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats); // Same, stats say how the data was copied (copy_engine.hpp)
     bool move_path(const fs::path& src, const fs::path& dest, bool overwrite = false); // Create parent directories too
+    bool move_path(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats); // Same, stats count what a cross-device move had to copy
+    bool link_path(const fs::path& src, const fs::path& dest); // copy_path() with hard links instead of copied data, false across filesystems and leaves nothing behind
 
     // Read/write of file with chunks
-    bool write_chunk(const fs::path& path, uint32_t offset, const std::vector<uint8_t>& data);
-    std::vector<uint8_t> read_chunk(const fs::path& path, uint32_t offset, uint32_t size);
+    bool write_chunk(const fs::path& path, uint64_t offset, const std::vector<uint8_t>& data);
+    std::vector<uint8_t> read_chunk(const fs::path& path, uint64_t offset, uint32_t size);
 
     // File info
-    uint64_t get_file_size(const fs::path& path); // returns SIZE_ERROR if over 4GB
+    uint64_t get_file_size(const fs::path& path); // returns SIZE_ERROR if the size is unknown
     uint64_t get_last_write_time(const fs::path& path); // in seconds from epoch
+    uint64_t available_space(const fs::path& path); // Bytes an unprivileged user may still write on path's filesystem, SIZE_ERROR if unknown
 
     // Hash files and chunks using libsodium generic hash
     bool is_hash_error(const std::array<uint8_t, crypto_generichash_BYTES>& h); // Chek if hash == HASH_ERROR
     std::array<uint8_t, crypto_generichash_BYTES> hash_file(const fs::path& path); // return HASH_ERROR if error
     std::array<uint8_t, crypto_generichash_BYTES> hash_chunk(const std::vector<uint8_t>& data); // return HASH_ERROR if error
+    std::array<uint8_t, crypto_generichash_BYTES> hash_chunk(const uint8_t* data, size_t size); // Same, for a chunk inside a larger buffer
+
+    // Tree hash of a file: chunk hashes are the leaves, each node hashes its two children, an odd
+    // node moves up unchanged. A file of one chunk hashes to its chunk hash, i.e. hash_file().
+    // Every chunk is verified on arrival, so a finished transfer only has to combine the plan.
+    std::array<uint8_t, crypto_generichash_BYTES> tree_hash(const std::vector<protocol::ChunkInfo>& chunks); // return HASH_ERROR if empty or a chunk hash is malformed
+    bool complete_tree(const std::vector<protocol::ChunkInfo>& chunks, const std::vector<bool>& chunk_state, const std::array<uint8_t, crypto_generichash_BYTES>& root); // Every chunk arrived and chunks hash to root
 
     // Conversion to string in hex notation
     std::string hash_to_hex(const std::array<uint8_t, crypto_generichash_BYTES>& hash);
@@ -79,6 +93,9 @@ namespace fsutils {
 
     // Chunk helper functions
     bool is_compute_chunks_error(const std::vector<protocol::ChunkInfo>& chunks); // Check if compute_chunks returned error value
-    uint32_t chunk_count(const uint32_t& file_size); // Number of chunks needed for file
-    std::vector<protocol::ChunkInfo> compute_chunks(const FileMetadata& fmeta); // Put all neded chunks, their sizes, hashes, indexes into vector 
+    uint32_t chunk_count(uint64_t file_size, uint32_t chunk_size = CHUNK_SIZE); // Number of chunks needed for file
+    std::vector<protocol::ChunkInfo> compute_chunks(const FileMetadata& fmeta, uint32_t chunk_size = CHUNK_SIZE); // Put all neded chunks, their sizes, hashes, indexes into vector
+    bool valid_chunk_plan(const std::vector<protocol::ChunkInfo>& chunks, uint64_t file_size, uint32_t chunk_size); // Indexes in order, every chunk chunk_size but the last
+    void assign_offsets(std::vector<protocol::ChunkInfo>& chunks); // Each offset is the sum of the sizes before it, works for fixed and content-defined plans
+    uint32_t next_pending_chunk(const std::vector<bool>& chunk_state, uint32_t from); // First index >= from not marked yet, chunk_state.size() if none
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace protocol {
+
+class BufferPool;
+
+// Byte buffer of one chunk body, from the socket read through hashing to the file write or the
+// socket write, moved along instead of copied. Goes back to its pool when the handle dies.
+// Built from a plain vector it is unpooled (JSON bodies, acks) and simply freed.
+class ChunkBuffer {
+public:
+    ChunkBuffer() = default;
+    ChunkBuffer(std::vector<uint8_t> bytes); // Unpooled, implicit so vectors still build frames
+    ~ChunkBuffer();
+
+    ChunkBuffer(const ChunkBuffer&) = delete;
+    ChunkBuffer& operator=(const ChunkBuffer&) = delete;
+    ChunkBuffer(ChunkBuffer&& other) noexcept = default; // Moving a vector keeps its data() in place
+    ChunkBuffer& operator=(ChunkBuffer&& other) noexcept;
+
+    std::vector<uint8_t>& bytes() { return bytes_; }
+    const std::vector<uint8_t>& bytes() const { return bytes_; }
+    uint8_t* data() { return bytes_.data(); }
+    size_t size() const { return bytes_.size(); }
+
+private:
+    friend class BufferPool;
+    ChunkBuffer(std::vector<uint8_t> bytes, std::shared_ptr<BufferPool> pool);
+
+    std::vector<uint8_t> bytes_;
+    std::shared_ptr<BufferPool> pool_; // Where bytes_ returns, nullptr when unpooled
+};
+
+// Chunk buffers of one connection kept for reuse, so a transfer allocates only until the window
+// is full. Buffers keep their capacity and size, a chunk of the same size needs no resize either.
+// The owner trims the pool when a transfer ends, so an idle connection holds no chunk memory.
+// Released buffers may come from another thread (io_uring completions, shutdown), hence mutex_.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+    static constexpr size_t MAX_IDLE_BYTES = 16 * 1024 * 1024; // Idle capacity kept, a full window of default sized chunks
+
+    ChunkBuffer acquire(uint32_t size); // size bytes, contents left over from the last user
+    void trim(); // Frees the idle buffers, ones still in use return later as usual
+
+private:
+    friend class ChunkBuffer;
+    void release(std::vector<uint8_t> bytes);
+
+    std::vector<std::vector<uint8_t>> idle_; // Most recently released last
+    size_t idle_bytes_ = 0; // Capacity of idle_
+    std::mutex mutex_;
+};
+
+}
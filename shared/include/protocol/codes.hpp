@@ -14,5 +14,6 @@ inline constexpr const int PRECONDITION_FAILED = 412;
 
 inline constexpr const int INTERNAL_SERVER_ERROR = 500;
 inline constexpr const int SERVICE_UNAVAILABLE = 503;
+inline constexpr const int INSUFFICIENT_STORAGE = 507;
 
 }
\ No newline at end of file
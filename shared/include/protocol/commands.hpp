@@ -18,5 +18,8 @@ inline constexpr const char* NEED_INPUT = "NEED_INPUT";
 inline constexpr const char* AUTH = "AUTH";
 inline constexpr const char* TIERS = "TIERS"; // List storage media configured on the server
 inline constexpr const char* SET_TIER = "SET_TIER"; // Move the calling user to another medium
+inline constexpr const char* ATTACH = "ATTACH"; // Join an upload of another session as an extra data connection
+inline constexpr const char* SIGNATURES = "SIGNATURES"; // Block signatures of a stored file, the base of a DELTA
+inline constexpr const char* DELTA = "DELTA"; // Replace a stored file, sending only what SIGNATURES did not cover
 
 }
\ No newline at end of file
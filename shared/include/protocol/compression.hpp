@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "protocol/message.hpp"
+#include "protocol/buffer_pool.hpp"
+
+namespace protocol {
+
+// Chunk body compression, negotiated per transfer: the client names the codec it speaks in
+// UPLOAD/DOWNLOAD and the resume answer, the server grants it in its response. The sender then
+// compresses each chunk that is worth it and sets flags::COMPRESSED, ChunkHeader::size becomes
+// the compressed size. The raw size is in the chunk plan, hashes stay over the raw bytes.
+inline constexpr const char* CODEC_ZSTD = "zstd";
+inline constexpr int COMPRESSION_LEVEL = 1; // Fastest zstd level, the link is the bottleneck we fight, not the ratio
+inline constexpr double MAX_ENTROPY = 7.5; // Bits per byte of the sample above which a chunk is sent as is
+
+bool worth_compressing(const uint8_t* data, size_t size); // Byte entropy of a sample: media, archives and encrypted data are skipped
+void compress_chunk(ChunkHeader& ch, ChunkBuffer& data, BufferPool& pool); // Replaces data and sets the flag when it shrinks, leaves both alone otherwise
+bool decompress_chunk(ChunkHeader& ch, ChunkBuffer& data, uint32_t raw_size, BufferPool& pool); // Clears the flag, false unless data decodes to exactly raw_size bytes
+
+}
@@ -10,4 +10,7 @@ namespace protocol::flags {
     inline constexpr const uint8_t SEND = 4;
     inline constexpr const uint8_t DONE = 5;
     inline constexpr const uint8_t EXIT = 6;
+    inline constexpr const uint8_t ABORTED = 7; // Answers the peer's ERROR/CHUNK_MISMATCH in a windowed transfer, last chunk frame of it
+
+    inline constexpr const uint8_t COMPRESSED = 0x80; // Bit on top of SEND/LAST: body is compressed with the transfer's codec (protocol/compression.hpp)
 }
\ No newline at end of file
@@ -3,7 +3,11 @@
 #include <nlohmann/json.hpp>
 #include <string>
 #include <cstdint>
+#include <memory>
+#include <array>
 #include <sodium.h>
+#include "filesystem/transfer_file.hpp"
+#include "protocol/buffer_pool.hpp"
 
 namespace protocol {
 
@@ -14,12 +18,13 @@ struct ChunkInfo {
     uint32_t index; // chunk index
     u_int32_t size; // size of chunk
     std::string chunk_hash; //hash_to_hex value
+    uint64_t offset = 0; // Start of the chunk in the file, fsutils::assign_offsets() derives it from the sizes before it (DELTA plans excepted)
 };
 
 // One entry of a recursive directory listing (SYNC / directory transfers)
 struct FileEntry {
     std::string relative_path; // Path relative to the listed directory, '/' separated
-    uint32_t size; // Size of file, 0 for directories
+    uint64_t size; // Size of file, 0 for directories
     std::string file_hash; // hash_to_hex value, empty for directories
     uint64_t last_modified; // Seconds since epoch
     bool is_directory;
@@ -33,14 +38,37 @@ struct TierInfo {
     bool is_current; // True for the tier the calling user is on
 };
 
+// One block of a stored file a delta upload may reuse (SIGNATURES responses)
+struct BlockSignature {
+    uint32_t index; // Block index, the block starts at index * block size
+    uint32_t size; // Block size, only the last block is shorter
+    uint32_t weak; // fsutils::RollingChecksum of the block
+    std::string strong; // hash_to_hex value
+};
+
+// Range of the stored file a DELTA upload keeps
+struct DeltaCopy {
+    uint64_t offset; // Where the range goes in the new file
+    uint64_t source; // Where it is in the stored file
+    uint64_t size;
+};
+
 // Client request JSON protocol
 struct Request {
     std::string cmd; // command
     std::string first_argument;
     std::string second_argument;
-    uint32_t size;
+    uint64_t size;
     std::string file_hash;
     std::vector<ChunkInfo> chunks;
+    uint32_t window = 0; // Chunks the client accepts unacknowledged (UPLOAD/DOWNLOAD/resume answer), 0 from old clients
+    uint32_t streams = 0; // Extra data connections the client wants for an UPLOAD, 0 keeps it on this connection
+    uint32_t chunk_size = 0; // UPLOAD: size chunks were cut with. DOWNLOAD: preferred size. 0 from old clients
+    std::string tree_hash; // UPLOAD: fsutils::tree_hash() of chunks, empty from old clients
+    std::string compression; // Codec the client can compress and decompress chunk bodies with (UPLOAD/DOWNLOAD/resume answer), empty from old clients
+    std::string chunking; // UPLOAD: CHUNKING_CDC when chunks were cut by content, empty for the fixed layout
+    std::vector<DeltaCopy> copies; // DELTA: ranges of the stored file the new one reuses, chunks carry the rest
+    bool instant = false; // UPLOAD: client takes a DONE answer when the server already holds the content, false from old clients
 };
 
 // Server rsponse JSON protocol
@@ -52,6 +80,14 @@ struct Response {
     std::vector<ChunkInfo> chunks;
     std::vector<FileEntry> files; // Recursive listing, only used by SYNC responses
     std::vector<TierInfo> tiers; // Configured storage media, only used by TIERS responses
+    uint32_t window = 0; // Negotiated transfer window, only used by UPLOAD/DOWNLOAD/RESUME responses
+    uint32_t streams = 0; // Extra data connections granted for an UPLOAD, 0 when not striped
+    std::string stream_token; // Secret the extra connections present in ATTACH, only set when streams > 0
+    uint32_t chunk_size = 0; // Size chunks of the transfer are cut with, only used by UPLOAD/DOWNLOAD/RESUME responses
+    std::string tree_hash; // fsutils::tree_hash() of chunks, only used by DOWNLOAD responses, empty from old servers
+    std::string compression; // Codec granted for chunk bodies of the transfer this response starts, empty sends them raw
+    std::vector<BlockSignature> signatures; // Blocks of the stored file, only used by SIGNATURES responses (block size in chunk_size)
+    std::vector<uint32_t> have; // Indexes of chunks the server already stores and put in place, only used by UPLOAD responses, the client skips them
 };
 
 // Binary protocol for file transfers
@@ -64,6 +100,58 @@ struct ChunkHeader {
 };
 #pragma pack(pop)
 
+// Sliding window for chunk transfers: how many chunks a sender may have on the wire before the
+// oldest one is acknowledged. The client asks for DEFAULT_WINDOW, the server answers with
+// negotiate_window(). A peer that never sends "window" gets 1 - the original stop-and-wait.
+inline constexpr uint32_t DEFAULT_WINDOW = 16; // 4 MB in flight with 256 KB chunks
+inline constexpr uint32_t MAX_WINDOW = 64;
+uint32_t negotiate_window(uint32_t requested);
+
+// Chunk size of a transfer: whoever hashes the file cuts it, the client for UPLOAD and the server
+// for DOWNLOAD (taking the client's "chunk_size" as a hint), with choose_chunk_size(). Offsets
+// are index * chunk_size. A peer that never sends "chunk_size" gets fsutils::CHUNK_SIZE.
+// An UPLOAD with "chunking": CHUNKING_CDC was cut by content instead (fsutils::compute_cdc_chunks),
+// chunk_size is then the average size and chunks carry their own offsets.
+inline constexpr uint32_t MIN_CHUNK_SIZE = 64 * 1024;
+inline constexpr uint32_t MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+inline constexpr uint32_t TARGET_CHUNKS = 4096; // Larger files get larger chunks, so their plan stays this short
+uint32_t preferred_chunk_size(uint64_t throughput); // About 50 ms of the link, throughput in bytes/s, 0 when unknown
+uint32_t choose_chunk_size(uint64_t file_size, uint32_t preferred); // preferred, grown until the file fits in TARGET_CHUNKS
+bool valid_chunk_size(uint32_t chunk_size); // Power of two within [MIN_CHUNK_SIZE, MAX_CHUNK_SIZE]
+inline constexpr const char* CHUNKING_CDC = "cdc";
+
+// File sizes and offsets are 64 bit, chunk indexes stay 32 bit. Any valid chunk size keeps the
+// indexes of a file up to MAX_FILE_SIZE (256 TiB) in range.
+inline constexpr uint64_t MAX_FILE_SIZE = static_cast<uint64_t>(UINT32_MAX) * MIN_CHUNK_SIZE;
+
+// Striped uploads: the client may open up to MAX_STREAMS extra connections next to the session's
+// own one. Each sends ATTACH <stream_token> instead of LOGIN and then only carries SEND chunks,
+// acknowledged on the same connection. LAST always travels on the session's connection.
+inline constexpr uint32_t MAX_STREAMS = 8;
+
+// OK/DONE acks carry a 4 byte body with the cumulative ack: every chunk below it is written.
+// The index in the header stays the selective ack of the chunk that was just written.
+std::vector<uint8_t> encode_ack(uint32_t cumulative);
+uint32_t decode_ack(const std::vector<uint8_t>& data); // 0 when the body is missing (stop-and-wait peer)
+
+// One frame waiting in a connection's write queue: length prefix or ChunkHeader, already in
+// network byte order, followed by the body. Only the front frame of a queue is being written.
+// A frame with file set has no body bytes in memory: the writer sends file_size bytes of the file
+// from file_offset straight to the socket with sendfile(2). The frame keeps the file open.
+struct OutboundFrame {
+    std::array<uint8_t, sizeof(ChunkHeader)> header; // Length prefix or ChunkHeader, no allocation per frame
+    size_t header_size = 0; // Bytes of header in use
+    ChunkBuffer body; // Pooled for chunk bodies, returns to its pool once the frame is written
+    bool exit_after = false; // Writer closes the connection once this frame is out
+    std::shared_ptr<fsutils::TransferFile> file; // Body source for sendfile(2), nullptr for in-memory bodies
+    uint64_t file_offset = 0; // Next byte of file to send
+    uint32_t file_size = 0; // Bytes of file still to send
+};
+
+OutboundFrame make_json_frame(const std::string& body); // Caller checks the body fits in uint32_t
+OutboundFrame make_chunk_frame(const ChunkHeader& ch, ChunkBuffer data); // ch in host byte order
+OutboundFrame make_file_chunk_frame(const ChunkHeader& ch, std::shared_ptr<fsutils::TransferFile> file, uint64_t offset); // Body is ch.size bytes of file at offset
+
 // Parsing
 void to_json(json& json, const ChunkInfo& ci);
 void from_json(const json& json, ChunkInfo& ci);
@@ -71,6 +159,10 @@ void to_json(json& json, const FileEntry& fe);
 void from_json(const json& json, FileEntry& fe);
 void to_json(json& json, const TierInfo& ti);
 void from_json(const json& json, TierInfo& ti);
+void to_json(json& json, const BlockSignature& bs);
+void from_json(const json& json, BlockSignature& bs);
+void to_json(json& json, const DeltaCopy& dc);
+void from_json(const json& json, DeltaCopy& dc);
 void to_json(json& json, const Request& req);
 void to_json(json& json, const Response& res);
 void from_json(const json& json, Request& req);
@@ -10,5 +10,6 @@ inline constexpr const char* CONFLICT = "CONFLICT";
 inline constexpr const char* BUSY = "BUSY";
 inline constexpr const char* EXIT = "EXIT";
 inline constexpr const char* RESUME = "RESUME";
+inline constexpr const char* DONE = "DONE"; // UPLOAD finished from content already stored, no chunks follow
 
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "filesystem/chunker.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <fstream>
+
+namespace fsutils {
+
+namespace {
+
+// Random value per byte, fixed by a seed: both sides of a transfer have to cut the same content the same way
+constexpr std::array<uint64_t, 256> make_gear() {
+    std::array<uint64_t, 256> gear{};
+    uint64_t state = 0x6d696e6964726976; // splitmix64
+    for(uint64_t& g : gear) {
+        state += 0x9e3779b97f4a7c15;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        g = z ^ (z >> 31);
+    }
+    return gear;
+}
+
+constexpr std::array<uint64_t, 256> GEAR = make_gear();
+
+// Top bits of the hash, they depend on the last 64 bytes while the low ones only see the last few
+constexpr uint64_t top_bits(int bits) {
+    return ~uint64_t{0} << (64 - bits);
+}
+
+}
+
+size_t cdc_cut(const uint8_t* data, size_t size, uint32_t avg) {
+    size_t min = cdc_min_size(avg);
+    if(size <= min) return size;
+
+    size_t end = std::min<size_t>(size, cdc_max_size(avg));
+    size_t normal = std::min<size_t>(end, avg);
+    int bits = std::countr_zero(avg);
+    uint64_t mask_small = top_bits(bits + 1); // Before avg: one bit more, cuts half as likely
+    uint64_t mask_large = top_bits(bits - 1); // After avg: one bit less, cuts twice as likely
+
+    uint64_t hash = 0;
+    size_t i = min; // Nothing is cut before min, so its bytes are not even hashed
+    for(; i < normal; ++i) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if((hash & mask_small) == 0) return i + 1;
+    }
+    for(; i < end; ++i) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if((hash & mask_large) == 0) return i + 1;
+    }
+    return end;
+}
+
+std::vector<protocol::ChunkInfo> compute_cdc_chunks(const FileMetadata& fmeta, uint32_t avg) {
+    std::vector<protocol::ChunkInfo> chunks;
+    std::vector<protocol::ChunkInfo> error{protocol::ChunkInfo{}};
+
+    std::ifstream f(fmeta.absolute_path, std::ios::binary);
+    if(!f) return error;
+
+    size_t max = cdc_max_size(avg);
+    std::vector<uint8_t> buffer(max * 2); // Refilled once less than max is left, so a cut always sees a full chunk
+    size_t start = 0;
+    size_t end = 0;
+    bool eof = false;
+    uint64_t offset = 0;
+
+    while(true) {
+        if(!eof && end - start < max) {
+            std::memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            size_t want = buffer.size() - end;
+            f.read(reinterpret_cast<char*>(buffer.data() + end), static_cast<std::streamsize>(want));
+            size_t got = static_cast<size_t>(f.gcount());
+            end += got;
+            eof = got < want;
+        }
+        if(start == end) break;
+
+        size_t size = cdc_cut(buffer.data() + start, end - start, avg);
+        std::array<uint8_t, crypto_generichash_BYTES> hash = hash_chunk(buffer.data() + start, size);
+        if(is_hash_error(hash)) return error;
+
+        chunks.push_back({static_cast<uint32_t>(chunks.size()), static_cast<uint32_t>(size), hash_to_hex(hash), offset});
+        offset += size;
+        start += size;
+    }
+
+    if(offset != fmeta.size || chunks.empty()) return error; // File changed since it was scanned
+    return chunks;
+}
+
+bool valid_cdc_plan(const std::vector<protocol::ChunkInfo>& chunks, uint64_t file_size, uint32_t avg) {
+    if(file_size == 0 || file_size > protocol::MAX_FILE_SIZE || chunks.empty()) return false;
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < chunks.size(); ++i) {
+        bool last = i + 1 == chunks.size();
+        if(chunks[i].index != i || chunks[i].size == 0 || chunks[i].size > cdc_max_size(avg)) return false;
+        if(!last && chunks[i].size < cdc_min_size(avg)) return false;
+        total += chunks[i].size;
+    }
+    return total == file_size;
+}
+
+}
@@ -0,0 +1,228 @@
+#include "filesystem/copy_engine.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fsutils {
+
+namespace {
+
+constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+// Descriptor closed on scope exit
+struct Fd {
+    int fd = -1;
+    ~Fd() { if(fd >= 0) ::close(fd); }
+};
+
+// Errors after which the next strategy may still work: the filesystem or the pair of them cannot do it
+bool unsupported(int error) {
+    return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV || error == EINVAL || error == ENOSYS || error == EBADF || error == ETXTBSY;
+}
+
+bool reflink(int in, int out) {
+    return ::ioctl(out, FICLONE, in) == 0;
+}
+
+// false with errno set, copied tells whether it is too late to fall back
+bool copy_range(int in, int out, uint64_t size, bool& copied) {
+    copied = false;
+    uint64_t done = 0;
+    while(done < size) {
+        ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(std::min<uint64_t>(size - done, 1ull << 30)), 0);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        if(n == 0) break; // Source shrank under us
+        done += static_cast<uint64_t>(n);
+        copied = true;
+    }
+    return done == size;
+}
+
+bool copy_buffered(int in, int out) {
+    ::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<char> buffer(BUFFER_SIZE);
+    while(true) {
+        ssize_t n = ::read(in, buffer.data(), buffer.size());
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        if(n == 0) return true;
+        for(ssize_t written = 0; written < n; ) {
+            ssize_t w = ::write(out, buffer.data() + written, static_cast<size_t>(n - written));
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            written += w;
+        }
+    }
+}
+
+}
+
+const char* to_string(CopyStrategy strategy) {
+    switch(strategy) {
+        case CopyStrategy::REFLINK: return "reflink";
+        case CopyStrategy::COPY_FILE_RANGE: return "copy_file_range";
+        case CopyStrategy::BUFFERED: return "buffered";
+    }
+    return "unknown";
+}
+
+void CopyStats::count(CopyStrategy strategy, uint64_t size) {
+    files++;
+    bytes += size;
+    switch(strategy) {
+        case CopyStrategy::REFLINK: reflinked++; break;
+        case CopyStrategy::COPY_FILE_RANGE: ranged++; break;
+        case CopyStrategy::BUFFERED: buffered++; break;
+    }
+}
+
+std::string CopyStats::summary() const {
+    char text[160];
+    std::snprintf(text, sizeof(text), "%llu files, %.1f MiB: %llu reflinked, %llu copy_file_range, %llu buffered",
+                  static_cast<unsigned long long>(files), static_cast<double>(bytes) / (1024.0 * 1024.0),
+                  static_cast<unsigned long long>(reflinked), static_cast<unsigned long long>(ranged), static_cast<unsigned long long>(buffered));
+    return text;
+}
+
+bool copy_file_data(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats, CopyStrategy first) {
+    Fd in;
+    in.fd = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in.fd < 0) return false;
+    struct stat st{};
+    if(::fstat(in.fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    Fd out;
+    out.fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_EXCL), st.st_mode & 07777);
+    if(out.fd < 0) return false;
+
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    std::optional<CopyStrategy> used;
+    if(first <= CopyStrategy::REFLINK && reflink(in.fd, out.fd)) {
+        used = CopyStrategy::REFLINK;
+    }
+    if(!used && first <= CopyStrategy::COPY_FILE_RANGE) {
+        bool copied = false;
+        if(copy_range(in.fd, out.fd, size, copied)) {
+            used = CopyStrategy::COPY_FILE_RANGE;
+        } else if(copied || !unsupported(errno)) { // A real I/O error, or too late to start over
+            ::unlink(dest.c_str());
+            return false;
+        }
+    }
+    if(!used) {
+        if(!copy_buffered(in.fd, out.fd)) {
+            ::unlink(dest.c_str());
+            return false;
+        }
+        used = CopyStrategy::BUFFERED;
+    }
+
+    if(::close(out.fd) != 0) { // Delayed write errors of NFS and the like show up here
+        out.fd = -1;
+        ::unlink(dest.c_str());
+        return false;
+    }
+    out.fd = -1;
+    stats.count(*used, size);
+    return true;
+}
+
+bool reflink_file(const fs::path& src, const fs::path& dest) {
+    Fd in;
+    in.fd = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in.fd < 0) return false;
+    struct stat st{};
+    if(::fstat(in.fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    Fd out;
+    out.fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if(out.fd < 0) return false;
+    bool cloned = reflink(in.fd, out.fd);
+    int closed = ::close(out.fd);
+    out.fd = -1;
+    if(!cloned || closed != 0) {
+        ::unlink(dest.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool copy_tree(const fs::path& src, const fs::path& dest, CopyStats& stats, CopyStrategy first) {
+    std::error_code ec;
+    if(!fs::is_directory(src, ec) || fs::exists(dest, ec)) return false;
+
+    // Directories are created in walk order (parents first), files are collected for the workers
+    std::vector<std::pair<fs::path, fs::path>> files;
+    fs::create_directories(dest, ec);
+    for(fs::recursive_directory_iterator it(src, ec), end; !ec && it != end; it.increment(ec)) {
+        fs::path target = dest / fs::relative(it->path(), src, ec);
+        if(ec) break;
+        if(it->is_directory(ec)) {
+            fs::create_directory(target, ec);
+        } else if(it->is_regular_file(ec)) {
+            files.emplace_back(it->path(), std::move(target));
+        } else if(!ec) {
+            ec = std::make_error_code(std::errc::not_supported); // Sockets, devices and the like
+        }
+    }
+    if(ec) {
+        fs::remove_all(dest, ec);
+        return false;
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::mutex stats_mutex;
+    auto worker = [&]() {
+        CopyStats local;
+        for(size_t i = next++; i < files.size() && !failed; i = next++) {
+            if(!copy_file_data(files[i].first, files[i].second, false, local, first)) {
+                failed = true;
+            }
+        }
+        std::lock_guard lock(stats_mutex);
+        stats.files += local.files;
+        stats.bytes += local.bytes;
+        stats.reflinked += local.reflinked;
+        stats.ranged += local.ranged;
+        stats.buffered += local.buffered;
+    };
+
+    // Reflinks and small files are metadata bound, several in flight keep the disk queue full
+    unsigned threads = static_cast<unsigned>(std::min<size_t>({MAX_COPY_THREADS, std::max(1u, std::thread::hardware_concurrency()), files.size()}));
+    std::vector<std::thread> pool;
+    for(unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto& thread : pool) {
+        thread.join();
+    }
+
+    if(failed) {
+        fs::remove_all(dest, ec);
+        return false;
+    }
+    return true;
+}
+
+}
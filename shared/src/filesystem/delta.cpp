@@ -0,0 +1,224 @@
+#include "filesystem/delta.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <utility>
+
+namespace fsutils {
+
+namespace {
+
+constexpr uint32_t LOW_16 = 0xffff;
+constexpr uint32_t COPY_PIECE = 1024 * 1024; // apply_copies() moves at most this much at once
+
+}
+
+void RollingChecksum::reset(const uint8_t* data, size_t size) {
+    a_ = 0;
+    b_ = 0;
+    size_ = static_cast<uint32_t>(size);
+    for(size_t i = 0; i < size; ++i) {
+        a_ += data[i];
+        b_ += static_cast<uint32_t>(size - i) * data[i];
+    }
+    a_ &= LOW_16;
+    b_ &= LOW_16;
+}
+
+void RollingChecksum::roll(uint8_t out, uint8_t in) {
+    a_ = (a_ - out + in) & LOW_16;
+    b_ = (b_ - size_ * out + a_) & LOW_16;
+}
+
+uint32_t signature_block_size(uint64_t file_size) {
+    uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+    return static_cast<uint32_t>(std::clamp<uint64_t>(std::bit_ceil(std::max<uint64_t>(root, 1)), MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+}
+
+std::vector<protocol::BlockSignature> compute_signatures(const fs::path& path, uint32_t block_size) {
+    std::vector<protocol::BlockSignature> signatures;
+    std::ifstream f(path, std::ios::binary);
+    if(!f) return signatures;
+
+    std::vector<uint8_t> block(block_size);
+    RollingChecksum sum;
+    while(f) {
+        f.read(reinterpret_cast<char*>(block.data()), block_size);
+        size_t got = static_cast<size_t>(f.gcount());
+        if(got == 0) break;
+
+        std::array<uint8_t, crypto_generichash_BYTES> hash = hash_chunk(block.data(), got);
+        if(is_hash_error(hash)) return {};
+        sum.reset(block.data(), got);
+        signatures.push_back({static_cast<uint32_t>(signatures.size()), static_cast<uint32_t>(got), sum.value(), hash_to_hex(hash)});
+    }
+    if(f.bad()) return {};
+    return signatures;
+}
+
+bool compute_delta(const FileMetadata& fmeta, const std::vector<protocol::BlockSignature>& signatures, uint32_t block_size, uint32_t chunk_size, Delta& out) {
+    out = Delta{};
+    if(block_size == 0 || chunk_size == 0) return false;
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> by_weak; // Weak checksum -> signature indexes
+    for(uint32_t i = 0; i < signatures.size(); ++i) {
+        by_weak[signatures[i].weak].push_back(i);
+    }
+
+    // Signature of the old file matching data[0, size), signatures.size() if none
+    auto find_block = [&](uint32_t weak, const uint8_t* data, size_t size) {
+        auto it = by_weak.find(weak);
+        if(it == by_weak.end()) return static_cast<uint32_t>(signatures.size());
+        std::string strong = hash_to_hex(hash_chunk(data, size)); // Only for weak hits, most positions never get here
+        for(uint32_t i : it->second) {
+            if(signatures[i].size == size && signatures[i].strong == strong) return i;
+        }
+        return static_cast<uint32_t>(signatures.size());
+    };
+
+    std::vector<std::pair<uint64_t, uint64_t>> literal_ranges; // Offset and size of new bytes
+    auto keep = [&](uint64_t offset, uint64_t source, uint64_t size) {
+        if(!out.copies.empty()) {
+            protocol::DeltaCopy& last = out.copies.back();
+            if(last.offset + last.size == offset && last.source + last.size == source) { // Consecutive blocks, one copy
+                last.size += size;
+                return;
+            }
+        }
+        out.copies.push_back({offset, source, size});
+    };
+
+    std::ifstream f(fmeta.absolute_path, std::ios::binary);
+    if(!f) return false;
+
+    std::vector<uint8_t> buffer(std::max<size_t>(static_cast<size_t>(block_size) * 4, COPY_PIECE));
+    uint64_t base = 0; // File offset of buffer[0]
+    size_t pos = 0; // Start of the window
+    size_t end = 0;
+    bool eof = false;
+    uint64_t literal_start = 0;
+    RollingChecksum sum;
+    bool rolling = false; // sum holds the window at pos
+
+    while(true) {
+        if(!eof && end - pos <= block_size) { // The window and the byte after it have to be in the buffer
+            std::memmove(buffer.data(), buffer.data() + pos, end - pos);
+            base += pos;
+            end -= pos;
+            pos = 0;
+            size_t want = buffer.size() - end;
+            f.read(reinterpret_cast<char*>(buffer.data() + end), static_cast<std::streamsize>(want));
+            size_t got = static_cast<size_t>(f.gcount());
+            end += got;
+            eof = got < want;
+        }
+
+        size_t avail = end - pos;
+        if(avail == 0) break;
+        if(avail < block_size) { // Tail of the file, only the old file's shorter last block can still match
+            sum.reset(buffer.data() + pos, avail);
+            uint32_t i = find_block(sum.value(), buffer.data() + pos, avail);
+            if(i < signatures.size()) {
+                if(base + pos > literal_start) literal_ranges.emplace_back(literal_start, base + pos - literal_start);
+                keep(base + pos, static_cast<uint64_t>(i) * block_size, avail);
+                literal_start = base + end;
+            }
+            pos = end;
+            break;
+        }
+
+        if(!rolling) {
+            sum.reset(buffer.data() + pos, block_size);
+            rolling = true;
+        }
+        uint32_t i = find_block(sum.value(), buffer.data() + pos, block_size);
+        if(i < signatures.size()) {
+            if(base + pos > literal_start) literal_ranges.emplace_back(literal_start, base + pos - literal_start);
+            keep(base + pos, static_cast<uint64_t>(i) * block_size, block_size);
+            pos += block_size;
+            literal_start = base + pos;
+            rolling = false;
+            continue;
+        }
+        if(avail > block_size) {
+            sum.roll(buffer[pos], buffer[pos + block_size]);
+        } else {
+            rolling = false;
+        }
+        ++pos;
+    }
+    if(f.bad()) return false;
+
+    uint64_t total = base + end;
+    if(total != fmeta.size || total == 0) return false; // File changed since it was scanned
+    if(total > literal_start) literal_ranges.emplace_back(literal_start, total - literal_start);
+
+    if(literal_ranges.empty()) { // Same blocks, maybe moved: send the tail anyway, so the upload ends with LAST and DONE as usual
+        protocol::DeltaCopy& last = out.copies.back();
+        uint64_t size = std::min<uint64_t>(last.size, chunk_size);
+        last.size -= size;
+        literal_ranges.emplace_back(last.offset + last.size, size);
+        if(last.size == 0) out.copies.pop_back();
+    }
+
+    TransferFile file;
+    if(!file.open(fmeta.absolute_path, TransferFile::Mode::READ)) return false;
+    std::vector<uint8_t> data;
+    for(const auto& [offset, size] : literal_ranges) {
+        for(uint64_t done = 0; done < size; ) {
+            uint32_t piece = static_cast<uint32_t>(std::min<uint64_t>(chunk_size, size - done));
+            if(!file.read_at(offset + done, piece, data)) return false;
+            std::array<uint8_t, crypto_generichash_BYTES> hash = hash_chunk(data);
+            if(is_hash_error(hash)) return false;
+            out.literals.push_back({static_cast<uint32_t>(out.literals.size()), piece, hash_to_hex(hash), offset + done});
+            out.literal_bytes += piece;
+            done += piece;
+        }
+    }
+    return true;
+}
+
+bool valid_delta_plan(const std::vector<protocol::ChunkInfo>& chunks, const std::vector<protocol::DeltaCopy>& copies, uint64_t file_size, uint64_t base_size, uint32_t chunk_size) {
+    if(file_size == 0 || file_size > protocol::MAX_FILE_SIZE || chunks.empty()) return false;
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges; // Offset and size of every piece of the new file
+    ranges.reserve(chunks.size() + copies.size());
+    for(uint32_t i = 0; i < chunks.size(); ++i) {
+        if(chunks[i].index != i || chunks[i].size == 0 || chunks[i].size > chunk_size) return false;
+        ranges.emplace_back(chunks[i].offset, chunks[i].size);
+    }
+    for(const protocol::DeltaCopy& copy : copies) {
+        if(copy.size == 0 || copy.size > base_size || copy.source > base_size - copy.size) return false;
+        ranges.emplace_back(copy.offset, copy.size);
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    uint64_t next = 0;
+    for(const auto& [offset, size] : ranges) {
+        if(offset != next || size > file_size - offset) return false; // Gap, overlap or past the end
+        next = offset + size;
+    }
+    return next == file_size;
+}
+
+bool apply_copies(const fs::path& base, TransferFile& dest, const std::vector<protocol::DeltaCopy>& copies) {
+    if(copies.empty()) return true;
+
+    TransferFile source;
+    if(!source.open(base, TransferFile::Mode::READ)) return false;
+    std::vector<uint8_t> data;
+    for(const protocol::DeltaCopy& copy : copies) {
+        for(uint64_t done = 0; done < copy.size; ) {
+            uint32_t piece = static_cast<uint32_t>(std::min<uint64_t>(COPY_PIECE, copy.size - done));
+            if(!source.read_at(copy.source + done, piece, data) || !dest.write_at(copy.offset + done, data)) return false;
+            done += piece;
+        }
+    }
+    return true;
+}
+
+}
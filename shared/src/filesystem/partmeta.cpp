@@ -2,6 +2,7 @@
 #include <fstream>
 #include <filesystem>
 #include <algorithm>
+#include <cctype>
 #include <thread>
 #include <string>
 #include <nlohmann/json.hpp>
@@ -22,20 +23,37 @@ std::filesystem::path PartialMetadata::get_partial_path(uint32_t id) {
     auto it = entries_.find(id);
     if(it == entries_.end()) return std::filesystem::path("");
 
+    if(!it->second.partial_path.empty()) return it->second.partial_path;
     std::string name = std::to_string(id) + ".part";
     return fsutils::absolute(std::filesystem::path(metadata_file_.parent_path() / name));
 }
 
+std::filesystem::path PartialMetadata::partial_path_beside(const std::filesystem::path& destination, uint32_t id) {
+    return fsutils::absolute(destination).parent_path() / (".minidrive-" + std::to_string(id) + ".part");
+}
+
+bool PartialMetadata::is_partial_beside(const std::filesystem::path& path) {
+    std::string name = path.filename().string();
+    const std::string prefix = ".minidrive-";
+    const std::string suffix = ".part";
+    if(name.size() <= prefix.size() + suffix.size() || name.rfind(prefix, 0) != 0 || !name.ends_with(suffix)) return false;
+    std::string id = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    return std::all_of(id.begin(), id.end(), [](unsigned char c) { return std::isdigit(c); });
+}
+
 uint32_t PartialMetadata::generate_id() {
-    if(!free_ids_.empty()) {
+    while(!free_ids_.empty()) {
         uint32_t id = free_ids_.front();
         free_ids_.pop();
-        return id;
+        if(entries_.count(id) == 0) return id; // Taken again meanwhile by an entry that brought its own id
+    }
+    while(entries_.count(next_id_) != 0) {
+        next_id_++;
     }
     return next_id_++;
 }
 
-uint32_t PartialMetadata::add_partial_metadata(TransferType type, fsutils::FileMetadata fmeta, std::vector<protocol::ChunkInfo> chunks, uint32_t id) {
+uint32_t PartialMetadata::add_partial_metadata(TransferType type, fsutils::FileMetadata fmeta, std::vector<protocol::ChunkInfo> chunks, uint32_t chunk_size, uint32_t id, std::filesystem::path partial_path, uint32_t peer_id) {
     std::lock_guard lock(partmeta_mutex_);
 
     if(id == UINT32_MAX) {
@@ -47,10 +65,14 @@ uint32_t PartialMetadata::add_partial_metadata(TransferType type, fsutils::FileM
         fmeta.absolute_path,
         fmeta.size,
         fmeta.hash,
+        fmeta.tree_hash,
         type,
         chunks,
+        chunk_size,
         std::vector<bool>(chunks.size(), false),
-        std::chrono::system_clock::now()
+        std::chrono::system_clock::now(),
+        std::move(partial_path),
+        peer_id == UINT32_MAX ? id : peer_id
     };
 
     entries_.emplace(id, std::move(entry));
@@ -60,8 +82,9 @@ uint32_t PartialMetadata::add_partial_metadata(TransferType type, fsutils::FileM
 void PartialMetadata::delete_partial_metadata(uint32_t id) {
     {
         std::lock_guard lock(partmeta_mutex_);
-        entries_.erase(id);
-        free_ids_.push(id);
+        if(entries_.erase(id) != 0) {
+            free_ids_.push(id);
+        }
     }
     save(); // persist the removal immediately -- otherwise a completed/discarded transfer
             // reappears as "resumable" from the stale on-disk file after the next restart
@@ -101,10 +124,14 @@ void PartialMetadata::save() {
             {"absolute_path", entry.absolute_path.string()},
             {"size", entry.size},
             {"file_hash", fsutils::hash_to_hex(entry.file_hash)},
+            {"tree_hash", fsutils::hash_to_hex(entry.tree_hash)},
             {"type", static_cast<int>(entry.type)},
             {"chunks", entry.chunks},
+            {"chunk_size", entry.chunk_size},
             {"chunk_state", entry.chunk_state},
-            {"last_activity", std::chrono::duration_cast<std::chrono::seconds>(entry.last_activity.time_since_epoch()).count()}
+            {"last_activity", std::chrono::duration_cast<std::chrono::seconds>(entry.last_activity.time_since_epoch()).count()},
+            {"partial_path", entry.partial_path.string()},
+            {"peer_id", entry.peer_id}
         });
     }
 
@@ -164,13 +191,20 @@ void PartialMetadata::load() {
         PartialMetadataEntry entry;
         entry.id = e.at("id").get<uint32_t>();
         entry.absolute_path = std::filesystem::path(e.at("absolute_path").get<std::string>());
-        entry.size = e.at("size").get<uint32_t>();
+        entry.size = e.at("size").get<uint64_t>();
         entry.file_hash = fsutils::hex_to_hash(e.at("file_hash").get<std::string>());
+        entry.tree_hash = fsutils::hex_to_hash(e.value("tree_hash", "")); // Entries written before tree hashes are checked against file_hash
         entry.type = static_cast<TransferType>(e.at("type").get<int>());
         entry.chunks = e.at("chunks").get<std::vector<protocol::ChunkInfo>>();
+        if(!e.at("chunks").empty() && !e.at("chunks").front().contains("offset")) {
+            fsutils::assign_offsets(entry.chunks); // Entries written before offsets were stored
+        }
+        entry.chunk_size = e.value("chunk_size", fsutils::CHUNK_SIZE); // Entries written before chunk size negotiation
         entry.chunk_state = e.at("chunk_state").get<std::vector<bool>>();
         auto ts = e.at("last_activity").get<uint64_t>();
         entry.last_activity = std::chrono::system_clock::time_point(std::chrono::seconds(ts));
+        entry.partial_path = std::filesystem::path(e.value("partial_path", "")); // Entries written before partials could live elsewhere
+        entry.peer_id = e.value("peer_id", entry.id); // Entries written before the server picked its own upload ids
 
         entries_.emplace(entry.id, std::move(entry));
         next_id_ = std::max(next_id_, entry.id + 1);
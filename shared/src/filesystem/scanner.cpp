@@ -0,0 +1,136 @@
+#include "filesystem/scanner.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "filesystem/chunker.hpp"
+
+namespace fsutils {
+
+namespace {
+
+struct Cut {
+    size_t start; // In the buffer
+    size_t size;
+};
+
+// Hash every cut of data into its slot of hashes on up to threads threads. The caller runs
+// alongside() first, then helps with the cuts that are left.
+template<typename F>
+void hash_cuts(const uint8_t* data, const std::vector<Cut>& cuts, std::vector<std::array<uint8_t, crypto_generichash_BYTES>>& hashes, unsigned threads, F&& alongside) {
+    hashes.resize(cuts.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for(size_t i = next++; i < cuts.size(); i = next++) {
+            hashes[i] = hash_chunk(data + cuts[i].start, cuts[i].size);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(unsigned t = 1; t < std::min<size_t>(threads, cuts.size() + 1); ++t) { // The caller is busy with alongside(), so one more than the cuts at most
+        pool.emplace_back(worker);
+    }
+    alongside();
+    worker();
+    for(auto& thread : pool) {
+        thread.join();
+    }
+}
+
+}
+
+bool scan_file_chunks(const fs::path& path, uint32_t chunk_size, bool content_defined, FileMetadata& fmeta, std::vector<protocol::ChunkInfo>& chunks, unsigned threads) {
+    chunks.clear();
+    if(chunk_size == 0) return false;
+    if(threads == 0) {
+        threads = std::min(MAX_HASH_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+    struct stat st{};
+    if(::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    chunks.reserve(content_defined ? 0 : chunk_count(size, chunk_size));
+
+    // A cut has to see a whole chunk: refill once less than that is left, unless the file ended
+    size_t need = content_defined ? cdc_max_size(chunk_size) : chunk_size;
+    std::vector<uint8_t> buffer(std::max({SCAN_BUFFER_SIZE, need * 2, std::min(MAX_SCAN_BUFFER_SIZE, need * threads)}));
+    size_t start = 0;
+    size_t end = 0;
+    bool eof = false;
+    uint64_t offset = 0;
+    std::vector<Cut> cuts;
+    std::vector<std::array<uint8_t, crypto_generichash_BYTES>> hashes;
+
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, crypto_generichash_BYTES);
+
+    while(true) {
+        size_t fresh = end; // Bytes from here on were read by this pass and are not in the file hash yet
+        if(!eof && end - start < need) {
+            std::memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            fresh = end;
+            while(!eof && end < buffer.size()) { // Fill it up, short reads are not the end
+                ssize_t n = ::read(fd, buffer.data() + end, buffer.size() - end);
+                if(n < 0 && errno == EINTR) continue;
+                if(n < 0) {
+                    ::close(fd);
+                    chunks.clear();
+                    return false;
+                }
+                if(n == 0) {
+                    eof = true;
+                    break;
+                }
+                end += static_cast<size_t>(n);
+            }
+        }
+        if(start == end) break;
+
+        // Every whole chunk in the buffer, the rest too once the file ended
+        cuts.clear();
+        size_t pos = start;
+        while(pos < end && (eof || end - pos >= need)) {
+            size_t cut = content_defined ? cdc_cut(buffer.data() + pos, end - pos, chunk_size) : std::min<size_t>(chunk_size, end - pos);
+            cuts.push_back({pos, cut});
+            pos += cut;
+        }
+        hash_cuts(buffer.data(), cuts, hashes, threads, [&]() {
+            crypto_generichash_update(&state, buffer.data() + fresh, end - fresh);
+        });
+        for(size_t i = 0; i < cuts.size(); ++i) {
+            chunks.push_back({static_cast<uint32_t>(chunks.size()), static_cast<uint32_t>(cuts[i].size), hash_to_hex(hashes[i]), offset});
+            offset += cuts[i].size;
+        }
+        start = pos;
+    }
+    ::close(fd);
+
+    if(offset != size) { // Grew or shrank while it was read, neither hash nor plan is the file's
+        chunks.clear();
+        return false;
+    }
+    fmeta = FileMetadata{
+        fsutils::absolute(path),
+        size,
+        get_last_write_time(path),
+        {}
+    };
+    crypto_generichash_final(&state, fmeta.hash.data(), crypto_generichash_BYTES);
+    return true;
+}
+
+}
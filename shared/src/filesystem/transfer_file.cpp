@@ -0,0 +1,145 @@
+#include "filesystem/transfer_file.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fsutils {
+
+TransferFile::~TransferFile() {
+    close();
+}
+
+TransferFile::TransferFile(TransferFile&& other) noexcept
+    : fd_(other.fd_), mode_(other.mode_), path_(std::move(other.path_)), error_(other.error_) {
+    other.fd_ = -1;
+}
+
+TransferFile& TransferFile::operator=(TransferFile&& other) noexcept {
+    if(this != &other) {
+        close();
+        fd_ = other.fd_;
+        mode_ = other.mode_;
+        path_ = std::move(other.path_);
+        error_ = other.error_;
+        other.fd_ = -1;
+    }
+    return *this;
+}
+
+bool TransferFile::open(const fs::path& path, Mode mode) {
+    if(fd_ >= 0 && mode_ == mode && path_ == path) return true;
+    close();
+
+    int flags = mode == Mode::WRITE ? (O_RDWR | O_CREAT) : O_RDONLY;
+    int fd;
+    do {
+        fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    } while(fd < 0 && errno == EINTR);
+
+    if(fd < 0) {
+        error_ = std::error_code(errno, std::generic_category());
+        return false;
+    }
+
+    fd_ = fd;
+    mode_ = mode;
+    path_ = path;
+    error_.clear();
+    return true;
+}
+
+void TransferFile::close() {
+    if(fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = -1;
+    path_.clear();
+}
+
+bool TransferFile::is_open() const {
+    return fd_ >= 0;
+}
+
+const fs::path& TransferFile::path() const {
+    return path_;
+}
+
+int TransferFile::native_handle() const {
+    return fd_;
+}
+
+bool TransferFile::write_at(uint64_t offset, const std::vector<uint8_t>& data) {
+    if(fd_ < 0 || mode_ != Mode::WRITE) {
+        error_ = std::make_error_code(std::errc::bad_file_descriptor);
+        return false;
+    }
+
+    size_t done = 0;
+    while(done < data.size()) { // pwrite may write less than asked
+        ssize_t n = ::pwrite(fd_, data.data() + done, data.size() - done, static_cast<off_t>(offset + done));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            error_ = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool TransferFile::read_at(uint64_t offset, uint32_t size, std::vector<uint8_t>& out) {
+    out.resize(size);
+    if(fd_ < 0) {
+        error_ = std::make_error_code(std::errc::bad_file_descriptor);
+        out.clear();
+        return false;
+    }
+
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = ::pread(fd_, out.data() + done, size - done, static_cast<off_t>(offset + done));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            error_ = std::error_code(errno, std::generic_category());
+            out.clear();
+            return false;
+        }
+        if(n == 0) { // File is shorter than its chunk plan, changed since it was hashed
+            error_ = std::make_error_code(std::errc::io_error);
+            out.resize(done);
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool TransferFile::preallocate(uint64_t size) {
+    if(fd_ < 0 || mode_ != Mode::WRITE) {
+        error_ = std::make_error_code(std::errc::bad_file_descriptor);
+        return false;
+    }
+    if(size == 0) return true;
+
+    int rc;
+    do { // Reserves the blocks in one go: contiguous on disk, and a full disk fails here instead of mid-transfer
+        rc = ::fallocate(fd_, 0, 0, static_cast<off_t>(size));
+    } while(rc != 0 && errno == EINTR);
+
+    if(rc == 0) return true;
+    if(errno == EOPNOTSUPP || errno == ENOSYS) return true; // Chunk writes grow the file as before
+    error_ = std::error_code(errno, std::generic_category());
+    return false;
+}
+
+void TransferFile::will_need(uint64_t offset, uint64_t length) {
+    if(fd_ < 0 || length == 0) return;
+    ::posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED); // Only a hint, a failure costs nothing but the read-ahead
+}
+
+const std::error_code& TransferFile::error() const {
+    return error_;
+}
+
+}
@@ -6,6 +6,8 @@
 #include <iostream>
 #include <array>
 #include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace fsutils {
 
@@ -99,7 +101,7 @@ bool is_subpath(const fs::path& base, const fs::path& sub) {
 uint64_t get_file_size(const fs::path& path) {
     std::error_code ec;
     uint64_t size = fs::file_size(path, ec);
-    if(ec ||size > UINT32_MAX) {
+    if(ec) {
         return SIZE_ERROR;
     }
     return size;
@@ -114,6 +116,15 @@ uint64_t get_last_write_time(const fs::path& path) {
     return std::chrono::duration_cast<std::chrono::seconds>(ftime.time_since_epoch()).count(); // Returns time in seconds
 }
 
+uint64_t available_space(const fs::path& path) {
+    std::error_code ec;
+    fs::space_info info = fs::space(path, ec); // statvfs() f_bavail * f_frsize
+    if(ec) {
+        return SIZE_ERROR;
+    }
+    return info.available;
+}
+
 bool mkdir(const fs::path& path) {
     std::error_code ec;
     bool result = fs::create_directories(path, ec);
@@ -125,7 +136,7 @@ bool mkdir(const fs::path& path) {
 
 bool rmdir(const fs::path& path) {
     std::error_code ec;
-    uint32_t result = fs::remove_all(path, ec);
+    std::uintmax_t result = fs::remove_all(path, ec);
     if(ec) {
         return false;
     }
@@ -149,7 +160,22 @@ bool remove_file(const fs::path& path) {
     return result;
 }
 
+bool sync_path(const fs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    bool result = ::fsync(fd) == 0;
+    ::close(fd);
+    return result;
+}
+
 bool copy_path(const fs::path& src, const fs::path& dest, bool overwrite) {
+    CopyStats stats;
+    return copy_path(src, dest, overwrite, stats);
+}
+
+bool copy_path(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats) {
     std::error_code ec;
 
     if(!fs::exists(src)) return false;
@@ -168,21 +194,19 @@ bool copy_path(const fs::path& src, const fs::path& dest, bool overwrite) {
 
     // Directory case
     if(fs::is_directory(src)) {
-        fs::create_directories(dest, ec);
-        if(ec) return false;
-
-        fs::copy(src, dest, fs::copy_options::recursive, ec);
-
-        return !ec;
+        return copy_tree(src, dest, stats);
     }
 
     // File case
-    fs::copy_file(src, dest, overwrite ? fs::copy_options::overwrite_existing : fs::copy_options::none, ec);
-
-    return !ec;
+    return copy_file_data(src, dest, overwrite, stats);
 }
 
 bool move_path(const fs::path& src, const fs::path& dest, bool overwrite) {
+    CopyStats stats;
+    return move_path(src, dest, overwrite, stats);
+}
+
+bool move_path(const fs::path& src, const fs::path& dest, bool overwrite, CopyStats& stats) {
     std::error_code ec;
 
     if(!fs::exists(src)) return false;
@@ -203,29 +227,47 @@ bool move_path(const fs::path& src, const fs::path& dest, bool overwrite) {
     fs::rename(src, dest, ec);
     if(!ec) return true;
 
-    // Rename fails, copy, then delete
-
-    // Directory
+    // Rename fails, copy, then delete. Across filesystems reflinks fail, copy_file_range may not
     if(fs::is_directory(src)) {
-        fs::create_directories(dest, ec);
-        if(ec) return false;
-
-        fs::copy(src, dest, fs::copy_options::recursive | fs::copy_options::overwrite_existing, ec);
-        if(ec) return false;
-
+        if(!copy_tree(src, dest, stats)) return false;
         fs::remove_all(src, ec);
         return !ec;
     }
 
     // File
-    fs::copy_file(src, dest, overwrite ? fs::copy_options::overwrite_existing : fs::copy_options::none, ec);
-    if(ec) return false;
+    if(!copy_file_data(src, dest, overwrite, stats)) return false;
 
     fs::remove(src, ec);
     return !ec;
 }
 
-bool write_chunk(const fs::path& path, uint32_t offset, const std::vector<uint8_t>& data) {
+bool link_path(const fs::path& src, const fs::path& dest) {
+    std::error_code ec;
+
+    if(!fs::exists(src) || fs::exists(dest)) return false;
+
+    // Make sure parent directories exist
+    if(!dest.parent_path().empty()) {
+        fs::create_directories(dest.parent_path(), ec);
+        if(ec) return false;
+    }
+
+    // Directories are created, files inside them linked
+    if(fs::is_directory(src)) {
+        fs::create_directories(dest, ec);
+        if(!ec) fs::copy(src, dest, fs::copy_options::recursive | fs::copy_options::create_hard_links, ec);
+    } else {
+        fs::create_hard_link(src, dest, ec);
+    }
+    if(ec) { // Half a tree would make the caller's fallback copy fail on existing files
+        std::error_code ignored;
+        fs::remove_all(dest, ignored);
+        return false;
+    }
+    return true;
+}
+
+bool write_chunk(const fs::path& path, uint64_t offset, const std::vector<uint8_t>& data) {
     std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
     
     // File does not exist, create file
@@ -238,13 +280,13 @@ bool write_chunk(const fs::path& path, uint32_t offset, const std::vector<uint8_
         if (!f) return false;
     }
 
-    f.seekp(offset);
+    f.seekp(static_cast<std::streamoff>(offset));
     f.write(reinterpret_cast<const char*>(data.data()), data.size());
 
     return f.good();
 }
 
-std::vector<uint8_t> read_chunk(const std::filesystem::path& path, uint32_t offset, uint32_t size) {
+std::vector<uint8_t> read_chunk(const std::filesystem::path& path, uint64_t offset, uint32_t size) {
     std::vector<uint8_t> buffer(size);
     std::ifstream f(path, std::ios::binary);
     if(!f) {
@@ -252,7 +294,7 @@ std::vector<uint8_t> read_chunk(const std::filesystem::path& path, uint32_t offs
         return buffer;
     }
 
-    f.seekg(offset);
+    f.seekg(static_cast<std::streamoff>(offset));
     f.read(reinterpret_cast<char*>(buffer.data()), size);
 
     buffer.resize(f.gcount());
@@ -288,13 +330,53 @@ std::array<uint8_t, crypto_generichash_BYTES> hash_file(const fs::path& path) {
 }
 
 std::array<uint8_t, crypto_generichash_BYTES> hash_chunk(const std::vector<uint8_t>& data) {
+    return hash_chunk(data.data(), data.size());
+}
+
+std::array<uint8_t, crypto_generichash_BYTES> hash_chunk(const uint8_t* data, size_t size) {
     std::array<uint8_t, crypto_generichash_BYTES> hash;
 
-    crypto_generichash(hash.data(), hash.size(), data.data(), data.size(), nullptr, 0);
+    crypto_generichash(hash.data(), hash.size(), data, size, nullptr, 0);
 
     return hash;
 }
 
+std::array<uint8_t, crypto_generichash_BYTES> tree_hash(const std::vector<protocol::ChunkInfo>& chunks) {
+    if(chunks.empty()) return HASH_ERROR;
+
+    std::vector<std::array<uint8_t, crypto_generichash_BYTES>> level;
+    level.reserve(chunks.size());
+    for(const protocol::ChunkInfo& chunk : chunks) {
+        std::array<uint8_t, crypto_generichash_BYTES> leaf = hex_to_hash(chunk.chunk_hash);
+        if(is_hash_error(leaf)) return HASH_ERROR;
+        level.push_back(leaf);
+    }
+
+    const uint8_t node = 1; // Prefix of node hashes, keeps them apart from chunk hashes
+    while(level.size() > 1) {
+        size_t parents = 0;
+        for(size_t i = 0; i + 1 < level.size(); i += 2) {
+            crypto_generichash_state state;
+            crypto_generichash_init(&state, nullptr, 0, crypto_generichash_BYTES);
+            crypto_generichash_update(&state, &node, 1);
+            crypto_generichash_update(&state, level[i].data(), level[i].size());
+            crypto_generichash_update(&state, level[i + 1].data(), level[i + 1].size());
+            crypto_generichash_final(&state, level[parents++].data(), crypto_generichash_BYTES);
+        }
+        if(level.size() % 2 == 1) {
+            level[parents++] = level.back();
+        }
+        level.resize(parents);
+    }
+    return level.front();
+}
+
+bool complete_tree(const std::vector<protocol::ChunkInfo>& chunks, const std::vector<bool>& chunk_state, const std::array<uint8_t, crypto_generichash_BYTES>& root) {
+    if(is_hash_error(root) || chunk_state.size() != chunks.size()) return false;
+    if(next_pending_chunk(chunk_state, 0) < chunk_state.size()) return false;
+    return tree_hash(chunks) == root;
+}
+
 std::string hash_to_hex(const std::array<uint8_t, crypto_generichash_BYTES>& hash) {
     std::string hex(hash.size() * 2 + 1, '\0');
     
@@ -331,14 +413,15 @@ bool is_scan_dir_error(const std::vector<FileMetadata>& list) {
 }
 
 FileMetadata scan_file(const fs::path& path) {
-    if(get_file_size(path) == SIZE_ERROR) return FileMetadata{};
+    uint64_t size = get_file_size(path);
+    if(size == SIZE_ERROR) return FileMetadata{};
     std::array<uint8_t, crypto_generichash_BYTES> hash = hash_file(path);
     if(is_hash_error(hash)) return FileMetadata{};
     return FileMetadata{
         fsutils::absolute(path),
-        static_cast<uint32_t>(get_file_size(path)),
+        size,
         get_last_write_time(path),
-        hash_file(path)
+        hash
     };
 }
 
@@ -357,12 +440,12 @@ std::vector<FileMetadata> scan_directory(const fs::path& dir, bool recursive) {
 
         if(is_file(entry.path())) {
             auto size = get_file_size(entry.path());
-            if(size == SIZE_ERROR) { // File too large
+            if(size == SIZE_ERROR) { // Vanished or unreadable
                 error = true;
                 return;
             }
 
-            metadata.size = static_cast<uint32_t>(size);
+            metadata.size = size;
             metadata.hash = hash_file(entry.path());
 
             if(is_hash_error(metadata.hash)) { // Error in hash_file()
@@ -397,22 +480,22 @@ bool is_compute_chunks_error(const std::vector<protocol::ChunkInfo>& chunks) {
     return chunks.size() == 1 && chunks[0].index == 0 && chunks[0].size == 0;
 }
 
-uint32_t chunk_count(const uint32_t& file_size) {
+uint32_t chunk_count(uint64_t file_size, uint32_t chunk_size) {
     if(file_size == 0) return 0;
-    return (file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    return static_cast<uint32_t>((file_size + chunk_size - 1) / chunk_size);
 }
 
-std::vector<protocol::ChunkInfo> compute_chunks(const FileMetadata& fmeta) {
+std::vector<protocol::ChunkInfo> compute_chunks(const FileMetadata& fmeta, uint32_t chunk_size) {
     std::vector<protocol::ChunkInfo> chunks;
 
-    uint32_t count = chunk_count(fmeta.size);
+    uint32_t count = chunk_count(fmeta.size, chunk_size);
     chunks.reserve(count);
 
     for(uint32_t i = 0; i < count; ++i) {
-        uint32_t offset = i * CHUNK_SIZE;
-        uint32_t chunk_size = std::min(CHUNK_SIZE, fmeta.size - offset);
+        uint64_t offset = static_cast<uint64_t>(i) * chunk_size;
+        uint32_t size = static_cast<uint32_t>(std::min<uint64_t>(chunk_size, fmeta.size - offset));
 
-        std::vector<uint8_t> data = read_chunk(fmeta.absolute_path, offset, chunk_size);
+        std::vector<uint8_t> data = read_chunk(fmeta.absolute_path, offset, size);
 
         if(data.empty()) {
             chunks.clear();
@@ -428,11 +511,35 @@ std::vector<protocol::ChunkInfo> compute_chunks(const FileMetadata& fmeta) {
             return chunks;
         }
         
-        chunks.push_back({i, chunk_size, hash_to_hex(hash)});
+        chunks.push_back({i, size, hash_to_hex(hash), offset});
     }
 
     return chunks;
 }
 
+bool valid_chunk_plan(const std::vector<protocol::ChunkInfo>& chunks, uint64_t file_size, uint32_t chunk_size) {
+    if(chunk_size == 0 || file_size > protocol::MAX_FILE_SIZE || chunks.size() != chunk_count(file_size, chunk_size)) return false;
+    for(uint32_t i = 0; i < chunks.size(); ++i) {
+        uint32_t expected = static_cast<uint32_t>(std::min<uint64_t>(chunk_size, file_size - static_cast<uint64_t>(i) * chunk_size));
+        if(chunks[i].index != i || chunks[i].size != expected) return false;
+    }
+    return true;
+}
+
+void assign_offsets(std::vector<protocol::ChunkInfo>& chunks) {
+    uint64_t offset = 0;
+    for(protocol::ChunkInfo& chunk : chunks) {
+        chunk.offset = offset;
+        offset += chunk.size;
+    }
 }
 
+uint32_t next_pending_chunk(const std::vector<bool>& chunk_state, uint32_t from) {
+    uint32_t count = static_cast<uint32_t>(chunk_state.size());
+    while(from < count && chunk_state[from]) {
+        ++from;
+    }
+    return std::min(from, count);
+}
+
+}
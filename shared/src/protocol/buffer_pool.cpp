@@ -0,0 +1,61 @@
+#include "protocol/buffer_pool.hpp"
+
+namespace protocol {
+
+ChunkBuffer::ChunkBuffer(std::vector<uint8_t> bytes)
+    : bytes_(std::move(bytes)) {
+}
+
+ChunkBuffer::ChunkBuffer(std::vector<uint8_t> bytes, std::shared_ptr<BufferPool> pool)
+    : bytes_(std::move(bytes)), pool_(std::move(pool)) {
+}
+
+ChunkBuffer::~ChunkBuffer() {
+    if(pool_ && bytes_.capacity() > 0) {
+        pool_->release(std::move(bytes_));
+    }
+}
+
+ChunkBuffer& ChunkBuffer::operator=(ChunkBuffer&& other) noexcept {
+    if(this != &other) {
+        if(pool_ && bytes_.capacity() > 0) {
+            pool_->release(std::move(bytes_));
+        }
+        bytes_ = std::move(other.bytes_);
+        pool_ = std::move(other.pool_);
+    }
+    return *this;
+}
+
+ChunkBuffer BufferPool::acquire(uint32_t size) {
+    std::vector<uint8_t> bytes;
+    {
+        std::lock_guard lock(mutex_);
+        if(!idle_.empty()) {
+            bytes = std::move(idle_.back());
+            idle_.pop_back();
+            idle_bytes_ -= bytes.capacity();
+        }
+    }
+    bytes.resize(size); // No allocation within capacity, nothing at all for the same size
+    return ChunkBuffer(std::move(bytes), shared_from_this());
+}
+
+void BufferPool::trim() {
+    std::vector<std::vector<uint8_t>> idle;
+    {
+        std::lock_guard lock(mutex_);
+        idle.swap(idle_);
+        idle_bytes_ = 0;
+    }
+}
+
+void BufferPool::release(std::vector<uint8_t> bytes) {
+    std::lock_guard lock(mutex_);
+    if(idle_bytes_ + bytes.capacity() <= MAX_IDLE_BYTES) {
+        idle_bytes_ += bytes.capacity();
+        idle_.push_back(std::move(bytes));
+    }
+}
+
+}
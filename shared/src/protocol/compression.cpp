@@ -0,0 +1,92 @@
+#include "protocol/compression.hpp"
+#include "protocol/flags.hpp"
+
+#include <array>
+#include <cmath>
+#include <memory>
+#include <zstd.h>
+
+namespace protocol {
+
+namespace {
+
+constexpr size_t SAMPLES = 16; // Spread over the chunk, so a header in front of media data does not fool the check
+constexpr size_t SAMPLE_SIZE = 256;
+
+struct CCtxDeleter {
+    void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+};
+
+struct DCtxDeleter {
+    void operator()(ZSTD_DCtx* ctx) const { ZSTD_freeDCtx(ctx); }
+};
+
+// One context per thread: creating one per chunk costs more than compressing a small chunk
+ZSTD_CCtx* compression_context() {
+    thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> ctx(ZSTD_createCCtx());
+    return ctx.get();
+}
+
+ZSTD_DCtx* decompression_context() {
+    thread_local std::unique_ptr<ZSTD_DCtx, DCtxDeleter> ctx(ZSTD_createDCtx());
+    return ctx.get();
+}
+
+}
+
+bool worth_compressing(const uint8_t* data, size_t size) {
+    if(size < SAMPLE_SIZE) return false;
+
+    std::array<uint32_t, 256> counts{};
+    size_t step = (size - SAMPLE_SIZE) / (SAMPLES - 1);
+    size_t sampled = 0;
+    for(size_t s = 0; s < SAMPLES; ++s) {
+        const uint8_t* sample = data + s * step;
+        for(size_t i = 0; i < SAMPLE_SIZE; ++i) {
+            counts[sample[i]]++;
+        }
+        sampled += SAMPLE_SIZE;
+    }
+
+    double entropy = 0.0;
+    for(uint32_t count : counts) {
+        if(count == 0) continue;
+        double p = static_cast<double>(count) / static_cast<double>(sampled);
+        entropy -= p * std::log2(p);
+    }
+    return entropy < MAX_ENTROPY;
+}
+
+void compress_chunk(ChunkHeader& ch, ChunkBuffer& data, BufferPool& pool) {
+    if(!worth_compressing(data.data(), data.size())) return;
+
+    ZSTD_CCtx* ctx = compression_context();
+    if(ctx == nullptr) return;
+
+    uint32_t limit = static_cast<uint32_t>(data.size() - data.size() / 16); // Under 1/16 saved is not worth the receiver's work
+    ChunkBuffer out = pool.acquire(limit);
+    size_t n = ZSTD_compressCCtx(ctx, out.data(), out.size(), data.data(), data.size(), COMPRESSION_LEVEL);
+    if(ZSTD_isError(n)) return; // Did not fit in limit
+
+    out.bytes().resize(n);
+    ch.size = static_cast<uint32_t>(n);
+    ch.flags |= flags::COMPRESSED;
+    data = std::move(out);
+}
+
+bool decompress_chunk(ChunkHeader& ch, ChunkBuffer& data, uint32_t raw_size, BufferPool& pool) {
+    ch.flags &= static_cast<uint8_t>(~flags::COMPRESSED);
+
+    ZSTD_DCtx* ctx = decompression_context();
+    if(ctx == nullptr) return false;
+
+    ChunkBuffer out = pool.acquire(raw_size); // Bounds the output, a frame claiming more fails instead of growing
+    size_t n = ZSTD_decompressDCtx(ctx, out.data(), out.size(), data.data(), data.size());
+    if(ZSTD_isError(n) || n != raw_size) return false;
+
+    ch.size = raw_size;
+    data = std::move(out);
+    return true;
+}
+
+}
@@ -1,4 +1,8 @@
 #include "protocol/message.hpp"
+#include "filesystem/utils.hpp"
+#include <algorithm>
+#include <cstring>
+#include <arpa/inet.h>
 #include <nlohmann/json.hpp>
 
 using nlohmann::json;
@@ -9,7 +13,8 @@ void to_json(json& j, const ChunkInfo& ci) {
     j = {
         {"index", ci.index},
         {"size", ci.size},
-        {"chunk_hash", ci.chunk_hash}
+        {"chunk_hash", ci.chunk_hash},
+        {"offset", ci.offset}
     };
 }
 
@@ -17,7 +22,8 @@ void from_json(const json& j, ChunkInfo& ci) {
     ci = {
         j.at("index").get<uint32_t>(),
         j.at("size").get<uint32_t>(),
-        j.at("chunk_hash").get<std::string>()
+        j.at("chunk_hash").get<std::string>(),
+        j.value("offset", uint64_t{0}) // Old peers send none, receivers assign offsets from the sizes anyway
     };
 }
 
@@ -34,7 +40,7 @@ void to_json(json& j, const FileEntry& fe) {
 void from_json(const json& j, FileEntry& fe) {
     fe = {
         j.at("relative_path").get<std::string>(),
-        j.at("size").get<uint32_t>(),
+        j.at("size").get<uint64_t>(),
         j.at("file_hash").get<std::string>(),
         j.at("last_modified").get<uint64_t>(),
         j.at("is_directory").get<bool>()
@@ -57,6 +63,40 @@ void from_json(const json& j, TierInfo& ti) {
     };
 }
 
+void to_json(json& j, const BlockSignature& bs) {
+    j = {
+        {"index", bs.index},
+        {"size", bs.size},
+        {"weak", bs.weak},
+        {"strong", bs.strong}
+    };
+}
+
+void from_json(const json& j, BlockSignature& bs) {
+    bs = {
+        j.at("index").get<uint32_t>(),
+        j.at("size").get<uint32_t>(),
+        j.at("weak").get<uint32_t>(),
+        j.at("strong").get<std::string>()
+    };
+}
+
+void to_json(json& j, const DeltaCopy& dc) {
+    j = {
+        {"offset", dc.offset},
+        {"source", dc.source},
+        {"size", dc.size}
+    };
+}
+
+void from_json(const json& j, DeltaCopy& dc) {
+    dc = {
+        j.at("offset").get<uint64_t>(),
+        j.at("source").get<uint64_t>(),
+        j.at("size").get<uint64_t>()
+    };
+}
+
 void to_json(json& j, const Request& req) {
     j = {
         {"cmd", req.cmd},
@@ -69,6 +109,38 @@ void to_json(json& j, const Request& req) {
     if(!req.chunks.empty()) {
         j["chunks"] = req.chunks;
     }
+
+    if(req.window != 0) {
+        j["window"] = req.window;
+    }
+
+    if(req.streams != 0) {
+        j["streams"] = req.streams;
+    }
+
+    if(req.chunk_size != 0) {
+        j["chunk_size"] = req.chunk_size;
+    }
+
+    if(!req.tree_hash.empty()) {
+        j["tree_hash"] = req.tree_hash;
+    }
+
+    if(!req.compression.empty()) {
+        j["compression"] = req.compression;
+    }
+
+    if(!req.chunking.empty()) {
+        j["chunking"] = req.chunking;
+    }
+
+    if(!req.copies.empty()) {
+        j["copies"] = req.copies;
+    }
+
+    if(req.instant) {
+        j["instant"] = true;
+    }
 }
 
 void to_json(json& j, const Response& res) {
@@ -90,19 +162,78 @@ void to_json(json& j, const Response& res) {
     if(!res.tiers.empty()) {
         j["tiers"] = res.tiers;
     }
+
+    if(res.window != 0) {
+        j["window"] = res.window;
+    }
+
+    if(res.streams != 0) {
+        j["streams"] = res.streams;
+        j["stream_token"] = res.stream_token;
+    }
+
+    if(res.chunk_size != 0) {
+        j["chunk_size"] = res.chunk_size;
+    }
+
+    if(!res.tree_hash.empty()) {
+        j["tree_hash"] = res.tree_hash;
+    }
+
+    if(!res.compression.empty()) {
+        j["compression"] = res.compression;
+    }
+
+    if(!res.signatures.empty()) {
+        j["signatures"] = res.signatures;
+    }
+    if(!res.have.empty()) {
+        j["have"] = res.have;
+    }
 }
 
 void from_json(const json& j, Request& req) {
     req.cmd = j.at("cmd").get<std::string>();
     req.first_argument = j.at("first_argument").get<std::string>();
     req.second_argument = j.at("second_argument").get<std::string>();
-    req.size = j.at("size").get<uint32_t>();
+    req.size = j.at("size").get<uint64_t>();
     req.file_hash = j.at("file_hash").get<std::string>();
 
     if(j.contains("chunks")) {
         req.chunks = j.at("chunks").get<std::vector<ChunkInfo>>();
     }
 
+    if(j.contains("window")) {
+        req.window = j.at("window").get<uint32_t>();
+    }
+
+    if(j.contains("streams")) {
+        req.streams = j.at("streams").get<uint32_t>();
+    }
+
+    if(j.contains("chunk_size")) {
+        req.chunk_size = j.at("chunk_size").get<uint32_t>();
+    }
+
+    if(j.contains("tree_hash")) {
+        req.tree_hash = j.at("tree_hash").get<std::string>();
+    }
+
+    if(j.contains("compression")) {
+        req.compression = j.at("compression").get<std::string>();
+    }
+
+    if(j.contains("chunking")) {
+        req.chunking = j.at("chunking").get<std::string>();
+    }
+
+    if(j.contains("copies")) {
+        req.copies = j.at("copies").get<std::vector<DeltaCopy>>();
+    }
+
+    if(j.contains("instant")) {
+        req.instant = j.at("instant").get<bool>();
+    }
 }
 
 void from_json(const json& j, Response& res) {
@@ -122,6 +253,105 @@ void from_json(const json& j, Response& res) {
     if(j.contains("tiers")) {
         res.tiers = j.at("tiers").get<std::vector<TierInfo>>();
     }
+
+    if(j.contains("window")) {
+        res.window = j.at("window").get<uint32_t>();
+    }
+
+    if(j.contains("streams")) {
+        res.streams = j.at("streams").get<uint32_t>();
+        res.stream_token = j.value("stream_token", "");
+    }
+
+    if(j.contains("chunk_size")) {
+        res.chunk_size = j.at("chunk_size").get<uint32_t>();
+    }
+
+    if(j.contains("tree_hash")) {
+        res.tree_hash = j.at("tree_hash").get<std::string>();
+    }
+
+    if(j.contains("compression")) {
+        res.compression = j.at("compression").get<std::string>();
+    }
+
+    if(j.contains("signatures")) {
+        res.signatures = j.at("signatures").get<std::vector<BlockSignature>>();
+    }
+    if(j.contains("have")) {
+        res.have = j.at("have").get<std::vector<uint32_t>>();
+    }
+}
+
+uint32_t negotiate_window(uint32_t requested) {
+    return std::clamp<uint32_t>(requested, 1, MAX_WINDOW);
+}
+
+uint32_t preferred_chunk_size(uint64_t throughput) {
+    if(throughput == 0) return fsutils::CHUNK_SIZE;
+    uint64_t target = throughput / 20; // 50 ms of the link per chunk keeps header, hash and ack overhead small
+    uint32_t size = MIN_CHUNK_SIZE;
+    while(size < MAX_CHUNK_SIZE && size < target) {
+        size *= 2;
+    }
+    return size;
+}
+
+uint32_t choose_chunk_size(uint64_t file_size, uint32_t preferred) {
+    uint32_t size = valid_chunk_size(preferred) ? preferred : fsutils::CHUNK_SIZE;
+    while(size < MAX_CHUNK_SIZE && file_size > static_cast<uint64_t>(size) * TARGET_CHUNKS) {
+        size *= 2;
+    }
+    return size;
+}
+
+bool valid_chunk_size(uint32_t chunk_size) {
+    return chunk_size >= MIN_CHUNK_SIZE && chunk_size <= MAX_CHUNK_SIZE && (chunk_size & (chunk_size - 1)) == 0;
+}
+
+std::vector<uint8_t> encode_ack(uint32_t cumulative) {
+    uint32_t net = htonl(cumulative);
+    std::vector<uint8_t> data(sizeof(uint32_t));
+    std::memcpy(data.data(), &net, sizeof(uint32_t));
+    return data;
+}
+
+uint32_t decode_ack(const std::vector<uint8_t>& data) {
+    if(data.size() != sizeof(uint32_t)) return 0;
+    uint32_t net;
+    std::memcpy(&net, data.data(), sizeof(uint32_t));
+    return ntohl(net);
+}
+
+OutboundFrame make_json_frame(const std::string& body) {
+    uint32_t len = htonl(static_cast<uint32_t>(body.size()));
+    OutboundFrame frame;
+    frame.header_size = sizeof(uint32_t);
+    std::memcpy(frame.header.data(), &len, sizeof(uint32_t));
+    frame.body = ChunkBuffer(std::vector<uint8_t>(body.begin(), body.end()));
+    return frame;
+}
+
+OutboundFrame make_chunk_frame(const ChunkHeader& ch, ChunkBuffer data) {
+    ChunkHeader net{
+        htonl(ch.transfer_id),
+        htonl(ch.index),
+        htonl(ch.size),
+        ch.flags
+    };
+    OutboundFrame frame;
+    frame.header_size = sizeof(ChunkHeader);
+    std::memcpy(frame.header.data(), &net, sizeof(ChunkHeader));
+    frame.body = std::move(data);
+    return frame;
+}
+
+OutboundFrame make_file_chunk_frame(const ChunkHeader& ch, std::shared_ptr<fsutils::TransferFile> file, uint64_t offset) {
+    OutboundFrame frame = make_chunk_frame(ch, ChunkBuffer());
+    frame.file = std::move(file);
+    frame.file_offset = offset;
+    frame.file_size = ch.size;
+    return frame;
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+
+// Timing and reporting shared by the benchmarks in this directory
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+struct Result {
+    double seconds;
+    bool ok; // What body returned, a failed run is reported but not timed
+};
+
+inline Result measure(const std::function<bool()>& body) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = body();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return {elapsed.count(), ok};
+}
+
+// "name: <ms> ms, <MB/s> MB/s, detail" for a run over bytes, "name: FAILED" if it failed
+inline void report(const std::string& name, const Result& r, uint64_t bytes, const std::string& detail = "") {
+    double mb = static_cast<double>(bytes) / (1024.0 * 1024.0);
+    std::cout << name << ": ";
+    if(!r.ok) {
+        std::cout << "FAILED" << std::endl;
+        return;
+    }
+    std::cout << r.seconds * 1000.0 << " ms, " << mb / r.seconds << " MB/s";
+    if(!detail.empty()) std::cout << ", " << detail;
+    std::cout << std::endl;
+}
+
+inline uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if(sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+}
+
+}
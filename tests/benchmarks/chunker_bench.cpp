@@ -0,0 +1,65 @@
+// Measures content-defined chunking (fsutils::cdc_cut) throughput on random data, and how many
+// chunks survive a one-byte insertion at the front of the data, which shifts every fixed chunk.
+//
+// Usage: chunker_bench [size_mb = 1024] [avg_kb = 256]
+//
+// Only the cut points are searched, chunks are not hashed: hashing costs the same for both
+// layouts, so this is the price of content-defined boundaries on top of it.
+
+#include "filesystem/chunker.hpp"
+#include "protocol/message.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace {
+
+std::vector<uint64_t> cut_points(const std::vector<uint8_t>& data, uint32_t avg) { // End offset of every chunk
+    std::vector<uint64_t> ends;
+    size_t start = 0;
+    while(start < data.size()) {
+        start += fsutils::cdc_cut(data.data() + start, data.size() - start, avg);
+        ends.push_back(start);
+    }
+    return ends;
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint64_t size_mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024;
+    uint32_t avg = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10) * 1024) : 256 * 1024;
+    if(size_mb == 0 || !protocol::valid_chunk_size(avg)) {
+        std::cerr << "size_mb must be positive, avg_kb a power of two within 64-4096" << std::endl;
+        return 1;
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint8_t> data(size_mb * 1024 * 1024);
+    for(auto& b : data) b = static_cast<uint8_t>(rng());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint64_t> ends = cut_points(data, avg);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double gb = static_cast<double>(data.size()) / (1024.0 * 1024.0 * 1024.0);
+    std::cout << "Chunked " << size_mb << " MB, avg " << avg / 1024 << " KB: " << gb / seconds << " GB/s, "
+              << ends.size() << " chunks, mean " << data.size() / ends.size() / 1024 << " KB" << std::endl;
+
+    std::vector<uint8_t> shifted;
+    shifted.reserve(data.size() + 1);
+    shifted.push_back(0x5a);
+    shifted.insert(shifted.end(), data.begin(), data.end());
+
+    std::set<uint64_t> before(ends.begin(), ends.end());
+    size_t kept = 0;
+    for(uint64_t end : cut_points(shifted, avg)) {
+        if(before.count(end - 1) != 0) kept++; // Same boundary, one byte later
+    }
+    std::cout << "After a 1 byte insertion at the front: " << kept << "/" << ends.size() << " boundaries kept" << std::endl;
+    return 0;
+}
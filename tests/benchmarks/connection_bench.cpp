@@ -0,0 +1,217 @@
+// Measures how a running server scales with the number of connections: for 1, 4, 16, ... up to
+// max_connections clients at once, each logs in (public mode) and then sends TIERS back to back,
+// which touches no files, so what is measured is the server's event loop, not the disk.
+//
+// Usage: connection_bench <port> [seconds per step = 5] [max_connections = 256] [host = 127.0.0.1] [client threads = one per core]
+//
+// Run it once against each io model of the same server build and compare the lines:
+//
+//     ./build/server/server --port 9100 --root /tmp/md_root --io-model shared &
+//     ./build/tests/connection_bench 9100
+//     ./build/server/server --port 9100 --root /tmp/md_root --io-model per-core --pin-cpus &
+//     ./build/tests/connection_bench 9100
+//
+// shared runs every session on one io_context served by all threads, per-core gives every
+// thread its own io_context and SO_REUSEPORT acceptor. Client and server share the machine,
+// so pass fewer client threads (or --threads to the server) to keep them off each other's cores.
+// Any refused login or request fails the benchmark.
+
+#include "bench.hpp"
+#include "protocol/commands.hpp"
+#include "protocol/message.hpp"
+#include "protocol/statuses.hpp"
+
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+
+using asio::ip::tcp;
+using nlohmann::json;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<uint8_t> frame(const std::string& cmd) {
+    protocol::Request req{};
+    req.cmd = cmd;
+    req.size = 0;
+    json j;
+    protocol::to_json(j, req);
+    std::string body = j.dump();
+    uint32_t len = htonl(static_cast<uint32_t>(body.size()));
+    std::vector<uint8_t> out(sizeof(len) + body.size());
+    std::memcpy(out.data(), &len, sizeof(len));
+    std::memcpy(out.data() + sizeof(len), body.data(), body.size());
+    return out;
+}
+
+struct Step;
+
+// One connection of a step. Only one operation of it is in flight at a time, so its handlers never overlap.
+struct Connection : std::enable_shared_from_this<Connection> {
+    Step* step;
+    tcp::socket socket;
+    uint32_t len = 0;
+    std::vector<char> body;
+    Clock::time_point sent;
+    std::vector<uint32_t> latencies; // Microseconds, measured requests only
+
+    Connection(Step* step, asio::io_context& io_context) : step(step), socket(io_context) {}
+    void start(const tcp::endpoint& endpoint);
+    void request();
+    void exchange(const std::vector<uint8_t>& out, std::function<void(bool)> done);
+};
+
+struct Step {
+    asio::io_context& io_context;
+    asio::steady_timer timer;
+    std::chrono::seconds duration;
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<uint8_t> login = frame(protocol::commands::LOGIN);
+    std::vector<uint8_t> tiers = frame(protocol::commands::TIERS);
+    std::atomic<size_t> logged_in{0};
+    std::atomic<size_t> errors{0};
+    std::atomic<bool> stop{false};
+    Clock::time_point begin;
+    Clock::time_point measuring;
+
+    Step(asio::io_context& io_context, std::chrono::seconds duration) : io_context(io_context), timer(io_context), duration(duration) {}
+
+    void ready() { // A connection logged in, the last one starts the clock for everybody
+        if(++logged_in != connections.size()) return;
+        measuring = Clock::now();
+        timer.expires_after(duration);
+        timer.async_wait([this](std::error_code) { stop = true; });
+        for(auto& connection : connections) {
+            asio::post(connection->socket.get_executor(), [connection]() { connection->request(); });
+        }
+    }
+    void failed() { // The others finish the request they have in flight and stop
+        errors++;
+        stop = true;
+    }
+};
+
+void Connection::start(const tcp::endpoint& endpoint) {
+    auto self = shared_from_this();
+    socket.async_connect(endpoint, [this, self](std::error_code ec) {
+        if(ec) {
+            step->failed();
+            return;
+        }
+        socket.set_option(tcp::no_delay(true), ec);
+        exchange(step->login, [this](bool ok) {
+            if(ok) step->ready();
+        });
+    });
+}
+
+void Connection::request() {
+    if(step->stop) return;
+    sent = Clock::now();
+    exchange(step->tiers, [this](bool ok) {
+        if(!ok) return;
+        latencies.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent).count()));
+        request();
+    });
+}
+
+void Connection::exchange(const std::vector<uint8_t>& out, std::function<void(bool)> done) {
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(out), [this, self, done](std::error_code ec, std::size_t) {
+        if(ec) {
+            step->failed();
+            return done(false);
+        }
+        asio::async_read(socket, asio::buffer(&len, sizeof(len)), [this, self, done](std::error_code ec, std::size_t) {
+            if(ec) {
+                step->failed();
+                return done(false);
+            }
+            body.resize(ntohl(len));
+            asio::async_read(socket, asio::buffer(body), [this, self, done](std::error_code ec, std::size_t) {
+                json res = ec ? json() : json::parse(body, nullptr, false);
+                bool ok = res.is_object() && res.value("status", "") == protocol::statuses::OK;
+                if(!ok) step->failed();
+                done(ok);
+            });
+        });
+    });
+}
+
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cerr << "Usage: connection_bench <port> [seconds per step = 5] [max_connections = 256] [host = 127.0.0.1] [client threads = one per core]" << std::endl;
+        return 1;
+    }
+    auto port = static_cast<uint16_t>(std::strtoul(argv[1], nullptr, 10));
+    auto seconds = std::chrono::seconds(argc > 2 ? std::strtol(argv[2], nullptr, 10) : 5);
+    size_t max_connections = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 256;
+    std::string host = argc > 4 ? argv[4] : "127.0.0.1";
+    unsigned threads = argc > 5 ? static_cast<unsigned>(std::strtoul(argv[5], nullptr, 10)) : std::max(1u, std::thread::hardware_concurrency());
+    if(port == 0 || seconds.count() <= 0 || max_connections == 0 || threads == 0) {
+        std::cerr << "port, seconds, max_connections and threads must be positive" << std::endl;
+        return 1;
+    }
+    std::error_code ec;
+    tcp::endpoint endpoint(asio::ip::make_address(host, ec), port);
+    if(ec) {
+        std::cerr << "Not an IP address: " << host << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    for(size_t n = 1; ok; n = std::min(n * 4, max_connections)) {
+        asio::io_context io_context(static_cast<int>(threads));
+        Step step(io_context, seconds);
+        for(size_t i = 0; i < n; ++i) {
+            step.connections.push_back(std::make_shared<Connection>(&step, io_context));
+        }
+        step.begin = Clock::now();
+        for(auto& connection : step.connections) {
+            connection->start(endpoint);
+        }
+        std::vector<std::thread> pool;
+        for(unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([&io_context]() { io_context.run(); });
+        }
+        for(auto& thread : pool) {
+            thread.join();
+        }
+        auto end = Clock::now();
+
+        std::vector<uint32_t> latencies;
+        for(auto& connection : step.connections) {
+            latencies.insert(latencies.end(), connection->latencies.begin(), connection->latencies.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        if(step.errors != 0 || step.logged_in != n) {
+            std::cerr << n << " connections: " << step.errors << " connection(s) failed or were refused, " << step.logged_in << " logged in" << std::endl;
+            ok = false;
+            break;
+        }
+        double login_ms = std::chrono::duration<double, std::milli>(step.measuring - step.begin).count();
+        double measured = std::chrono::duration<double>(end - step.measuring).count();
+        std::cout << n << " connections: all logged in after " << login_ms << " ms, "
+                  << static_cast<double>(latencies.size()) / measured << " requests/s, latency p50 " << bench::percentile(latencies, 0.50)
+                  << " us, p99 " << bench::percentile(latencies, 0.99) << " us" << std::endl;
+        if(n == max_connections) break;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// Copies one directory tree with each strategy of the copy engine (fsutils::copy_tree), starting
+// at reflink, at copy_file_range(2) and at a plain buffered copy, next to the single threaded
+// std::filesystem::copy that fsutils::copy_path() used before.
+//
+// Usage: copy_bench [files = 256] [file_mb = 16] [work_dir = temp directory]
+//
+// Put work_dir on the filesystem to measure: reflinks need btrfs, XFS or bcachefs, elsewhere that
+// run falls back and the per-strategy counts say so. The tree is written once and stays in the
+// page cache, so the numbers are the cost of moving data around, not of reading it from disk.
+// Each run starts after sync(2) and its copy is deleted before the next one.
+
+#include "bench.hpp"
+#include "filesystem/copy_engine.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+bench::Result measure(const std::function<bool()>& body) {
+    ::sync(); // Writeback of the previous run would otherwise land on this one
+    return bench::measure(body);
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint32_t files = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 256;
+    uint32_t file_mb = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 16;
+    fs::path dir = argc > 3 ? fs::path(argv[3]) : fs::temp_directory_path() / "minidrive_copy_bench";
+    if(files == 0 || file_mb == 0 || file_mb > 4095) {
+        std::cerr << "files must be positive, file_mb 1-4095" << std::endl;
+        return 1;
+    }
+
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    fs::path src = dir / "src";
+
+    // Ten files per directory, so the tree has some depth like a real user's files/
+    std::mt19937_64 rng(42);
+    std::vector<char> data(static_cast<size_t>(file_mb) * 1024 * 1024);
+    for(uint32_t i = 0; i < files; ++i) {
+        for(auto& b : data) b = static_cast<char>(rng());
+        fs::path file = src / ("d" + std::to_string(i / 10)) / ("f" + std::to_string(i));
+        fs::create_directories(file.parent_path(), ec);
+        std::ofstream(file, std::ios::binary).write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+    uint64_t bytes = static_cast<uint64_t>(files) * data.size();
+    std::cout << "Tree of " << files << " files, " << file_mb << " MB each, in " << dir.string() << std::endl;
+
+    bench::Result plain = measure([&]() {
+        std::error_code copy_ec;
+        fs::copy(src, dir / "plain", fs::copy_options::recursive, copy_ec);
+        return !copy_ec;
+    });
+    bench::report("std::filesystem::copy", plain, bytes);
+    fs::remove_all(dir / "plain", ec);
+
+    for(fsutils::CopyStrategy first : {fsutils::CopyStrategy::REFLINK, fsutils::CopyStrategy::COPY_FILE_RANGE, fsutils::CopyStrategy::BUFFERED}) {
+        fsutils::CopyStats stats;
+        fs::path dest = dir / fsutils::to_string(first);
+        bench::Result r = measure([&]() { return fsutils::copy_tree(src, dest, stats, first); });
+        bench::report(std::string("copy_tree from ") + fsutils::to_string(first), r, bytes, stats.summary());
+        fs::remove_all(dest, ec);
+    }
+
+    fs::remove_all(dir, ec);
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Measures public-mode clients working at once against a running server: readers LIST a shared
+// directory, writers create and remove a directory of their own. Every public session shares one
+// lock scope, so with one lock per user they all take turns; with path locks the readers share
+// shared/ and every writer only holds its own w<N>/, and all of them proceed together.
+//
+// Usage: path_lock_bench <port> [clients = 100] [writers = clients / 4] [seconds = 10] [host = 127.0.0.1]
+//
+//     ./build/server/server --port 9100 --root /tmp/md_root &
+//     ./build/tests/path_lock_bench 9100
+//
+// Run it against a build before path locks (or with --lock-wait 0, which answers 503 instead of
+// waiting) to see the difference. Requests refused with 503 are counted, any other error fails
+// the benchmark. It leaves shared/ and the w<N>/ directories in the public storage.
+
+#include "bench.hpp"
+#include "protocol/codes.hpp"
+#include "protocol/commands.hpp"
+#include "protocol/message.hpp"
+
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+
+using asio::ip::tcp;
+using nlohmann::json;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// One blocking client, requests one at a time. Returns the response code, 0 when the connection failed
+struct Client {
+    tcp::socket socket;
+
+    explicit Client(asio::io_context& io_context) : socket(io_context) {}
+
+    bool connect(const tcp::endpoint& endpoint) {
+        std::error_code ec;
+        socket.connect(endpoint, ec);
+        if(ec) return false;
+        socket.set_option(tcp::no_delay(true), ec);
+        return request(protocol::commands::LOGIN, "") == protocol::codes::OK;
+    }
+
+    int request(const std::string& cmd, const std::string& argument) {
+        protocol::Request req{};
+        req.cmd = cmd;
+        req.first_argument = argument;
+        req.size = 0;
+        json j;
+        protocol::to_json(j, req);
+        std::string body = j.dump();
+        uint32_t len = htonl(static_cast<uint32_t>(body.size()));
+        std::error_code ec;
+        std::array<asio::const_buffer, 2> out{asio::buffer(&len, sizeof(len)), asio::buffer(body)};
+        asio::write(socket, out, ec);
+        if(ec) return 0;
+        asio::read(socket, asio::buffer(&len, sizeof(len)), ec);
+        if(ec) return 0;
+        std::string reply(ntohl(len), '\0');
+        asio::read(socket, asio::buffer(reply), ec);
+        if(ec) return 0;
+        json res = json::parse(reply, nullptr, false);
+        return res.is_object() ? res.value("code", 0) : 0;
+    }
+};
+
+struct Totals {
+    std::vector<uint32_t> latencies; // Microseconds, answered requests
+    uint64_t busy = 0; // Refused with 503
+    uint64_t failed = 0; // Any other error
+};
+
+void report(const char* what, std::vector<uint32_t>& latencies, uint64_t busy, double seconds) {
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << what << static_cast<double>(latencies.size()) / seconds << " requests/s, "
+              << busy << " refused as busy, latency p50 " << bench::percentile(latencies, 0.50)
+              << " us, p99 " << bench::percentile(latencies, 0.99) << " us" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cerr << "Usage: path_lock_bench <port> [clients = 100] [writers = clients / 4] [seconds = 10] [host = 127.0.0.1]" << std::endl;
+        return 1;
+    }
+    auto port = static_cast<uint16_t>(std::strtoul(argv[1], nullptr, 10));
+    size_t clients = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100;
+    size_t writers = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : clients / 4;
+    auto seconds = std::chrono::seconds(argc > 4 ? std::strtol(argv[4], nullptr, 10) : 10);
+    std::string host = argc > 5 ? argv[5] : "127.0.0.1";
+    if(port == 0 || clients == 0 || writers > clients || seconds.count() <= 0) {
+        std::cerr << "port, clients and seconds must be positive, writers at most clients" << std::endl;
+        return 1;
+    }
+    std::error_code ec;
+    tcp::endpoint endpoint(asio::ip::make_address(host, ec), port);
+    if(ec) {
+        std::cerr << "Not an IP address: " << host << std::endl;
+        return 1;
+    }
+
+    asio::io_context io_context;
+    {
+        Client setup(io_context);
+        if(!setup.connect(endpoint)) {
+            std::cerr << "Cannot log in to " << host << ":" << port << std::endl;
+            return 1;
+        }
+        setup.request(protocol::commands::MKDIR, "shared"); // Left over from an earlier run is fine
+        for(size_t w = 0; w < writers; ++w) {
+            setup.request(protocol::commands::MKDIR, "w" + std::to_string(w));
+            setup.request(protocol::commands::RMDIR, "w" + std::to_string(w) + "/d");
+        }
+    }
+
+    std::vector<Totals> totals(clients);
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i]() {
+            Client client(io_context);
+            bool connected = client.connect(endpoint);
+            ready++;
+            while(!go) std::this_thread::yield();
+            if(!connected) {
+                totals[i].failed++;
+                return;
+            }
+            bool writer = i < writers;
+            std::string dir = "w" + std::to_string(i) + "/d";
+            for(uint64_t n = 0; !stop; ++n) {
+                auto sent = Clock::now();
+                int code = writer ? client.request(n % 2 == 0 ? protocol::commands::MKDIR : protocol::commands::RMDIR, dir)
+                                  : client.request(protocol::commands::LIST, "shared");
+                if(code == protocol::codes::SERVICE_UNAVAILABLE) {
+                    totals[i].busy++;
+                    if(writer) n--; // Try the same step again
+                } else if(code != protocol::codes::OK) {
+                    totals[i].failed++;
+                    return;
+                } else {
+                    totals[i].latencies.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent).count()));
+                }
+            }
+        });
+    }
+    while(ready != clients) std::this_thread::yield();
+    auto start = Clock::now();
+    go = true;
+    std::this_thread::sleep_for(seconds);
+    stop = true;
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    double measured = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint32_t> reads;
+    std::vector<uint32_t> writes;
+    uint64_t read_busy = 0;
+    uint64_t write_busy = 0;
+    uint64_t failed = 0;
+    for(size_t i = 0; i < clients; ++i) {
+        auto& into = i < writers ? writes : reads;
+        into.insert(into.end(), totals[i].latencies.begin(), totals[i].latencies.end());
+        (i < writers ? write_busy : read_busy) += totals[i].busy;
+        failed += totals[i].failed;
+    }
+    std::cout << clients << " public clients, " << writers << " writing, " << measured << " s" << std::endl;
+    report("LIST shared:        ", reads, read_busy, measured);
+    report("MKDIR/RMDIR w<N>/d: ", writes, write_busy, measured);
+    std::cout << "Total: " << static_cast<double>(reads.size() + writes.size()) / measured << " requests/s" << std::endl;
+    if(failed != 0) {
+        std::cerr << failed << " client(s) failed with an error other than 503" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Measures hashing a file and cutting its chunk plan the old way - scan_file() for the whole-file
+// hash, then compute_chunks()/compute_cdc_chunks() reading it again - against the single pass of
+// fsutils::scan_file_chunks(), for the fixed and the content-defined layout.
+//
+// Usage: scan_bench [size_mb = 1024] [chunk_kb = 256] [work_dir = temp directory] [threads = one per core]
+//
+// Each run starts with the file evicted from the page cache (POSIX_FADV_DONTNEED after fdatasync),
+// like a DOWNLOAD of a file nobody touched lately, then again with it cached. Both paths hash
+// every byte twice (file hash and chunk hash), so a warm cache shows little more than the
+// per-chunk opens, a cold one the read the single pass saves.
+// Last, the single pass hashing its chunks on the calling thread only against one thread per core
+// (at most MAX_HASH_THREADS), warm, which is where the threads show: the whole-file hash stays on
+// one thread, so the speedup tops out at about 2x.
+// All paths must produce the same hash and plan, the benchmark fails otherwise.
+
+#include "bench.hpp"
+#include "filesystem/chunker.hpp"
+#include "filesystem/scanner.hpp"
+#include "filesystem/utils.hpp"
+#include "protocol/message.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void evict(const fs::path& file) { // Best effort, a filesystem that ignores the advice measures warm twice
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+bool same_plan(const std::vector<protocol::ChunkInfo>& a, const std::vector<protocol::ChunkInfo>& b) {
+    if(a.size() != b.size()) return false;
+    for(size_t i = 0; i < a.size(); ++i) {
+        if(a[i].index != b[i].index || a[i].size != b[i].size || a[i].chunk_hash != b[i].chunk_hash || a[i].offset != b[i].offset) return false;
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint64_t size_mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024;
+    uint32_t chunk_size = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10) * 1024) : 256 * 1024;
+    fs::path dir = argc > 3 ? fs::path(argv[3]) : fs::temp_directory_path() / "minidrive_scan_bench";
+    if(size_mb == 0 || !protocol::valid_chunk_size(chunk_size) || (argc > 4 && std::strtoul(argv[4], nullptr, 10) == 0)) {
+        std::cerr << "size_mb and threads must be positive, chunk_kb a power of two within 64-4096" << std::endl;
+        return 1;
+    }
+    if(sodium_init() < 0) return 1;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    fs::path file = dir / "scan_bench.bin";
+    {
+        std::mt19937_64 rng(42);
+        std::vector<char> block(1024 * 1024);
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        for(uint64_t i = 0; i < size_mb; ++i) {
+            for(auto& b : block) b = static_cast<char>(rng());
+            out.write(block.data(), static_cast<std::streamsize>(block.size()));
+        }
+    }
+    double mb = static_cast<double>(size_mb);
+    std::cout << "File of " << size_mb << " MB, chunks of " << chunk_size / 1024 << " KB, in " << dir.string() << std::endl;
+
+    bool ok = true;
+    for(bool cold : {true, false}) {
+        for(bool content_defined : {false, true}) {
+            std::string layout = std::string(content_defined ? "cdc" : "fixed") + (cold ? ", cold" : ", warm");
+
+            fsutils::FileMetadata before;
+            std::vector<protocol::ChunkInfo> before_chunks;
+            if(cold) evict(file);
+            double two_pass = bench::measure([&]() {
+                before = fsutils::scan_file(file);
+                before_chunks = content_defined ? fsutils::compute_cdc_chunks(before, chunk_size) : fsutils::compute_chunks(before, chunk_size);
+                return true; // Checked against the single pass below
+            }).seconds;
+
+            fsutils::FileMetadata after;
+            std::vector<protocol::ChunkInfo> after_chunks;
+            if(cold) evict(file);
+            bench::Result one_pass = bench::measure([&]() { return fsutils::scan_file_chunks(file, chunk_size, content_defined, after, after_chunks); });
+
+            std::cout << layout << ", scan_file + compute_chunks: " << two_pass * 1000.0 << " ms, " << mb / two_pass << " MB/s" << std::endl;
+            std::cout << layout << ", scan_file_chunks:           " << one_pass.seconds * 1000.0 << " ms, " << mb / one_pass.seconds << " MB/s, "
+                      << after_chunks.size() << " chunks" << std::endl;
+            if(!one_pass.ok || before.hash != after.hash || !same_plan(before_chunks, after_chunks)) {
+                std::cerr << layout << ": the single pass disagrees with the old path" << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    unsigned threads = argc > 4 ? static_cast<unsigned>(std::strtoul(argv[4], nullptr, 10)) : std::min(fsutils::MAX_HASH_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+    for(bool content_defined : {false, true}) {
+        const char* layout = content_defined ? "cdc" : "fixed";
+        fsutils::FileMetadata single;
+        std::vector<protocol::ChunkInfo> single_chunks;
+        bench::Result one = bench::measure([&]() { return fsutils::scan_file_chunks(file, chunk_size, content_defined, single, single_chunks, 1); });
+
+        fsutils::FileMetadata parallel;
+        std::vector<protocol::ChunkInfo> parallel_chunks;
+        bench::Result many = bench::measure([&]() { return fsutils::scan_file_chunks(file, chunk_size, content_defined, parallel, parallel_chunks, threads); });
+
+        std::cout << layout << ", warm, 1 thread:  " << one.seconds * 1000.0 << " ms, " << mb / one.seconds << " MB/s" << std::endl;
+        std::cout << layout << ", warm, " << threads << " threads: " << many.seconds * 1000.0 << " ms, " << mb / many.seconds << " MB/s, "
+                  << one.seconds / many.seconds << "x" << std::endl;
+        if(!one.ok || !many.ok || single.hash != parallel.hash || !same_plan(single_chunks, parallel_chunks)) {
+            std::cerr << layout << ": hashing on " << threads << " threads disagrees with 1 thread" << std::endl;
+            ok = false;
+        }
+    }
+
+    fs::remove(file, ec);
+    return ok ? 0 : 1;
+}
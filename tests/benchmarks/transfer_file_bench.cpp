@@ -0,0 +1,105 @@
+// Compares the per-chunk open path (fsutils::write_chunk/read_chunk) with a transfer-scoped
+// fsutils::TransferFile (one descriptor, pwrite/pread at chunk offsets).
+//
+// Usage: transfer_file_bench [size_mb = 256] [work_dir = temp directory]
+//
+// Files stay in the page cache, so the numbers show the cost of opening/seeking/closing per
+// chunk rather than disk speed.
+
+#include "bench.hpp"
+#include "filesystem/utils.hpp"
+#include "filesystem/transfer_file.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void report(const std::string& name, const bench::Result& r, uint32_t chunks, uint64_t bytes) {
+    std::ostringstream detail;
+    detail << r.seconds * 1e6 / chunks << " us/chunk";
+    bench::report(name, r, bytes, detail.str());
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint32_t size_mb = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 256;
+    fs::path dir = argc > 2 ? fs::path(argv[2]) : fs::temp_directory_path() / "minidrive_transfer_file_bench";
+    if(size_mb == 0 || size_mb > 4095) {
+        std::cerr << "size_mb must be 1-4095" << std::endl;
+        return 1;
+    }
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if(ec) {
+        std::cerr << "Cannot create " << dir << ": " << ec.message() << std::endl;
+        return 1;
+    }
+
+    const uint64_t bytes = static_cast<uint64_t>(size_mb) * 1024 * 1024;
+    const uint32_t chunks = static_cast<uint32_t>(bytes / fsutils::CHUNK_SIZE);
+
+    std::vector<uint8_t> chunk(fsutils::CHUNK_SIZE);
+    std::mt19937 rng(42);
+    for(auto& b : chunk) b = static_cast<uint8_t>(rng());
+
+    fs::path legacy_file = dir / "per_chunk_open.bin";
+    fs::path held_file = dir / "transfer_file.bin";
+    fs::remove(legacy_file, ec);
+    fs::remove(held_file, ec);
+
+    std::cout << "Chunks: " << chunks << " x " << fsutils::CHUNK_SIZE << " B (" << size_mb << " MB) in " << dir << std::endl;
+
+    bench::Result write_legacy = bench::measure([&] {
+        for(uint32_t i = 0; i < chunks; ++i) {
+            if(!fsutils::write_chunk(legacy_file, i * fsutils::CHUNK_SIZE, chunk)) return false;
+        }
+        return true;
+    });
+    report("write, open per chunk ", write_legacy, chunks, bytes);
+
+    bench::Result write_held = bench::measure([&] {
+        fsutils::TransferFile file;
+        if(!file.open(held_file, fsutils::TransferFile::Mode::WRITE)) return false;
+        for(uint32_t i = 0; i < chunks; ++i) {
+            if(!file.write_at(static_cast<uint64_t>(i) * fsutils::CHUNK_SIZE, chunk)) return false;
+        }
+        return true;
+    });
+    report("write, TransferFile   ", write_held, chunks, bytes);
+
+    bench::Result read_legacy = bench::measure([&] {
+        for(uint32_t i = 0; i < chunks; ++i) {
+            std::vector<uint8_t> data = fsutils::read_chunk(legacy_file, i * fsutils::CHUNK_SIZE, fsutils::CHUNK_SIZE);
+            if(data.size() != fsutils::CHUNK_SIZE) return false;
+        }
+        return true;
+    });
+    report("read,  open per chunk ", read_legacy, chunks, bytes);
+
+    bench::Result read_held = bench::measure([&] {
+        fsutils::TransferFile file;
+        if(!file.open(held_file, fsutils::TransferFile::Mode::READ)) return false;
+        std::vector<uint8_t> data;
+        for(uint32_t i = 0; i < chunks; ++i) {
+            if(!file.read_at(static_cast<uint64_t>(i) * fsutils::CHUNK_SIZE, fsutils::CHUNK_SIZE, data)) return false;
+        }
+        return true;
+    });
+    report("read,  TransferFile   ", read_held, chunks, bytes);
+
+    fs::remove(legacy_file, ec);
+    fs::remove(held_file, ec);
+
+    bool ok = write_legacy.ok && write_held.ok && read_legacy.ok && read_held.ok;
+    return ok ? 0 : 1;
+}
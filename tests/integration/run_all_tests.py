@@ -31,7 +31,12 @@ TEST_SUITES = [
     ("err", "Error Handling", "test_error_handling.py"),
     ("resume", "Resume Transfers", "test_resume.py"),
     ("log", "Client Logging", "test_logging.py"),
+    ("striped", "Striped Uploads", "test_striped_transfer.py"),
+    ("cdc", "Content-Defined Chunking", "test_cdc.py"),
+    ("store", "Chunk Store", "test_chunk_store.py"),
+    ("uring", "io_uring Engine", "test_io_engine.py"),
     ("multi", "Multiple Sessions", "test_multiple_sessions.py"),
+    ("stress", "Session Stress", "test_stress_sessions.py"),
 ]
 
 
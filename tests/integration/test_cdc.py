@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Integration tests for content-defined chunking (client --cdc).
+
+Goal:
+- A file chunked by content arrives byte-identical, and downloads back the same.
+- An edited copy (bytes inserted near the start) of an uploaded file uploads intact with --cdc.
+
+Usage:
+    python3 tests/integration/test_cdc.py
+"""
+
+import os
+import sys
+import subprocess
+
+from test_utils import (
+    TestResult,
+    check_executables,
+    TestEnvironment,
+    calculate_hash
+)
+
+SERVER_PORT = 9034
+
+CHUNK_SIZE = 256 * 1024
+
+
+class CdcEnv(TestEnvironment):
+    def __init__(self, port=SERVER_PORT):
+        super().__init__("cdc", port)
+
+    def run_cdc(self, commands, label, timeout=60):
+        """Run public mode client commands with --cdc, returns (stdout, exit_code)."""
+        self.test_counter += 1
+        stdout_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_stdout.log")
+        client_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_client.log")
+
+        proc = self.start_client_process(f"127.0.0.1:{self.port}", client_log, extra_args=["--cdc"])
+        input_data = "\n".join(commands) + "\nEXIT\n"
+        try:
+            stdout, _ = proc.communicate(input=input_data, timeout=timeout)
+            code = proc.returncode
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            stdout, _ = proc.communicate()
+            code = -1
+
+        with open(stdout_log, "w") as f:
+            f.write(f"# Commands: {commands} (--cdc)\n")
+            f.write(f"# Exit code: {code}\n")
+            f.write(f"# {'='*50}\n\n")
+            f.write(stdout or "")
+        return stdout or "", code
+
+
+def server_file(env, name):
+    return os.path.join(env.server_root, "public", "files", name)
+
+
+def test_cdc_roundtrip(env: CdcEnv, results: TestResult):
+    """Upload and download with content-defined chunks, both copies must match."""
+    name = "cdc_roundtrip.bin"
+    local = os.path.join(env.client_cwd, name)
+    with open(local, "wb") as f:
+        f.write(os.urandom(12 * CHUNK_SIZE + 4321))
+    downloaded = "cdc_roundtrip_back.bin"
+
+    stdout, _ = env.run_cdc([f"UPLOAD {name}", f"DOWNLOAD {name} {downloaded}"], "cdc_roundtrip")
+
+    remote = server_file(env, name)
+    back = os.path.join(env.client_cwd, downloaded)
+    if "Upload successful" not in stdout or not os.path.exists(remote) or calculate_hash(remote) != calculate_hash(local):
+        results.fail("CDC round trip", f"Upload failed or server copy differs: {stdout[-300:]}")
+    elif not os.path.exists(back) or calculate_hash(back) != calculate_hash(local):
+        results.fail("CDC round trip", "Downloaded copy differs")
+    else:
+        results.ok("CDC round trip")
+
+
+def test_cdc_edited_upload(env: CdcEnv, results: TestResult):
+    """Bytes inserted near the start shift every later offset, the new version must still arrive intact."""
+    original = os.path.join(env.client_cwd, "cdc_original.bin")
+    data = os.urandom(16 * CHUNK_SIZE)
+    with open(original, "wb") as f:
+        f.write(data)
+    stdout, _ = env.run_cdc(["UPLOAD cdc_original.bin"], "cdc_edited_original")
+    if "Upload successful" not in stdout:
+        results.fail("CDC upload of an edited file", f"First upload failed: {stdout[-300:]}")
+        return
+
+    name = "cdc_edited.bin"
+    local = os.path.join(env.client_cwd, name)
+    with open(local, "wb") as f:
+        f.write(data[:1000] + os.urandom(100) + data[1000:])
+    stdout, _ = env.run_cdc([f"UPLOAD {name}"], "cdc_edited")
+
+    remote = server_file(env, name)
+    if os.path.exists(remote) and calculate_hash(remote) == calculate_hash(local):
+        results.ok("CDC upload of an edited file")
+    else:
+        results.fail("CDC upload of an edited file", f"Server copy differs: {stdout[-300:]}")
+
+
+def main():
+    print("MiniDrive Integration Tests - Content-Defined Chunking")
+    print("=" * 60)
+
+    check_executables()
+
+    env = CdcEnv()
+    results = TestResult(env.log_dir)
+
+    try:
+        env.setup_server_root()
+        env.start_server()
+
+        test_cdc_roundtrip(env, results)
+        test_cdc_edited_upload(env, results)
+
+    finally:
+        env.cleanup()
+
+    ok = results.summary()
+    print(f"\nLogs saved to: {env.log_dir}")
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
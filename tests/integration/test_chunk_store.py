@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""Integration tests for a server started with --chunk-store.
+
+Goal:
+- An upload whose leading chunks are already stored only sends the rest, and the result matches.
+- A user who knows another user's chunks (by uploading the same bytes) is not handed them:
+  the server stages nothing from files outside the uploader's own and the public ones.
+- An upload of a file the server already stores finishes without sending it, but never from
+  another user's copy.
+
+Usage:
+    python3 tests/integration/test_chunk_store.py
+"""
+
+import os
+import re
+import sys
+import subprocess
+
+from test_utils import (
+    TestResult,
+    check_executables,
+    TestEnvironment,
+    calculate_hash
+)
+
+SERVER_PORT = 9035
+
+MB = 1024 * 1024
+
+ALICE = ("alice", "alice_pw")
+BOB = ("bob", "bob_pw")
+
+
+class ChunkStoreEnv(TestEnvironment):
+    def __init__(self, port=SERVER_PORT):
+        super().__init__("chunk_store", port)
+
+    def run_as(self, user, commands, label, timeout=60):
+        """Run client commands as (username, password), or in public mode for None. Returns (stdout, client log)."""
+        self.test_counter += 1
+        stdout_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_stdout.log")
+        client_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_client.log")
+
+        address = f"127.0.0.1:{self.port}"
+        lines = list(commands) + ["EXIT"]
+        if user is not None:
+            address = f"{user[0]}@{address}"
+            lines = [user[1]] + lines
+        proc = self.start_client_process(address, client_log)
+        try:
+            stdout, _ = proc.communicate(input="\n".join(lines) + "\n", timeout=timeout)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            stdout, _ = proc.communicate()
+
+        with open(stdout_log, "w") as f:
+            f.write(f"# User: {user[0] if user else 'public'}\n# Commands: {commands}\n")
+            f.write(f"# {'='*50}\n\n")
+            f.write(stdout or "")
+        log = ""
+        if os.path.exists(client_log):
+            with open(client_log, errors="replace") as f:
+                log = f.read()
+        return stdout or "", log
+
+    def server_log(self):
+        with open(os.path.join(self.log_dir, "server.log"), errors="replace") as f:
+            return f.read()
+
+    def staged_lines(self, username):
+        """Server log lines saying chunks were staged for username's upload."""
+        return re.findall(rf"\[{re.escape(username)}\] \d+ of \d+ chunks .* are already stored", self.server_log())
+
+
+def write_file(env, name, data):
+    path = os.path.join(env.client_cwd, name)
+    with open(path, "wb") as f:
+        f.write(data)
+    return path
+
+
+def public_file(env, name):
+    return os.path.join(env.server_root, "public", "files", name)
+
+
+def private_file(env, username, name):
+    return os.path.join(env.server_root, "private", username, "files", name)
+
+
+def test_upload_skips_stored_chunks(env: ChunkStoreEnv, results: TestResult):
+    """A file that extends a stored one: the stored prefix is staged on the server, not sent."""
+    base = os.urandom(4 * MB)
+    first = write_file(env, "store_base.bin", base)
+    stdout, _ = env.run_as(None, [f"UPLOAD {first}"], "store_base")
+    if "Upload successful" not in stdout:
+        results.fail("Upload skips stored chunks", f"First upload failed: {stdout[-300:]}")
+        return
+
+    extended = write_file(env, "store_extended.bin", base + os.urandom(MB + 123))
+    stdout, log = env.run_as(None, [f"UPLOAD {extended}"], "store_extended")
+    remote = public_file(env, "store_extended.bin")
+    if "Upload successful" not in stdout or not os.path.exists(remote) or calculate_hash(remote) != calculate_hash(extended):
+        results.fail("Upload skips stored chunks", f"Second upload failed or differs: {stdout[-300:]}")
+    elif not env.staged_lines("public") or "Server already stores" not in stdout + log:
+        results.fail("Upload skips stored chunks", "Server did not report the stored chunks as had")
+    else:
+        results.ok("Upload skips stored chunks")
+
+
+def test_no_chunks_from_other_users(env: ChunkStoreEnv, results: TestResult):
+    """bob uploads bytes only alice stores: nothing is staged for him, every chunk travels."""
+    secret = os.urandom(4 * MB)
+    local = write_file(env, "store_secret.bin", secret)
+    stdout, _ = env.run_as(ALICE, [f"UPLOAD {local}"], "store_alice")
+    if "Upload successful" not in stdout:
+        results.fail("No chunks from other users", f"alice's upload failed: {stdout[-300:]}")
+        return
+
+    guess = write_file(env, "store_guess.bin", secret + os.urandom(MB)) # Same leading chunk hashes as alice's file
+    stdout, log = env.run_as(BOB, [f"UPLOAD {guess}"], "store_bob")
+    remote = private_file(env, "bob", "store_guess.bin")
+    if "Upload successful" not in stdout or not os.path.exists(remote) or calculate_hash(remote) != calculate_hash(guess):
+        results.fail("No chunks from other users", f"bob's upload failed or differs: {stdout[-300:]}")
+    elif env.staged_lines("bob") or "Server already stores" in stdout + log:
+        results.fail("No chunks from other users", "alice's chunks were staged into bob's upload")
+    else:
+        results.ok("No chunks from other users")
+
+
+def test_instant_upload(env: ChunkStoreEnv, results: TestResult):
+    """The same bytes under a new name: the server places its stored copy, no chunks are sent."""
+    data = os.urandom(2 * MB + 77)
+    first = write_file(env, "instant_first.bin", data)
+    stdout, _ = env.run_as(None, [f"UPLOAD {first}"], "instant_first")
+    if "Upload successful" not in stdout:
+        results.fail("Instant upload", f"First upload failed: {stdout[-300:]}")
+        return
+
+    again = write_file(env, "instant_again.bin", data)
+    stdout, _ = env.run_as(None, [f"UPLOAD {again}"], "instant_again")
+    remote = public_file(env, "instant_again.bin")
+    if "Identical file already stored" not in stdout:
+        results.fail("Instant upload", f"Server did not finish it from its copy: {stdout[-300:]}")
+    elif not os.path.exists(remote) or calculate_hash(remote) != calculate_hash(again):
+        results.fail("Instant upload", "Server copy differs")
+    else:
+        results.ok("Instant upload")
+
+
+def test_no_instant_upload_from_other_users(env: ChunkStoreEnv, results: TestResult):
+    """bob uploads an exact copy of a file only alice stores: it has to be sent in full."""
+    secret = os.urandom(MB + 5)
+    local = write_file(env, "instant_secret.bin", secret)
+    stdout, _ = env.run_as(ALICE, [f"UPLOAD {local}"], "instant_alice")
+    if "Upload successful" not in stdout:
+        results.fail("No instant upload from other users", f"alice's upload failed: {stdout[-300:]}")
+        return
+
+    stdout, _ = env.run_as(BOB, [f"UPLOAD {local}"], "instant_bob")
+    remote = private_file(env, "bob", "instant_secret.bin")
+    if "Identical file already stored" in stdout:
+        results.fail("No instant upload from other users", "bob's upload was finished from alice's file")
+    elif "Upload successful" not in stdout or not os.path.exists(remote) or calculate_hash(remote) != calculate_hash(local):
+        results.fail("No instant upload from other users", f"bob's upload failed or differs: {stdout[-300:]}")
+    else:
+        results.ok("No instant upload from other users")
+
+
+def main():
+    print("MiniDrive Integration Tests - Chunk Store")
+    print("=" * 60)
+
+    check_executables()
+
+    env = ChunkStoreEnv()
+    results = TestResult(env.log_dir)
+
+    try:
+        env.setup_server_root()
+        env.start_server(["--chunk-store"])
+        for user in (ALICE, BOB):
+            env.register_user(user[0], user[1], f"register_{user[0]}")
+
+        test_upload_skips_stored_chunks(env, results)
+        test_no_chunks_from_other_users(env, results)
+        test_instant_upload(env, results)
+        test_no_instant_upload_from_other_users(env, results)
+
+    finally:
+        env.cleanup()
+
+    ok = results.summary()
+    print(f"\nLogs saved to: {env.log_dir}")
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -478,6 +478,44 @@ def test_download_binary_file(env, results):
         env.run_client(f"DELETE {server_file}", "cleanup_download_binary")
 
 
+def test_download_after_server_side_change(env, results):
+    """DOWNLOAD must not serve a stale chunk plan after the stored file changed in place."""
+    server_file = "download_changed.bin"
+    server_file_path = os.path.join(env.client_cwd, server_file)
+    with open(server_file_path, "wb") as f:
+        f.write(os.urandom(1024 * 600))
+    env.run_client(f"UPLOAD {server_file}", "setup_download_changed")
+    os.remove(server_file_path)
+
+    local_file = "downloaded_changed.bin"
+    local_file_path = os.path.join(env.client_cwd, local_file)
+    stored = os.path.join(env.server_root, "public", "files", server_file)
+
+    try:
+        env.run_client(f"DOWNLOAD {server_file} {local_file}", "download_changed_first")
+        if os.path.exists(local_file_path):
+            os.remove(local_file_path)
+
+        new_content = os.urandom(1024 * 600) # Same size, different bytes
+        with open(stored, "r+b") as f:
+            f.write(new_content)
+
+        stdout, code = env.run_client(f"DOWNLOAD {server_file} {local_file}", "download_changed_second")
+        if not has_ok_response(stdout) or not os.path.exists(local_file_path):
+            results.fail("DOWNLOAD after server-side change", "Second download failed")
+            return
+        with open(local_file_path, "rb") as f:
+            if f.read() == new_content:
+                results.ok("DOWNLOAD after server-side change")
+            else:
+                results.fail("DOWNLOAD after server-side change", "Got the old content")
+
+    finally:
+        if os.path.exists(local_file_path):
+            os.remove(local_file_path)
+        env.run_client(f"DELETE {server_file}", "cleanup_download_changed")
+
+
 def test_download_nonexistent(env, results):
     """Test DOWNLOAD fails for non-existent remote file."""
     stdout, code = env.run_client("DOWNLOAD nonexistent.xyz local.txt", "download_nonexistent")
@@ -678,6 +716,7 @@ def main():
         test_download_file(env, results)
         test_download_binary_file(env, results)
         test_download_very_large_file(env, results)
+        test_download_after_server_side_change(env, results)
         test_download_nonexistent(env, results)
         
         # DELETE tests
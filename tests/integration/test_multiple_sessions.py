@@ -4,6 +4,7 @@
 Goal:
 - Validate the server can handle multiple sessions for the same user (or public mode).
 - Exercise concurrent operations on the same files/user.
+- A second session of a user waits for the first one's operation instead of getting 503.
 
 Usage:
     python3 tests/integration/test_multiple_sessions.py
@@ -482,6 +483,39 @@ def test_auth_race_condition_same_file(env: MultiSessionEnv, results: TestResult
         results.fail("Auth Race Condition", "File corrupted (mixed content)")
 
 
+def test_same_user_waits_for_lock(env: MultiSessionEnv, results: TestResult):
+    """Commands of a second session queue behind the first session's upload instead of getting 503."""
+    username = "queue_user"
+    password = "password"
+    env.register_user(username, password, "queue_reg")
+
+    cwd_a = env.new_workdir("queue_a")
+    with open(os.path.join(cwd_a, "big.bin"), "wb") as f:
+        f.write(os.urandom(32 * 1024 * 1024))
+    cwd_b = env.new_workdir("queue_b")
+
+    proc_a, input_a, log_a = env.spawn_auth_client(cwd_a, username, password, "UPLOAD big.bin big.bin", "queue_a")
+    proc_b, input_b, log_b = env.spawn_auth_client(cwd_b, username, password, ["LIST", "MKDIR queued_dir", "LIST"], "queue_b")
+
+    def _second():
+        time.sleep(0.3) # Let the upload take the lock first
+        return communicate_and_log(proc_b, input_b, log_b)
+
+    (stdout_a, code_a), (stdout_b, code_b) = _run_parallel_jobs([
+        lambda: communicate_and_log(proc_a, input_a, log_a),
+        _second
+    ])
+
+    if code_a != 0 or "ERROR" in stdout_a:
+        results.fail("Same User Lock Queue", f"Upload failed. See {log_a}")
+    elif code_b != 0 or "ERROR" in stdout_b:
+        results.fail("Same User Lock Queue", f"Second session was refused instead of waiting. See {log_b}")
+    elif "queued_dir" not in stdout_b:
+        results.fail("Same User Lock Queue", f"MKDIR of the second session did not land. See {log_b}")
+    else:
+        results.ok("Second session of a user waited for the upload instead of getting 503")
+
+
 def test_registration_race_condition(env: MultiSessionEnv, results: TestResult):
     """Concurrent registration of the same user."""
     username = "conflict_user"
@@ -555,6 +589,7 @@ def main():
         test_race_condition_upload(env, results)
         test_auth_multi_session_consistency(env, results)
         test_auth_race_condition_same_file(env, results)
+        test_same_user_waits_for_lock(env, results)
         test_registration_race_condition(env, results)
 
     finally:
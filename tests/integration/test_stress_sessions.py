@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""Stress test for MiniDrive sessions running on many threads at once.
+
+Goal:
+- Drive many concurrent sessions (public mode plus several private users with several sessions
+  each) through uploads, listings and downloads in rounds, so handlers of different sessions run
+  on all io_context threads at the same time.
+- Every command either succeeds or is refused with 503 (another session of the same user held an
+  overlapping path lock too long, or the work pool was full); downloads that succeed match what
+  was stored.
+- The server survives, and exits cleanly on SIGTERM with sessions still connected.
+- Built with -DMINIDRIVE_SANITIZE=thread (or address), the server log must hold no sanitizer report:
+
+    cmake -S . -B build-tsan -DMINIDRIVE_SANITIZE=thread && cmake --build build-tsan -j
+    MINIDRIVE_BUILD_DIR=build-tsan python3 tests/integration/test_stress_sessions.py
+
+- MINIDRIVE_IO_MODEL=per-core runs the server with one io_context per thread (--io-model per-core),
+  so striped and parallel sessions also cross io_contexts.
+
+Usage:
+    python3 tests/integration/test_stress_sessions.py
+"""
+
+import os
+import sys
+import re
+import subprocess
+import threading
+import time
+
+from test_utils import (
+    TestResult,
+    check_executables,
+    calculate_hash,
+    TestEnvironment,
+    communicate_and_log,
+    SERVER_EXE
+)
+
+SERVER_PORT = 9032
+
+USERS = [("stress_a", "pass_a"), ("stress_b", "pass_b"), ("stress_c", "pass_c")]
+SESSIONS_PER_USER = 4
+PUBLIC_SESSIONS = 8
+ROUNDS = 3
+CLIENT_TIMEOUT = 180 # Sanitized builds run several times slower
+IO_MODEL = os.environ.get("MINIDRIVE_IO_MODEL", "shared")
+
+_ERROR_RE = re.compile(r"^ERROR:\s*<(\d+)>", re.MULTILINE)
+_SANITIZER_RE = re.compile(r"WARNING: ThreadSanitizer|ERROR: AddressSanitizer|ERROR: LeakSanitizer|runtime error:")
+
+
+class StressEnv(TestEnvironment):
+
+    def start_server(self):
+        self.server_log_file = open(os.path.join(self.log_dir, "server.log"), "a")
+        self.server_process = subprocess.Popen(
+            [SERVER_EXE, "--port", str(self.port), "--root", self.server_root, "--io-model", IO_MODEL],
+            stdout=self.server_log_file,
+            stderr=self.server_log_file,
+            text=True,
+        )
+        time.sleep(0.5)
+        if self.server_process.poll() is not None:
+            self.server_log_file.close()
+            with open(os.path.join(self.log_dir, "server.log")) as f:
+                output = f.read()
+            raise RuntimeError(f"Server failed to start: {output}")
+        print(f"Server started on port {self.port} (PID: {self.server_process.pid}, {IO_MODEL} io model)")
+
+    def is_server_alive(self) -> bool:
+        return self.server_process is not None and self.server_process.poll() is None
+
+    def spawn(self, cwd: str, user, commands, label: str):
+        """Spawn a client as user (None for public) and return (proc, input_data, stdout_log_path)."""
+        lines = list(commands) + ["EXIT"]
+        address = f"127.0.0.1:{self.port}"
+        if user is not None:
+            address = f"{user[0]}@{address}"
+            lines = [user[1]] + lines
+        stdout_log = os.path.join(self.log_dir, f"{label}_stdout.log")
+        client_log = os.path.join(self.log_dir, f"{label}_client.log")
+        proc = self.start_client_process(address, client_log, cwd=cwd)
+        return proc, "\n".join(lines) + "\n", stdout_log
+
+
+def _write_random(path: str, size: int):
+    with open(path, "wb") as f:
+        f.write(os.urandom(size))
+
+
+def seed(env: StressEnv, results: TestResult):
+    """Register the users and store the file every session downloads. Returns its hash or None."""
+    for username, password in USERS:
+        stdout, code = env.register_user(username, password, f"register_{username}")
+        if code != 0:
+            results.fail("Stress setup", f"Registration of {username} failed (exit code {code})")
+            return None
+
+    cwd = env.new_workdir("seed")
+    _write_random(os.path.join(cwd, "seed.bin"), 2 * 1024 * 1024 + 12345)
+    for user in [None] + USERS:
+        label = f"seed_{user[0] if user else 'public'}"
+        proc, input_data, stdout_log = env.spawn(cwd, user, ["UPLOAD seed.bin seed.bin"], label)
+        stdout, code = communicate_and_log(proc, input_data, stdout_log, timeout=CLIENT_TIMEOUT)
+        if code != 0 or "ERROR" in stdout:
+            results.fail("Stress setup", f"Seeding {label} failed. See {stdout_log}")
+            return None
+    results.ok("Registered users and seeded their storage")
+    return calculate_hash(os.path.join(cwd, "seed.bin"))
+
+
+def storm(env: StressEnv, results: TestResult, seed_hash: str, round_no: int):
+    """One round: every session at once, each uploading its own file, listing and downloading the seed."""
+    sessions = [None] * PUBLIC_SESSIONS + [user for user in USERS for _ in range(SESSIONS_PER_USER)]
+    outcomes = [None] * len(sessions)
+
+    def _run(i, user):
+        label = f"r{round_no}_s{i:02d}_{user[0] if user else 'public'}"
+        cwd = env.new_workdir(label)
+        _write_random(os.path.join(cwd, "own.bin"), 256 * 1024 + i * 4099)
+        commands = [
+            f"UPLOAD own.bin own_r{round_no}_s{i}.bin",
+            "LIST",
+            "DOWNLOAD seed.bin seed_copy.bin",
+            "LIST",
+        ]
+        proc, input_data, stdout_log = env.spawn(cwd, user, commands, label)
+        stdout, code = communicate_and_log(proc, input_data, stdout_log, timeout=CLIENT_TIMEOUT)
+        outcomes[i] = (label, cwd, stdout, code, stdout_log)
+
+    threads = [threading.Thread(target=_run, args=(i, user), daemon=True) for i, user in enumerate(sessions)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    busy = 0
+    for label, cwd, stdout, code, stdout_log in outcomes:
+        if code != 0:
+            results.fail(f"Stress round {round_no}", f"{label} exited with {code}. See {stdout_log}")
+            return False
+        codes = [int(c) for c in _ERROR_RE.findall(stdout)]
+        unexpected = [c for c in codes if c != 503]
+        if unexpected:
+            results.fail(f"Stress round {round_no}", f"{label} got errors {unexpected}. See {stdout_log}")
+            return False
+        busy += len(codes)
+        copy = os.path.join(cwd, "seed_copy.bin")
+        if os.path.exists(copy) and calculate_hash(copy) != seed_hash:
+            results.fail(f"Stress round {round_no}", f"{label} downloaded a corrupt copy. See {stdout_log}")
+            return False
+
+    if not env.is_server_alive():
+        results.fail(f"Stress round {round_no}", "Server died")
+        return False
+    results.ok(f"Stress round {round_no}: {len(sessions)} concurrent sessions, {busy} command(s) refused as busy")
+    return True
+
+
+def shutdown_with_sessions(env: StressEnv, results: TestResult):
+    """SIGTERM while sessions are connected and idle: every one is told to exit, the server stops."""
+    procs = []
+    for i in range(PUBLIC_SESSIONS):
+        cwd = env.new_workdir(f"idle_{i}")
+        proc, _, _ = env.spawn(cwd, None, [], f"idle_{i}")
+        procs.append(proc)
+    time.sleep(1.0) # Let them log in, stdin stays open so they wait for commands
+
+    server = env.server_process
+    env.stop_server() # SIGTERM, SIGKILL after 5 seconds
+    for proc in procs:
+        try:
+            proc.communicate(input="", timeout=30)
+        except Exception:
+            proc.kill()
+            proc.communicate()
+    if server.returncode != 0:
+        results.fail("Shutdown", f"Server did not exit cleanly on SIGTERM (exit code {server.returncode})")
+    else:
+        results.ok("Server stopped cleanly with sessions connected")
+
+
+def check_sanitizer_report(env: StressEnv, results: TestResult):
+    server_log = os.path.join(env.log_dir, "server.log")
+    with open(server_log, "r", errors="replace") as f:
+        report = _SANITIZER_RE.search(f.read())
+    if report:
+        results.fail("Sanitizer", f"Server log has a sanitizer report ({report.group(0)}). See {server_log}")
+    else:
+        results.ok("No sanitizer report in the server log")
+
+
+def main():
+    print("MiniDrive Integration Tests - Session Stress")
+    print("=" * 60)
+
+    check_executables()
+
+    # Keep going after the first race, the log then lists all of them
+    os.environ.setdefault("TSAN_OPTIONS", "halt_on_error=0 second_deadlock_stack=1")
+
+    env = StressEnv("stress", SERVER_PORT)
+    results = TestResult(env.log_dir)
+
+    try:
+        env.setup_server_root()
+        env.start_server()
+
+        seed_hash = seed(env, results)
+        if seed_hash is not None:
+            for round_no in range(1, ROUNDS + 1):
+                if not storm(env, results, seed_hash, round_no):
+                    break
+        shutdown_with_sessions(env, results)
+        check_sanitizer_report(env, results)
+
+    finally:
+        env.cleanup()
+
+    ok = results.summary()
+    print(f"\nLogs saved to: {env.log_dir}")
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
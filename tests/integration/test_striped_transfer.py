@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+"""Integration tests for striped uploads (client --streams).
+
+Goal:
+- An upload spread over extra data connections arrives byte-identical.
+- The session keeps working after a striped upload (later commands, plain downloads).
+- Invalid --streams values are rejected before connecting.
+
+Usage:
+    python3 tests/integration/test_striped_transfer.py
+"""
+
+import os
+import sys
+import subprocess
+
+from test_utils import (
+    TestResult,
+    check_executables,
+    TestEnvironment,
+    calculate_hash,
+    has_ok_response
+)
+
+SERVER_PORT = 9031
+
+CHUNK_SIZE = 256 * 1024
+
+
+class StripedEnv(TestEnvironment):
+    def __init__(self, port=SERVER_PORT):
+        super().__init__("striped", port)
+
+    def run_striped(self, commands, label, streams, timeout=60):
+        """Run public mode client commands with --streams, returns (stdout, exit_code)."""
+        self.test_counter += 1
+        stdout_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_stdout.log")
+        client_log = os.path.join(self.log_dir, f"{self.test_counter:02d}_{label}_client.log")
+
+        proc = self.start_client_process(f"127.0.0.1:{self.port}", client_log, extra_args=["--streams", str(streams)])
+        input_data = "\n".join(commands) + "\nEXIT\n"
+        try:
+            stdout, _ = proc.communicate(input=input_data, timeout=timeout)
+            code = proc.returncode
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            stdout, _ = proc.communicate()
+            code = -1
+
+        with open(stdout_log, "w") as f:
+            f.write(f"# Commands: {commands} (--streams {streams})\n")
+            f.write(f"# Exit code: {code}\n")
+            f.write(f"# {'='*50}\n\n")
+            f.write(stdout or "")
+        return stdout or "", code
+
+
+def make_file(env, name, size):
+    path = os.path.join(env.client_cwd, name)
+    with open(path, "wb") as f:
+        f.write(os.urandom(size))
+    return path
+
+
+def server_file(env, name):
+    return os.path.join(env.server_root, "public", "files", name)
+
+
+def test_striped_upload(env: StripedEnv, results: TestResult):
+    """Many chunks over four extra connections, server copy must match."""
+    name = "striped_big.bin"
+    local = make_file(env, name, 40 * CHUNK_SIZE + 1234) # Odd tail chunk
+
+    stdout, _ = env.run_striped([f"UPLOAD {name}"], "striped_upload", 4)
+    if "Upload successful" not in stdout:
+        results.fail("Striped upload", f"Upload did not finish: {stdout[-300:]}")
+        return
+
+    remote = server_file(env, name)
+    if os.path.exists(remote) and calculate_hash(remote) == calculate_hash(local):
+        results.ok("Striped upload")
+    else:
+        results.fail("Striped upload", "Server copy differs from the local file")
+
+
+def test_striped_single_chunk(env: StripedEnv, results: TestResult):
+    """A one-chunk file has nothing to stripe, LAST still has to go out on the session's connection."""
+    name = "striped_small.bin"
+    local = make_file(env, name, 1000)
+
+    stdout, _ = env.run_striped([f"UPLOAD {name}"], "striped_single_chunk", 8)
+    remote = server_file(env, name)
+    if "Upload successful" in stdout and os.path.exists(remote) and calculate_hash(remote) == calculate_hash(local):
+        results.ok("Striped upload of a single chunk")
+    else:
+        results.fail("Striped upload of a single chunk", f"Got: {stdout[-300:]}")
+
+
+def test_commands_after_striped_upload(env: StripedEnv, results: TestResult):
+    """The session's own connection stays usable: list and download in the same run."""
+    name = "striped_roundtrip.bin"
+    local = make_file(env, name, 12 * CHUNK_SIZE + 7)
+    downloaded = "striped_roundtrip_back.bin"
+
+    stdout, _ = env.run_striped([
+        f"UPLOAD {name}",
+        "LIST",
+        f"DOWNLOAD {name} {downloaded}"
+    ], "striped_roundtrip", 3)
+
+    back = os.path.join(env.client_cwd, downloaded)
+    if "Upload successful" not in stdout or name not in stdout:
+        results.fail("Commands after striped upload", f"Upload or LIST failed: {stdout[-300:]}")
+    elif not os.path.exists(back) or calculate_hash(back) != calculate_hash(local):
+        results.fail("Commands after striped upload", "Downloaded copy differs")
+    else:
+        results.ok("Commands after striped upload")
+
+
+def test_streams_zero(env: StripedEnv, results: TestResult):
+    """--streams 0 keeps the upload on the session's connection."""
+    name = "striped_zero.bin"
+    local = make_file(env, name, 5 * CHUNK_SIZE)
+
+    stdout, _ = env.run_striped([f"UPLOAD {name}"], "streams_zero", 0)
+    remote = server_file(env, name)
+    if has_ok_response(stdout) and os.path.exists(remote) and calculate_hash(remote) == calculate_hash(local):
+        results.ok("--streams 0")
+    else:
+        results.fail("--streams 0", f"Got: {stdout[-300:]}")
+
+
+def test_invalid_streams(env: StripedEnv, results: TestResult):
+    """Out of range or non-numeric counts are refused before connecting."""
+    for value in ["9", "-1", "many"]:
+        stdout, code = env.run_striped(["LIST"], f"invalid_streams_{value}", value, timeout=10)
+        if code == 0 or "--streams" not in stdout:
+            results.fail(f"Invalid --streams {value}", f"Expected usage error, got code {code}: {stdout[-200:]}")
+            return
+    results.ok("Invalid --streams values rejected")
+
+
+def main():
+    print("MiniDrive Integration Tests - Striped Uploads")
+    print("=" * 60)
+
+    check_executables()
+
+    env = StripedEnv()
+    results = TestResult(env.log_dir)
+
+    try:
+        env.setup_server_root()
+        env.start_server()
+
+        test_striped_upload(env, results)
+        test_striped_single_chunk(env, results)
+        test_commands_after_striped_upload(env, results)
+        test_streams_zero(env, results)
+        test_invalid_streams(env, results)
+
+    finally:
+        env.cleanup()
+
+    ok = results.summary()
+    print(f"\nLogs saved to: {env.log_dir}")
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -24,7 +24,7 @@ from pathlib import Path
 
 
 # Configuration
-BUILD_DIR = os.path.abspath("build")
+BUILD_DIR = os.path.abspath(os.environ.get("MINIDRIVE_BUILD_DIR", "build")) # e.g. build-tsan for a sanitized build
 
 def _get_exe_path(name, subfolder):
     """Find executable, checking build/subfolder/name then build/name."""
@@ -138,6 +138,7 @@ class TestEnvironment:
         self.server_root = os.path.abspath(f"data/test_{suite_name}_root")
         self.server_process = None
         self.server_log_file = None
+        self.server_args = []
         self.test_counter = 0
         
         # Setup client working directory
@@ -195,10 +196,11 @@ class TestEnvironment:
             # Default to False if check fails to be safe
             return False
 
-    def start_client_process(self, address, log_file=None, cwd=None, text=True, bufsize=-1):
+    def start_client_process(self, address, log_file=None, cwd=None, text=True, bufsize=-1, extra_args=None):
         """
         Start the client process with appropriate arguments.
         Handles logging support check automatically.
+        extra_args are appended after the endpoint (e.g. ["--streams", "4"]).
         """
         if self.supports_logging is None:
             self.supports_logging = self._check_logging_support()
@@ -207,6 +209,8 @@ class TestEnvironment:
         args = ["stdbuf", "-o0", "-e0", CLIENT_EXE, address]
         if self.supports_logging and log_file:
             args.extend(["--log", log_file])
+        if extra_args:
+            args.extend(extra_args)
             
         return subprocess.Popen(
             args,
@@ -236,11 +240,16 @@ class TestEnvironment:
             shutil.rmtree(self.server_root)
         os.makedirs(self.server_root, exist_ok=True)
     
-    def start_server(self):
-        """Start the MiniDrive server."""
+    def start_server(self, extra_args=None):
+        """
+        Start the MiniDrive server.
+        extra_args are appended after the root (e.g. ["--chunk-store"]), restart_server() keeps them.
+        """
+        if extra_args is not None:
+            self.server_args = list(extra_args)
         self.server_log_file = open(os.path.join(self.log_dir, "server.log"), "a")
         self.server_process = subprocess.Popen(
-            [SERVER_EXE, "--port", str(self.port), "--root", self.server_root],
+            [SERVER_EXE, "--port", str(self.port), "--root", self.server_root] + self.server_args,
             stdout=self.server_log_file,
             stderr=self.server_log_file,
             text=True
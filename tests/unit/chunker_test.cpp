@@ -0,0 +1,129 @@
+// Content-defined chunking (filesystem/chunker.hpp): cuts stay put around an insertion, chunk
+// sizes stay within [cdc_min_size, cdc_max_size], and the file reader cuts like cdc_cut() does.
+
+#undef NDEBUG // The checks are asserts, keep them in release builds
+#include "filesystem/chunker.hpp"
+
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sodium.h>
+#include <unistd.h>
+
+namespace {
+
+std::vector<uint8_t> random_bytes(size_t size, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> data(size);
+    for(auto& b : data) b = static_cast<uint8_t>(rng());
+    return data;
+}
+
+std::vector<uint64_t> cut_points(const std::vector<uint8_t>& data, uint32_t avg) { // End offset of every chunk
+    std::vector<uint64_t> ends;
+    size_t start = 0;
+    while(start < data.size()) {
+        start += fsutils::cdc_cut(data.data() + start, data.size() - start, avg);
+        ends.push_back(start);
+    }
+    return ends;
+}
+
+void check_sizes(const std::vector<uint64_t>& ends, uint32_t avg) {
+    uint64_t start = 0;
+    for(size_t i = 0; i < ends.size(); ++i) {
+        uint64_t size = ends[i] - start;
+        assert(size > 0 && size <= fsutils::cdc_max_size(avg));
+        if(i + 1 < ends.size()) {
+            assert(size >= fsutils::cdc_min_size(avg));
+        }
+        start = ends[i];
+    }
+}
+
+fsutils::FileMetadata write_file(const std::filesystem::path& path, const std::vector<uint8_t>& data) {
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    return fsutils::FileMetadata{path, data.size(), 0, {}};
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0) {
+        std::cerr << "libsodium initialization failed" << std::endl;
+        return 1;
+    }
+    const uint32_t avg = protocol::MIN_CHUNK_SIZE;
+
+    // Test 1: an insertion near the start only moves the cuts around it
+    std::vector<uint8_t> data = random_bytes(8 * 1024 * 1024, 42);
+    std::vector<uint8_t> edited = data;
+    const size_t at = 1000;
+    const size_t inserted = 100;
+    std::vector<uint8_t> insertion = random_bytes(inserted, 7);
+    edited.insert(edited.begin() + at, insertion.begin(), insertion.end());
+
+    std::vector<uint64_t> before = cut_points(data, avg);
+    std::vector<uint64_t> after = cut_points(edited, avg);
+    assert(before.size() > 64);
+    size_t b = 0;
+    size_t a = 0;
+    while(b < before.size() && a < after.size() && before[b] + inserted != after[a]) { // Walk both to the first shared cut
+        if(before[b] + inserted < after[a]) ++b;
+        else ++a;
+    }
+    assert(b < before.size() && before[b] < at + 4 * fsutils::cdc_max_size(avg)); // Back in step within a few chunks
+    assert(before.size() - b == after.size() - a);
+    for(; b < before.size(); ++a, ++b) {
+        assert(before[b] + inserted == after[a]);
+    }
+    std::cout << "Cuts back in step after an insertion" << std::endl;
+
+    // Test 2: chunk sizes stay within bounds, on random data and on data that never cuts
+    check_sizes(before, avg);
+    check_sizes(after, avg);
+    check_sizes(cut_points(random_bytes(8 * 1024 * 1024, 3), 4 * avg), 4 * avg);
+    std::vector<uint8_t> zeros(1024 * 1024 + 123, 0);
+    std::vector<uint64_t> flat = cut_points(zeros, avg);
+    check_sizes(flat, avg);
+    for(size_t i = 0; i + 1 < flat.size(); ++i) { // The hash never matches on zeros, only max_size cuts them
+        assert(flat[i] == (i + 1) * fsutils::cdc_max_size(avg));
+    }
+    assert(fsutils::cdc_cut(zeros.data(), fsutils::cdc_min_size(avg), avg) == fsutils::cdc_min_size(avg)); // A tail shorter than min is one chunk
+    std::cout << "Chunk sizes within [min, max]" << std::endl;
+
+    // Test 3: compute_cdc_chunks() reads a file in pieces and cuts it the same way
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("minidrive_chunker_test_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    std::vector<protocol::ChunkInfo> chunks = fsutils::compute_cdc_chunks(write_file(dir / "edited.bin", edited), avg);
+    assert(chunks.size() == after.size());
+    uint64_t offset = 0;
+    for(size_t i = 0; i < chunks.size(); ++i) {
+        assert(chunks[i].index == i && chunks[i].offset == offset);
+        offset += chunks[i].size;
+        assert(offset == after[i]);
+    }
+    assert(fsutils::valid_cdc_plan(chunks, edited.size(), avg));
+    assert(!fsutils::valid_cdc_plan(chunks, edited.size() + 1, avg));
+
+    const uint32_t min = fsutils::cdc_min_size(avg);
+    const uint32_t max = fsutils::cdc_max_size(avg);
+    auto plan = [](std::vector<uint32_t> sizes) {
+        std::vector<protocol::ChunkInfo> p;
+        for(uint32_t size : sizes) p.push_back({static_cast<uint32_t>(p.size()), size, "", 0});
+        return p;
+    };
+    assert(fsutils::valid_cdc_plan(plan({min, max, 1}), uint64_t{min} + max + 1, avg)); // Only the last chunk may be short
+    assert(!fsutils::valid_cdc_plan(plan({min - 1, max, 1}), uint64_t{min} + max, avg));
+    assert(!fsutils::valid_cdc_plan(plan({min, max + 1}), uint64_t{min} + max + 1, avg));
+    std::filesystem::remove_all(dir);
+    std::cout << "File chunk plan matches" << std::endl;
+
+    std::cout << "\nChunker tests passed!" << std::endl;
+    return 0;
+}
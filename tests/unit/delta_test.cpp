@@ -0,0 +1,147 @@
+// Delta uploads (filesystem/delta.hpp): compute_delta() finds moved and unchanged blocks, the
+// plan it makes rebuilds the new file through apply_copies(), and valid_delta_plan() refuses
+// plans that overlap, leave gaps or read outside the stored file.
+
+#undef NDEBUG // The checks are asserts, keep them in release builds
+#include "filesystem/delta.hpp"
+
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sodium.h>
+#include <unistd.h>
+
+namespace {
+
+const std::filesystem::path DIR = std::filesystem::temp_directory_path() / ("minidrive_delta_test_" + std::to_string(::getpid()));
+constexpr uint32_t BLOCK = fsutils::MIN_BLOCK_SIZE;
+constexpr uint32_t CHUNK = protocol::MIN_CHUNK_SIZE;
+
+std::vector<uint8_t> random_bytes(size_t size, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> data(size);
+    for(auto& b : data) b = static_cast<uint8_t>(rng());
+    return data;
+}
+
+fsutils::FileMetadata write_file(const std::string& name, const std::vector<uint8_t>& data) {
+    std::filesystem::path path = DIR / name;
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    return fsutils::FileMetadata{path, data.size(), 0, {}};
+}
+
+std::vector<uint8_t> read_file(const std::filesystem::path& path) {
+    std::ifstream f(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+// Delta of updated against old, checked the way the server checks it, then applied the way the
+// server applies it: copies from the stored file, literals from the client's bytes
+fsutils::Delta delta_of(const std::vector<uint8_t>& old, const std::vector<uint8_t>& updated) {
+    fsutils::FileMetadata base = write_file("old.bin", old);
+    assert(fsutils::signature_block_size(old.size()) == BLOCK);
+    std::vector<protocol::BlockSignature> signatures = fsutils::compute_signatures(base.absolute_path, BLOCK);
+    assert(!signatures.empty());
+
+    fsutils::Delta delta;
+    assert(fsutils::compute_delta(write_file("new.bin", updated), signatures, BLOCK, CHUNK, delta));
+    assert(fsutils::valid_delta_plan(delta.literals, delta.copies, updated.size(), old.size(), CHUNK));
+
+    std::filesystem::path rebuilt = DIR / "rebuilt.bin";
+    std::filesystem::remove(rebuilt);
+    fsutils::TransferFile dest;
+    assert(dest.open(rebuilt, fsutils::TransferFile::Mode::WRITE));
+    assert(fsutils::apply_copies(base.absolute_path, dest, delta.copies));
+    uint64_t literal_bytes = 0;
+    for(const protocol::ChunkInfo& chunk : delta.literals) {
+        std::vector<uint8_t> body(updated.begin() + static_cast<std::ptrdiff_t>(chunk.offset), updated.begin() + static_cast<std::ptrdiff_t>(chunk.offset + chunk.size));
+        assert(chunk.chunk_hash == fsutils::hash_to_hex(fsutils::hash_chunk(body)));
+        assert(dest.write_at(chunk.offset, body));
+        literal_bytes += chunk.size;
+    }
+    dest.close();
+    assert(literal_bytes == delta.literal_bytes);
+    assert(read_file(rebuilt) == updated);
+    return delta;
+}
+
+bool has_copy(const fsutils::Delta& delta, uint64_t offset, uint64_t source, uint64_t size) {
+    for(const protocol::DeltaCopy& copy : delta.copies) {
+        if(copy.offset == offset && copy.source == source && copy.size == size) return true;
+    }
+    return false;
+}
+
+protocol::ChunkInfo literal(uint32_t index, uint32_t size, uint64_t offset) {
+    return protocol::ChunkInfo{index, size, "", offset};
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0) {
+        std::cerr << "libsodium initialization failed" << std::endl;
+        return 1;
+    }
+    std::filesystem::create_directories(DIR);
+
+    const size_t tail = 700; // The stored file's last block is shorter than BLOCK
+    const std::vector<uint8_t> old = random_bytes(100 * BLOCK + tail, 42);
+    auto block = [&](size_t i) { return old.begin() + static_cast<std::ptrdiff_t>(i * BLOCK); };
+
+    // Test 1: a block moved further into the file is copied from where it was
+    std::vector<uint8_t> moved(old.begin(), block(10));
+    moved.insert(moved.end(), block(11), block(40));
+    moved.insert(moved.end(), block(10), block(11));
+    moved.insert(moved.end(), block(40), old.end());
+    fsutils::Delta delta = delta_of(old, moved);
+    assert(has_copy(delta, 39 * BLOCK, 10 * BLOCK, BLOCK));
+    assert(delta.literal_bytes <= CHUNK); // Only the tail every upload sends
+    std::cout << "Moved block copied" << std::endl;
+
+    // Test 2: an edit inside the short tail block sends just that tail
+    std::vector<uint8_t> tail_edit = old;
+    tail_edit[tail_edit.size() - 10] ^= 0xff;
+    delta = delta_of(old, tail_edit);
+    assert(delta.copies.size() == 1 && has_copy(delta, 0, 0, 100 * BLOCK));
+    assert(delta.literal_bytes == tail);
+
+    // An edit elsewhere still finds the unchanged short tail, at the end of the last copy
+    std::vector<uint8_t> head_edit = old;
+    head_edit[5] ^= 0xff;
+    delta = delta_of(old, head_edit);
+    assert(delta.copies.size() == 1 && has_copy(delta, BLOCK, BLOCK, 99 * BLOCK + tail));
+    assert(delta.literal_bytes == BLOCK);
+    std::cout << "Short tail block matched and replaced" << std::endl;
+
+    // Test 3: an identical file still ends with a literal, cut from the end of the last copy
+    delta = delta_of(old, old);
+    assert(delta.copies.size() == 1 && has_copy(delta, 0, 0, old.size() - CHUNK));
+    assert(delta.literals.size() == 1 && delta.literals[0].offset == old.size() - CHUNK && delta.literal_bytes == CHUNK);
+    std::cout << "Identical file sends one chunk" << std::endl;
+
+    // Test 4: malformed plans, for a 10000 byte file from an 8000 byte stored one
+    const uint64_t size = 10000;
+    const uint64_t base = 8000;
+    const uint32_t chunk = 4096;
+    assert(fsutils::valid_delta_plan({literal(0, 4000, 6000)}, {{0, 0, 6000}}, size, base, chunk));
+    assert(!fsutils::valid_delta_plan({literal(0, 4000, 5000), literal(1, 1000, 9000)}, {{0, 0, 6000}}, size, base, chunk)); // Overlap
+    assert(!fsutils::valid_delta_plan({literal(0, 3500, 6500)}, {{0, 0, 6000}}, size, base, chunk)); // Gap
+    assert(!fsutils::valid_delta_plan({literal(0, 4000, 6000)}, {{0, 2001, 6000}}, size, base, chunk)); // Source past the stored file
+    assert(!fsutils::valid_delta_plan({literal(0, 4000, 6000)}, {{0, 0, 9000}}, size, base, chunk)); // Longer than the stored file
+    assert(!fsutils::valid_delta_plan({literal(0, 4000, 0)}, {{4000, 0, 7000}}, size, base, chunk)); // Past the end of the new file
+    assert(!fsutils::valid_delta_plan({literal(0, 2000, 6000), literal(0, 2000, 8000)}, {{0, 0, 6000}}, size, base, chunk)); // Index out of order
+    assert(!fsutils::valid_delta_plan({literal(0, 6000, 4000)}, {{0, 0, 4000}}, size, base, chunk)); // Literal over chunk_size
+    assert(!fsutils::valid_delta_plan({}, {{0, 0, 8000}}, 8000, base, chunk)); // Nothing left to send
+    std::cout << "Malformed plans rejected" << std::endl;
+
+    std::filesystem::remove_all(DIR);
+    std::cout << "\nDelta tests passed!" << std::endl;
+    return 0;
+}
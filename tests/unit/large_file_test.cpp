@@ -0,0 +1,93 @@
+// Files past 4 GiB (64-bit sizes and offsets): a sparse file just over the 32-bit limit is
+// sized, written and read at offsets above it, and its chunk plan and JSON keep them intact.
+// Sparse, so it costs a few MiB of disk whatever the filesystem reports as its size.
+
+#undef NDEBUG // The checks are asserts, keep them in release builds
+#include "filesystem/transfer_file.hpp"
+#include "filesystem/utils.hpp"
+#include "protocol/message.hpp"
+
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <unistd.h>
+
+int main() {
+    const uint64_t four_gib = uint64_t{1} << 32;
+    const uint64_t size = four_gib + 3 * 1024 * 1024 + 123;
+    const uint64_t offset = four_gib + 1024 * 1024; // Lands on 1 MiB if cut to 32 bits
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("minidrive_large_file_test_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    std::filesystem::path path = dir / "sparse.bin";
+    std::error_code ec;
+    { std::ofstream create(path, std::ios::binary); }
+    std::filesystem::resize_file(path, size, ec);
+    if(ec) { // A filesystem without sparse files or with a small file size limit
+        std::cout << "Cannot create a " << size << " byte sparse file (" << ec.message() << "), skipping" << std::endl;
+        std::filesystem::remove_all(dir);
+        return 0;
+    }
+
+    // Test 1: the size comes back whole
+    assert(fsutils::get_file_size(path) == size);
+    std::cout << "Size past 4 GiB read back" << std::endl;
+
+    // Test 2: writes and reads above 4 GiB go where they were aimed
+    std::vector<uint8_t> pattern(64 * 1024);
+    for(size_t i = 0; i < pattern.size(); ++i) pattern[i] = static_cast<uint8_t>(i * 7 + 1);
+    {
+        fsutils::TransferFile file;
+        assert(file.open(path, fsutils::TransferFile::Mode::WRITE));
+        assert(file.write_at(offset, pattern));
+        std::vector<uint8_t> back;
+        assert(file.read_at(offset, static_cast<uint32_t>(pattern.size()), back) && back == pattern);
+        assert(file.read_at(size - 123, 123, back)); // The last bytes of the file
+    }
+    assert(fsutils::read_chunk(path, offset, static_cast<uint32_t>(pattern.size())) == pattern);
+    assert(fsutils::read_chunk(path, offset - four_gib, static_cast<uint32_t>(pattern.size())) == std::vector<uint8_t>(pattern.size(), 0)); // Nothing landed on the truncated offset
+
+    std::vector<uint8_t> tail(123, 0xab);
+    assert(fsutils::write_chunk(path, size - tail.size(), tail));
+    assert(fsutils::read_chunk(path, size - tail.size(), static_cast<uint32_t>(tail.size())) == tail);
+    assert(fsutils::get_file_size(path) == size);
+    std::cout << "Writes and reads past 4 GiB in place" << std::endl;
+
+    // Test 3: a chunk plan over the whole file, offsets past 4 GiB
+    const uint32_t chunk_size = protocol::MAX_CHUNK_SIZE;
+    uint32_t count = fsutils::chunk_count(size, chunk_size);
+    assert(count == 1025);
+    std::vector<protocol::ChunkInfo> chunks;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t chunk = i + 1 < count ? chunk_size : static_cast<uint32_t>(size - uint64_t{i} * chunk_size);
+        chunks.push_back({i, chunk, "", 0});
+    }
+    fsutils::assign_offsets(chunks);
+    assert(chunks.back().offset == four_gib && chunks.back().size == size - four_gib);
+    assert(fsutils::valid_chunk_plan(chunks, size, chunk_size));
+    assert(!fsutils::valid_chunk_plan(chunks, size - four_gib, chunk_size)); // Same plan against the size cut to 32 bits
+    std::cout << "Chunk plan past 4 GiB valid" << std::endl;
+
+    // Test 4: sizes and offsets survive the JSON of a request
+    protocol::Request req;
+    req.cmd = "UPLOAD";
+    req.first_argument = "sparse.bin";
+    req.size = size;
+    req.chunks = {chunks.back()};
+    nlohmann::json j;
+    protocol::to_json(j, req);
+    protocol::Request parsed;
+    protocol::from_json(nlohmann::json::parse(j.dump()), parsed);
+    assert(parsed.size == size);
+    assert(parsed.chunks.size() == 1 && parsed.chunks[0].offset == four_gib && parsed.chunks[0].index == count - 1);
+    std::cout << "Request JSON keeps 64-bit sizes" << std::endl;
+
+    std::filesystem::remove_all(dir);
+    std::cout << "\nLarge file tests passed!" << std::endl;
+    return 0;
+}